@@ -174,6 +174,42 @@ namespace sqlitevfs {
 		}
 		/* Methods above are valid for version 3 */
 		/* Additional methods may be added in future releases */
+
+		/**
+		 * A single read performed by `xReadV`, with the same meaning as the `xRead` arguments.
+		 */
+		struct IoVec {
+			void *p;
+			int iAmt;
+			sqlite3_int64 iOfst;
+		};
+
+		/**
+		 * Read several possibly scattered buffers at once.
+		 *
+		 * This is not part of SQLite's IO methods, it is an extension point for shims that need many pages at once, like prefetchers.
+		 * The default implementation calls `xRead` for each buffer.
+		 * Override this to batch reads, for example coalescing adjacent buffers into a single `preadv`.
+		 *
+		 * Short reads zero fill the rest of their buffer and do not stop the remaining reads, just like in `xRead`.
+		 *
+		 * @return `SQLITE_OK` if every buffer was fully read,
+		 *         `SQLITE_IOERR_SHORT_READ` if any of them was short,
+		 *         or the first other error code returned by a read.
+		 */
+		virtual int xReadV(const IoVec *iov, int iovcnt) {
+			int result = SQLITE_OK;
+			for (int i = 0; i < iovcnt; i++) {
+				int read_result = xRead(iov[i].p, iov[i].iAmt, iov[i].iOfst);
+				if (read_result == SQLITE_IOERR_SHORT_READ) {
+					result = read_result;
+				}
+				else if (read_result != SQLITE_OK) {
+					return read_result;
+				}
+			}
+			return result;
+		}
 	};
 
 	/**
@@ -0,0 +1,100 @@
+/**
+ * @file ExtentAllocator.hpp
+ * Free space management shared by the samples that pack variable sized data into one file.
+ */
+#ifndef __EXTENT_ALLOCATOR_HPP__
+#define __EXTENT_ALLOCATOR_HPP__
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <sqlite3.h>
+
+// Free space of a file, as extents sorted by offset and by size.
+class ExtentAllocator {
+public:
+	// End of the used space, the file can be truncated there
+	sqlite3_int64 end;
+	sqlite3_int64 free_bytes = 0;
+
+	// `start` is the end of the space reserved at the beginning of the file.
+	explicit ExtentAllocator(sqlite3_int64 start) : end(start) {}
+
+	// Rebuild the free space from the used extents.
+	void load(std::vector<std::pair<sqlite3_int64, sqlite3_int64>> used) {
+		std::sort(used.begin(), used.end());
+		sqlite3_int64 position = 0;
+		for (auto& extent : used) {
+			if (extent.first > position) {
+				insert(position, extent.first - position);
+			}
+			position = std::max(position, extent.first + extent.second);
+		}
+		end = position;
+	}
+
+	// Best fit allocation, appending to the end of the file if no free extent is large enough.
+	sqlite3_int64 allocate(sqlite3_int64 size) {
+		auto it = by_size.lower_bound(size);
+		if (it == by_size.end()) {
+			sqlite3_int64 offset = end;
+			end += size;
+			return offset;
+		}
+		sqlite3_int64 offset = it->second, length = it->first;
+		erase(offset, length);
+		if (length > size) {
+			insert(offset + size, length - size);
+		}
+		return offset;
+	}
+
+	void release(sqlite3_int64 offset, sqlite3_int64 length) {
+		auto next = by_offset.find(offset + length);
+		if (next != by_offset.end()) {
+			length += next->second;
+			erase(next->first, next->second);
+		}
+		auto previous = by_offset.lower_bound(offset);
+		if (previous != by_offset.begin()) {
+			--previous;
+			if (previous->first + previous->second == offset) {
+				offset = previous->first;
+				length += previous->second;
+				erase(previous->first, previous->second);
+			}
+		}
+		if (offset + length == end) {
+			end = offset;
+		}
+		else {
+			insert(offset, length);
+		}
+	}
+
+private:
+	std::map<sqlite3_int64, sqlite3_int64> by_offset;
+	std::multimap<sqlite3_int64, sqlite3_int64> by_size;
+
+	void insert(sqlite3_int64 offset, sqlite3_int64 length) {
+		by_offset[offset] = length;
+		by_size.emplace(length, offset);
+		free_bytes += length;
+	}
+
+	void erase(sqlite3_int64 offset, sqlite3_int64 length) {
+		by_offset.erase(offset);
+		auto range = by_size.equal_range(length);
+		for (auto it = range.first; it != range.second; ++it) {
+			if (it->second == offset) {
+				by_size.erase(it);
+				break;
+			}
+		}
+		free_bytes -= length;
+	}
+};
+
+#endif  // __EXTENT_ALLOCATOR_HPP__
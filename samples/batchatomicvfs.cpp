@@ -0,0 +1,451 @@
+// Batch atomic write VFS shim: reports `SQLITE_IOCAP_BATCH_ATOMIC` and implements it with a redo log.
+//
+// When the database file reports `SQLITE_IOCAP_BATCH_ATOMIC`, SQLite keeps
+// the rollback journal in memory and brackets the page writes of each commit
+// with `SQLITE_FCNTL_BEGIN_ATOMIC_WRITE` and `SQLITE_FCNTL_COMMIT_ATOMIC_WRITE`.
+// This shim buffers those writes and, on commit, writes them as a single
+// checksummed record to `<database>-redo`, syncs it, and only then applies
+// them to the database. Once the log is synced the commit is done: if
+// applying it fails, the commit still succeeds and the log is applied again
+// before the database is synced or written otherwise, or by the recovery of
+// the next connection. After SQLite syncs the database, the redo log is
+// truncated. A commit costs one sequential log write plus the database
+// writes and two syncs, instead of journal writes, journal creation and
+// deletion and at least two syncs plus a directory sync.
+//
+// Recovery happens when a connection takes a SHARED lock and finds a redo
+// log that no writer is working on: the log is replayed while holding an
+// EXCLUSIVE lock. Replaying is idempotent, so a log left behind by a commit
+// that was already applied is harmless. Before the first write that does not
+// go through a batch (for example when a transaction spills to a real
+// journal), the redo log is truncated and synced so that it can never be
+// replayed over newer data.
+//
+// @note SQLite only uses batch atomic writes when compiled with `SQLITE_ENABLE_BATCH_ATOMIC_WRITE`.
+// @warning Every process that writes to the database must use this VFS.
+//
+// `PRAGMA batch_atomic_stats` reports commits, rollbacks and recoveries.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <climits>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace sqlitevfs;
+using namespace std;
+
+static const char redo_magic[8] = { 'S', 'Q', 'L', 'R', 'E', 'D', 'O', '2' };
+// magic, entry count, body size and two checksum words, covering the count, the size and the body
+static const int redo_header_size = 24;
+// offset and size of each entry, followed by its data
+static const int redo_entry_header_size = 12;
+
+static void put_u32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+static uint32_t get_u32(const unsigned char *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// Same checksum as SQLite's WAL frames, continuing `checksum`. `size` must be a multiple of 8.
+static void redo_checksum(const unsigned char *data, size_t size, uint32_t checksum[2]) {
+	uint32_t s1 = checksum[0], s2 = checksum[1];
+	for (size_t i = 0; i + 8 <= size; i += 8) {
+		s1 += get_u32(data + i) + s2;
+		s2 += get_u32(data + i + 4) + s1;
+	}
+	checksum[0] = s1;
+	checksum[1] = s2;
+}
+
+static void redo_record_checksum(const unsigned char *record, size_t body_size, uint32_t checksum[2]) {
+	checksum[0] = checksum[1] = 0;
+	redo_checksum(record + 8, 8, checksum);
+	redo_checksum(record + redo_header_size, body_size, checksum);
+}
+
+struct BatchAtomicFileShim : public SQLiteFileImpl {
+	struct PendingWrite {
+		sqlite3_int64 offset;
+		vector<unsigned char> data;
+	};
+
+	sqlite3_file *redo_file = nullptr;
+	string redo_path;
+	bool in_batch = false;
+	vector<PendingWrite> batch;
+	int lock_level = SQLITE_LOCK_NONE;
+	// Whether the redo log is known to be empty on disk during the current write transaction
+	bool redo_cleared = false;
+	// Whether this connection left a valid redo log that can be truncated after the next database sync
+	bool redo_valid = false;
+	// Whether the redo log holds a commit whose writes to the database failed
+	bool redo_unapplied = false;
+
+	sqlite3_int64 commits = 0;
+	sqlite3_int64 rollbacks = 0;
+	sqlite3_int64 recoveries = 0;
+
+	int xDeviceCharacteristics() override {
+		int characteristics = SQLiteFileImpl::xDeviceCharacteristics();
+		return redo_file ? characteristics | SQLITE_IOCAP_BATCH_ATOMIC : characteristics;
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (in_batch) {
+			const unsigned char *bytes = (const unsigned char *) p;
+			batch.push_back({ iOfst, vector<unsigned char>(bytes, bytes + iAmt) });
+			return SQLITE_OK;
+		}
+		if (redo_file && !redo_cleared) {
+			int result = clear_redo_log();
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		// Replaying a stale log after a truncation would write pages past the end of the database
+		if (redo_file && !redo_cleared) {
+			int result = clear_redo_log();
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		return SQLiteFileImpl::xTruncate(size);
+	}
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		int result = SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		if (in_batch && (result == SQLITE_OK || result == SQLITE_IOERR_SHORT_READ)) {
+			// Overlay writes buffered in the current batch
+			for (const PendingWrite& write : batch) {
+				sqlite3_int64 write_end = write.offset + (sqlite3_int64) write.data.size();
+				sqlite3_int64 start = iOfst > write.offset ? iOfst : write.offset;
+				sqlite3_int64 end = iOfst + iAmt < write_end ? iOfst + iAmt : write_end;
+				if (start < end) {
+					memcpy((char *) p + (start - iOfst), write.data.data() + (start - write.offset), end - start);
+				}
+			}
+		}
+		return result;
+	}
+
+	int xFileSize(sqlite3_int64 *pSize) override {
+		int result = SQLiteFileImpl::xFileSize(pSize);
+		if (result == SQLITE_OK && in_batch) {
+			for (const PendingWrite& write : batch) {
+				if (write.offset + (sqlite3_int64) write.data.size() > *pSize) {
+					*pSize = write.offset + write.data.size();
+				}
+			}
+		}
+		return result;
+	}
+
+	int xSync(int flags) override {
+		if (redo_unapplied && replay_redo_log() == SQLITE_OK) {
+			redo_unapplied = false;
+		}
+		int result = SQLiteFileImpl::xSync(flags);
+		if (result == SQLITE_OK && redo_valid && !redo_unapplied) {
+			// The database is durable, the log is not needed anymore.
+			// No need to sync the truncation, replaying an applied log is harmless.
+			redo_file->pMethods->xTruncate(redo_file, 0);
+			redo_valid = false;
+		}
+		return result;
+	}
+
+	int xLock(int flags) override {
+		int result = SQLiteFileImpl::xLock(flags);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		int previous_level = lock_level;
+		lock_level = flags;
+		if (flags == SQLITE_LOCK_SHARED && previous_level == SQLITE_LOCK_NONE && redo_file) {
+			result = recover();
+			if (result != SQLITE_OK) {
+				SQLiteFileImpl::xUnlock(SQLITE_LOCK_NONE);
+				lock_level = SQLITE_LOCK_NONE;
+			}
+		}
+		return result;
+	}
+
+	int xUnlock(int flags) override {
+		int result = SQLiteFileImpl::xUnlock(flags);
+		if (result == SQLITE_OK) {
+			lock_level = flags;
+			if (flags <= SQLITE_LOCK_SHARED) {
+				redo_cleared = false;
+			}
+		}
+		return result;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (redo_file) {
+			switch (op) {
+				case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
+					in_batch = true;
+					batch.clear();
+					return SQLITE_OK;
+
+				case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE: {
+					int result = commit_batch();
+					in_batch = false;
+					batch.clear();
+					return result;
+				}
+
+				case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE:
+					in_batch = false;
+					batch.clear();
+					rollbacks++;
+					return SQLITE_OK;
+
+				case SQLITE_FCNTL_PRAGMA: {
+					char **argv = (char **) pArg;
+					if (sqlite3_stricmp(argv[1], "batch_atomic_stats") == 0) {
+						argv[0] = sqlite3_mprintf("commits=%lld rollbacks=%lld recoveries=%lld", commits, rollbacks, recoveries);
+						return SQLITE_OK;
+					}
+					break;
+				}
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	int xClose() override {
+		if (redo_file) {
+			redo_file->pMethods->xClose(redo_file);
+		}
+		return SQLiteFileImpl::xClose();
+	}
+
+	~BatchAtomicFileShim() {
+		sqlite3_free(redo_file);
+	}
+
+	// Write the batch to the redo log, sync it, then apply it to the database.
+	int commit_batch() {
+		size_t body_size = 0;
+		for (const PendingWrite& write : batch) {
+			body_size += redo_entry_header_size + ((write.data.size() + 7) & ~(size_t) 7);
+		}
+		if (body_size % 8) {
+			body_size += 8 - body_size % 8;
+		}
+		vector<unsigned char> record(redo_header_size + body_size, 0);
+		unsigned char *entry = record.data() + redo_header_size;
+		for (const PendingWrite& write : batch) {
+			put_u32(entry, (uint32_t) (write.offset >> 32));
+			put_u32(entry + 4, (uint32_t) write.offset);
+			put_u32(entry + 8, (uint32_t) write.data.size());
+			memcpy(entry + redo_entry_header_size, write.data.data(), write.data.size());
+			entry += redo_entry_header_size + ((write.data.size() + 7) & ~(size_t) 7);
+		}
+		memcpy(record.data(), redo_magic, sizeof(redo_magic));
+		put_u32(record.data() + 8, (uint32_t) batch.size());
+		put_u32(record.data() + 12, (uint32_t) body_size);
+		uint32_t checksum[2];
+		redo_record_checksum(record.data(), body_size, checksum);
+		put_u32(record.data() + 16, checksum[0]);
+		put_u32(record.data() + 20, checksum[1]);
+
+		// Errors before the log is synced make SQLite fall back to a regular journal
+		int result = redo_file->pMethods->xWrite(redo_file, record.data(), (int) record.size(), 0);
+		if (result == SQLITE_OK) {
+			result = redo_file->pMethods->xSync(redo_file, SQLITE_SYNC_NORMAL);
+		}
+		if (result != SQLITE_OK) {
+			return SQLITE_IOERR_WRITE;
+		}
+		redo_valid = true;
+		redo_cleared = false;
+
+		// The commit is durable now: failing it would have SQLite roll back over a partly written
+		// database that the log replays later. Writes that don't make it are redone from the log.
+		commits++;
+		for (const PendingWrite& write : batch) {
+			result = SQLiteFileImpl::xWrite(write.data.data(), (int) write.data.size(), write.offset);
+			if (result != SQLITE_OK) {
+				sqlite3_log(result, "can't apply the commit in \"%s\", it stays in the redo log", redo_path.c_str());
+				redo_unapplied = true;
+				break;
+			}
+		}
+		return SQLITE_OK;
+	}
+
+	// Make sure the redo log is empty on disk before writing outside of a batch.
+	int clear_redo_log() {
+		if (redo_unapplied) {
+			int result = replay_redo_log();
+			if (result == SQLITE_OK) {
+				result = SQLiteFileImpl::xSync(SQLITE_SYNC_NORMAL);
+			}
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			redo_unapplied = false;
+		}
+		sqlite3_int64 size;
+		int result = redo_file->pMethods->xFileSize(redo_file, &size);
+		if (result == SQLITE_OK && size > 0) {
+			result = redo_file->pMethods->xTruncate(redo_file, 0);
+		}
+		// Sync even if empty, the truncation may come from another connection and not be durable yet
+		if (result == SQLITE_OK) {
+			result = redo_file->pMethods->xSync(redo_file, SQLITE_SYNC_NORMAL);
+		}
+		redo_valid = false;
+		redo_cleared = result == SQLITE_OK;
+		return result;
+	}
+
+	// Read the redo log into `writes`, leaving it empty when the log is empty, torn or invalid.
+	int read_redo_log(vector<PendingWrite>& writes) {
+		writes.clear();
+		sqlite3_int64 size;
+		int result = redo_file->pMethods->xFileSize(redo_file, &size);
+		if (result != SQLITE_OK || size < redo_header_size) {
+			return result;
+		}
+		vector<unsigned char> record(size);
+		result = redo_file->pMethods->xRead(redo_file, record.data(), (int) size, 0);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		uint32_t count = get_u32(record.data() + 8);
+		uint32_t body_size = get_u32(record.data() + 12);
+		uint32_t checksum[2];
+		if (memcmp(record.data(), redo_magic, sizeof(redo_magic)) != 0
+			|| body_size % 8 != 0
+			|| body_size > size - redo_header_size) {
+			return SQLITE_OK;
+		}
+		redo_record_checksum(record.data(), body_size, checksum);
+		if (checksum[0] != get_u32(record.data() + 16) || checksum[1] != get_u32(record.data() + 20)) {
+			// Torn log: its commit never happened, and the database was not touched
+			return SQLITE_OK;
+		}
+
+		const unsigned char *body = record.data() + redo_header_size;
+		size_t position = 0;
+		for (uint32_t i = 0; i < count; i++) {
+			if (body_size - position < (size_t) redo_entry_header_size) {
+				break;
+			}
+			const unsigned char *entry = body + position;
+			sqlite3_int64 offset = ((sqlite3_int64) get_u32(entry) << 32) | get_u32(entry + 4);
+			size_t entry_size = get_u32(entry + 8);
+			size_t padded_size = (entry_size + 7) & ~(size_t) 7;
+			if (offset < 0 || entry_size > INT_MAX || padded_size > body_size - position - redo_entry_header_size) {
+				break;
+			}
+			writes.push_back({ offset, vector<unsigned char>(entry + redo_entry_header_size, entry + redo_entry_header_size + entry_size) });
+			position += redo_entry_header_size + padded_size;
+		}
+		if (writes.size() != count) {
+			sqlite3_log(SQLITE_CORRUPT, "invalid redo log \"%s\" ignored", redo_path.c_str());
+			writes.clear();
+		}
+		return SQLITE_OK;
+	}
+
+	// Apply the writes of the redo log to the database, without syncing it.
+	int replay_redo_log() {
+		vector<PendingWrite> writes;
+		int result = read_redo_log(writes);
+		for (size_t i = 0; i < writes.size() && result == SQLITE_OK; i++) {
+			result = SQLiteFileImpl::xWrite(writes[i].data.data(), (int) writes[i].data.size(), writes[i].offset);
+		}
+		return result;
+	}
+
+	// Replay a redo log left behind by a writer that is not around anymore. Called with a SHARED lock held.
+	int recover() {
+		sqlite3_int64 size;
+		int result = redo_file->pMethods->xFileSize(redo_file, &size);
+		if (result != SQLITE_OK || size < redo_header_size) {
+			return result;
+		}
+		int reserved = 0;
+		result = SQLiteFileImpl::xCheckReservedLock(&reserved);
+		if (result != SQLITE_OK || reserved) {
+			// A writer is active, the log belongs to it
+			return result;
+		}
+		vector<PendingWrite> writes;
+		result = read_redo_log(writes);
+		if (result != SQLITE_OK || writes.empty()) {
+			return result;
+		}
+
+		// Same lock dance SQLite does for hot journals
+		result = SQLiteFileImpl::xLock(SQLITE_LOCK_RESERVED);
+		if (result == SQLITE_OK) {
+			result = SQLiteFileImpl::xLock(SQLITE_LOCK_EXCLUSIVE);
+		}
+		if (result == SQLITE_OK) {
+			for (size_t i = 0; i < writes.size() && result == SQLITE_OK; i++) {
+				result = SQLiteFileImpl::xWrite(writes[i].data.data(), (int) writes[i].data.size(), writes[i].offset);
+			}
+			if (result == SQLITE_OK) {
+				result = SQLiteFileImpl::xSync(SQLITE_SYNC_NORMAL);
+			}
+			if (result == SQLITE_OK) {
+				redo_unapplied = false;
+				result = clear_redo_log();
+				recoveries++;
+			}
+		}
+		int unlock_result = SQLiteFileImpl::xUnlock(SQLITE_LOCK_SHARED);
+		return result == SQLITE_OK ? unlock_result : (result == SQLITE_BUSY ? SQLITE_BUSY : SQLITE_IOERR);
+	}
+};
+
+struct BatchAtomicVfsShim : public SQLiteVfsImpl<BatchAtomicFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<BatchAtomicFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result != SQLITE_OK || zName == nullptr || !(flags & SQLITE_OPEN_MAIN_DB) || (flags & SQLITE_OPEN_READONLY)) {
+			return result;
+		}
+
+		BatchAtomicFileShim& shim = file->implementation;
+		shim.redo_path = string(zName) + "-redo";
+		shim.redo_file = (sqlite3_file *) sqlite3_malloc(original_vfs->szOsFile);
+		if (shim.redo_file == nullptr) {
+			file->original_file->pMethods->xClose(file->original_file);
+			return SQLITE_NOMEM;
+		}
+		memset(shim.redo_file, 0, original_vfs->szOsFile);
+		int redo_flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MAIN_JOURNAL;
+		if (original_vfs->xOpen(original_vfs, shim.redo_path.c_str(), shim.redo_file, redo_flags, nullptr) != SQLITE_OK) {
+			// Without a redo log the database simply won't report batch atomic writes
+			sqlite3_free(shim.redo_file);
+			shim.redo_file = nullptr;
+		}
+		return SQLITE_OK;
+	}
+};
+
+extern "C" int sqlite3_batchatomicvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<BatchAtomicVfsShim> batchatomicvfs("batchatomicvfs");
+	int rc = batchatomicvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
@@ -0,0 +1,231 @@
+// Busy wait VFS shim: wakes busy waiters when a lock is released, instead of letting them sleep it out.
+//
+// When a lock is busy, SQLite's busy handler calls `xSleep` with growing
+// delays (up to 100 ms for `sqlite3_busy_timeout`), so a waiter usually
+// wakes long after the lock became free. This shim remembers, per thread,
+// which database returned `SQLITE_BUSY` from `xLock` or `xShmLock`. The next
+// `xSleep` of that thread then waits on a condition variable of the
+// database, which every `xUnlock` and `xShmLock` unlock in this process
+// signals. The requested duration is kept as a timeout, so releases by other
+// processes are still noticed, just not sooner.
+//
+// Busy handlers count their delays as fully slept. So that a waiter woken
+// early doesn't run out of its `sqlite3_busy_timeout` sooner, the connection's
+// next attempt at the lock that was busy keeps waiting for releases and
+// retrying until the requested sleep would have ended, before it returns
+// `SQLITE_BUSY`. That only applies to database locks and the WAL write lock,
+// other WAL index locks are also tried without the intent to wait. Other
+// locks, such as the upgrade to RESERVED that SQLite expects to fail fast in
+// a read transaction, and other connections don't wait.
+//
+// `PRAGMA busywait_stats` reports sleeps, early wakeups and timeouts of the process.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <sys/stat.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Lock release notifications of a database, shared by the connections of this process.
+struct LockEvent {
+	mutex mtx;
+	condition_variable cv;
+	atomic<uint64_t> generation { 0 };
+	atomic<int> waiters { 0 };
+
+	void signal() {
+		generation++;
+		if (waiters.load() > 0) {
+			// Taking the mutex orders this with a waiter that checked `generation` but doesn't wait yet
+			lock_guard<mutex> lock(mtx);
+			cv.notify_all();
+		}
+	}
+};
+
+struct BusyWaitStats {
+	atomic<sqlite3_int64> sleeps { 0 };
+	atomic<sqlite3_int64> event_waits { 0 };
+	atomic<sqlite3_int64> woken { 0 };
+	atomic<sqlite3_int64> timeouts { 0 };
+};
+
+// End of a connection's last `xSleep` that was woken early, as the busy handler counts it.
+// The next attempt at the lock that was busy retries until then.
+struct SleepDeadline {
+	chrono::steady_clock::time_point end;
+	// The database lock level, or -1 - offset for a WAL index lock
+	int lock = 0;
+};
+
+// The database whose lock was last busy on this thread, and its generation at that time
+static thread_local shared_ptr<LockEvent> busy_event;
+static thread_local uint64_t busy_generation = 0;
+// The connection and lock that were busy, if a retry of that lock may wait
+static thread_local shared_ptr<SleepDeadline> busy_deadline;
+static thread_local int busy_lock = 0;
+
+struct BusyWaitFileShim : public SQLiteFileImpl {
+	shared_ptr<LockEvent> event;
+	shared_ptr<SleepDeadline> deadline = make_shared<SleepDeadline>();
+	BusyWaitStats *stats = nullptr;
+
+	int xLock(int flags) override {
+		if (!event) {
+			return SQLiteFileImpl::xLock(flags);
+		}
+		return wait_for_lock([&] {
+			return SQLiteFileImpl::xLock(flags);
+		}, flags);
+	}
+
+	int xUnlock(int flags) override {
+		int result = SQLiteFileImpl::xUnlock(flags);
+		if (event) {
+			event->signal();
+		}
+		return result;
+	}
+
+	int xShmLock(int offset, int n, int flags) override {
+		if (!event) {
+			return SQLiteFileImpl::xShmLock(offset, n, flags);
+		}
+		if (flags & SQLITE_SHM_UNLOCK) {
+			int result = SQLiteFileImpl::xShmLock(offset, n, flags);
+			event->signal();
+			return result;
+		}
+		// Slot 0 is the WAL write lock, see `WAL_WRITE_LOCK` in sqlite3.c
+		bool write_lock = offset == 0 && (flags & SQLITE_SHM_EXCLUSIVE);
+		return wait_for_lock([&] {
+			return SQLiteFileImpl::xShmLock(offset, n, flags);
+		}, -1 - offset, write_lock);
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA && stats) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "busywait_stats") == 0) {
+				argv[0] = sqlite3_mprintf("sleeps=%lld event_waits=%lld woken=%lld timeouts=%lld",
+					stats->sleeps.load(), stats->event_waits.load(), stats->woken.load(), stats->timeouts.load());
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+private:
+	// Try to take lock `lock_id` with `try_lock`. If the deadline is for this lock, retry on every release until then, and clear it.
+	template <class TryLock>
+	int wait_for_lock(TryLock try_lock, int lock_id, bool may_wait = true) {
+		chrono::steady_clock::time_point sleep_end;
+		if (may_wait && deadline->lock == lock_id) {
+			sleep_end = deadline->end;
+			*deadline = SleepDeadline();
+		}
+		while (true) {
+			// Read before trying the lock, so a release in between isn't missed
+			uint64_t generation = event->generation.load();
+			int result = try_lock();
+			if (result != SQLITE_BUSY) {
+				return result;
+			}
+			if (chrono::steady_clock::now() >= sleep_end) {
+				busy_event = event;
+				busy_generation = generation;
+				busy_deadline = may_wait ? deadline : nullptr;
+				busy_lock = lock_id;
+				return result;
+			}
+			unique_lock<mutex> lock(event->mtx);
+			event->waiters++;
+			event->cv.wait_until(lock, sleep_end, [&] {
+				return event->generation.load() != generation;
+			});
+			event->waiters--;
+		}
+	}
+};
+
+struct BusyWaitVfsShim : public SQLiteVfsImpl<BusyWaitFileShim> {
+	BusyWaitStats stats;
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<BusyWaitFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		struct stat st;
+		if (result == SQLITE_OK && zName && (flags & SQLITE_OPEN_MAIN_DB) && stat(zName, &st) == 0) {
+			file->implementation.event = lock_event(st);
+			file->implementation.stats = &stats;
+		}
+		return result;
+	}
+
+	int xSleep(int microseconds) override {
+		stats.sleeps++;
+		shared_ptr<LockEvent> event = move(busy_event);
+		shared_ptr<SleepDeadline> deadline = move(busy_deadline);
+		busy_event.reset();
+		busy_deadline.reset();
+		if (!event) {
+			return SQLiteVfsImpl::xSleep(microseconds);
+		}
+
+		stats.event_waits++;
+		uint64_t generation = busy_generation;
+		auto end = chrono::steady_clock::now() + chrono::microseconds(microseconds);
+		unique_lock<mutex> lock(event->mtx);
+		event->waiters++;
+		bool woken = event->cv.wait_until(lock, end, [&] {
+			return event->generation.load() != generation;
+		});
+		event->waiters--;
+		if (woken) {
+			if (deadline) {
+				deadline->end = end;
+				deadline->lock = busy_lock;
+			}
+			stats.woken++;
+		}
+		else {
+			stats.timeouts++;
+		}
+		return microseconds;
+	}
+
+private:
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<LockEvent>> events;
+
+	shared_ptr<LockEvent> lock_event(const struct stat& st) {
+		lock_guard<mutex> lock(mtx);
+		weak_ptr<LockEvent>& entry = events[make_pair(st.st_dev, st.st_ino)];
+		shared_ptr<LockEvent> event = entry.lock();
+		if (!event) {
+			event = make_shared<LockEvent>();
+			entry = event;
+		}
+		return event;
+	}
+};
+
+extern "C" int sqlite3_busywaitvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<BusyWaitVfsShim> busywaitvfs("busywaitvfs");
+	int rc = busywaitvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
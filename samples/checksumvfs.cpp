@@ -0,0 +1,727 @@
+// Checksum VFS shim: stores a CRC-32C of every database page in its reserved bytes, and verifies it on reads.
+//
+// SQLite can leave bytes unused at the end of every page (byte 20 of the
+// database header). When a database has 8 of them, this shim fills them on
+// every page write with the page number and the CRC-32C of the page up to
+// the checksum, so misdirected writes are caught as well as bit rot. Page
+// reads, including multi-page ones and pages mapped with `xFetch`, are
+// verified, and fail with `SQLITE_IOERR_DATA` on a mismatch, which is also
+// logged with `sqlite3_log`. Databases with other reserve sizes pass through.
+// Set up a database with `.filectrl reserve_bytes 8` in the `sqlite3` shell
+// or `sqlite3_file_control(db, "main", SQLITE_FCNTL_RESERVE_BYTES, &n)`,
+// before creating it or followed by `VACUUM`. A `VACUUM` that changes the
+// page size or reserve may spill pages before it writes page 1 with the new
+// layout: the shim then puts back the bytes it replaced in them, and seals
+// every page of the file again.
+//
+// The CRC runs on the SSE 4.2 or ARMv8 CRC32C instructions when the CPU
+// supports them, chosen at runtime, and on slicing-by-8 tables otherwise.
+// The instructions have a latency of 3 cycles but a throughput of 1, so
+// several pages are checksummed as interleaved streams. A single page is
+// split in 3 lanes instead, combined with tables that shift a CRC over the
+// length of a lane.
+//
+// Only database files are checksummed: WAL frames have their own checksums,
+// and pages copied from the WAL or a rollback journal get new ones when they
+// are written back.
+//
+// URI parameters:
+//   checksum_impl=sse42|armv8|portable  force an implementation, if supported (default: fastest)
+//
+// `PRAGMA checksum_verification=on|off` turns verification on reads on or off for the connection,
+// to salvage data from a damaged database.
+// `PRAGMA checksum_scan[=<threads>]` verifies every page of the file, reading 1 MiB chunks on
+// several threads (default: one per CPU, up to 16), and reports the failed pages and the throughput.
+// `PRAGMA checksum_stats` reports the implementation and the written, verified and failed pages.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CHECKSUMVFS_SSE42 1
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define CHECKSUMVFS_ARMV8 1
+#endif
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Page trailer: the page number, then the CRC-32C of the page before the CRC
+static const int reserve_bytes = 8;
+static const int header_size = 100;
+// The page holding the lock bytes is never written, see `PENDING_BYTE` in sqlite3.c
+static const sqlite3_int64 pending_byte = 0x40000000;
+static const sqlite3_int64 scan_chunk_size = 1 << 20;
+
+static uint64_t load_le64(const uint8_t *p) {
+	uint64_t value = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&value, p, 8);
+#else
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t) p[i] << (8 * i);
+	}
+#endif
+	return value;
+}
+
+static uint32_t load_le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void store_le32(uint8_t *p, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		p[i] = (uint8_t) (value >> (8 * i));
+	}
+}
+
+// An implementation of the CRC-32C register update, without the initial and final inversions.
+struct Kernel {
+	const char *name;
+	uint32_t (*update)(uint32_t crc, const uint8_t *data, size_t length);
+	// Three independent streams of the same length, interleaved
+	void (*update3)(uint32_t crc[3], const uint8_t *const data[3], size_t length);
+};
+
+namespace portable {
+	// Slicing-by-8: `tables[k][b]` is the CRC of byte `b` followed by `k` zero bytes
+	struct Tables {
+		uint32_t tables[8][256];
+
+		Tables() {
+			for (uint32_t b = 0; b < 256; b++) {
+				uint32_t crc = b;
+				for (int i = 0; i < 8; i++) {
+					crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+				}
+				tables[0][b] = crc;
+			}
+			for (int k = 1; k < 8; k++) {
+				for (int b = 0; b < 256; b++) {
+					uint32_t previous = tables[k - 1][b];
+					tables[k][b] = (previous >> 8) ^ tables[0][previous & 0xff];
+				}
+			}
+		}
+	};
+
+	static const Tables crc_tables;
+
+	static uint32_t update(uint32_t crc, const uint8_t *data, size_t length) {
+		const uint32_t (*t)[256] = crc_tables.tables;
+		for (; length >= 8; data += 8, length -= 8) {
+			uint64_t v = load_le64(data) ^ crc;
+			crc = t[7][v & 0xff] ^ t[6][(v >> 8) & 0xff] ^ t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff]
+				^ t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^ t[1][(v >> 48) & 0xff] ^ t[0][v >> 56];
+		}
+		for (; length > 0; data++, length--) {
+			crc = t[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+		}
+		return crc;
+	}
+
+	// Table lookups don't wait on each other, nothing to gain from interleaving
+	static void update3(uint32_t crc[3], const uint8_t *const data[3], size_t length) {
+		for (int i = 0; i < 3; i++) {
+			crc[i] = update(crc[i], data[i], length);
+		}
+	}
+
+	static const Kernel kernel = { "portable", update, update3 };
+}
+
+#ifdef CHECKSUMVFS_SSE42
+namespace sse42 {
+	__attribute__((target("sse4.2")))
+	static uint32_t update(uint32_t crc, const uint8_t *data, size_t length) {
+		uint64_t c = crc;
+		for (; length >= 8; data += 8, length -= 8) {
+			c = _mm_crc32_u64(c, load_le64(data));
+		}
+		for (; length > 0; data++, length--) {
+			c = _mm_crc32_u8((uint32_t) c, *data);
+		}
+		return (uint32_t) c;
+	}
+
+	__attribute__((target("sse4.2")))
+	static void update3(uint32_t crc[3], const uint8_t *const data[3], size_t length) {
+		uint64_t c0 = crc[0], c1 = crc[1], c2 = crc[2];
+		const uint8_t *p0 = data[0], *p1 = data[1], *p2 = data[2];
+		size_t i = 0;
+		for (; i + 8 <= length; i += 8) {
+			c0 = _mm_crc32_u64(c0, load_le64(p0 + i));
+			c1 = _mm_crc32_u64(c1, load_le64(p1 + i));
+			c2 = _mm_crc32_u64(c2, load_le64(p2 + i));
+		}
+		crc[0] = update((uint32_t) c0, p0 + i, length - i);
+		crc[1] = update((uint32_t) c1, p1 + i, length - i);
+		crc[2] = update((uint32_t) c2, p2 + i, length - i);
+	}
+
+	static const Kernel kernel = { "sse42", update, update3 };
+}
+#endif
+
+#ifdef CHECKSUMVFS_ARMV8
+namespace armv8 {
+	__attribute__((target("+crc")))
+	static uint32_t update(uint32_t crc, const uint8_t *data, size_t length) {
+		for (; length >= 8; data += 8, length -= 8) {
+			crc = __crc32cd(crc, load_le64(data));
+		}
+		for (; length > 0; data++, length--) {
+			crc = __crc32cb(crc, *data);
+		}
+		return crc;
+	}
+
+	__attribute__((target("+crc")))
+	static void update3(uint32_t crc[3], const uint8_t *const data[3], size_t length) {
+		uint32_t c0 = crc[0], c1 = crc[1], c2 = crc[2];
+		const uint8_t *p0 = data[0], *p1 = data[1], *p2 = data[2];
+		size_t i = 0;
+		for (; i + 8 <= length; i += 8) {
+			c0 = __crc32cd(c0, load_le64(p0 + i));
+			c1 = __crc32cd(c1, load_le64(p1 + i));
+			c2 = __crc32cd(c2, load_le64(p2 + i));
+		}
+		crc[0] = update(c0, p0 + i, length - i);
+		crc[1] = update(c1, p1 + i, length - i);
+		crc[2] = update(c2, p2 + i, length - i);
+	}
+
+	static const Kernel kernel = { "armv8", update, update3 };
+}
+#endif
+
+// The fastest implementation the CPU supports, or the one named `name` if supported.
+static const Kernel *select_kernel(const char *name) {
+	vector<const Kernel *> supported;
+#ifdef CHECKSUMVFS_SSE42
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		supported.push_back(&sse42::kernel);
+	}
+#endif
+#if defined(CHECKSUMVFS_ARMV8) && defined(HWCAP_CRC32)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		supported.push_back(&armv8::kernel);
+	}
+#endif
+	supported.push_back(&portable::kernel);
+	for (const Kernel *kernel : supported) {
+		if (name && sqlite3_stricmp(name, kernel->name) == 0) {
+			return kernel;
+		}
+	}
+	return supported.front();
+}
+
+// Page checksums of a page size.
+class PageChecksum {
+public:
+	const Kernel *kernel;
+	int page_size = 0;
+
+	explicit PageChecksum(const Kernel *kernel): kernel(kernel) {}
+
+	void set_page_size(int size) {
+		if (size == page_size) {
+			return;
+		}
+		page_size = size;
+		// 3 lanes of whole words, the few remaining bytes are appended after combining
+		lane_size = (checked_size() / 24) * 8;
+		// Shifting is linear: combine the shifted CRC of each bit
+		vector<uint8_t> zeros(lane_size);
+		uint32_t columns[32];
+		for (int bit = 0; bit < 32; bit++) {
+			columns[bit] = kernel->update(1u << bit, zeros.data(), lane_size);
+		}
+		for (int k = 0; k < 4; k++) {
+			for (int b = 0; b < 256; b++) {
+				uint32_t shifted = 0;
+				for (int bit = 0; bit < 8; bit++) {
+					if (b & (1 << bit)) {
+						shifted ^= columns[8 * k + bit];
+					}
+				}
+				shift_tables[k][b] = shifted;
+			}
+		}
+	}
+
+	// Bytes covered by the CRC: the whole page but the CRC itself
+	int checked_size() const {
+		return page_size - 4;
+	}
+
+	// CRC-32C of one page, computed as 3 interleaved lanes.
+	uint32_t page(const uint8_t *data) const {
+		const uint8_t *lanes[3] = { data, data + lane_size, data + 2 * lane_size };
+		uint32_t crc[3] = { 0xffffffff, 0, 0 };
+		kernel->update3(crc, lanes, lane_size);
+		uint32_t combined = shift(shift(crc[0]) ^ crc[1]) ^ crc[2];
+		return ~kernel->update(combined, data + 3 * lane_size, checked_size() - 3 * lane_size);
+	}
+
+	// CRC-32C of `count` consecutive pages, computed 3 pages at a time as interleaved streams.
+	void pages(const uint8_t *data, int count, uint32_t *crcs) const {
+		int i = 0;
+		for (; i + 3 <= count; i += 3) {
+			const uint8_t *streams[3] = { data + (size_t) i * page_size, data + (size_t) (i + 1) * page_size,
+				data + (size_t) (i + 2) * page_size };
+			uint32_t crc[3] = { 0xffffffff, 0xffffffff, 0xffffffff };
+			kernel->update3(crc, streams, checked_size());
+			for (int j = 0; j < 3; j++) {
+				crcs[i + j] = ~crc[j];
+			}
+		}
+		for (; i < count; i++) {
+			crcs[i] = page(data + (size_t) i * page_size);
+		}
+	}
+
+	// Fill the trailers of `count` consecutive pages, the first one being `first_page`.
+	void seal(uint8_t *data, int count, uint32_t first_page) const {
+		for (int i = 0; i < count; i++) {
+			store_le32(data + (size_t) (i + 1) * page_size - reserve_bytes, first_page + i);
+		}
+		vector<uint32_t> crcs(count);
+		pages(data, count, crcs.data());
+		for (int i = 0; i < count; i++) {
+			store_le32(data + (size_t) (i + 1) * page_size - 4, crcs[i]);
+		}
+	}
+
+	// Index of the first page of `count` that doesn't match its trailer, or -1.
+	int verify(const uint8_t *data, int count, uint32_t first_page, vector<uint32_t>& crcs) const {
+		crcs.resize(count);
+		pages(data, count, crcs.data());
+		for (int i = 0; i < count; i++) {
+			const uint8_t *trailer = data + (size_t) (i + 1) * page_size - reserve_bytes;
+			if (load_le32(trailer) != first_page + i || load_le32(trailer + 4) != crcs[i]) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+private:
+	int lane_size = 0;
+	// `shift_tables[k][b]` is byte `k` of a CRC register equal to `b`, shifted over `lane_size` zero bytes
+	uint32_t shift_tables[4][256];
+
+	uint32_t shift(uint32_t crc) const {
+		return shift_tables[0][crc & 0xff] ^ shift_tables[1][(crc >> 8) & 0xff]
+			^ shift_tables[2][(crc >> 16) & 0xff] ^ shift_tables[3][crc >> 24];
+	}
+};
+
+struct ChecksumStats {
+	atomic<sqlite3_int64> written { 0 };
+	atomic<sqlite3_int64> verified { 0 };
+	atomic<sqlite3_int64> failed { 0 };
+};
+
+struct ChecksumFileShim : public SQLiteFileImpl {
+	// Set for database files only
+	unique_ptr<PageChecksum> checksum;
+	ChecksumStats *stats = nullptr;
+	string path;
+	// Whether the last header read or written has the reserve size of checksums
+	bool enabled = false;
+	bool verification = true;
+	int lock_level = SQLITE_LOCK_NONE;
+	// Offsets and bytes SQLite wrote where trailers were stored, since the last sync or page 1 write
+	vector<pair<sqlite3_int64, uint64_t>> overwritten_trailers;
+	// Reused by every write, the data to write can't be changed in place
+	vector<uint8_t> buffer;
+	vector<uint32_t> crcs;
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		int result = SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		if (result != SQLITE_OK || !checksum) {
+			return result;
+		}
+		if (iOfst == 0) {
+			read_header((const uint8_t *) p, iAmt);
+		}
+		if (enabled && verification && whole_pages(iAmt, iOfst)) {
+			return verify((const uint8_t *) p, iAmt, iOfst);
+		}
+		return result;
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!checksum) {
+			return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		}
+		if (iOfst != 0 || iAmt < header_size) {
+			return write_pages((const uint8_t *) p, iAmt, iOfst);
+		}
+		// A VACUUM changes the page size or reserve with page 1, which it writes after spilling other pages
+		bool was_enabled = enabled;
+		int old_page_size = checksum->page_size;
+		read_header((const uint8_t *) p, iAmt);
+		if (enabled == was_enabled && (!enabled || checksum->page_size == old_page_size)) {
+			overwritten_trailers.clear();
+			return write_pages((const uint8_t *) p, iAmt, iOfst);
+		}
+		int result = relayout();
+		if (result == SQLITE_OK) {
+			result = write_pages((const uint8_t *) p, iAmt, iOfst);
+		}
+		return result;
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (checksum) {
+			auto end = remove_if(overwritten_trailers.begin(), overwritten_trailers.end(), [&](const pair<sqlite3_int64, uint64_t>& trailer) {
+				return trailer.first >= size;
+			});
+			overwritten_trailers.erase(end, overwritten_trailers.end());
+		}
+		return SQLiteFileImpl::xTruncate(size);
+	}
+
+	int xSync(int flags) override {
+		int result = SQLiteFileImpl::xSync(flags);
+		if (result == SQLITE_OK) {
+			overwritten_trailers.clear();
+		}
+		return result;
+	}
+
+	int xLock(int flags) override {
+		int result = SQLiteFileImpl::xLock(flags);
+		if (result == SQLITE_OK) {
+			lock_level = flags;
+		}
+		return result;
+	}
+
+	int xUnlock(int flags) override {
+		int result = SQLiteFileImpl::xUnlock(flags);
+		if (result == SQLITE_OK) {
+			lock_level = flags;
+			if (flags <= SQLITE_LOCK_SHARED) {
+				// The write transaction is over, even without syncs
+				overwritten_trailers.clear();
+			}
+		}
+		return result;
+	}
+
+	// Mapped pages are verified as well, every time SQLite fetches them
+	int xFetch(sqlite3_int64 iOfst, int iAmt, void **pp) override {
+		int result = SQLiteFileImpl::xFetch(iOfst, iAmt, pp);
+		if (result != SQLITE_OK || !checksum || !*pp) {
+			return result;
+		}
+		if (iOfst == 0) {
+			read_header((const uint8_t *) *pp, iAmt);
+		}
+		if (enabled && verification && whole_pages(iAmt, iOfst)) {
+			result = verify((const uint8_t *) *pp, iAmt, iOfst);
+			if (result != SQLITE_OK) {
+				SQLiteFileImpl::xUnfetch(iOfst, *pp);
+				*pp = nullptr;
+			}
+		}
+		return result;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA && checksum) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "checksum_verification") == 0) {
+				if (argv[2]) {
+					verification = sqlite3_stricmp(argv[2], "on") == 0 || sqlite3_stricmp(argv[2], "true") == 0
+						|| atoi(argv[2]) != 0;
+				}
+				argv[0] = sqlite3_mprintf("%s", verification ? "on" : "off");
+				return SQLITE_OK;
+			}
+			if (sqlite3_stricmp(argv[1], "checksum_scan") == 0) {
+				int threads = argv[2] ? atoi(argv[2]) : (int) min(16u, max(1u, thread::hardware_concurrency()));
+				return scan(max(1, min(threads, 64)), argv);
+			}
+			if (sqlite3_stricmp(argv[1], "checksum_stats") == 0) {
+				argv[0] = sqlite3_mprintf("impl=%s enabled=%d page_size=%d written=%lld verified=%lld failed=%lld",
+					checksum->kernel->name, enabled, checksum->page_size,
+					stats->written.load(), stats->verified.load(), stats->failed.load());
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+private:
+	// Track the page size and reserve of the database from page 1.
+	void read_header(const uint8_t *header, int size) {
+		if (size < header_size || memcmp(header, "SQLite format 3", 16) != 0) {
+			return;
+		}
+		int page_size = (header[16] << 8) | header[17];
+		if (page_size == 1) {
+			page_size = 65536;
+		}
+		enabled = header[20] == reserve_bytes && page_size >= 512;
+		if (enabled) {
+			checksum->set_page_size(page_size);
+		}
+	}
+
+	bool whole_pages(int iAmt, sqlite3_int64 iOfst) const {
+		int page_size = checksum->page_size;
+		return iAmt >= page_size && iAmt % page_size == 0 && iOfst % page_size == 0;
+	}
+
+	uint32_t page_number(sqlite3_int64 offset) const {
+		return (uint32_t) (offset / checksum->page_size + 1);
+	}
+
+	// Write `iAmt` bytes, sealing the pages they touch if the database has checksums.
+	int write_pages(const uint8_t *data, int iAmt, sqlite3_int64 iOfst) {
+		if (!enabled) {
+			return SQLiteFileImpl::xWrite(data, iAmt, iOfst);
+		}
+		const int page_size = checksum->page_size;
+		if (!whole_pages(iAmt, iOfst)) {
+			// A VACUUM to a larger page size writes pages in parts, the last part written seals the page right
+			int result = SQLiteFileImpl::xWrite(data, iAmt, iOfst);
+			for (sqlite3_int64 offset = iOfst / page_size * page_size; result == SQLITE_OK && offset < iOfst + iAmt; offset += page_size) {
+				result = reseal(offset);
+			}
+			return result;
+		}
+		int count = iAmt / page_size;
+		for (int i = 0; i < count; i++) {
+			sqlite3_int64 offset = (sqlite3_int64) (i + 1) * page_size - reserve_bytes;
+			uint64_t bytes;
+			memcpy(&bytes, data + offset, reserve_bytes);
+			overwritten_trailers.emplace_back(iOfst + offset, bytes);
+		}
+		buffer.assign(data, data + iAmt);
+		checksum->seal(buffer.data(), count, page_number(iOfst));
+		stats->written += count;
+		return SQLiteFileImpl::xWrite(buffer.data(), iAmt, iOfst);
+	}
+
+	// Seal the page at `offset` as it is in the file, unless it isn't complete yet.
+	int reseal(sqlite3_int64 offset) {
+		const int page_size = checksum->page_size;
+		buffer.resize(page_size);
+		int result = SQLiteFileImpl::xRead(buffer.data(), page_size, offset);
+		if (result != SQLITE_OK) {
+			return result == SQLITE_IOERR_SHORT_READ ? SQLITE_OK : result;
+		}
+		uint8_t *trailer = buffer.data() + page_size - reserve_bytes;
+		uint64_t bytes;
+		memcpy(&bytes, trailer, reserve_bytes);
+		overwritten_trailers.emplace_back(offset + page_size - reserve_bytes, bytes);
+		checksum->seal(buffer.data(), 1, page_number(offset));
+		stats->written++;
+		return SQLiteFileImpl::xWrite(trailer, reserve_bytes, offset + page_size - reserve_bytes);
+	}
+
+	// Pages spilled before page 1 have the new layout, but were written for the old one: give back the
+	// bytes trailers replaced, then seal every page for the new layout. The pages a VACUUM didn't write
+	// yet will be, or will be truncated.
+	int relayout() {
+		vector<pair<sqlite3_int64, uint64_t>> trailers;
+		trailers.swap(overwritten_trailers);
+		for (const auto& trailer : trailers) {
+			uint8_t bytes[reserve_bytes];
+			memcpy(bytes, &trailer.second, reserve_bytes);
+			int result = SQLiteFileImpl::xWrite(bytes, reserve_bytes, trailer.first);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		if (!enabled) {
+			return SQLITE_OK;
+		}
+		const int page_size = checksum->page_size;
+		sqlite3_int64 size;
+		int result = SQLiteFileImpl::xFileSize(&size);
+		for (sqlite3_int64 offset = page_size; result == SQLITE_OK && offset < size; offset += page_size) {
+			if (offset > pending_byte || offset + page_size <= pending_byte) {
+				result = reseal(offset);
+			}
+		}
+		return result;
+	}
+
+	int verify(const uint8_t *data, int iAmt, sqlite3_int64 iOfst) {
+		int count = iAmt / checksum->page_size;
+		int failed = checksum->verify(data, count, page_number(iOfst), crcs);
+		if (failed < 0) {
+			stats->verified += count;
+			return SQLITE_OK;
+		}
+		stats->verified += failed;
+		stats->failed++;
+		uint32_t expected = page_number(iOfst) + failed;
+		uint32_t stored = load_le32(data + (size_t) (failed + 1) * checksum->page_size - reserve_bytes);
+		if (stored != expected) {
+			sqlite3_log(SQLITE_IOERR_DATA, "checksum fault on page %u of \"%s\": holds page %u", expected, path.c_str(), stored);
+		}
+		else {
+			sqlite3_log(SQLITE_IOERR_DATA, "checksum fault on page %u of \"%s\"", expected, path.c_str());
+		}
+		return SQLITE_IOERR_DATA;
+	}
+
+	// Verify every page of the file with `threads` threads reading chunks of it, answer `PRAGMA checksum_scan`.
+	int scan(int threads, char **argv) {
+		// A SHARED lock keeps writers of rollback journal databases out. In WAL mode, checkpoints may
+		// still write pages while they are read: failed pages are read again at the end.
+		bool locked = false;
+		if (lock_level == SQLITE_LOCK_NONE) {
+			int result = xLock(SQLITE_LOCK_SHARED);
+			if (result != SQLITE_OK) {
+				argv[0] = sqlite3_mprintf("checksum_scan: the database is locked");
+				return result;
+			}
+			locked = true;
+		}
+		int result = scan_locked(threads, argv);
+		if (locked) {
+			xUnlock(SQLITE_LOCK_NONE);
+		}
+		return result;
+	}
+
+	int scan_locked(int threads, char **argv) {
+		uint8_t header[header_size];
+		sqlite3_int64 size = 0;
+		int result = SQLiteFileImpl::xRead(header, header_size, 0);
+		if (result == SQLITE_OK) {
+			read_header(header, header_size);
+			result = SQLiteFileImpl::xFileSize(&size);
+		}
+		if (result != SQLITE_OK) {
+			argv[0] = sqlite3_mprintf("checksum_scan: %s", sqlite3_errstr(result));
+			return result;
+		}
+		if (!enabled) {
+			argv[0] = sqlite3_mprintf("checksum_scan: the database doesn't have %d reserved bytes per page", reserve_bytes);
+			return SQLITE_ERROR;
+		}
+
+		const int page_size = checksum->page_size;
+		const sqlite3_int64 pages = size / page_size;
+		const sqlite3_int64 chunk_pages = max<sqlite3_int64>(1, scan_chunk_size / page_size);
+		const sqlite3_int64 chunks = (pages + chunk_pages - 1) / chunk_pages;
+		sqlite3_file *file = original_file;
+		atomic<sqlite3_int64> next_chunk { 0 };
+		atomic<int> error { SQLITE_OK };
+		mutex failures_mtx;
+		vector<uint32_t> failures;
+
+		auto start = chrono::steady_clock::now();
+		auto worker = [&] {
+			vector<uint8_t> data(chunk_pages * page_size);
+			vector<uint32_t> sums;
+			for (sqlite3_int64 chunk = next_chunk++; chunk < chunks && error.load() == SQLITE_OK; chunk = next_chunk++) {
+				sqlite3_int64 first = chunk * chunk_pages;
+				int count = (int) min(chunk_pages, pages - first);
+				// The base file is only used for positioned reads, which the unix VFS allows from any thread
+				int read = file->pMethods->xRead(file, data.data(), count * page_size, first * page_size);
+				if (read != SQLITE_OK) {
+					error = read;
+					break;
+				}
+				for (int i = 0; i < count;) {
+					int failed = checksum->verify(data.data() + (size_t) i * page_size, count - i, (uint32_t) (first + i + 1), sums);
+					if (failed < 0) {
+						break;
+					}
+					i += failed;
+					sqlite3_int64 offset = (first + i) * page_size;
+					if (offset > pending_byte || offset + page_size <= pending_byte) {
+						lock_guard<mutex> lock(failures_mtx);
+						failures.push_back((uint32_t) (first + i + 1));
+					}
+					i++;
+				}
+			}
+		};
+		vector<thread> workers;
+		for (int i = 1; i < threads && i < chunks; i++) {
+			workers.emplace_back(worker);
+		}
+		worker();
+		for (thread& t : workers) {
+			t.join();
+		}
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		if (error.load() != SQLITE_OK) {
+			argv[0] = sqlite3_mprintf("checksum_scan: %s", sqlite3_errstr(error.load()));
+			return error.load();
+		}
+
+		// Pages written by a concurrent checkpoint while being read are fine the second time
+		sort(failures.begin(), failures.end());
+		vector<uint8_t> page(page_size);
+		vector<uint32_t> sums;
+		auto end = remove_if(failures.begin(), failures.end(), [&](uint32_t number) {
+			return SQLiteFileImpl::xRead(page.data(), page_size, (sqlite3_int64) (number - 1) * page_size) == SQLITE_OK
+				&& checksum->verify(page.data(), 1, number, sums) < 0;
+		});
+		failures.erase(end, failures.end());
+		stats->verified += pages - (sqlite3_int64) failures.size();
+		stats->failed += failures.size();
+		for (uint32_t number : failures) {
+			sqlite3_log(SQLITE_IOERR_DATA, "checksum fault on page %u of \"%s\"", number, path.c_str());
+		}
+
+		argv[0] = sqlite3_mprintf("pages=%lld failed=%d first_failed=%u threads=%d mib_per_s=%.0f",
+			pages, (int) failures.size(), failures.empty() ? 0 : failures.front(), threads,
+			(double) pages * page_size / (1 << 20) / max(elapsed.count(), 1e-6));
+		return SQLITE_OK;
+	}
+};
+
+struct ChecksumVfsShim : public SQLiteVfsImpl<ChecksumFileShim> {
+	ChecksumStats stats;
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<ChecksumFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result == SQLITE_OK && zName && (flags & SQLITE_OPEN_MAIN_DB)) {
+			ChecksumFileShim& shim = file->implementation;
+			shim.checksum.reset(new PageChecksum(select_kernel(sqlite3_uri_parameter(zName, "checksum_impl"))));
+			shim.stats = &stats;
+			shim.path = zName;
+		}
+		return result;
+	}
+};
+
+extern "C" int sqlite3_checksumvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<ChecksumVfsShim> checksumvfs("checksumvfs");
+	int rc = checksumvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
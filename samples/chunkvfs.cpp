@@ -0,0 +1,1094 @@
+// Chunk store VFS shim: stores pages as content-addressed chunks shared by databases, and databases as manifests.
+//
+// The database file SQLite opens is a manifest: a 4096 byte header (magic,
+// page size, page count, chunk directory) followed by the 16 byte hash of
+// every page, all zero for zero filled pages. Pages themselves are files of
+// the chunk directory, named by their hash, `<dir>/<2 hex digits>/<30 hex digits>`.
+// Identical pages, within a database, across its versions or across all the
+// databases using the same directory, are stored once. A snapshot is a copy
+// of the manifest, whatever the size of the database.
+//
+// Pages are hashed with a 128 bit hash in the style of XXH3, processing 64
+// byte stripes in 8 independent lanes, with AVX2 or SSE2 on x86-64 and
+// portable code elsewhere. A write whose chunk already exists compares their
+// contents rather than trusting the hash, and refreshes its modification
+// time.
+//
+// New chunks are synced on `xSync`, along with their directories, before
+// the changed manifest entries are written and synced. After a crash, an
+// entry that may be torn belongs to the interrupted transaction or
+// checkpoint, which SQLite rewrites from the rollback journal or WAL.
+//
+// Every manifest has a hard link in `<dir>/refs`. A background thread
+// periodically counts the references to every chunk in the open manifests
+// of this process, from memory, and in the other manifests of `refs`. It
+// deletes manifests whose only remaining link is the one in `refs`, then the
+// chunks without references that weren't written or reused for
+// `chunk_gc_grace` seconds, which covers the unsynced references of other
+// processes. Within a process, reuses and deletions of chunks are serialized.
+// A reuse checks that the chunk is still linked after refreshing its time,
+// so a collection of another process can only delete it in between if it
+// checked the time of the chunk just before.
+//
+// URI parameters:
+//   chunk_dir=<path>             chunk directory of a new manifest (default `chunks` next to the database)
+//   chunk_gc_interval=<seconds>  interval of the garbage collection, 0 to disable it (default 60)
+//   chunk_gc_grace=<seconds>     age of the unreferenced chunks that are deleted (default 600)
+//
+// `PRAGMA chunk_stats` reports the pages, chunks written and deduplicated, and collections.
+// `PRAGMA chunk_snapshot=<path>` creates a new manifest at `path` with the content of the
+// database as of its last sync. Run `PRAGMA wal_checkpoint` first for WAL databases.
+// `PRAGMA chunk_gc` runs a collection right away, and reports its results.
+//
+// @note The chunk directory must be on the same file system as the manifests, for the hard links.
+// @note The manifest is shared by the connections of one process, a database must not be
+//       written by several processes at once.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CHUNKVFS_X86 1
+#endif
+
+using namespace sqlitevfs;
+using namespace std;
+
+static const char manifest_magic[8] = { 'S', 'Q', 'L', 'C', 'H', 'N', 'K', '1' };
+static const int header_size = 4096;
+static const int path_offset = 64;
+static const int entry_size = 16;
+// New chunks kept open for their sync, beyond which they are synced right away
+static const size_t max_unsynced_chunks = 256;
+
+static void put_u64(unsigned char *p, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t) p[i] << (8 * i);
+	}
+	return value;
+}
+
+struct ChunkHash {
+	uint64_t low = 0;
+	uint64_t high = 0;
+
+	bool zero() const {
+		return low == 0 && high == 0;
+	}
+
+	bool operator==(const ChunkHash& other) const {
+		return low == other.low && high == other.high;
+	}
+
+	bool operator!=(const ChunkHash& other) const {
+		return !(*this == other);
+	}
+
+	struct Hasher {
+		size_t operator()(const ChunkHash& hash) const {
+			return (size_t) hash.low;
+		}
+	};
+};
+
+static const uint64_t prime64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint32_t prime32_1 = 0x9E3779B1U;
+// Stripes between two scrambles of the accumulators
+static const int stripes_per_block = 16;
+
+// The secret keying the lanes, from a fixed seed.
+static const uint64_t *hash_secret() {
+	static uint64_t secret[stripes_per_block + 8];
+	static once_flag once;
+	call_once(once, [] {
+		uint64_t state = 0x5A17C0DE;
+		for (uint64_t& word : secret) {
+			// splitmix64
+			uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			word = z ^ (z >> 31);
+		}
+	});
+	return secret;
+}
+
+// Accumulate `stripes` stripes of 64 bytes into 8 lanes, scrambling them after every block of stripes.
+// All implementations give the same results, as chunk names depend on them.
+struct HashKernel {
+	const char *name;
+	void (*accumulate)(uint64_t acc[8], const unsigned char *data, size_t stripes, const uint64_t *secret);
+};
+
+namespace portable {
+	static void stripe(uint64_t acc[8], const unsigned char *data, const uint64_t *key) {
+		for (int lane = 0; lane < 8; lane++) {
+			uint64_t value;
+			memcpy(&value, data + lane * 8, sizeof(value));
+			uint64_t keyed = value ^ key[lane];
+			acc[lane ^ 1] += value;
+			acc[lane] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+		}
+	}
+
+	static void accumulate(uint64_t acc[8], const unsigned char *data, size_t stripes, const uint64_t *secret) {
+		for (size_t i = 0; i < stripes; i++) {
+			stripe(acc, data + i * 64, secret + i % stripes_per_block);
+			if (i % stripes_per_block == stripes_per_block - 1) {
+				for (int lane = 0; lane < 8; lane++) {
+					acc[lane] = (acc[lane] ^ (acc[lane] >> 47) ^ secret[stripes_per_block + lane]) * prime32_1;
+				}
+			}
+		}
+	}
+
+	static const HashKernel kernel = { "portable", accumulate };
+}
+
+#ifdef CHUNKVFS_X86
+namespace sse2 {
+	static void accumulate(uint64_t acc[8], const unsigned char *data, size_t stripes, const uint64_t *secret) {
+		__m128i a[4];
+		for (int i = 0; i < 4; i++) {
+			a[i] = _mm_loadu_si128((const __m128i *) acc + i);
+		}
+		const __m128i prime = _mm_set1_epi32((int) prime32_1);
+		for (size_t s = 0; s < stripes; s++) {
+			const __m128i *input = (const __m128i *) (data + s * 64);
+			const __m128i *key = (const __m128i *) (secret + s % stripes_per_block);
+			for (int i = 0; i < 4; i++) {
+				__m128i value = _mm_loadu_si128(input + i);
+				__m128i keyed = _mm_xor_si128(value, _mm_loadu_si128(key + i));
+				// Low half of each lane times its high half, plus the value of the other lane
+				__m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+				a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2))));
+			}
+			if (s % stripes_per_block == stripes_per_block - 1) {
+				const __m128i *scramble = (const __m128i *) (secret + stripes_per_block);
+				for (int i = 0; i < 4; i++) {
+					__m128i x = _mm_xor_si128(_mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47)), _mm_loadu_si128(scramble + i));
+					__m128i high = _mm_mul_epu32(_mm_srli_epi64(x, 32), prime);
+					a[i] = _mm_add_epi64(_mm_mul_epu32(x, prime), _mm_slli_epi64(high, 32));
+				}
+			}
+		}
+		for (int i = 0; i < 4; i++) {
+			_mm_storeu_si128((__m128i *) acc + i, a[i]);
+		}
+	}
+
+	static const HashKernel kernel = { "sse2", accumulate };
+}
+
+namespace avx2 {
+	__attribute__((target("avx2")))
+	static void accumulate(uint64_t acc[8], const unsigned char *data, size_t stripes, const uint64_t *secret) {
+		__m256i a[2];
+		for (int i = 0; i < 2; i++) {
+			a[i] = _mm256_loadu_si256((const __m256i *) acc + i);
+		}
+		const __m256i prime = _mm256_set1_epi32((int) prime32_1);
+		for (size_t s = 0; s < stripes; s++) {
+			const __m256i *input = (const __m256i *) (data + s * 64);
+			const __m256i *key = (const __m256i *) (secret + s % stripes_per_block);
+			for (int i = 0; i < 2; i++) {
+				__m256i value = _mm256_loadu_si256(input + i);
+				__m256i keyed = _mm256_xor_si256(value, _mm256_loadu_si256(key + i));
+				__m256i product = _mm256_mul_epu32(keyed, _mm256_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+				a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(product, _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2))));
+			}
+			if (s % stripes_per_block == stripes_per_block - 1) {
+				const __m256i *scramble = (const __m256i *) (secret + stripes_per_block);
+				for (int i = 0; i < 2; i++) {
+					__m256i x = _mm256_xor_si256(_mm256_xor_si256(a[i], _mm256_srli_epi64(a[i], 47)), _mm256_loadu_si256(scramble + i));
+					__m256i high = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime);
+					a[i] = _mm256_add_epi64(_mm256_mul_epu32(x, prime), _mm256_slli_epi64(high, 32));
+				}
+			}
+		}
+		for (int i = 0; i < 2; i++) {
+			_mm256_storeu_si256((__m256i *) acc + i, a[i]);
+		}
+	}
+
+	static const HashKernel kernel = { "avx2", accumulate };
+}
+#endif
+
+// The fastest implementation the CPU supports.
+static const HashKernel *select_kernel() {
+#ifdef CHUNKVFS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return &avx2::kernel;
+	}
+	return &sse2::kernel;
+#else
+	return &portable::kernel;
+#endif
+}
+
+static const HashKernel *hash_kernel = select_kernel();
+
+static uint64_t fold_multiply(uint64_t a, uint64_t b) {
+	unsigned __int128 product = (unsigned __int128) a * b;
+	return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+static uint64_t avalanche(uint64_t h) {
+	h ^= h >> 37;
+	h *= 0x165667919E3779F9ULL;
+	return h ^ (h >> 32);
+}
+
+// 128 bit hash of a chunk, XXH3 style but not XXH3 compatible.
+static ChunkHash chunk_hash(const unsigned char *data, size_t size) {
+	const uint64_t *secret = hash_secret();
+	uint64_t acc[8] = { prime32_1, prime64_1, prime64_2, prime64_1 ^ prime64_2, prime64_2 >> 1, prime32_1 ^ prime64_1, prime64_1 >> 3, prime64_2 ^ 1 };
+	size_t stripes = size / 64;
+	hash_kernel->accumulate(acc, data, stripes, secret);
+	if (size % 64) {
+		unsigned char last[64] = {};
+		memcpy(last, data + stripes * 64, size % 64);
+		portable::stripe(acc, last, secret + 8);
+	}
+	ChunkHash hash;
+	hash.low = size * prime64_1;
+	hash.high = ~(size * prime64_2);
+	for (int lane = 0; lane < 8; lane += 2) {
+		hash.low += fold_multiply(acc[lane] ^ secret[lane], acc[lane + 1] ^ secret[lane + 1]);
+		hash.high += fold_multiply(acc[lane] ^ secret[lane + 9], acc[lane + 1] ^ secret[lane + 10]);
+	}
+	hash.low = avalanche(hash.low);
+	hash.high = avalanche(hash.high);
+	// All zero is reserved for zero filled pages
+	if (hash.zero()) {
+		hash.low = 1;
+	}
+	return hash;
+}
+
+static void put_hash(unsigned char *p, const ChunkHash& hash) {
+	put_u64(p, hash.low);
+	put_u64(p + 8, hash.high);
+}
+
+static ChunkHash get_hash(const unsigned char *p) {
+	ChunkHash hash;
+	hash.low = get_u64(p);
+	hash.high = get_u64(p + 8);
+	return hash;
+}
+
+static bool is_zero(const unsigned char *data, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		if (data[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int sync_path(const string& path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return SQLITE_IOERR_FSYNC;
+	}
+	int result = fsync(fd) == 0 ? SQLITE_OK : SQLITE_IOERR_FSYNC;
+	close(fd);
+	return result;
+}
+
+struct ChunkStore;
+
+// A chunk directory, shared by the manifests of this process using it, and its garbage collection.
+class ChunkDirectory {
+public:
+	const string path;
+	mutex mtx;
+
+	sqlite3_int64 collections = 0;
+	sqlite3_int64 deleted_chunks = 0;
+	sqlite3_int64 deleted_manifests = 0;
+	sqlite3_int64 referenced_chunks = 0;
+	sqlite3_int64 shared_chunks = 0;
+
+	ChunkDirectory(const string& path, int grace_seconds) : path(path), grace_seconds(grace_seconds) {}
+
+	~ChunkDirectory() {
+		{
+			lock_guard<mutex> lock(mtx);
+			stopping = true;
+		}
+		cv.notify_all();
+		if (collector.joinable()) {
+			collector.join();
+		}
+	}
+
+	// Create the directory and its subdirectories.
+	int create() {
+		if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+			return SQLITE_CANTOPEN;
+		}
+		for (int i = 0; i < 256; i++) {
+			if (mkdir(fanout_path(i).c_str(), 0755) != 0 && errno != EEXIST) {
+				return SQLITE_CANTOPEN;
+			}
+		}
+		if (mkdir((path + "/refs").c_str(), 0755) != 0 && errno != EEXIST) {
+			return SQLITE_CANTOPEN;
+		}
+		return SQLITE_OK;
+	}
+
+	void start_collection(int interval) {
+		collector = thread([this, interval] {
+			unique_lock<mutex> lock(mtx);
+			while (!stopping) {
+				if (cv.wait_for(lock, chrono::seconds(interval), [this] { return stopping; })) {
+					break;
+				}
+				lock.unlock();
+				collect();
+				lock.lock();
+			}
+		});
+	}
+
+	void attach(ChunkStore *store) {
+		lock_guard<mutex> lock(mtx);
+		stores.insert(store);
+	}
+
+	void detach(ChunkStore *store) {
+		lock_guard<mutex> lock(mtx);
+		stores.erase(store);
+	}
+
+	string fanout_path(int fanout) const {
+		char name[4];
+		snprintf(name, sizeof(name), "/%02x", fanout);
+		return path + name;
+	}
+
+	string chunk_path(const ChunkHash& hash) const {
+		char name[40];
+		snprintf(name, sizeof(name), "/%02x/%014llx%016llx", (unsigned) (hash.high >> 56),
+			(unsigned long long) (hash.high & 0xFFFFFFFFFFFFFFULL), (unsigned long long) hash.low);
+		return path + name;
+	}
+
+	// Link `manifest` into `refs`, so collections see its references.
+	int reference(const string& manifest) {
+		struct stat st;
+		if (stat(manifest.c_str(), &st) != 0) {
+			return SQLITE_CANTOPEN;
+		}
+		string link_path = path + "/refs/" + to_string(st.st_dev) + "-" + to_string(st.st_ino);
+		if (link(manifest.c_str(), link_path.c_str()) != 0 && errno != EEXIST) {
+			sqlite3_log(SQLITE_CANTOPEN, "can't link \"%s\" into \"%s\": %s", manifest.c_str(), link_path.c_str(), strerror(errno));
+			return SQLITE_CANTOPEN;
+		}
+		return SQLITE_OK;
+	}
+
+	// Count the references to every chunk, then delete unreferenced chunks and manifests.
+	void collect();
+
+	// Held while a chunk is reused and while a collection deletes chunks, so this process never
+	// deletes a chunk between the reference count and the modification time a reuse refreshes.
+	mutex reuse_mtx;
+
+private:
+	set<ChunkStore *> stores;
+	// Serializes collections of the thread and `PRAGMA chunk_gc`
+	mutex collect_mtx;
+	int grace_seconds;
+	thread collector;
+	condition_variable cv;
+	bool stopping = false;
+};
+
+// Manifest of a database, shared by the connections of this process.
+struct ChunkStore {
+	mutex mtx;
+	shared_ptr<ChunkDirectory> directory;
+	string manifest_path;
+	dev_t device = 0;
+	ino_t inode = 0;
+	// 0 until the first write creates the header
+	int page_size = 0;
+	sqlite3_int64 page_count = 0;
+	vector<ChunkHash> entries;
+	// Pages whose entry changed since the last `xSync`
+	set<sqlite3_int64> dirty_entries;
+	bool header_dirty = false;
+	// New chunks and their subdirectories, to sync before the entries pointing to them
+	vector<int> unsynced_chunks;
+	set<int> unsynced_fanouts;
+
+	sqlite3_int64 written_chunks = 0;
+	sqlite3_int64 deduplicated_pages = 0;
+	sqlite3_int64 zero_pages = 0;
+
+	~ChunkStore() {
+		for (int fd : unsynced_chunks) {
+			close(fd);
+		}
+		if (directory) {
+			directory->detach(this);
+		}
+	}
+
+	// Sync new chunks and their subdirectories. Must be called with `mtx` locked.
+	int sync_chunks() {
+		int result = SQLITE_OK;
+		for (int fd : unsynced_chunks) {
+			if (fdatasync(fd) != 0) {
+				result = SQLITE_IOERR_FSYNC;
+			}
+			close(fd);
+		}
+		unsynced_chunks.clear();
+		for (int fanout : unsynced_fanouts) {
+			if (result == SQLITE_OK) {
+				result = sync_path(directory->fanout_path(fanout));
+			}
+		}
+		if (result == SQLITE_OK) {
+			unsynced_fanouts.clear();
+		}
+		return result;
+	}
+
+	// Write the header and the changed entries. Must be called with `mtx` locked.
+	int flush_manifest(sqlite3_file *file) {
+		if (header_dirty) {
+			unsigned char header[header_size] = {};
+			memcpy(header, manifest_magic, sizeof(manifest_magic));
+			put_u64(header + 8, (uint64_t) page_size);
+			put_u64(header + 16, (uint64_t) page_count);
+			memcpy(header + path_offset, directory->path.data(), directory->path.size());
+			int result = file->pMethods->xWrite(file, header, header_size, 0);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			header_dirty = false;
+		}
+		// Write runs of adjacent entries at once
+		vector<unsigned char> run;
+		for (auto it = dirty_entries.begin(); it != dirty_entries.end();) {
+			sqlite3_int64 first = *it, last = first;
+			while (++it != dirty_entries.end() && *it == last + 1 && last - first < 4095) {
+				last = *it;
+			}
+			run.resize((last - first + 1) * entry_size);
+			for (sqlite3_int64 page = first; page <= last; page++) {
+				put_hash(run.data() + (page - first) * entry_size, page < (sqlite3_int64) entries.size() ? entries[page] : ChunkHash());
+			}
+			int result = file->pMethods->xWrite(file, run.data(), (int) run.size(), header_size + first * entry_size);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		dirty_entries.clear();
+		return SQLITE_OK;
+	}
+
+	// Load the header and entries, or leave the store empty for empty files.
+	int load(sqlite3_file *file) {
+		sqlite3_int64 size;
+		int result = file->pMethods->xFileSize(file, &size);
+		if (result != SQLITE_OK || size == 0) {
+			return result;
+		}
+		unsigned char header[header_size];
+		result = file->pMethods->xRead(file, header, header_size, 0);
+		if (result != SQLITE_OK || memcmp(header, manifest_magic, sizeof(manifest_magic)) != 0) {
+			return SQLITE_NOTADB;
+		}
+		page_size = (int) get_u64(header + 8);
+		page_count = (sqlite3_int64) get_u64(header + 16);
+		if (page_size < 512 || page_size > 65536 || (page_size & (page_size - 1)) != 0) {
+			return SQLITE_NOTADB;
+		}
+		vector<unsigned char> data(page_count * entry_size);
+		if (!data.empty()) {
+			result = file->pMethods->xRead(file, data.data(), (int) data.size(), header_size);
+			if (result != SQLITE_OK && result != SQLITE_IOERR_SHORT_READ) {
+				return result;
+			}
+		}
+		entries.resize(page_count);
+		for (sqlite3_int64 page = 0; page < page_count; page++) {
+			entries[page] = get_hash(data.data() + page * entry_size);
+		}
+		return SQLITE_OK;
+	}
+
+	// Store `data` as a chunk, unless it exists already.
+	int store_chunk(const ChunkHash& hash, const unsigned char *data) {
+		string path = directory->chunk_path(hash);
+		unique_lock<mutex> reuse_lock(directory->reuse_mtx);
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd >= 0) {
+			vector<unsigned char> existing(page_size);
+			bool same = pread(fd, existing.data(), page_size, 0) == page_size && memcmp(existing.data(), data, page_size) == 0;
+			// Reused chunks are as young as new ones for the garbage collection
+			futimens(fd, nullptr);
+			if (!same) {
+				close(fd);
+				sqlite3_log(SQLITE_IOERR_WRITE, "chunk \"%s\" differs from a page with the same hash", path.c_str());
+				return SQLITE_IOERR_WRITE;
+			}
+			// The collection of another process may have deleted it since it was opened, write it again then
+			struct stat opened, current;
+			if (fstat(fd, &opened) == 0 && stat(path.c_str(), &current) == 0 && opened.st_dev == current.st_dev && opened.st_ino == current.st_ino) {
+				reuse_lock.unlock();
+				lock_guard<mutex> lock(mtx);
+				deduplicated_pages++;
+				// Synced too, the chunk may be a new one of another database or process
+				return add_unsynced(fd, hash);
+			}
+			close(fd);
+		}
+		reuse_lock.unlock();
+
+		// Write a temporary file then rename it, so a chunk is never seen partially written
+		static atomic<uint64_t> counter(0);
+		string temporary = path + ".tmp" + to_string(getpid()) + "-" + to_string(counter++);
+		fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) {
+			return SQLITE_IOERR_WRITE;
+		}
+		if (pwrite(fd, data, page_size, 0) != page_size || rename(temporary.c_str(), path.c_str()) != 0) {
+			close(fd);
+			unlink(temporary.c_str());
+			return SQLITE_IOERR_WRITE;
+		}
+		lock_guard<mutex> lock(mtx);
+		written_chunks++;
+		return add_unsynced(fd, hash);
+	}
+
+private:
+	// Must be called with `mtx` locked.
+	int add_unsynced(int fd, const ChunkHash& hash) {
+		unsynced_chunks.push_back(fd);
+		unsynced_fanouts.insert((int) (hash.high >> 56));
+		if (unsynced_chunks.size() >= max_unsynced_chunks) {
+			return sync_chunks();
+		}
+		return SQLITE_OK;
+	}
+};
+
+void ChunkDirectory::collect() {
+	lock_guard<mutex> collect_lock(collect_mtx);
+	unordered_map<ChunkHash, uint32_t, ChunkHash::Hasher> references;
+	sqlite3_int64 manifests_deleted = 0, chunks_deleted = 0;
+
+	// Open manifests of this process, with the entries of their unsynced pages. Those aren't read
+	// from `refs`: closing a descriptor of their inode would release the locks of their connections.
+	set<pair<dev_t, ino_t>> open_manifests;
+	{
+		lock_guard<mutex> lock(mtx);
+		for (ChunkStore *store : stores) {
+			lock_guard<mutex> store_lock(store->mtx);
+			open_manifests.insert(make_pair(store->device, store->inode));
+			for (const ChunkHash& hash : store->entries) {
+				if (!hash.zero()) {
+					references[hash]++;
+				}
+			}
+		}
+	}
+
+	// Other manifests of `refs`, deleting those whose database is gone
+	string refs = path + "/refs";
+	DIR *dir = opendir(refs.c_str());
+	if (dir == nullptr) {
+		return;
+	}
+	vector<unsigned char> data;
+	while (struct dirent *entry = readdir(dir)) {
+		string manifest = refs + "/" + entry->d_name;
+		struct stat st;
+		if (entry->d_name[0] == '.' || lstat(manifest.c_str(), &st) != 0 || !S_ISREG(st.st_mode)
+			|| open_manifests.count(make_pair(st.st_dev, st.st_ino))) {
+			continue;
+		}
+		if (st.st_nlink == 1) {
+			manifests_deleted += unlink(manifest.c_str()) == 0;
+			continue;
+		}
+		int fd = open(manifest.c_str(), O_RDONLY);
+		if (fd < 0) {
+			continue;
+		}
+		data.resize(st.st_size > header_size ? st.st_size - header_size : 0);
+		unsigned char header[header_size];
+		if (pread(fd, header, header_size, 0) == header_size && memcmp(header, manifest_magic, sizeof(manifest_magic)) == 0
+			&& pread(fd, data.data(), data.size(), header_size) == (ssize_t) data.size()) {
+			sqlite3_int64 count = min<sqlite3_int64>(get_u64(header + 16), data.size() / entry_size);
+			for (sqlite3_int64 page = 0; page < count; page++) {
+				ChunkHash hash = get_hash(data.data() + page * entry_size);
+				if (!hash.zero()) {
+					references[hash]++;
+				}
+			}
+		}
+		close(fd);
+	}
+	closedir(dir);
+
+	time_t deadline = time(nullptr) - grace_seconds;
+	for (int fanout = 0; fanout < 256; fanout++) {
+		string fanout_dir = fanout_path(fanout);
+		lock_guard<mutex> reuse_lock(reuse_mtx);
+		dir = opendir(fanout_dir.c_str());
+		if (dir == nullptr) {
+			continue;
+		}
+		while (struct dirent *entry = readdir(dir)) {
+			string chunk = fanout_dir + "/" + entry->d_name;
+			unsigned long long high, low;
+			struct stat st;
+			if (entry->d_name[0] == '.' || stat(chunk.c_str(), &st) != 0 || st.st_mtime > deadline) {
+				continue;
+			}
+			// Temporary files left by crashes are as unreferenced as can be
+			bool chunk_name = strlen(entry->d_name) == 30 && sscanf(entry->d_name, "%14llx%16llx", &high, &low) == 2;
+			ChunkHash hash;
+			hash.high = ((uint64_t) fanout << 56) | high;
+			hash.low = low;
+			if (!chunk_name || references.find(hash) == references.end()) {
+				chunks_deleted += unlink(chunk.c_str()) == 0;
+			}
+		}
+		closedir(dir);
+	}
+
+	lock_guard<mutex> lock(mtx);
+	collections++;
+	deleted_chunks += chunks_deleted;
+	deleted_manifests += manifests_deleted;
+	referenced_chunks = (sqlite3_int64) references.size();
+	shared_chunks = 0;
+	for (const auto& reference : references) {
+		shared_chunks += reference.second > 1;
+	}
+}
+
+struct ChunkFileShim : public SQLiteFileImpl {
+	shared_ptr<ChunkStore> store;
+	// Reused for writes of partial pages
+	vector<unsigned char> page_buffer;
+	int lock_level = SQLITE_LOCK_NONE;
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!store) {
+			return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		}
+		unsigned char *out = (unsigned char *) p;
+		for (sqlite3_int64 position = iOfst; position < iOfst + iAmt;) {
+			ChunkHash hash;
+			int page_size;
+			sqlite3_int64 page;
+			{
+				lock_guard<mutex> lock(store->mtx);
+				page_size = store->page_size;
+				page = page_size ? position / page_size : 0;
+				if (page_size == 0 || page >= store->page_count) {
+					memset(out + (position - iOfst), 0, iOfst + iAmt - position);
+					return SQLITE_IOERR_SHORT_READ;
+				}
+				hash = store->entries[page];
+			}
+			int in_page = (int) (position % page_size);
+			int length = (int) min<sqlite3_int64>(page_size - in_page, iOfst + iAmt - position);
+			unsigned char *destination = out + (position - iOfst);
+			if (hash.zero()) {
+				memset(destination, 0, length);
+			}
+			else {
+				string path = store->directory->chunk_path(hash);
+				int fd = open(path.c_str(), O_RDONLY);
+				ssize_t read = fd >= 0 ? pread(fd, destination, length, in_page) : -1;
+				if (fd >= 0) {
+					close(fd);
+				}
+				if (read != length) {
+					sqlite3_log(SQLITE_CORRUPT, "chunk \"%s\" of page %lld is missing", path.c_str(), page + 1);
+					return SQLITE_CORRUPT;
+				}
+			}
+			position += length;
+		}
+		return SQLITE_OK;
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!store) {
+			return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		}
+		int page_size;
+		{
+			lock_guard<mutex> lock(store->mtx);
+			if (store->page_size == 0) {
+				bool page_sized = iOfst == 0 && iAmt >= 512 && iAmt <= 65536 && (iAmt & (iAmt - 1)) == 0;
+				store->page_size = page_sized ? iAmt : 4096;
+				store->header_dirty = true;
+			}
+			page_size = store->page_size;
+		}
+		const unsigned char *data = (const unsigned char *) p;
+		for (sqlite3_int64 position = iOfst; position < iOfst + iAmt;) {
+			sqlite3_int64 page = position / page_size;
+			int in_page = (int) (position % page_size);
+			int length = (int) min<sqlite3_int64>(page_size - in_page, iOfst + iAmt - position);
+			const unsigned char *page_data = data + (position - iOfst);
+			if (in_page != 0 || length != page_size) {
+				// Merge a partial page with its stored contents
+				page_buffer.resize(page_size);
+				int result = xRead(page_buffer.data(), page_size, page * page_size);
+				if (result != SQLITE_OK && result != SQLITE_IOERR_SHORT_READ) {
+					return result;
+				}
+				memcpy(page_buffer.data() + in_page, page_data, length);
+				page_data = page_buffer.data();
+			}
+			ChunkHash hash;
+			if (!is_zero(page_data, page_size)) {
+				hash = chunk_hash(page_data, page_size);
+				int result = store->store_chunk(hash, page_data);
+				if (result != SQLITE_OK) {
+					return result;
+				}
+			}
+
+			lock_guard<mutex> lock(store->mtx);
+			if (hash.zero()) {
+				store->zero_pages++;
+			}
+			if (page >= (sqlite3_int64) store->entries.size()) {
+				store->entries.resize(page + 1);
+			}
+			store->entries[page] = hash;
+			store->dirty_entries.insert(page);
+			if (page >= store->page_count) {
+				store->page_count = page + 1;
+				store->header_dirty = true;
+			}
+			position += length;
+		}
+		return SQLITE_OK;
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (!store) {
+			return SQLiteFileImpl::xTruncate(size);
+		}
+		lock_guard<mutex> lock(store->mtx);
+		if (store->page_size == 0) {
+			return SQLITE_OK;
+		}
+		sqlite3_int64 pages = (size + store->page_size - 1) / store->page_size;
+		if (pages < store->page_count) {
+			store->page_count = pages;
+			store->entries.resize(pages);
+			store->dirty_entries.erase(store->dirty_entries.lower_bound(pages), store->dirty_entries.end());
+			store->header_dirty = true;
+		}
+		return SQLITE_OK;
+	}
+
+	int xSync(int flags) override {
+		if (!store) {
+			return SQLiteFileImpl::xSync(flags);
+		}
+		{
+			lock_guard<mutex> lock(store->mtx);
+			int result = store->sync_chunks();
+			if (result == SQLITE_OK) {
+				result = store->flush_manifest(original_file);
+			}
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		return SQLiteFileImpl::xSync(flags);
+	}
+
+	int xLock(int flags) override {
+		int result = SQLiteFileImpl::xLock(flags);
+		if (result == SQLITE_OK) {
+			lock_level = flags;
+		}
+		return result;
+	}
+
+	int xUnlock(int flags) override {
+		int result = SQLiteFileImpl::xUnlock(flags);
+		if (result == SQLITE_OK) {
+			lock_level = flags;
+		}
+		return result;
+	}
+
+	int xFileSize(sqlite3_int64 *pSize) override {
+		if (!store) {
+			return SQLiteFileImpl::xFileSize(pSize);
+		}
+		lock_guard<mutex> lock(store->mtx);
+		*pSize = store->page_count * store->page_size;
+		return SQLITE_OK;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (store) {
+			switch (op) {
+				case SQLITE_FCNTL_PRAGMA: {
+					char **argv = (char **) pArg;
+					if (sqlite3_stricmp(argv[1], "chunk_stats") == 0) {
+						ChunkDirectory& directory = *store->directory;
+						lock_guard<mutex> lock(directory.mtx);
+						lock_guard<mutex> store_lock(store->mtx);
+						argv[0] = sqlite3_mprintf("hash=%s page_size=%d pages=%lld written_chunks=%lld deduplicated_pages=%lld zero_pages=%lld "
+							"collections=%lld referenced_chunks=%lld shared_chunks=%lld deleted_chunks=%lld deleted_manifests=%lld",
+							hash_kernel->name, store->page_size, store->page_count, store->written_chunks, store->deduplicated_pages, store->zero_pages,
+							directory.collections, directory.referenced_chunks, directory.shared_chunks,
+							directory.deleted_chunks, directory.deleted_manifests);
+						return SQLITE_OK;
+					}
+					if (sqlite3_stricmp(argv[1], "chunk_snapshot") == 0) {
+						if (argv[2] == nullptr) {
+							argv[0] = sqlite3_mprintf("chunk_snapshot requires a path");
+							return SQLITE_ERROR;
+						}
+						int result = snapshot(argv[2]);
+						if (result != SQLITE_OK) {
+							argv[0] = sqlite3_mprintf("can't create snapshot \"%s\": %s", argv[2], sqlite3_errstr(result));
+						}
+						return result;
+					}
+					if (sqlite3_stricmp(argv[1], "chunk_gc") == 0) {
+						ChunkDirectory& directory = *store->directory;
+						directory.collect();
+						lock_guard<mutex> lock(directory.mtx);
+						argv[0] = sqlite3_mprintf("referenced_chunks=%lld shared_chunks=%lld deleted_chunks=%lld deleted_manifests=%lld",
+							directory.referenced_chunks, directory.shared_chunks, directory.deleted_chunks, directory.deleted_manifests);
+						return SQLITE_OK;
+					}
+					break;
+				}
+				// The manifest doesn't grow along with the logical size
+				case SQLITE_FCNTL_SIZE_HINT:
+				case SQLITE_FCNTL_CHUNK_SIZE:
+					return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	// The file only holds the manifest, there are no pages to map
+	int xFetch(sqlite3_int64 iOfst, int iAmt, void **pp) override {
+		if (!store) {
+			return SQLiteFileImpl::xFetch(iOfst, iAmt, pp);
+		}
+		*pp = nullptr;
+		return SQLITE_OK;
+	}
+
+	int xUnfetch(sqlite3_int64 iOfst, void *p) override {
+		if (!store) {
+			return SQLiteFileImpl::xUnfetch(iOfst, p);
+		}
+		return SQLITE_OK;
+	}
+
+	int xClose() override {
+		if (store) {
+			lock_guard<mutex> lock(store->mtx);
+			if (store->sync_chunks() == SQLITE_OK) {
+				store->flush_manifest(original_file);
+			}
+		}
+		store.reset();
+		return SQLiteFileImpl::xClose();
+	}
+
+private:
+	// Copy the manifest as of the last sync to `path`, and reference it.
+	int snapshot(const char *path) {
+		// A SHARED lock keeps writers of rollback journal databases out, so the copy isn't
+		// taken in the middle of a commit. In WAL mode, checkpoints may still write the manifest.
+		bool locked = false;
+		if (lock_level == SQLITE_LOCK_NONE) {
+			int result = xLock(SQLITE_LOCK_SHARED);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			locked = true;
+		}
+		vector<unsigned char> data;
+		int result;
+		{
+			lock_guard<mutex> lock(store->mtx);
+			sqlite3_int64 size;
+			result = SQLiteFileImpl::xFileSize(&size);
+			if (result == SQLITE_OK) {
+				data.resize(size);
+				if (size) {
+					result = SQLiteFileImpl::xRead(data.data(), (int) size, 0);
+				}
+			}
+		}
+		if (locked) {
+			xUnlock(SQLITE_LOCK_NONE);
+		}
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) {
+			return SQLITE_CANTOPEN;
+		}
+		bool written = write(fd, data.data(), data.size()) == (ssize_t) data.size() && fsync(fd) == 0;
+		close(fd);
+		if (!written) {
+			unlink(path);
+			return SQLITE_IOERR_WRITE;
+		}
+		return store->directory->reference(path);
+	}
+};
+
+struct ChunkVfsShim : public SQLiteVfsImpl<ChunkFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<ChunkFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		struct stat st;
+		if (result != SQLITE_OK || zName == nullptr || !(flags & SQLITE_OPEN_MAIN_DB) || stat(zName, &st) != 0) {
+			return result;
+		}
+		ChunkFileShim& shim = file->implementation;
+
+		lock_guard<mutex> lock(mtx);
+		weak_ptr<ChunkStore>& entry = stores[make_pair(st.st_dev, st.st_ino)];
+		shim.store = entry.lock();
+		if (!shim.store) {
+			shared_ptr<ChunkStore> store = make_shared<ChunkStore>();
+			store->manifest_path = zName;
+			store->device = st.st_dev;
+			store->inode = st.st_ino;
+			result = store->load(file->original_file);
+			string directory_path;
+			if (result == SQLITE_OK && store->page_size) {
+				unsigned char header[header_size];
+				file->original_file->pMethods->xRead(file->original_file, header, header_size, 0);
+				directory_path.assign((const char *) header + path_offset, strnlen((const char *) header + path_offset, header_size - path_offset));
+			}
+			else if (result == SQLITE_OK) {
+				const char *parameter = sqlite3_uri_parameter(zName, "chunk_dir");
+				string manifest = zName;
+				directory_path = parameter ? parameter : manifest.substr(0, manifest.find_last_of('/') + 1) + "chunks";
+				char full_path[PATH_MAX];
+				if (directory_path.size() >= (size_t) (header_size - path_offset)
+					|| (mkdir(directory_path.c_str(), 0755) != 0 && errno != EEXIST) || !realpath(directory_path.c_str(), full_path)) {
+					result = SQLITE_CANTOPEN;
+				}
+				else {
+					directory_path = full_path;
+				}
+			}
+			if (result == SQLITE_OK) {
+				result = open_directory(directory_path, zName, store->directory);
+			}
+			if (result == SQLITE_OK) {
+				result = store->directory->reference(zName);
+			}
+			if (result != SQLITE_OK) {
+				file->original_file->pMethods->xClose(file->original_file);
+				return result;
+			}
+			store->directory->attach(store.get());
+			entry = store;
+			shim.store = store;
+		}
+		return result;
+	}
+
+private:
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<ChunkStore>> stores;
+	map<pair<dev_t, ino_t>, weak_ptr<ChunkDirectory>> directories;
+
+	// The directory at `path`, created and collected from the first time this process uses it.
+	int open_directory(const string& path, sqlite3_filename zName, shared_ptr<ChunkDirectory>& directory) {
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0) {
+			sqlite3_log(SQLITE_CANTOPEN, "chunk directory \"%s\" not found", path.c_str());
+			return SQLITE_CANTOPEN;
+		}
+		weak_ptr<ChunkDirectory>& entry = directories[make_pair(st.st_dev, st.st_ino)];
+		directory = entry.lock();
+		if (!directory) {
+			directory = make_shared<ChunkDirectory>(path, (int) sqlite3_uri_int64(zName, "chunk_gc_grace", 600));
+			int result = directory->create();
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			int interval = (int) sqlite3_uri_int64(zName, "chunk_gc_interval", 60);
+			if (interval > 0) {
+				directory->start_collection(interval);
+			}
+			entry = directory;
+		}
+		return SQLITE_OK;
+	}
+};
+
+extern "C" int sqlite3_chunkvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<ChunkVfsShim> chunkvfs("chunkvfs");
+	int rc = chunkvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
@@ -0,0 +1,588 @@
+// Compression VFS shim: stores every page of the database zlib compressed, in a variable size slot.
+//
+// Layout of a compressed database file:
+//   - two 4096 byte header copies: magic, block size, checksum, sequence number
+//     and the offsets of up to 509 map chunks
+//   - map chunks of 8192 entries, one 8 byte entry per block, with the offset
+//     and compressed length of its slot (0 for blocks never written)
+//   - slots, 64 byte aligned, reused through a free space allocator
+// A block is a database page, its size is taken from the first write.
+// `xRead` decompresses, `xFileSize` reports the uncompressed size. Journals and WAL files are not compressed.
+//
+// The page map is the only persistent structure. The free space allocator is
+// rebuilt from it when the database is opened. Map entries are written on
+// `xSync`, right before syncing the database. Slots freed by a rewrite or a
+// truncation are only reused after that sync, so the durable map never
+// points to a slot that was overwritten since. After a crash, every block
+// whose entry or slot may be torn was written by the interrupted transaction
+// or checkpoint, and SQLite rewrites it from the rollback journal or WAL.
+// The header changes when map chunks are added. It is written to the older
+// copy, after syncing the chunks it points to, and the copy with the highest
+// sequence number and a valid checksum is used. A torn header write leaves
+// the previous one in place, whose chunks hold every block that existed
+// before the interrupted transaction. Free space at the end of the file is
+// given back on sync.
+//
+// URI parameters:
+//   compress_level=<0-9>  zlib compression level (default 6)
+//
+// `PRAGMA compress_stats` reports the logical and physical sizes of the database.
+//
+// @note The page map is shared by the connections of one process, a compressed database
+//       must not be used by several processes at once.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+#include "ExtentAllocator.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <zlib.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+static const char compressed_magic[8] = { 'S', 'Q', 'L', 'Z', 'I', 'P', '0', '1' };
+static const int header_size = 4096;
+static const int header_copies = 2;
+static const int max_chunks = (header_size - 24) / 8;
+static const sqlite3_int64 chunk_entries = 8192;
+static const sqlite3_int64 slot_alignment = 64;
+
+static void put_u64(unsigned char *p, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t) p[i] << (8 * i);
+	}
+	return value;
+}
+
+// A map entry holds the slot offset in 16 byte units in the upper 40 bits, and the compressed length in the lower 24.
+static uint64_t make_entry(sqlite3_int64 offset, int length) {
+	return ((uint64_t) offset >> 4) << 24 | (uint64_t) length;
+}
+
+static sqlite3_int64 entry_offset(uint64_t entry) {
+	return (sqlite3_int64) (entry >> 24) << 4;
+}
+
+static int entry_length(uint64_t entry) {
+	return (int) (entry & 0xFFFFFF);
+}
+
+static sqlite3_int64 slot_capacity(int length) {
+	return (length + slot_alignment - 1) / slot_alignment * slot_alignment;
+}
+
+// Page map and free space of a compressed database, shared by the connections of this process.
+struct CompressedStore {
+	mutex mtx;
+	// 0 until the first write creates the header
+	int block_size = 0;
+	vector<sqlite3_int64> chunk_offsets;
+	vector<uint64_t> entries;
+	sqlite3_int64 block_count = 0;
+	// Of the last header written, the copy it went to is `(sequence - 1) % header_copies`
+	uint64_t header_sequence = 0;
+	// Blocks whose entry changed since the last `xSync`
+	set<sqlite3_int64> dirty_blocks;
+	bool header_dirty = false;
+	ExtentAllocator allocator{header_size * header_copies};
+	// Slots that the durable page map may still point to
+	vector<pair<sqlite3_int64, sqlite3_int64>> pending_frees;
+	// Open connections using the store
+	int connections = 0;
+
+	sqlite3_int64 compressed_bytes = 0;
+};
+
+struct CompressFileShim : public SQLiteFileImpl {
+	shared_ptr<CompressedStore> store;
+	int level = Z_DEFAULT_COMPRESSION;
+	// Reused for every block, to avoid allocations per I/O
+	vector<unsigned char> block_buffer;
+	vector<unsigned char> slot_buffer;
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!store) {
+			return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		}
+		unsigned char *out = (unsigned char *) p;
+		sqlite3_int64 block_size, block_count;
+		{
+			lock_guard<mutex> lock(store->mtx);
+			block_size = store->block_size;
+			block_count = store->block_count;
+		}
+		if (block_size == 0) {
+			memset(p, 0, iAmt);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+
+		sqlite3_int64 position = iOfst;
+		while (position < iOfst + iAmt) {
+			sqlite3_int64 block = position / block_size;
+			int in_block = (int) (position % block_size);
+			int length = (int) min<sqlite3_int64>(block_size - in_block, iOfst + iAmt - position);
+			if (block >= block_count) {
+				memset(out + (position - iOfst), 0, iOfst + iAmt - position);
+				return SQLITE_IOERR_SHORT_READ;
+			}
+			// Whole blocks are decompressed in place
+			bool whole = in_block == 0 && length == block_size;
+			if (!whole) {
+				block_buffer.resize(block_size);
+			}
+			unsigned char *destination = whole ? out + (position - iOfst) : block_buffer.data();
+			int result = read_block(block, destination);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			if (!whole) {
+				memcpy(out + (position - iOfst), destination + in_block, length);
+			}
+			position += length;
+		}
+		return SQLITE_OK;
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!store) {
+			return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		}
+		const unsigned char *in = (const unsigned char *) p;
+		sqlite3_int64 block_size;
+		{
+			lock_guard<mutex> lock(store->mtx);
+			if (store->block_size == 0) {
+				bool page_sized = iOfst == 0 && iAmt >= 512 && iAmt <= 65536 && (iAmt & (iAmt - 1)) == 0;
+				store->block_size = page_sized ? iAmt : 4096;
+				store->header_dirty = true;
+			}
+			block_size = store->block_size;
+		}
+
+		sqlite3_int64 position = iOfst;
+		while (position < iOfst + iAmt) {
+			sqlite3_int64 block = position / block_size;
+			int in_block = (int) (position % block_size);
+			int length = (int) min<sqlite3_int64>(block_size - in_block, iOfst + iAmt - position);
+			const unsigned char *data = in + (position - iOfst);
+			if (in_block != 0 || length != block_size) {
+				// Merge a partial block with its stored contents
+				block_buffer.resize(block_size);
+				int result = read_block(block, block_buffer.data());
+				if (result == SQLITE_IOERR_SHORT_READ) {
+					memset(block_buffer.data(), 0, block_size);
+				}
+				else if (result != SQLITE_OK) {
+					return result;
+				}
+				memcpy(block_buffer.data() + in_block, data, length);
+				data = block_buffer.data();
+			}
+			int result = write_block(block, data, (int) block_size);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			position += length;
+		}
+		return SQLITE_OK;
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (!store) {
+			return SQLiteFileImpl::xTruncate(size);
+		}
+		lock_guard<mutex> lock(store->mtx);
+		if (store->block_size == 0) {
+			return SQLITE_OK;
+		}
+		sqlite3_int64 blocks = (size + store->block_size - 1) / store->block_size;
+		for (sqlite3_int64 block = blocks; block < store->block_count; block++) {
+			free_entry(block);
+		}
+		store->block_count = min(store->block_count, blocks);
+		return SQLITE_OK;
+	}
+
+	int xSync(int flags) override {
+		if (!store) {
+			return SQLiteFileImpl::xSync(flags);
+		}
+		vector<pair<sqlite3_int64, sqlite3_int64>> synced_frees;
+		{
+			lock_guard<mutex> lock(store->mtx);
+			int result = flush_map();
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			synced_frees.swap(store->pending_frees);
+		}
+		int result = SQLiteFileImpl::xSync(flags);
+
+		lock_guard<mutex> lock(store->mtx);
+		if (result != SQLITE_OK) {
+			store->pending_frees.insert(store->pending_frees.end(), synced_frees.begin(), synced_frees.end());
+			return result;
+		}
+		for (auto& extent : synced_frees) {
+			store->allocator.release(extent.first, extent.second);
+		}
+		// Give back free space at the end of the file
+		sqlite3_int64 physical_size;
+		if (SQLiteFileImpl::xFileSize(&physical_size) == SQLITE_OK && physical_size > store->allocator.end) {
+			SQLiteFileImpl::xTruncate(store->allocator.end);
+		}
+		return SQLITE_OK;
+	}
+
+	int xFileSize(sqlite3_int64 *pSize) override {
+		if (!store) {
+			return SQLiteFileImpl::xFileSize(pSize);
+		}
+		lock_guard<mutex> lock(store->mtx);
+		*pSize = store->block_count * store->block_size;
+		return SQLITE_OK;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (store) {
+			switch (op) {
+				case SQLITE_FCNTL_PRAGMA: {
+					char **argv = (char **) pArg;
+					if (sqlite3_stricmp(argv[1], "compress_stats") == 0) {
+						lock_guard<mutex> lock(store->mtx);
+						argv[0] = sqlite3_mprintf("logical_size=%lld physical_size=%lld compressed_bytes=%lld free_bytes=%lld block_size=%d",
+							store->block_count * store->block_size, store->allocator.end, store->compressed_bytes,
+							store->allocator.free_bytes, store->block_size);
+						return SQLITE_OK;
+					}
+					break;
+				}
+				// The physical file doesn't grow along with the logical size
+				case SQLITE_FCNTL_SIZE_HINT:
+				case SQLITE_FCNTL_CHUNK_SIZE:
+					return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	// Pages are compressed on disk, they can't be mapped
+	int xFetch(sqlite3_int64 iOfst, int iAmt, void **pp) override {
+		if (!store) {
+			return SQLiteFileImpl::xFetch(iOfst, iAmt, pp);
+		}
+		*pp = nullptr;
+		return SQLITE_OK;
+	}
+
+	int xUnfetch(sqlite3_int64 iOfst, void *p) override {
+		if (!store) {
+			return SQLiteFileImpl::xUnfetch(iOfst, p);
+		}
+		return SQLITE_OK;
+	}
+
+	int xClose() override {
+		if (store) {
+			lock_guard<mutex> lock(store->mtx);
+			flush_map();
+			// Without syncs (`PRAGMA synchronous=OFF`), freed slots are only reused after the last connection closed
+			if (--store->connections == 0) {
+				for (auto& extent : store->pending_frees) {
+					store->allocator.release(extent.first, extent.second);
+				}
+				store->pending_frees.clear();
+			}
+		}
+		return SQLiteFileImpl::xClose();
+	}
+
+	// Load the page map, or create an empty store for empty files.
+	static int load(sqlite3_file *file, CompressedStore& store) {
+		sqlite3_int64 physical_size;
+		int result = file->pMethods->xFileSize(file, &physical_size);
+		if (result != SQLITE_OK || physical_size == 0) {
+			return result;
+		}
+		vector<unsigned char> headers(header_size * header_copies);
+		result = file->pMethods->xRead(file, headers.data(), (int) headers.size(), 0);
+		if (result != SQLITE_OK && result != SQLITE_IOERR_SHORT_READ) {
+			return result;
+		}
+		// The valid copy with the highest sequence number
+		const unsigned char *header = nullptr;
+		bool found_magic = false;
+		for (int i = 0; i < header_copies; i++) {
+			const unsigned char *copy = headers.data() + i * header_size;
+			if (memcmp(copy, compressed_magic, sizeof(compressed_magic)) != 0) {
+				continue;
+			}
+			found_magic = true;
+			if (header_checksum(copy) == (uint32_t) (get_u64(copy + 8) >> 32)
+				&& (header == nullptr || get_u64(copy + 16) > get_u64(header + 16))) {
+				header = copy;
+			}
+		}
+		if (header == nullptr) {
+			return found_magic ? SQLITE_CORRUPT : SQLITE_NOTADB;
+		}
+		store.block_size = (int) (get_u64(header + 8) & 0xFFFFFFFF);
+		store.header_sequence = get_u64(header + 16);
+
+		vector<pair<sqlite3_int64, sqlite3_int64>> used { { 0, header_size * header_copies } };
+		vector<unsigned char> chunk(chunk_entries * 8);
+		for (int i = 0; i < max_chunks; i++) {
+			sqlite3_int64 chunk_offset = (sqlite3_int64) get_u64(header + 24 + i * 8);
+			if (chunk_offset == 0) {
+				break;
+			}
+			result = file->pMethods->xRead(file, chunk.data(), (int) chunk.size(), chunk_offset);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			store.chunk_offsets.push_back(chunk_offset);
+			used.emplace_back(chunk_offset, (sqlite3_int64) chunk.size());
+			for (sqlite3_int64 j = 0; j < chunk_entries; j++) {
+				uint64_t entry = get_u64(chunk.data() + j * 8);
+				store.entries.push_back(entry);
+				if (entry) {
+					store.block_count = i * chunk_entries + j + 1;
+					used.emplace_back(entry_offset(entry), slot_capacity(entry_length(entry)));
+					store.compressed_bytes += entry_length(entry);
+				}
+			}
+		}
+		store.entries.resize(store.block_count);
+		store.allocator.load(used);
+		return SQLITE_OK;
+	}
+
+	// CRC-32 of a header copy, without its checksum field.
+	static uint32_t header_checksum(const unsigned char *header) {
+		uLong crc = crc32(0, header, 12);
+		return (uint32_t) crc32(crc, header + 16, header_size - 16);
+	}
+
+private:
+	// Read and decompress `block` into `destination`, which has room for a whole block.
+	int read_block(sqlite3_int64 block, unsigned char *destination) {
+		uint64_t entry;
+		int block_size;
+		{
+			lock_guard<mutex> lock(store->mtx);
+			entry = block < (sqlite3_int64) store->entries.size() ? store->entries[block] : 0;
+			block_size = store->block_size;
+		}
+		if (entry == 0) {
+			// Never written, like a hole in a sparse file
+			memset(destination, 0, block_size);
+			return SQLITE_OK;
+		}
+		int length = entry_length(entry);
+		if (length == block_size) {
+			// Stored uncompressed
+			return SQLiteFileImpl::xRead(destination, length, entry_offset(entry));
+		}
+		slot_buffer.resize(length);
+		int result = SQLiteFileImpl::xRead(slot_buffer.data(), length, entry_offset(entry));
+		if (result != SQLITE_OK) {
+			return result == SQLITE_IOERR_SHORT_READ ? SQLITE_CORRUPT : result;
+		}
+		uLongf decompressed_length = block_size;
+		if (uncompress(destination, &decompressed_length, slot_buffer.data(), length) != Z_OK || (int) decompressed_length != block_size) {
+			return SQLITE_CORRUPT;
+		}
+		return SQLITE_OK;
+	}
+
+	// Compress `data` into a slot and point the entry of `block` to it.
+	int write_block(sqlite3_int64 block, const unsigned char *data, int block_size) {
+		slot_buffer.resize(compressBound(block_size));
+		uLongf length = slot_buffer.size();
+		const unsigned char *slot_data = slot_buffer.data();
+		if (compress2(slot_buffer.data(), &length, data, block_size, level) != Z_OK || (sqlite3_int64) length > block_size - slot_alignment) {
+			// Not worth it, store the block as is
+			length = block_size;
+			slot_data = data;
+		}
+
+		sqlite3_int64 offset;
+		{
+			lock_guard<mutex> lock(store->mtx);
+			int result = ensure_chunk(block);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			if (block >= (sqlite3_int64) store->entries.size()) {
+				store->entries.resize(block + 1);
+			}
+			uint64_t old_entry = store->entries[block];
+			if (old_entry && store->dirty_blocks.count(block) && slot_capacity(entry_length(old_entry)) == slot_capacity((int) length)) {
+				// The slot was allocated since the last sync, the durable map doesn't point to it, so it can be rewritten in place
+				offset = entry_offset(old_entry);
+			}
+			else {
+				offset = store->allocator.allocate(slot_capacity((int) length));
+				if (old_entry) {
+					store->pending_frees.emplace_back(entry_offset(old_entry), slot_capacity(entry_length(old_entry)));
+				}
+			}
+		}
+
+		int result = SQLiteFileImpl::xWrite(slot_data, (int) length, offset);
+
+		lock_guard<mutex> lock(store->mtx);
+		uint64_t old_entry = store->entries[block];
+		if (result != SQLITE_OK) {
+			if (offset != entry_offset(old_entry)) {
+				store->allocator.release(offset, slot_capacity((int) length));
+			}
+			return result;
+		}
+		store->compressed_bytes += (sqlite3_int64) length - (old_entry ? entry_length(old_entry) : 0);
+		store->entries[block] = make_entry(offset, (int) length);
+		store->dirty_blocks.insert(block);
+		store->block_count = max(store->block_count, block + 1);
+		return SQLITE_OK;
+	}
+
+	// Must be called with `store->mtx` locked.
+	void free_entry(sqlite3_int64 block) {
+		uint64_t entry = block < (sqlite3_int64) store->entries.size() ? store->entries[block] : 0;
+		if (entry) {
+			store->pending_frees.emplace_back(entry_offset(entry), slot_capacity(entry_length(entry)));
+			store->compressed_bytes -= entry_length(entry);
+			store->entries[block] = 0;
+			store->dirty_blocks.insert(block);
+		}
+	}
+
+	// Make sure the map chunk of `block` exists. Must be called with `store->mtx` locked.
+	int ensure_chunk(sqlite3_int64 block) {
+		while ((sqlite3_int64) store->chunk_offsets.size() <= block / chunk_entries) {
+			if ((int) store->chunk_offsets.size() == max_chunks) {
+				return SQLITE_FULL;
+			}
+			// Chunks are zero filled, which is the entry of blocks never written
+			vector<unsigned char> zeros(chunk_entries * 8);
+			sqlite3_int64 chunk_offset = store->allocator.allocate(zeros.size());
+			int result = SQLiteFileImpl::xWrite(zeros.data(), (int) zeros.size(), chunk_offset);
+			if (result != SQLITE_OK) {
+				store->allocator.release(chunk_offset, zeros.size());
+				return result;
+			}
+			store->chunk_offsets.push_back(chunk_offset);
+			store->header_dirty = true;
+		}
+		return SQLITE_OK;
+	}
+
+	// Write changed map entries and the header. Must be called with `store->mtx` locked.
+	int flush_map() {
+		auto& dirty = store->dirty_blocks;
+		vector<unsigned char> run;
+		for (auto it = dirty.begin(); it != dirty.end(); ) {
+			// Write runs of consecutive entries in the same chunk at once
+			sqlite3_int64 first = *it, last = first;
+			for (++it; it != dirty.end() && *it == last + 1 && *it % chunk_entries != 0; ++it) {
+				last = *it;
+			}
+			run.resize((last - first + 1) * 8);
+			for (sqlite3_int64 block = first; block <= last; block++) {
+				uint64_t entry = block < (sqlite3_int64) store->entries.size() ? store->entries[block] : 0;
+				put_u64(run.data() + (block - first) * 8, entry);
+			}
+			sqlite3_int64 offset = store->chunk_offsets[first / chunk_entries] + first % chunk_entries * 8;
+			int result = SQLiteFileImpl::xWrite(run.data(), (int) run.size(), offset);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		dirty.clear();
+
+		if (store->header_dirty) {
+			// The header must never point to chunks that aren't durable yet
+			int result = SQLiteFileImpl::xSync(SQLITE_SYNC_NORMAL);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			uint64_t sequence = store->header_sequence + 1;
+			unsigned char header[header_size] = {};
+			memcpy(header, compressed_magic, sizeof(compressed_magic));
+			put_u64(header + 16, sequence);
+			for (size_t i = 0; i < store->chunk_offsets.size(); i++) {
+				put_u64(header + 24 + i * 8, (uint64_t) store->chunk_offsets[i]);
+			}
+			put_u64(header + 8, (uint64_t) store->block_size);
+			uint32_t checksum = header_checksum(header);
+			put_u64(header + 8, (uint64_t) store->block_size | (uint64_t) checksum << 32);
+			result = SQLiteFileImpl::xWrite(header, header_size, (sqlite3_int64) ((sequence - 1) % header_copies) * header_size);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			store->header_sequence = sequence;
+			store->header_dirty = false;
+		}
+		return SQLITE_OK;
+	}
+};
+
+struct CompressVfsShim : public SQLiteVfsImpl<CompressFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<CompressFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		struct stat st;
+		if (result != SQLITE_OK || zName == nullptr || !(flags & SQLITE_OPEN_MAIN_DB) || stat(zName, &st) != 0) {
+			return result;
+		}
+		CompressFileShim& shim = file->implementation;
+		shim.level = (int) sqlite3_uri_int64(zName, "compress_level", Z_DEFAULT_COMPRESSION);
+
+		lock_guard<mutex> lock(mtx);
+		weak_ptr<CompressedStore>& entry = stores[make_pair(st.st_dev, st.st_ino)];
+		shim.store = entry.lock();
+		if (!shim.store) {
+			shim.store = make_shared<CompressedStore>();
+			result = CompressFileShim::load(file->original_file, *shim.store);
+			if (result != SQLITE_OK) {
+				file->original_file->pMethods->xClose(file->original_file);
+				return result;
+			}
+			entry = shim.store;
+		}
+		lock_guard<mutex> store_lock(shim.store->mtx);
+		shim.store->connections++;
+		return result;
+	}
+
+private:
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<CompressedStore>> stores;
+};
+
+extern "C" int sqlite3_compressvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<CompressVfsShim> compressvfs("compressvfs");
+	int rc = compressvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
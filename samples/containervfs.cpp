@@ -0,0 +1,1217 @@
+// Container VFS: stores many small databases, with their journals and WAL files, inside one container file.
+//
+// A path like `/data/tenants.sqlc/customer42` names the logical file
+// `customer42` of the container `/data/tenants.sqlc`, which is created when
+// a logical file is created in it. SQLite appends `-journal` or `-wal` to the
+// path, so the journals and WAL files of a logical database are logical files
+// of the same container. Paths outside of a `.sqlc` container are left to the
+// base VFS. `xOpen`, `xDelete` and `xAccess` look logical files up by name.
+//
+// Layout of a container file:
+//   - two 4096 byte superblock copies, written alternately: magic, generation
+//     and the offsets of the record chunks
+//   - record chunks of 64, 128, 256... records, stored three times: checksum,
+//     sequence number, name, size and up to 16 extents of a logical file
+//   - extents of logical files, 4096 byte aligned, reused through a free space allocator
+// Logical files are written in place. A file grows by extents of at least
+// 16 KiB and half its capacity, adjacent extents are merged, and a file with
+// too many extents is copied to a single one.
+//
+// A record is written as soon as its file is created, deleted, resized or
+// moved, so a crash of the process loses nothing. It goes to the copy after
+// the durable one, or to the third copy while a flush is making the second
+// one durable. `xSync` of any logical file flushes the container once.
+// Concurrent `xSync` calls share flushes: one caller flushes while the others
+// wait, and all of them return once it is done.
+// Extents freed by a truncation or a deletion are punched out after the
+// flush that made their records durable, and only reused after the next one.
+// Records may reach the disk before the data of their file, but then they
+// expose zeros, never the old contents of another file.
+// `xDelete` only flushes when SQLite asks for a directory sync, like the
+// unix VFS. Use `journal_mode=WAL` or `PERSIST` for durable commits without
+// `synchronous=EXTRA`.
+//
+// `PRAGMA container_stats` reports the files, space and flushes of the container.
+//
+// @note File locks and WAL indexes of logical files are kept in memory. A container
+//       is locked by the first process that opens it, others get `SQLITE_BUSY`.
+// @note A failed flush may have lost writes of any logical file. The container
+//       then fails every write until it is opened again.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+#include "ExtentAllocator.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+static const char container_magic[8] = { 'S', 'Q', 'L', 'C', 'T', 'N', 'R', '1' };
+static const char container_suffix[] = ".sqlc/";
+static const int superblock_size = 4096;
+static const sqlite3_int64 data_start = 2 * superblock_size;
+static const int record_size = 256;
+static const int record_copies = 3;
+static const size_t max_name = 96;
+static const size_t max_extents = 16;
+static const int name_offset = 32;
+static const int extents_offset = name_offset + max_name;
+static const sqlite3_int64 first_chunk_records = 64;
+static const size_t max_chunks = 32;
+// Extents are stored in blocks
+static const sqlite3_int64 block_size = 4096;
+static const sqlite3_int64 min_extent = 16384;
+// Free space at the end of the container is given back once it reaches this size
+static const sqlite3_int64 trim_threshold = 1 << 20;
+// Largest I/O of zero fills, copies and record loads, which bounds their buffers
+static const int max_io_size = 65536;
+
+static const unsigned char zeros[max_io_size] = {};
+
+static void put_u16(unsigned char *p, uint16_t value) {
+	p[0] = (unsigned char) value;
+	p[1] = (unsigned char) (value >> 8);
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+	return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static void put_u32(unsigned char *p, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_u64(unsigned char *p, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t) p[i] << (8 * i);
+	}
+	return value;
+}
+
+// Same checksum as SQLite's WAL frames, `size` must be a multiple of 8.
+static void log_checksum(const unsigned char *data, size_t size, unsigned char out[8]) {
+	uint32_t s1 = 0, s2 = 0;
+	for (size_t i = 0; i + 8 <= size; i += 8) {
+		s1 += get_u32(data + i) + s2;
+		s2 += get_u32(data + i + 4) + s1;
+	}
+	put_u32(out, s1);
+	put_u32(out + 4, s2);
+}
+
+static sqlite3_int64 round_up(sqlite3_int64 value) {
+	return (value + block_size - 1) / block_size * block_size;
+}
+
+// Split `path` into the path of its container and a logical name, false if `path` is not in a container.
+static bool split_path(const char *path, string& container, string& name) {
+	const char *found = nullptr;
+	for (const char *match = path ? strstr(path, container_suffix) : nullptr; match; match = strstr(match + 1, container_suffix)) {
+		found = match;
+	}
+	if (found == nullptr) {
+		return false;
+	}
+	const char *logical = found + sizeof(container_suffix) - 1;
+	if (*logical == '\0' || strchr(logical, '/') != nullptr) {
+		return false;
+	}
+	container.assign(path, logical - 1);
+	name = logical;
+	return true;
+}
+
+// WAL index of a logical database, shared by its connections.
+struct ContainerShm {
+	mutex mtx;
+	vector<unique_ptr<char[]>> regions;
+	atomic<int> slots[SQLITE_SHM_NLOCK];
+
+	ContainerShm() {
+		// Positive values count SHARED locks, -1 is an EXCLUSIVE lock
+		for (atomic<int>& slot : slots) {
+			slot = 0;
+		}
+	}
+};
+
+// A logical file of a container.
+struct ContainerEntry {
+	string name;
+	// Index of its record, -1 once deleted
+	sqlite3_int64 record = -1;
+	sqlite3_int64 size = 0;
+	vector<pair<sqlite3_int64, sqlite3_int64>> extents;
+	sqlite3_int64 capacity = 0;
+	int opens = 0;
+
+	// File locks held by the connections of this process
+	int shared_locks = 0;
+	bool reserved = false;
+	bool pending = false;
+	bool exclusive = false;
+	weak_ptr<ContainerShm> shm;
+};
+
+// A container file and its logical files, shared by the connections of this process.
+class Container {
+public:
+	mutex mtx;
+	map<string, shared_ptr<ContainerEntry>> entries;
+
+	~Container() {
+		if (file) {
+			if (file->pMethods) {
+				file->pMethods->xUnlock(file, SQLITE_LOCK_NONE);
+				file->pMethods->xClose(file);
+			}
+			sqlite3_free(file);
+		}
+		// Closed last, as closing any descriptor of the container drops the locks of the base VFS
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	// Open or create the container at `path` and lock it for this process.
+	int open(sqlite3_vfs *vfs, const string& container_path) {
+		path = container_path;
+		file = (sqlite3_file *) sqlite3_malloc(vfs->szOsFile);
+		if (file == nullptr) {
+			return SQLITE_NOMEM;
+		}
+		memset(file, 0, vfs->szOsFile);
+		int result = vfs->xOpen(vfs, path.c_str(), file, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MAIN_JOURNAL, nullptr);
+		if (result == SQLITE_OK) {
+			result = file->pMethods->xLock(file, SQLITE_LOCK_SHARED);
+		}
+		if (result == SQLITE_OK) {
+			result = file->pMethods->xLock(file, SQLITE_LOCK_EXCLUSIVE);
+		}
+		if (result == SQLITE_OK) {
+			// Used to punch out free extents
+			fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+			result = fd >= 0 ? load() : SQLITE_CANTOPEN;
+		}
+		return result;
+	}
+
+	// Open the logical file `name`, creating it if `flags` allow. Must be called with `mtx` locked.
+	int open_entry(const string& name, int flags, shared_ptr<ContainerEntry>& entry) {
+		auto it = entries.find(name);
+		if (it != entries.end()) {
+			if ((flags & SQLITE_OPEN_EXCLUSIVE) && (flags & SQLITE_OPEN_CREATE)) {
+				return SQLITE_CANTOPEN;
+			}
+			entry = it->second;
+		}
+		else {
+			if (!(flags & SQLITE_OPEN_CREATE) || name.size() > max_name) {
+				return SQLITE_CANTOPEN;
+			}
+			if (failed != SQLITE_OK) {
+				return failed;
+			}
+			if (free_records.empty()) {
+				int result = add_chunk();
+				if (result != SQLITE_OK) {
+					return result;
+				}
+			}
+			entry = make_shared<ContainerEntry>();
+			entry->name = name;
+			entry->record = *free_records.begin();
+			free_records.erase(free_records.begin());
+			records[entry->record] = entry;
+			entries[name] = entry;
+			int result = write_record(entry->record);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		entry->opens++;
+		return SQLITE_OK;
+	}
+
+	// Must be called with `mtx` locked.
+	void close_entry(ContainerEntry *entry) {
+		entry->opens--;
+		if (entry->record < 0 && entry->opens == 0) {
+			free_extents(entry);
+		}
+	}
+
+	// Delete the logical file `name`. Its space is freed once it is closed. Must be called with `mtx` locked.
+	int remove(const string& name) {
+		auto it = entries.find(name);
+		if (it == entries.end()) {
+			return SQLITE_IOERR_DELETE_NOENT;
+		}
+		if (failed != SQLITE_OK) {
+			return failed;
+		}
+		shared_ptr<ContainerEntry> entry = it->second;
+		sqlite3_int64 index = entry->record;
+		entries.erase(it);
+		records[index] = nullptr;
+		free_records.insert(index);
+		entry->record = -1;
+		if (entry->opens == 0) {
+			free_extents(entry.get());
+		}
+		return write_record(index);
+	}
+
+	// Make `entry` hold at least `size` bytes. Must be called with `mtx` locked.
+	int reserve(ContainerEntry *entry, sqlite3_int64 size) {
+		if (failed != SQLITE_OK) {
+			return failed;
+		}
+		while (entry->capacity < size) {
+			if (entry->extents.size() == max_extents) {
+				return relocate(entry, size);
+			}
+			sqlite3_int64 length = round_up(max(size - entry->capacity, max(min_extent, entry->capacity / 2)));
+			sqlite3_int64 offset = allocator.allocate(length);
+			file_end = max(file_end, allocator.end);
+			if (!entry->extents.empty() && entry->extents.back().first + entry->extents.back().second == offset) {
+				entry->extents.back().second += length;
+			}
+			else {
+				entry->extents.emplace_back(offset, length);
+			}
+			// Written with the size, extents past it are lost in a crash but never read
+			entry->capacity += length;
+		}
+		return SQLITE_OK;
+	}
+
+	// Set the size of `entry`, freeing the extents past it. Must be called with `mtx` locked.
+	int resize(ContainerEntry *entry, sqlite3_int64 size) {
+		if (failed != SQLITE_OK) {
+			return failed;
+		}
+		entry->size = size;
+		sqlite3_int64 position = 0;
+		size_t kept = 0;
+		while (kept < entry->extents.size() && position < size) {
+			position += entry->extents[kept++].second;
+		}
+		for (size_t i = kept; i < entry->extents.size(); i++) {
+			pending_frees.push_back(entry->extents[i]);
+			entry->capacity -= entry->extents[i].second;
+		}
+		entry->extents.resize(kept);
+		return entry->record >= 0 ? write_record(entry->record) : SQLITE_OK;
+	}
+
+	// Container offsets and lengths of bytes [offset, offset + length) of `entry`, within its capacity.
+	// Must be called with `mtx` locked.
+	void pieces(const ContainerEntry *entry, sqlite3_int64 offset, sqlite3_int64 length, vector<pair<sqlite3_int64, sqlite3_int64>>& out) const {
+		out.clear();
+		sqlite3_int64 position = 0;
+		for (auto& extent : entry->extents) {
+			sqlite3_int64 start = max(offset, position), end = min(offset + length, position + extent.second);
+			if (start < end) {
+				out.emplace_back(extent.first + start - position, end - start);
+			}
+			position += extent.second;
+		}
+	}
+
+	int read_pieces(const vector<pair<sqlite3_int64, sqlite3_int64>>& pieces, unsigned char *data) const {
+		for (auto& piece : pieces) {
+			int result = file->pMethods->xRead(file, data, (int) piece.second, piece.first);
+			// Space that was allocated but never written reads as zeros
+			if (result != SQLITE_OK && result != SQLITE_IOERR_SHORT_READ) {
+				return result;
+			}
+			data += piece.second;
+		}
+		return SQLITE_OK;
+	}
+
+	// Write `data` to `pieces`, or zeros if `data` is NULL.
+	int write_pieces(const vector<pair<sqlite3_int64, sqlite3_int64>>& pieces, const unsigned char *data) const {
+		for (auto& piece : pieces) {
+			for (sqlite3_int64 done = 0; done < piece.second; done += max_io_size) {
+				int length = (int) min<sqlite3_int64>(max_io_size, piece.second - done);
+				int result = file->pMethods->xWrite(file, data ? data + done : zeros, length, piece.first + done);
+				if (result != SQLITE_OK) {
+					return result;
+				}
+			}
+			if (data) {
+				data += piece.second;
+			}
+		}
+		return SQLITE_OK;
+	}
+
+	// Count data written to the container. Must be called with `mtx` locked.
+	void wrote() {
+		writes++;
+	}
+
+	// Flush the container, sharing the flush with concurrent callers.
+	int commit() {
+		unique_lock<mutex> lock(mtx);
+		uint64_t ticket = ++sync_requests;
+		syncs++;
+		while (flushing && flushed < ticket) {
+			commit_done.wait(lock);
+		}
+		if (failed != SQLITE_OK) {
+			return failed;
+		}
+		if (flushed >= ticket) {
+			shared_syncs++;
+			return SQLITE_OK;
+		}
+
+		// Flush for all the requests so far
+		flushing = true;
+		uint64_t covered = sync_requests;
+		bool needed = !dirty_records.empty() || writes > 0 || !punched.empty();
+		flushing_records.swap(dirty_records);
+		vector<pair<sqlite3_int64, sqlite3_int64>> frees, erased;
+		frees.swap(pending_frees);
+		erased.swap(punched);
+		writes = 0;
+		lock.unlock();
+
+		int result = needed ? file->pMethods->xSync(file, SQLITE_SYNC_NORMAL) : SQLITE_OK;
+
+		lock.lock();
+		if (result == SQLITE_OK) {
+			for (sqlite3_int64 index : flushing_records) {
+				record_seqs[index]++;
+			}
+			for (auto& extent : erased) {
+				allocator.release(extent.first, extent.second);
+			}
+			// The durable records don't point to these extents anymore
+			for (auto& extent : frees) {
+				(erase(extent.first, extent.second) == SQLITE_OK ? punched : pending_frees).push_back(extent);
+			}
+			if (needed) {
+				flushes++;
+			}
+			flushed = covered;
+			// Give back free space at the end of the container
+			if (file_end - allocator.end >= trim_threshold && file->pMethods->xTruncate(file, allocator.end) == SQLITE_OK) {
+				file_end = allocator.end;
+			}
+		}
+		else {
+			failed = result;
+		}
+		flushing_records.clear();
+		flushing = false;
+		commit_done.notify_all();
+		return result;
+	}
+
+	// Must be called with `mtx` locked.
+	char *stats() const {
+		sqlite3_int64 used = 0;
+		for (auto& entry : entries) {
+			used += entry.second->size;
+		}
+		return sqlite3_mprintf("files=%d records=%lld used=%lld size=%lld free=%lld syncs=%lld flushes=%lld shared=%lld relocations=%lld",
+			(int) entries.size(), (sqlite3_int64) records.size(), used, allocator.end, allocator.free_bytes,
+			syncs, flushes, shared_syncs, relocations);
+	}
+
+private:
+	string path;
+	sqlite3_file *file = nullptr;
+	int fd = -1;
+	uint64_t generation = 0;
+	vector<sqlite3_int64> chunks;
+	// Entries by record index, NULL for free records
+	vector<shared_ptr<ContainerEntry>> records;
+	// Sequence number of the durable copy of each record
+	vector<uint64_t> record_seqs;
+	set<sqlite3_int64> free_records;
+	// Records written since the last flush
+	set<sqlite3_int64> dirty_records;
+	ExtentAllocator allocator{data_start};
+	// Extents that durable records may still point to
+	vector<pair<sqlite3_int64, sqlite3_int64>> pending_frees;
+	// Extents punched out since the last flush
+	vector<pair<sqlite3_int64, sqlite3_int64>> punched;
+	// Physical end of the container, at least
+	sqlite3_int64 file_end = data_start;
+	// Data writes since the last flush
+	sqlite3_int64 writes = 0;
+	// Error of a failed flush or record write, returned by every later write
+	int failed = SQLITE_OK;
+
+	condition_variable commit_done;
+	bool flushing = false;
+	// Records made durable by the flush in progress
+	set<sqlite3_int64> flushing_records;
+	uint64_t sync_requests = 0;
+	uint64_t flushed = 0;
+
+	sqlite3_int64 syncs = 0;
+	sqlite3_int64 flushes = 0;
+	sqlite3_int64 shared_syncs = 0;
+	sqlite3_int64 relocations = 0;
+
+	sqlite3_int64 record_offset(sqlite3_int64 index, int copy) const {
+		sqlite3_int64 chunk_records = first_chunk_records;
+		for (sqlite3_int64 chunk : chunks) {
+			if (index < chunk_records) {
+				return chunk + (copy * chunk_records + index) * record_size;
+			}
+			index -= chunk_records;
+			chunk_records *= 2;
+		}
+		return -1;
+	}
+
+	// Write record `index` after its durable copy, or after the copy being flushed. Must be called with `mtx` locked.
+	int write_record(sqlite3_int64 index) {
+		uint64_t sequence = record_seqs[index] + (flushing_records.count(index) ? 2 : 1);
+		unsigned char record[record_size];
+		encode_record(records[index].get(), sequence, record);
+		dirty_records.insert(index);
+		int result = file->pMethods->xWrite(file, record, record_size, record_offset(index, (int) (sequence % record_copies)));
+		if (result != SQLITE_OK) {
+			failed = result;
+		}
+		return result;
+	}
+
+	static void encode_record(const ContainerEntry *entry, uint64_t sequence, unsigned char *out) {
+		memset(out, 0, record_size);
+		put_u64(out + 8, sequence);
+		if (entry) {
+			put_u64(out + 16, entry->size);
+			put_u16(out + 24, (uint16_t) entry->name.size());
+			put_u16(out + 26, (uint16_t) entry->extents.size());
+			memcpy(out + name_offset, entry->name.data(), entry->name.size());
+			for (size_t i = 0; i < entry->extents.size(); i++) {
+				put_u32(out + extents_offset + 8 * i, (uint32_t) (entry->extents[i].first / block_size));
+				put_u32(out + extents_offset + 8 * i + 4, (uint32_t) (entry->extents[i].second / block_size));
+			}
+		}
+		log_checksum(out + 8, record_size - 8, out);
+	}
+
+	static bool record_valid(const unsigned char *record) {
+		unsigned char checksum[8];
+		log_checksum(record + 8, record_size - 8, checksum);
+		return memcmp(checksum, record, 8) == 0 && get_u64(record + 8) != 0;
+	}
+
+	// Deallocate a free extent, so that the file reusing it never reads its old contents.
+	int erase(sqlite3_int64 offset, sqlite3_int64 length) {
+#ifdef __linux__
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+			return SQLITE_OK;
+		}
+#endif
+		return write_pieces({ { offset, length } }, nullptr);
+	}
+
+	// Read the superblock and the records, and rebuild the free space.
+	int load() {
+		sqlite3_int64 size;
+		int result = file->pMethods->xFileSize(file, &size);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		unsigned char superblock[superblock_size];
+		bool found = false;
+		for (int copy = 0; copy < 2 && size >= data_start; copy++) {
+			unsigned char candidate[superblock_size];
+			unsigned char checksum[8];
+			result = file->pMethods->xRead(file, candidate, superblock_size, copy * superblock_size);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			log_checksum(candidate + 16, superblock_size - 16, checksum);
+			if (memcmp(candidate, container_magic, 8) != 0 || memcmp(candidate + 8, checksum, 8) != 0
+				|| get_u32(candidate + 24) != record_size || get_u32(candidate + 28) > max_chunks) {
+				continue;
+			}
+			if (!found || get_u64(candidate + 16) > generation) {
+				memcpy(superblock, candidate, superblock_size);
+				generation = get_u64(candidate + 16);
+				found = true;
+			}
+		}
+		if (!found) {
+			// A new container, or one whose creation was interrupted
+			if (size >= data_start) {
+				return SQLITE_CORRUPT;
+			}
+			return write_superblock();
+		}
+
+		vector<pair<sqlite3_int64, sqlite3_int64>> used = { { 0, data_start } };
+		uint32_t chunk_count = get_u32(superblock + 28);
+		const sqlite3_int64 group = max_io_size / record_size;
+		vector<unsigned char> buffer(record_copies * max_io_size);
+		sqlite3_int64 chunk_records = first_chunk_records;
+		for (uint32_t chunk = 0; chunk < chunk_count; chunk++, chunk_records *= 2) {
+			sqlite3_int64 offset = (sqlite3_int64) get_u64(superblock + 32 + 8 * chunk);
+			chunks.push_back(offset);
+			used.emplace_back(offset, record_copies * chunk_records * record_size);
+			for (sqlite3_int64 first = 0; first < chunk_records; first += group) {
+				sqlite3_int64 count = min(group, chunk_records - first);
+				for (int copy = 0; copy < record_copies; copy++) {
+					result = file->pMethods->xRead(file, buffer.data() + copy * max_io_size, (int) (count * record_size),
+						offset + (copy * chunk_records + first) * record_size);
+					if (result != SQLITE_OK && result != SQLITE_IOERR_SHORT_READ) {
+						return result;
+					}
+				}
+				for (sqlite3_int64 i = 0; i < count; i++) {
+					const unsigned char *copies[record_copies];
+					for (int copy = 0; copy < record_copies; copy++) {
+						copies[copy] = buffer.data() + copy * max_io_size + i * record_size;
+					}
+					result = load_record(copies, used);
+					if (result != SQLITE_OK) {
+						return result;
+					}
+				}
+			}
+		}
+
+		// Free space may hold data of deleted files or of extents allocated before a crash
+		sort(used.begin(), used.end());
+		sqlite3_int64 position = 0;
+		vector<pair<sqlite3_int64, sqlite3_int64>> gaps;
+		for (auto& extent : used) {
+			if (extent.first > position) {
+				gaps.emplace_back(position, extent.first - position);
+			}
+			position = max(position, extent.first + extent.second);
+		}
+		for (auto& gap : gaps) {
+			result = erase(gap.first, gap.second);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			punched.push_back(gap);
+			used.push_back(gap);
+		}
+		allocator.load(used);
+		// Space allocated past the records before a crash
+		if (size > allocator.end) {
+			file->pMethods->xTruncate(file, allocator.end);
+		}
+		file_end = allocator.end;
+		return SQLITE_OK;
+	}
+
+	// Load the newest valid copy of the next record.
+	int load_record(const unsigned char *copies[record_copies], vector<pair<sqlite3_int64, sqlite3_int64>>& used) {
+		const unsigned char *record = nullptr;
+		for (int copy = 0; copy < record_copies; copy++) {
+			if (record_valid(copies[copy]) && (!record || get_u64(copies[copy] + 8) > get_u64(record + 8))) {
+				record = copies[copy];
+			}
+		}
+		sqlite3_int64 index = (sqlite3_int64) records.size();
+		records.emplace_back();
+		record_seqs.push_back(record ? get_u64(record + 8) : 0);
+		uint16_t name_length = record ? get_u16(record + 24) : 0;
+		if (name_length == 0) {
+			free_records.insert(index);
+			return SQLITE_OK;
+		}
+
+		uint16_t extent_count = get_u16(record + 26);
+		if (name_length > max_name || extent_count > max_extents) {
+			return SQLITE_CORRUPT;
+		}
+		shared_ptr<ContainerEntry> entry = make_shared<ContainerEntry>();
+		entry->name.assign((const char *) record + name_offset, name_length);
+		entry->record = index;
+		entry->size = (sqlite3_int64) get_u64(record + 16);
+		for (uint16_t i = 0; i < extent_count; i++) {
+			sqlite3_int64 offset = get_u32(record + extents_offset + 8 * i) * block_size;
+			sqlite3_int64 length = get_u32(record + extents_offset + 8 * i + 4) * block_size;
+			if (offset < data_start || length == 0) {
+				return SQLITE_CORRUPT;
+			}
+			entry->extents.emplace_back(offset, length);
+			entry->capacity += length;
+			used.emplace_back(offset, length);
+		}
+		if (entry->size < 0 || entry->size > entry->capacity || entries.count(entry->name)) {
+			return SQLITE_CORRUPT;
+		}
+		records[index] = entry;
+		entries[entry->name] = entry;
+		return SQLITE_OK;
+	}
+
+	// Write the next superblock copy and flush it. Must be called with `mtx` locked.
+	int write_superblock() {
+		unsigned char superblock[superblock_size] = {};
+		memcpy(superblock, container_magic, 8);
+		put_u64(superblock + 16, generation + 1);
+		put_u32(superblock + 24, record_size);
+		put_u32(superblock + 28, (uint32_t) chunks.size());
+		for (size_t i = 0; i < chunks.size(); i++) {
+			put_u64(superblock + 32 + 8 * i, chunks[i]);
+		}
+		log_checksum(superblock + 16, superblock_size - 16, superblock + 8);
+		int result = file->pMethods->xWrite(file, superblock, superblock_size, ((generation + 1) % 2) * superblock_size);
+		if (result == SQLITE_OK) {
+			result = file->pMethods->xSync(file, SQLITE_SYNC_NORMAL);
+		}
+		if (result == SQLITE_OK) {
+			generation++;
+		}
+		return result;
+	}
+
+	// Add a chunk of free records, twice as large as the last one. Must be called with `mtx` locked.
+	int add_chunk() {
+		if (chunks.size() == max_chunks) {
+			return SQLITE_FULL;
+		}
+		sqlite3_int64 chunk_records = first_chunk_records << chunks.size();
+		sqlite3_int64 length = record_copies * chunk_records * record_size;
+		sqlite3_int64 offset = allocator.allocate(length);
+		file_end = max(file_end, allocator.end);
+		// Zeroed records are free, they must be durable before the superblock points to them
+		int result = write_pieces({ { offset, length } }, nullptr);
+		if (result == SQLITE_OK) {
+			result = file->pMethods->xSync(file, SQLITE_SYNC_NORMAL);
+		}
+		if (result == SQLITE_OK) {
+			chunks.push_back(offset);
+			result = write_superblock();
+			if (result != SQLITE_OK) {
+				// The superblock may still be durable, the chunk space is only reclaimed when the container is opened again
+				chunks.pop_back();
+			}
+		}
+		else {
+			allocator.release(offset, length);
+		}
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		sqlite3_int64 first = (sqlite3_int64) records.size();
+		records.resize(first + chunk_records);
+		record_seqs.resize(first + chunk_records, 0);
+		for (sqlite3_int64 index = first; index < first + chunk_records; index++) {
+			free_records.insert(index);
+		}
+		return SQLITE_OK;
+	}
+
+	// Copy `entry` to a single extent of at least `size` bytes. Must be called with `mtx` locked.
+	int relocate(ContainerEntry *entry, sqlite3_int64 size) {
+		sqlite3_int64 length = round_up(max(size, entry->capacity + entry->capacity / 2));
+		sqlite3_int64 offset = allocator.allocate(length);
+		file_end = max(file_end, allocator.end);
+		vector<unsigned char> buffer(max_io_size);
+		vector<pair<sqlite3_int64, sqlite3_int64>> source;
+		int result = SQLITE_OK;
+		for (sqlite3_int64 position = 0; position < entry->size && result == SQLITE_OK; position += max_io_size) {
+			sqlite3_int64 count = min<sqlite3_int64>(max_io_size, entry->size - position);
+			pieces(entry, position, count, source);
+			result = read_pieces(source, buffer.data());
+			if (result == SQLITE_OK) {
+				result = write_pieces({ { offset + position, count } }, buffer.data());
+			}
+		}
+		// The copy must be durable before the record points to it
+		if (result == SQLITE_OK) {
+			result = file->pMethods->xSync(file, SQLITE_SYNC_NORMAL);
+		}
+		if (result != SQLITE_OK) {
+			pending_frees.emplace_back(offset, length);
+			return result;
+		}
+		pending_frees.insert(pending_frees.end(), entry->extents.begin(), entry->extents.end());
+		entry->extents = { { offset, length } };
+		entry->capacity = length;
+		relocations++;
+		return entry->record >= 0 ? write_record(entry->record) : SQLITE_OK;
+	}
+
+	// Must be called with `mtx` locked.
+	void free_extents(ContainerEntry *entry) {
+		pending_frees.insert(pending_frees.end(), entry->extents.begin(), entry->extents.end());
+		entry->extents.clear();
+		entry->capacity = 0;
+	}
+};
+
+struct ContainerFile : public SQLiteFileImpl {
+	// NULL for files outside of containers
+	shared_ptr<Container> container;
+	shared_ptr<ContainerEntry> entry;
+	bool delete_on_close = false;
+	int lock_level = SQLITE_LOCK_NONE;
+	bool holds_reserved = false;
+	shared_ptr<ContainerShm> shm;
+	// Lock slots held by this connection
+	uint16_t shared_mask = 0;
+	uint16_t exclusive_mask = 0;
+	// Reused for every I/O, to avoid allocations
+	vector<pair<sqlite3_int64, sqlite3_int64>> io_pieces;
+	vector<pair<sqlite3_int64, sqlite3_int64>> gap_pieces;
+
+	int iVersion() const override {
+		// No memory mapping
+		return container ? 2 : SQLiteFileImpl::iVersion();
+	}
+
+	int xClose() override {
+		if (!container) {
+			return SQLiteFileImpl::xClose();
+		}
+		xShmUnmap(0);
+		xUnlock(SQLITE_LOCK_NONE);
+		lock_guard<mutex> lock(container->mtx);
+		if (delete_on_close && entry->record >= 0) {
+			container->remove(entry->name);
+		}
+		container->close_entry(entry.get());
+		return SQLITE_OK;
+	}
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!container) {
+			return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		}
+		sqlite3_int64 available;
+		{
+			lock_guard<mutex> lock(container->mtx);
+			available = max<sqlite3_int64>(0, min<sqlite3_int64>(iAmt, entry->size - iOfst));
+			container->pieces(entry.get(), iOfst, available, io_pieces);
+		}
+		int result = container->read_pieces(io_pieces, (unsigned char *) p);
+		if (result == SQLITE_OK && available < iAmt) {
+			memset((unsigned char *) p + available, 0, iAmt - available);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return result;
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!container) {
+			return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		}
+		{
+			lock_guard<mutex> lock(container->mtx);
+			int result = container->reserve(entry.get(), iOfst + iAmt);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			container->pieces(entry.get(), entry->size, max<sqlite3_int64>(0, iOfst - entry->size), gap_pieces);
+			container->pieces(entry.get(), iOfst, iAmt, io_pieces);
+		}
+		// The size only grows once the data is written, so that other connections never read unwritten space
+		int result = container->write_pieces(gap_pieces, nullptr);
+		if (result == SQLITE_OK) {
+			result = container->write_pieces(io_pieces, (const unsigned char *) p);
+		}
+		lock_guard<mutex> lock(container->mtx);
+		container->wrote();
+		if (result == SQLITE_OK && iOfst + iAmt > entry->size) {
+			result = container->resize(entry.get(), iOfst + iAmt);
+		}
+		return result;
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (!container) {
+			return SQLiteFileImpl::xTruncate(size);
+		}
+		{
+			lock_guard<mutex> lock(container->mtx);
+			if (size <= entry->size) {
+				return container->resize(entry.get(), size);
+			}
+			int result = container->reserve(entry.get(), size);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			container->pieces(entry.get(), entry->size, size - entry->size, gap_pieces);
+		}
+		int result = container->write_pieces(gap_pieces, nullptr);
+		lock_guard<mutex> lock(container->mtx);
+		container->wrote();
+		if (result == SQLITE_OK && size > entry->size) {
+			result = container->resize(entry.get(), size);
+		}
+		return result;
+	}
+
+	int xSync(int flags) override {
+		if (!container) {
+			return SQLiteFileImpl::xSync(flags);
+		}
+		return container->commit();
+	}
+
+	int xFileSize(sqlite3_int64 *pSize) override {
+		if (!container) {
+			return SQLiteFileImpl::xFileSize(pSize);
+		}
+		lock_guard<mutex> lock(container->mtx);
+		*pSize = entry->size;
+		return SQLITE_OK;
+	}
+
+	int xLock(int level) override {
+		if (!container) {
+			return SQLiteFileImpl::xLock(level);
+		}
+		lock_guard<mutex> lock(container->mtx);
+		ContainerEntry& locks = *entry;
+		if (lock_level >= level) {
+			return SQLITE_OK;
+		}
+		if (level == SQLITE_LOCK_SHARED) {
+			if (locks.pending || locks.exclusive) {
+				return SQLITE_BUSY;
+			}
+			locks.shared_locks++;
+		}
+		else if (level == SQLITE_LOCK_RESERVED) {
+			if (locks.reserved) {
+				return SQLITE_BUSY;
+			}
+			locks.reserved = true;
+			holds_reserved = true;
+		}
+		else {
+			// PENDING keeps new readers out until the other ones are gone
+			if (lock_level < SQLITE_LOCK_PENDING) {
+				if (locks.pending) {
+					return SQLITE_BUSY;
+				}
+				locks.pending = true;
+				lock_level = SQLITE_LOCK_PENDING;
+			}
+			if (locks.shared_locks > 1) {
+				return SQLITE_BUSY;
+			}
+			locks.exclusive = true;
+		}
+		lock_level = level;
+		return SQLITE_OK;
+	}
+
+	int xUnlock(int level) override {
+		if (!container) {
+			return SQLiteFileImpl::xUnlock(level);
+		}
+		lock_guard<mutex> lock(container->mtx);
+		ContainerEntry& locks = *entry;
+		if (lock_level <= level) {
+			return SQLITE_OK;
+		}
+		if (lock_level >= SQLITE_LOCK_PENDING) {
+			locks.pending = false;
+		}
+		if (lock_level == SQLITE_LOCK_EXCLUSIVE) {
+			locks.exclusive = false;
+		}
+		if (holds_reserved && level < SQLITE_LOCK_RESERVED) {
+			locks.reserved = false;
+			holds_reserved = false;
+		}
+		if (level == SQLITE_LOCK_NONE) {
+			locks.shared_locks--;
+		}
+		lock_level = level;
+		return SQLITE_OK;
+	}
+
+	int xCheckReservedLock(int *pResOut) override {
+		if (!container) {
+			return SQLiteFileImpl::xCheckReservedLock(pResOut);
+		}
+		lock_guard<mutex> lock(container->mtx);
+		*pResOut = entry->reserved || entry->pending || entry->exclusive;
+		return SQLITE_OK;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (!container) {
+			return SQLiteFileImpl::xFileControl(op, pArg);
+		}
+		if (op == SQLITE_FCNTL_PRAGMA) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "container_stats") == 0) {
+				lock_guard<mutex> lock(container->mtx);
+				argv[0] = container->stats();
+				return SQLITE_OK;
+			}
+		}
+		// Size hints and chunk sizes don't apply, logical files grow by extents
+		return SQLITE_NOTFOUND;
+	}
+
+	int xSectorSize() override {
+		if (!container) {
+			return SQLiteFileImpl::xSectorSize();
+		}
+		return (int) block_size;
+	}
+
+	int xDeviceCharacteristics() override {
+		if (!container) {
+			return SQLiteFileImpl::xDeviceCharacteristics();
+		}
+		return SQLITE_IOCAP_POWERSAFE_OVERWRITE;
+	}
+
+	int xShmMap(int iPg, int pgsz, int flags, void volatile **pp) override {
+		if (!container) {
+			return SQLiteFileImpl::xShmMap(iPg, pgsz, flags, pp);
+		}
+		if (!shm) {
+			lock_guard<mutex> lock(container->mtx);
+			shm = entry->shm.lock();
+			if (!shm) {
+				shm = make_shared<ContainerShm>();
+				entry->shm = shm;
+			}
+		}
+		lock_guard<mutex> lock(shm->mtx);
+		while ((int) shm->regions.size() <= iPg && flags) {
+			shm->regions.emplace_back(new char[pgsz]());
+		}
+		*pp = (int) shm->regions.size() > iPg ? shm->regions[iPg].get() : nullptr;
+		return SQLITE_OK;
+	}
+
+	int xShmLock(int offset, int n, int flags) override {
+		if (!container) {
+			return SQLiteFileImpl::xShmLock(offset, n, flags);
+		}
+		uint16_t mask = (uint16_t) (((1 << n) - 1) << offset);
+		if (flags & SQLITE_SHM_UNLOCK) {
+			for (int i = offset; i < offset + n; i++) {
+				if (shared_mask & (1 << i)) {
+					shm->slots[i]--;
+				}
+				else if (exclusive_mask & (1 << i)) {
+					shm->slots[i] = 0;
+				}
+			}
+			shared_mask &= ~mask;
+			exclusive_mask &= ~mask;
+			return SQLITE_OK;
+		}
+
+		if (flags & SQLITE_SHM_SHARED) {
+			// Only single slots are locked SHARED
+			if ((shared_mask | exclusive_mask) & mask) {
+				return SQLITE_OK;
+			}
+			atomic<int>& slot = shm->slots[offset];
+			int value = slot.load();
+			do {
+				if (value < 0) {
+					return SQLITE_BUSY;
+				}
+			} while (!slot.compare_exchange_weak(value, value + 1));
+			shared_mask |= mask;
+			return SQLITE_OK;
+		}
+
+		for (int i = offset; i < offset + n; i++) {
+			int expected = 0;
+			if (!(exclusive_mask & (1 << i)) && !shm->slots[i].compare_exchange_strong(expected, -1)) {
+				// Give back the slots taken so far
+				for (int j = offset; j < i; j++) {
+					if (!(exclusive_mask & (1 << j))) {
+						shm->slots[j] = 0;
+					}
+				}
+				return SQLITE_BUSY;
+			}
+		}
+		exclusive_mask |= mask;
+		return SQLITE_OK;
+	}
+
+	void xShmBarrier() override {
+		if (!container) {
+			return SQLiteFileImpl::xShmBarrier();
+		}
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+
+	int xShmUnmap(int deleteFlag) override {
+		if (!container) {
+			return SQLiteFileImpl::xShmUnmap(deleteFlag);
+		}
+		if (shm) {
+			xShmLock(0, SQLITE_SHM_NLOCK, SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE);
+			// The last connection frees the WAL index
+			shm.reset();
+		}
+		return SQLITE_OK;
+	}
+};
+
+struct ContainerVfs : public SQLiteVfsImpl<ContainerFile> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<ContainerFile> *file, int flags, int *pOutFlags) override {
+		string container_path, name;
+		if (!split_path(zName, container_path, name)) {
+			return SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		}
+		shared_ptr<Container> container;
+		int result = find_container(container_path, flags & SQLITE_OPEN_CREATE, container);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		shared_ptr<ContainerEntry> entry;
+		{
+			lock_guard<mutex> lock(container->mtx);
+			result = container->open_entry(name, flags, entry);
+		}
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		file->implementation.container = container;
+		file->implementation.entry = entry;
+		file->implementation.delete_on_close = (flags & SQLITE_OPEN_DELETEONCLOSE) != 0;
+		if (pOutFlags) {
+			*pOutFlags = flags;
+		}
+		return SQLITE_OK;
+	}
+
+	int xDelete(const char *zName, int syncDir) override {
+		string container_path, name;
+		if (!split_path(zName, container_path, name)) {
+			return SQLiteVfsImpl::xDelete(zName, syncDir);
+		}
+		shared_ptr<Container> container;
+		if (find_container(container_path, false, container) != SQLITE_OK) {
+			return SQLITE_IOERR_DELETE_NOENT;
+		}
+		int result;
+		{
+			lock_guard<mutex> lock(container->mtx);
+			result = container->remove(name);
+		}
+		if (result == SQLITE_OK && syncDir) {
+			result = container->commit();
+		}
+		return result;
+	}
+
+	int xAccess(const char *zName, int flags, int *pResOut) override {
+		string container_path, name;
+		if (!split_path(zName, container_path, name)) {
+			return SQLiteVfsImpl::xAccess(zName, flags, pResOut);
+		}
+		shared_ptr<Container> container;
+		*pResOut = 0;
+		if (find_container(container_path, false, container) == SQLITE_OK) {
+			lock_guard<mutex> lock(container->mtx);
+			*pResOut = container->entries.count(name) ? 1 : 0;
+		}
+		return SQLITE_OK;
+	}
+
+	int xFullPathname(const char *zName, int nOut, char *zOut) override {
+		string container_path, name;
+		if (!split_path(zName, container_path, name)) {
+			return SQLiteVfsImpl::xFullPathname(zName, nOut, zOut);
+		}
+		// The base VFS would fail to resolve a path through the container file
+		int result = SQLiteVfsImpl::xFullPathname(container_path.c_str(), nOut, zOut);
+		if (result != SQLITE_OK && result != SQLITE_OK_SYMLINK) {
+			return result;
+		}
+		size_t length = strlen(zOut);
+		if (length + 1 + name.size() >= (size_t) nOut) {
+			return SQLITE_CANTOPEN;
+		}
+		zOut[length] = '/';
+		memcpy(zOut + length + 1, name.c_str(), name.size() + 1);
+		return result;
+	}
+
+private:
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<Container>> containers;
+
+	int find_container(const string& path, bool create, shared_ptr<Container>& container) {
+		lock_guard<mutex> lock(mtx);
+		struct stat st;
+		if (stat(path.c_str(), &st) == 0) {
+			auto key = make_pair(st.st_dev, st.st_ino);
+			container = containers[key].lock();
+			if (container) {
+				return SQLITE_OK;
+			}
+			containers.erase(key);
+		}
+		else if (!create) {
+			return SQLITE_CANTOPEN;
+		}
+		container = make_shared<Container>();
+		int result = container->open(original_vfs, path);
+		if (result == SQLITE_OK && stat(path.c_str(), &st) != 0) {
+			result = SQLITE_IOERR_FSTAT;
+		}
+		if (result != SQLITE_OK) {
+			container.reset();
+			return result;
+		}
+		containers[make_pair(st.st_dev, st.st_ino)] = container;
+		return SQLITE_OK;
+	}
+};
+
+extern "C" int sqlite3_containervfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<ContainerVfs> containervfs("containervfs");
+	int rc = containervfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
@@ -0,0 +1,124 @@
+// Full scan throughput of a database through cryptvfs, in plaintext and encrypted with each implementation.
+//
+// Usage: cryptvfs-sample [directory] [size in MiB]
+//
+// The database is scanned with a tiny page cache, so every page goes
+// through `xRead` and is decrypted, while the OS cache holds the whole file.
+// The results thus show the CPU cost of the decryption, the worst case.
+// Build with optimizations (`-DCMAKE_BUILD_TYPE=Release`) for meaningful results.
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include <sqlite3.h>
+
+using namespace std;
+
+static const char *key = "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f";
+
+static int exec(sqlite3 *db, const char *sql) {
+	char *err = nullptr;
+	int result = sqlite3_exec(db, sql, nullptr, nullptr, &err);
+	if (result != SQLITE_OK) {
+		cout << "Error: " << (err ?: sqlite3_errstr(result)) << endl;
+		sqlite3_free(err);
+	}
+	return result;
+}
+
+static int create(const string& uri, int size_mib) {
+	sqlite3 *db = nullptr;
+	int result = sqlite3_open_v2(uri.c_str(), &db, SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, "cryptvfs");
+	if (result == SQLITE_OK) {
+		result = exec(db, "DROP TABLE IF EXISTS t; CREATE TABLE t(b)");
+	}
+	if (result == SQLITE_OK) {
+		// Rows of 400 bytes, about 10 per page
+		string fill = "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < " + to_string(size_mib * 2400)
+			+ ") INSERT INTO t SELECT randomblob(400) FROM n";
+		result = exec(db, fill.c_str());
+	}
+	sqlite3_close(db);
+	return result;
+}
+
+// MiB/s of full scans of `uri`, or a negative value on errors. `stats` gets `PRAGMA crypt_stats`.
+static double scan(const string& uri, string& stats) {
+	sqlite3 *db = nullptr;
+	double throughput = -1;
+	if (sqlite3_open_v2(uri.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, "cryptvfs") == SQLITE_OK
+		&& exec(db, "PRAGMA cache_size=16; PRAGMA mmap_size=0; SELECT max(b) FROM t") == SQLITE_OK) {
+		sqlite3_stmt *stmt = nullptr;
+		sqlite3_prepare_v2(db, "SELECT max(b) FROM t", -1, &stmt, nullptr);
+		sqlite3_int64 pages = 0, page_size = 0;
+		sqlite3_stmt *info = nullptr;
+		sqlite3_prepare_v2(db, "SELECT page_count, page_size FROM pragma_page_count, pragma_page_size", -1, &info, nullptr);
+		if (info && sqlite3_step(info) == SQLITE_ROW) {
+			pages = sqlite3_column_int64(info, 0);
+			page_size = sqlite3_column_int64(info, 1);
+		}
+		sqlite3_finalize(info);
+		sqlite3_prepare_v2(db, "PRAGMA crypt_stats", -1, &info, nullptr);
+		if (info && sqlite3_step(info) == SQLITE_ROW) {
+			stats = (const char *) sqlite3_column_text(info, 0);
+		}
+		sqlite3_finalize(info);
+
+		const int scans = 5;
+		auto start = chrono::steady_clock::now();
+		for (int i = 0; i < scans && stmt; i++) {
+			sqlite3_step(stmt);
+			sqlite3_reset(stmt);
+		}
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		sqlite3_finalize(stmt);
+		throughput = (double) pages * page_size * scans / (1 << 20) / elapsed.count();
+	}
+	sqlite3_close(db);
+	return throughput;
+}
+
+int main(int argc, const char **argv) {
+	sqlite3 *db = nullptr;
+	int result = sqlite3_open("", &db);
+	if (result != SQLITE_OK) {
+		cout << "Error: " << sqlite3_errstr(result) << endl;
+		return result;
+	}
+
+	result = sqlite3_db_config(db, SQLITE_DBCONFIG_ENABLE_LOAD_EXTENSION, 1, nullptr);
+	if (result != SQLITE_OK) {
+		cout << "Error: " << sqlite3_errstr(result) << endl;
+		return result;
+	}
+
+	char *err = nullptr;
+	result = sqlite3_load_extension(db, "cryptvfs", nullptr, &err);
+	if (result != SQLITE_OK && result != SQLITE_OK_LOAD_PERMANENTLY) {
+		cout << "Error: " << (err ?: sqlite3_errstr(result)) << endl;
+		sqlite3_free(err);
+		sqlite3_close(db);
+		return result;
+	}
+
+	sqlite3_close(db);
+
+	string directory = argc > 1 ? argv[1] : ".";
+	int size_mib = argc > 2 ? stoi(argv[2]) : 128;
+	string plain = "file:" + directory + "/cryptvfs-plain.sqlite";
+	string encrypted = "file:" + directory + "/cryptvfs-encrypted.sqlite?crypt_key=" + key;
+	if (create(plain, size_mib) != SQLITE_OK || create(encrypted, size_mib) != SQLITE_OK) {
+		return 1;
+	}
+
+	string stats;
+	double baseline = scan(plain, stats);
+	cout << "plaintext: " << (int) baseline << " MiB/s" << endl;
+	// Unsupported implementations fall back to the fastest one, `crypt_stats` tells which one was used
+	for (const char *impl : { "vaes", "aesni", "portable" }) {
+		double throughput = scan(encrypted + "&crypt_impl=" + impl, stats);
+		cout << stats.substr(0, stats.find(' ')) << ": " << (int) throughput << " MiB/s, "
+			<< (int) (100 * throughput / baseline) << "% of plaintext" << endl;
+	}
+	return 0;
+}
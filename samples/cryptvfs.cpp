@@ -0,0 +1,683 @@
+// Crypt VFS shim: encrypts databases, their rollback journals and WAL files with AES-XTS.
+//
+// Files are encrypted like a disk: in 4096 byte data units, with the unit
+// number and the kind of file (database, journal or WAL) as the XTS tweak.
+// XTS needs no space for IVs or tags, so page layouts and file sizes stay
+// those SQLite expects, except for writes that don't end on a 16 byte block:
+// they are padded, which the journal and WAL formats ignore. Writes that don't
+// start or end on a block boundary read and decrypt the edge blocks first.
+// Like disk encryption, XTS provides confidentiality, not authenticity.
+//
+// The AES rounds run on VAES (4 blocks per AVX-512 instruction) or AES-NI
+// (8 blocks interleaved) when the CPU supports them, chosen at runtime, and on
+// a portable, byte oriented implementation otherwise, two orders of magnitude
+// slower. Data is decrypted in place for reads, and encrypted in a buffer
+// reused by every write of a file.
+//
+// The key is 32 (XTS-AES-128) or 64 (XTS-AES-256) bytes, the two halves must
+// differ. It is given in hexadecimal with the `crypt_key` URI parameter, or
+// with `PRAGMA crypt_key='<hex>'` before the first statement that reads the
+// database. Without a key, files are neither encrypted nor decrypted.
+//
+// URI parameters:
+//   crypt_key=<hex>                 encryption key
+//   crypt_impl=vaes|aesni|portable  force an implementation, if supported (default: fastest)
+//
+// `PRAGMA crypt_stats` reports the implementation and the encrypted and decrypted bytes.
+//
+// @note The WAL index (`-shm`) and temporary files are not encrypted: the
+//       former only holds page numbers, use `PRAGMA temp_store=memory` for the latter.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRYPTVFS_X86 1
+#endif
+
+using namespace sqlitevfs;
+using namespace std;
+
+static const size_t block_size = 16;
+static const size_t unit_size = 4096;
+
+// Tweak values of the kinds of files, so equal offsets of different files don't share tweaks
+static const uint64_t database_kind = 0;
+static const uint64_t journal_kind = 1;
+static const uint64_t wal_kind = 2;
+
+// Tweaks are computed for every block, these must compile to single moves
+static uint64_t load_le64(const unsigned char *p) {
+	uint64_t value = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(&value, p, 8);
+#else
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t) p[i] << (8 * i);
+	}
+#endif
+	return value;
+}
+
+static void store_le64(unsigned char *p, uint64_t value) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(p, &value, 8);
+#else
+	for (int i = 0; i < 8; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+#endif
+}
+
+static uint8_t xtime(uint8_t a) {
+	return (uint8_t) ((a << 1) ^ ((a & 0x80) ? 0x1B : 0));
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+	uint8_t product = 0;
+	while (b) {
+		if (b & 1) {
+			product ^= a;
+		}
+		a = xtime(a);
+		b >>= 1;
+	}
+	return product;
+}
+
+// AES S-boxes, computed from their definition in FIPS-197 rather than spelled out.
+struct SBoxes {
+	uint8_t forward[256];
+	uint8_t inverse[256];
+
+	SBoxes() {
+		for (int x = 0; x < 256; x++) {
+			// Multiplicative inverse, x^254
+			uint8_t inv = x ? 1 : 0;
+			for (int i = 0; x && i < 254; i++) {
+				inv = gf_mul(inv, (uint8_t) x);
+			}
+			uint8_t s = inv;
+			for (int i = 1; i <= 4; i++) {
+				s ^= (uint8_t) ((inv << i) | (inv >> (8 - i)));
+			}
+			s ^= 0x63;
+			forward[x] = s;
+			inverse[s] = (uint8_t) x;
+		}
+	}
+};
+
+static const SBoxes& sboxes() {
+	static SBoxes boxes;
+	return boxes;
+}
+
+static void mix_column(uint8_t *a) {
+	uint8_t a0 = a[0], a1 = a[1], a2 = a[2], a3 = a[3], all = a0 ^ a1 ^ a2 ^ a3;
+	a[0] ^= all ^ xtime(a0 ^ a1);
+	a[1] ^= all ^ xtime(a1 ^ a2);
+	a[2] ^= all ^ xtime(a2 ^ a3);
+	a[3] ^= all ^ xtime(a3 ^ a0);
+}
+
+// InvMixColumns is MixColumns after multiplying by {04}x^2 + {05}
+static void inv_mix_column(uint8_t *a) {
+	uint8_t u = xtime(xtime(a[0] ^ a[2]));
+	uint8_t v = xtime(xtime(a[1] ^ a[3]));
+	a[0] ^= u;
+	a[1] ^= v;
+	a[2] ^= u;
+	a[3] ^= v;
+	mix_column(a);
+}
+
+// Expanded AES-128 or AES-256 key.
+struct AesKey {
+	int rounds = 0;
+	alignas(16) uint8_t enc[15][16];
+	// Round keys of the equivalent inverse cipher, as used by `aesdec`
+	alignas(16) uint8_t dec[15][16];
+
+	void expand(const uint8_t *key, int key_bytes) {
+		const SBoxes& boxes = sboxes();
+		int nk = key_bytes / 4;
+		rounds = nk + 6;
+		uint8_t *w = &enc[0][0];
+		memcpy(w, key, key_bytes);
+		uint8_t rcon = 1;
+		for (int i = nk; i < 4 * (rounds + 1); i++) {
+			uint8_t t[4];
+			memcpy(t, w + 4 * (i - 1), 4);
+			if (i % nk == 0) {
+				uint8_t t0 = t[0];
+				t[0] = boxes.forward[t[1]] ^ rcon;
+				t[1] = boxes.forward[t[2]];
+				t[2] = boxes.forward[t[3]];
+				t[3] = boxes.forward[t0];
+				rcon = xtime(rcon);
+			}
+			else if (nk > 6 && i % nk == 4) {
+				for (uint8_t& byte : t) {
+					byte = boxes.forward[byte];
+				}
+			}
+			for (int j = 0; j < 4; j++) {
+				w[4 * i + j] = w[4 * (i - nk) + j] ^ t[j];
+			}
+		}
+
+		memcpy(dec[0], enc[rounds], 16);
+		for (int r = 1; r < rounds; r++) {
+			memcpy(dec[r], enc[rounds - r], 16);
+			for (int c = 0; c < 4; c++) {
+				inv_mix_column(dec[r] + 4 * c);
+			}
+		}
+		memcpy(dec[rounds], enc[0], 16);
+	}
+
+	~AesKey() {
+		volatile uint8_t *p = &enc[0][0];
+		for (size_t i = 0; i < sizeof(enc) + sizeof(dec); i++) {
+			p[i] = 0;
+		}
+	}
+};
+
+// An implementation of the AES rounds. `xts` transforms each block with its tweak: `E(P ^ T) ^ T`.
+struct Kernel {
+	const char *name;
+	void (*encrypt_block)(const AesKey& key, uint8_t *block);
+	void (*xts_encrypt)(const AesKey& key, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+	void (*xts_decrypt)(const AesKey& key, uint8_t *data, const uint8_t *tweaks, size_t blocks);
+};
+
+// Portable implementation, byte by byte. Its table lookups depend on the data, prefer the hardware ones.
+namespace portable {
+	// Source byte of each byte of the state after ShiftRows and InvShiftRows, the state is stored column by column
+	static const uint8_t shift_rows[16] = { 0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12, 1, 6, 11 };
+	static const uint8_t inv_shift_rows[16] = { 0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3 };
+
+	static void sub_shift_rows(uint8_t *s, const uint8_t *box, const uint8_t *shift) {
+		uint8_t t[16];
+		for (int i = 0; i < 16; i++) {
+			t[i] = box[s[shift[i]]];
+		}
+		memcpy(s, t, 16);
+	}
+
+	static void add_round_key(uint8_t *s, const uint8_t *round_key) {
+		for (int i = 0; i < 16; i++) {
+			s[i] ^= round_key[i];
+		}
+	}
+
+	static void encrypt_block(const AesKey& key, uint8_t *s) {
+		const uint8_t *box = sboxes().forward;
+		add_round_key(s, key.enc[0]);
+		for (int r = 1; r < key.rounds; r++) {
+			sub_shift_rows(s, box, shift_rows);
+			for (int c = 0; c < 4; c++) {
+				mix_column(s + 4 * c);
+			}
+			add_round_key(s, key.enc[r]);
+		}
+		sub_shift_rows(s, box, shift_rows);
+		add_round_key(s, key.enc[key.rounds]);
+	}
+
+	static void decrypt_block(const AesKey& key, uint8_t *s) {
+		const uint8_t *box = sboxes().inverse;
+		add_round_key(s, key.dec[0]);
+		for (int r = 1; r < key.rounds; r++) {
+			sub_shift_rows(s, box, inv_shift_rows);
+			for (int c = 0; c < 4; c++) {
+				inv_mix_column(s + 4 * c);
+			}
+			add_round_key(s, key.dec[r]);
+		}
+		sub_shift_rows(s, box, inv_shift_rows);
+		add_round_key(s, key.dec[key.rounds]);
+	}
+
+	template <bool Decrypt>
+	static void xts(const AesKey& key, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+		for (size_t i = 0; i < blocks; i++, data += block_size, tweaks += block_size) {
+			add_round_key(data, tweaks);
+			if (Decrypt) {
+				decrypt_block(key, data);
+			}
+			else {
+				encrypt_block(key, data);
+			}
+			add_round_key(data, tweaks);
+		}
+	}
+
+	static const Kernel kernel = { "portable", encrypt_block, xts<false>, xts<true> };
+}
+
+#ifdef CRYPTVFS_X86
+namespace aesni {
+	__attribute__((target("aes,sse2")))
+	static void encrypt_block(const AesKey& key, uint8_t *block) {
+		__m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *) block), _mm_load_si128((const __m128i *) key.enc[0]));
+		for (int r = 1; r < key.rounds; r++) {
+			x = _mm_aesenc_si128(x, _mm_load_si128((const __m128i *) key.enc[r]));
+		}
+		x = _mm_aesenclast_si128(x, _mm_load_si128((const __m128i *) key.enc[key.rounds]));
+		_mm_storeu_si128((__m128i *) block, x);
+	}
+
+	template <bool Decrypt>
+	__attribute__((target("aes,sse2")))
+	static inline __m128i round(__m128i x, __m128i round_key) {
+		return Decrypt ? _mm_aesdec_si128(x, round_key) : _mm_aesenc_si128(x, round_key);
+	}
+
+	template <bool Decrypt>
+	__attribute__((target("aes,sse2")))
+	static inline __m128i last_round(__m128i x, __m128i round_key) {
+		return Decrypt ? _mm_aesdeclast_si128(x, round_key) : _mm_aesenclast_si128(x, round_key);
+	}
+
+	// Interleaves 8 blocks, so the AES units stay busy despite the latency of each round
+	template <bool Decrypt>
+	__attribute__((target("aes,sse2")))
+	static void xts(const AesKey& key, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+		const uint8_t (*round_keys)[16] = Decrypt ? key.dec : key.enc;
+		__m128i k[15];
+		for (int r = 0; r <= key.rounds; r++) {
+			k[r] = _mm_load_si128((const __m128i *) round_keys[r]);
+		}
+		__m128i *blocks_ptr = (__m128i *) data;
+		const __m128i *tweaks_ptr = (const __m128i *) tweaks;
+		size_t i = 0;
+		for (; i + 8 <= blocks; i += 8) {
+			__m128i t[8], x[8];
+#pragma GCC unroll 8
+			for (int j = 0; j < 8; j++) {
+				t[j] = _mm_loadu_si128(tweaks_ptr + i + j);
+				x[j] = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(blocks_ptr + i + j), t[j]), k[0]);
+			}
+			for (int r = 1; r < key.rounds; r++) {
+#pragma GCC unroll 8
+				for (int j = 0; j < 8; j++) {
+					x[j] = round<Decrypt>(x[j], k[r]);
+				}
+			}
+#pragma GCC unroll 8
+			for (int j = 0; j < 8; j++) {
+				x[j] = last_round<Decrypt>(x[j], k[key.rounds]);
+				_mm_storeu_si128(blocks_ptr + i + j, _mm_xor_si128(x[j], t[j]));
+			}
+		}
+		for (; i < blocks; i++) {
+			__m128i t = _mm_loadu_si128(tweaks_ptr + i);
+			__m128i x = _mm_xor_si128(_mm_xor_si128(_mm_loadu_si128(blocks_ptr + i), t), k[0]);
+			for (int r = 1; r < key.rounds; r++) {
+				x = round<Decrypt>(x, k[r]);
+			}
+			x = last_round<Decrypt>(x, k[key.rounds]);
+			_mm_storeu_si128(blocks_ptr + i, _mm_xor_si128(x, t));
+		}
+	}
+
+	static const Kernel kernel = { "aesni", encrypt_block, xts<false>, xts<true> };
+}
+
+namespace vaes {
+	template <bool Decrypt>
+	__attribute__((target("vaes,avx512f")))
+	static inline __m512i round(__m512i x, __m512i round_key) {
+		return Decrypt ? _mm512_aesdec_epi128(x, round_key) : _mm512_aesenc_epi128(x, round_key);
+	}
+
+	template <bool Decrypt>
+	__attribute__((target("vaes,avx512f")))
+	static inline __m512i last_round(__m512i x, __m512i round_key) {
+		return Decrypt ? _mm512_aesdeclast_epi128(x, round_key) : _mm512_aesenclast_epi128(x, round_key);
+	}
+
+	// 4 registers of 4 blocks, the remaining blocks go through AES-NI
+	template <bool Decrypt>
+	__attribute__((target("vaes,avx512f")))
+	static void xts(const AesKey& key, uint8_t *data, const uint8_t *tweaks, size_t blocks) {
+		const uint8_t (*round_keys)[16] = Decrypt ? key.dec : key.enc;
+		__m512i k[15];
+		for (int r = 0; r <= key.rounds; r++) {
+			// The zero masked form, as GCC warns about the undefined source of `_mm512_broadcast_i32x4`
+			k[r] = _mm512_maskz_broadcast_i32x4((__mmask16) 0xFFFF, _mm_load_si128((const __m128i *) round_keys[r]));
+		}
+		size_t i = 0;
+		for (; i + 16 <= blocks; i += 16) {
+			__m512i t[4], x[4];
+#pragma GCC unroll 4
+			for (int j = 0; j < 4; j++) {
+				t[j] = _mm512_loadu_si512(tweaks + (i + 4 * j) * block_size);
+				x[j] = _mm512_xor_si512(_mm512_xor_si512(_mm512_loadu_si512(data + (i + 4 * j) * block_size), t[j]), k[0]);
+			}
+			for (int r = 1; r < key.rounds; r++) {
+#pragma GCC unroll 4
+				for (int j = 0; j < 4; j++) {
+					x[j] = round<Decrypt>(x[j], k[r]);
+				}
+			}
+#pragma GCC unroll 4
+			for (int j = 0; j < 4; j++) {
+				x[j] = last_round<Decrypt>(x[j], k[key.rounds]);
+				_mm512_storeu_si512(data + (i + 4 * j) * block_size, _mm512_xor_si512(x[j], t[j]));
+			}
+		}
+		aesni::xts<Decrypt>(key, data + i * block_size, tweaks + i * block_size, blocks - i);
+	}
+
+	static const Kernel kernel = { "vaes", aesni::encrypt_block, xts<false>, xts<true> };
+}
+#endif
+
+// The fastest kernel supported by the CPU, or `name` if given and supported.
+static const Kernel *select_kernel(const char *name) {
+	vector<const Kernel *> supported;
+#ifdef CRYPTVFS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("aes")) {
+		supported.push_back(&vaes::kernel);
+	}
+	if (__builtin_cpu_supports("aes")) {
+		supported.push_back(&aesni::kernel);
+	}
+#endif
+	supported.push_back(&portable::kernel);
+	for (const Kernel *kernel : supported) {
+		if (name && sqlite3_stricmp(name, kernel->name) == 0) {
+			return kernel;
+		}
+	}
+	return supported.front();
+}
+
+// XTS key pair and the kernel that uses it.
+class XtsCipher {
+public:
+	const Kernel *kernel;
+	vector<uint8_t> raw_key;
+
+	XtsCipher(const vector<uint8_t>& key, const Kernel *kernel): kernel(kernel), raw_key(key) {
+		size_t half = key.size() / 2;
+		data_key.expand(key.data(), (int) half);
+		tweak_key.expand(key.data() + half, (int) half);
+	}
+
+	// Encrypt or decrypt `length` bytes of a file at `offset`, both multiples of the block size.
+	void crypt(bool decrypt, uint8_t *data, size_t length, sqlite3_int64 offset, uint64_t file_kind) const {
+		alignas(64) uint8_t tweaks[unit_size];
+		while (length > 0) {
+			uint64_t unit = (uint64_t) offset / unit_size;
+			size_t first_block = (size_t) (offset % unit_size) / block_size;
+			size_t blocks = min(length / block_size, unit_size / block_size - first_block);
+
+			// T = E(unit, file kind), multiplied by alpha in GF(2^128) for each block of the unit
+			uint8_t tweak[16];
+			store_le64(tweak, unit);
+			store_le64(tweak + 8, file_kind);
+			kernel->encrypt_block(tweak_key, tweak);
+			uint64_t low = load_le64(tweak), high = load_le64(tweak + 8);
+			for (size_t i = 0; i < first_block + blocks; i++) {
+				if (i >= first_block) {
+					store_le64(tweaks + (i - first_block) * block_size, low);
+					store_le64(tweaks + (i - first_block) * block_size + 8, high);
+				}
+				uint64_t carry = high >> 63;
+				high = (high << 1) | (low >> 63);
+				low = (low << 1) ^ (carry * 0x87);
+			}
+
+			(decrypt ? kernel->xts_decrypt : kernel->xts_encrypt)(data_key, data, tweaks, blocks);
+			data += blocks * block_size;
+			offset += blocks * block_size;
+			length -= blocks * block_size;
+		}
+	}
+
+private:
+	AesKey data_key;
+	AesKey tweak_key;
+};
+
+// Parse a key of 32 or 64 bytes in hexadecimal, with different halves.
+static bool parse_key(const char *hex, vector<uint8_t>& key) {
+	size_t length = strlen(hex);
+	if (length != 64 && length != 128) {
+		return false;
+	}
+	key.resize(length / 2);
+	for (size_t i = 0; i < length; i++) {
+		char c = hex[i];
+		int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if (digit < 0) {
+			return false;
+		}
+		key[i / 2] = (uint8_t) (i % 2 ? (key[i / 2] << 4) | digit : digit);
+	}
+	return memcmp(key.data(), key.data() + key.size() / 2, key.size() / 2) != 0;
+}
+
+// Key of a database, shared by its connections, journals and WAL files in this process.
+struct CryptDatabase {
+	// Set once, as changing the key would require rewriting the files
+	atomic<XtsCipher *> cipher { nullptr };
+	// `crypt_impl` URI parameter of the first connection
+	string impl;
+
+	atomic<sqlite3_int64> encrypted_bytes { 0 };
+	atomic<sqlite3_int64> decrypted_bytes { 0 };
+
+	~CryptDatabase() {
+		delete cipher.load();
+	}
+
+	// Set the key, or check that it is the current one.
+	bool set_key(const char *hex) {
+		vector<uint8_t> key;
+		if (!parse_key(hex, key)) {
+			return false;
+		}
+		XtsCipher *current = cipher.load();
+		if (current) {
+			return current->raw_key == key;
+		}
+		XtsCipher *created = new XtsCipher(key, select_kernel(impl.c_str()));
+		if (!cipher.compare_exchange_strong(current, created)) {
+			delete created;
+			return current->raw_key == key;
+		}
+		return true;
+	}
+};
+
+struct CryptFileShim : public SQLiteFileImpl {
+	shared_ptr<CryptDatabase> database;
+	uint64_t file_kind = database_kind;
+	// Reused by every write, the data to write can't be encrypted in place
+	vector<uint8_t> buffer;
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		const XtsCipher *cipher = database ? database->cipher.load() : nullptr;
+		if (!cipher) {
+			return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		}
+		sqlite3_int64 start = iOfst / block_size * block_size;
+		sqlite3_int64 end = (iOfst + iAmt + block_size - 1) / block_size * block_size;
+		// Reads of whole blocks, like page reads, are decrypted in place
+		bool aligned = start == iOfst && end == iOfst + iAmt;
+		if (!aligned) {
+			buffer.resize(end - start);
+		}
+		uint8_t *data = aligned ? (uint8_t *) p : buffer.data();
+		int result = SQLiteFileImpl::xRead(data, (int) (end - start), start);
+		sqlite3_int64 valid_end = end;
+		if (result == SQLITE_IOERR_SHORT_READ) {
+			// The base VFS zero filled the missing part, which isn't encrypted
+			sqlite3_int64 size;
+			if (SQLiteFileImpl::xFileSize(&size) != SQLITE_OK) {
+				return SQLITE_IOERR_READ;
+			}
+			valid_end = max(start, min(end, size / (sqlite3_int64) block_size * (sqlite3_int64) block_size));
+			memset(data + (valid_end - start), 0, end - valid_end);
+		}
+		else if (result != SQLITE_OK) {
+			return result;
+		}
+		cipher->crypt(true, data, valid_end - start, start, file_kind);
+		database->decrypted_bytes += valid_end - start;
+		if (!aligned) {
+			memcpy(p, data + (iOfst - start), iAmt);
+		}
+		return iOfst + iAmt <= valid_end ? SQLITE_OK : SQLITE_IOERR_SHORT_READ;
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		const XtsCipher *cipher = database ? database->cipher.load() : nullptr;
+		if (!cipher) {
+			return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		}
+		sqlite3_int64 start = iOfst / block_size * block_size;
+		sqlite3_int64 end = (iOfst + iAmt + block_size - 1) / block_size * block_size;
+		buffer.resize(end - start);
+		// Partial edge blocks keep their other bytes, or are padded with zeros past the end of the file
+		if (start != iOfst) {
+			int result = read_block(buffer.data(), start, cipher);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		if (end != iOfst + iAmt && (end - start > (sqlite3_int64) block_size || start == iOfst)) {
+			int result = read_block(buffer.data() + (end - start - block_size), end - block_size, cipher);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		memcpy(buffer.data() + (iOfst - start), p, iAmt);
+		cipher->crypt(false, buffer.data(), buffer.size(), start, file_kind);
+		database->encrypted_bytes += buffer.size();
+		return SQLiteFileImpl::xWrite(buffer.data(), (int) buffer.size(), start);
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (database && database->cipher.load()) {
+			// Keep the last block whole
+			size = (size + block_size - 1) / block_size * block_size;
+		}
+		return SQLiteFileImpl::xTruncate(size);
+	}
+
+	// Mapped pages would be ciphertext
+	int xFetch(sqlite3_int64 iOfst, int iAmt, void **pp) override {
+		if (database && database->cipher.load()) {
+			*pp = nullptr;
+			return SQLITE_OK;
+		}
+		return SQLiteFileImpl::xFetch(iOfst, iAmt, pp);
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA && database && file_kind == database_kind) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "crypt_key") == 0) {
+				if (!argv[2] || !database->set_key(argv[2])) {
+					argv[0] = sqlite3_mprintf("crypt_key: expected 64 or 128 hex digits, with different halves, matching any key already set");
+					return SQLITE_ERROR;
+				}
+				return SQLITE_OK;
+			}
+			if (sqlite3_stricmp(argv[1], "crypt_stats") == 0) {
+				const XtsCipher *cipher = database->cipher.load();
+				argv[0] = sqlite3_mprintf("impl=%s key_bits=%d encrypted_bytes=%lld decrypted_bytes=%lld",
+					cipher ? cipher->kernel->name : "none", cipher ? (int) cipher->raw_key.size() * 4 : 0,
+					database->encrypted_bytes.load(), database->decrypted_bytes.load());
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+private:
+	// Read and decrypt the block at `offset`, or zero it if it is past the end of the file.
+	int read_block(uint8_t *block, sqlite3_int64 offset, const XtsCipher *cipher) {
+		int result = SQLiteFileImpl::xRead(block, block_size, offset);
+		if (result == SQLITE_IOERR_SHORT_READ) {
+			// Files only hold whole blocks, a short one wasn't written yet
+			memset(block, 0, block_size);
+			return SQLITE_OK;
+		}
+		if (result == SQLITE_OK) {
+			cipher->crypt(true, block, block_size, offset, file_kind);
+		}
+		return result;
+	}
+};
+
+struct CryptVfsShim : public SQLiteVfsImpl<CryptFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<CryptFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result != SQLITE_OK || zName == nullptr) {
+			return result;
+		}
+		CryptFileShim& shim = file->implementation;
+		if (flags & SQLITE_OPEN_MAIN_DB) {
+			shim.database = database(zName, true);
+			const char *key = sqlite3_uri_parameter(zName, "crypt_key");
+			if (key && !shim.database->set_key(key)) {
+				file->original_file->pMethods->xClose(file->original_file);
+				return SQLITE_AUTH;
+			}
+		}
+		else if (flags & (SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL)) {
+			// Journals and WAL files use the key of their database
+			shim.database = database(sqlite3_filename_database(zName), false);
+			shim.file_kind = (flags & SQLITE_OPEN_WAL) ? wal_kind : journal_kind;
+		}
+		return result;
+	}
+
+private:
+	mutex mtx;
+	map<string, weak_ptr<CryptDatabase>> databases;
+
+	shared_ptr<CryptDatabase> database(const char *name, bool create) {
+		lock_guard<mutex> lock(mtx);
+		weak_ptr<CryptDatabase>& entry = databases[name];
+		shared_ptr<CryptDatabase> db = entry.lock();
+		if (!db && create) {
+			db = make_shared<CryptDatabase>();
+			const char *impl = sqlite3_uri_parameter(name, "crypt_impl");
+			db->impl = impl ? impl : "";
+			entry = db;
+		}
+		return db;
+	}
+};
+
+extern "C" int sqlite3_cryptvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<CryptVfsShim> cryptvfs("cryptvfs");
+	int rc = cryptvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
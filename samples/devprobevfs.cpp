@@ -0,0 +1,207 @@
+// Device probing VFS shim: reports `xSectorSize` and `xDeviceCharacteristics` from the actual device.
+//
+// The unix VFS reports a fixed 4096 byte sector and no device capabilities
+// beyond `SQLITE_IOCAP_POWERSAFE_OVERWRITE`. At `xOpen`, this shim looks up
+// the block device behind the file in sysfs (logical and physical block size)
+// once per device, and derives:
+//   - the sector size, from the physical block size,
+//   - `SQLITE_IOCAP_POWERSAFE_OVERWRITE`, when physical blocks are no larger
+//     than a memory page, so writeback never rewrites data outside the page.
+// Nothing else can be derived from the device. Its atomic write unit only
+// applies to `RWF_ATOMIC` writes, not to the plain writes SQLite issues, and
+// whether its write cache needs flushing changes what `xSync` costs, not what
+// SQLite may assume about writes. `SQLITE_IOCAP_ATOMICnnn`,
+// `SQLITE_IOCAP_SEQUENTIAL` and `SQLITE_IOCAP_SAFE_APPEND` also depend on how
+// the kernel orders writeback, so they are only set by override. Files
+// without a block device keep the base VFS answers.
+//
+// URI parameters, each overriding the probed value:
+//   probe_sector_size=<bytes>
+//   probe_atomic=<bytes>       largest atomic write, 0 for none
+//   probe_psow=<bool>
+//   probe_sequential=<bool>
+//   probe_safe_append=<bool>
+//
+// `PRAGMA device_probe` reports the probed device and the reported values.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+using namespace sqlitevfs;
+using namespace std;
+
+struct DeviceProbe {
+	bool found = false;
+	unsigned int major_number = 0;
+	unsigned int minor_number = 0;
+	int logical_block_size = 0;
+	int physical_block_size = 0;
+};
+
+// Probe results, computed once per device.
+class DeviceProber {
+public:
+	DeviceProbe probe(dev_t device) {
+		lock_guard<mutex> lock(mtx);
+		auto it = probes.find(device);
+		if (it == probes.end()) {
+			it = probes.emplace(device, probe_sysfs(device)).first;
+		}
+		return it->second;
+	}
+
+private:
+	mutex mtx;
+	map<dev_t, DeviceProbe> probes;
+
+	static DeviceProbe probe_sysfs(dev_t device) {
+		DeviceProbe probe;
+#ifdef __linux__
+		probe.major_number = major(device);
+		probe.minor_number = minor(device);
+		char device_path[64];
+		snprintf(device_path, sizeof(device_path), "/sys/dev/block/%u:%u", probe.major_number, probe.minor_number);
+		// Partitions share the request queue of their whole disk
+		string queue = string(device_path) + (access((string(device_path) + "/partition").c_str(), F_OK) == 0 ? "/../queue/" : "/queue/");
+
+		probe.logical_block_size = read_int(queue + "logical_block_size");
+		probe.physical_block_size = read_int(queue + "physical_block_size");
+		if (probe.logical_block_size <= 0 || probe.physical_block_size <= 0) {
+			return DeviceProbe();
+		}
+		probe.found = true;
+#endif
+		return probe;
+	}
+
+	static int read_int(const string& path) {
+		ifstream file(path);
+		int value = 0;
+		file >> value;
+		return file ? value : 0;
+	}
+};
+
+struct DevProbeFileShim : public SQLiteFileImpl {
+	DeviceProbe probe;
+	int sector_size = 0;
+	int characteristics = 0;
+
+	int xSectorSize() override {
+		return sector_size > 0 ? sector_size : SQLiteFileImpl::xSectorSize();
+	}
+
+	int xDeviceCharacteristics() override {
+		return sector_size > 0 ? characteristics : SQLiteFileImpl::xDeviceCharacteristics();
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "device_probe") == 0) {
+				argv[0] = sqlite3_mprintf("device=%u:%u found=%d logical_block_size=%d physical_block_size=%d sector_size=%d characteristics=0x%x",
+					probe.major_number, probe.minor_number, probe.found, probe.logical_block_size, probe.physical_block_size,
+					xSectorSize(), xDeviceCharacteristics());
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+};
+
+struct DevProbeVfsShim : public SQLiteVfsImpl<DevProbeFileShim> {
+	DeviceProber prober;
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<DevProbeFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		struct stat st;
+		if (result != SQLITE_OK || zName == nullptr || stat(zName, &st) != 0) {
+			return result;
+		}
+		DevProbeFileShim& shim = file->implementation;
+		shim.probe = prober.probe(st.st_dev);
+
+		// Overrides are only available for files that belong to a database name with URI parameters
+		const int uri_types = SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL;
+		sqlite3_filename uri = (flags & uri_types) ? zName : nullptr;
+		if (!shim.probe.found && !has_override(uri)) {
+			return result;
+		}
+
+		// `shim.original_file` is only set once `xOpen` returns
+		sqlite3_file *original = file->original_file;
+		int default_sector_size = original->pMethods->xSectorSize(original);
+		int characteristics = original->pMethods->xDeviceCharacteristics(original);
+		int page_size = (int) sysconf(_SC_PAGESIZE);
+		int sector_size = shim.probe.found ? shim.probe.physical_block_size : default_sector_size;
+		int atomic_max = 0;
+		bool psow = shim.probe.found ? shim.probe.physical_block_size <= page_size : (characteristics & SQLITE_IOCAP_POWERSAFE_OVERWRITE) != 0;
+		bool sequential = (characteristics & SQLITE_IOCAP_SEQUENTIAL) != 0;
+		bool safe_append = (characteristics & SQLITE_IOCAP_SAFE_APPEND) != 0;
+		if (uri) {
+			sector_size = (int) sqlite3_uri_int64(uri, "probe_sector_size", sector_size);
+			atomic_max = (int) sqlite3_uri_int64(uri, "probe_atomic", atomic_max);
+			psow = sqlite3_uri_boolean(uri, "probe_psow", psow);
+			sequential = sqlite3_uri_boolean(uri, "probe_sequential", sequential);
+			safe_append = sqlite3_uri_boolean(uri, "probe_safe_append", safe_append);
+		}
+
+		const int atomic_bits = SQLITE_IOCAP_ATOMIC | SQLITE_IOCAP_ATOMIC512 | SQLITE_IOCAP_ATOMIC1K | SQLITE_IOCAP_ATOMIC2K
+			| SQLITE_IOCAP_ATOMIC4K | SQLITE_IOCAP_ATOMIC8K | SQLITE_IOCAP_ATOMIC16K | SQLITE_IOCAP_ATOMIC32K | SQLITE_IOCAP_ATOMIC64K;
+		characteristics &= ~(atomic_bits | SQLITE_IOCAP_POWERSAFE_OVERWRITE | SQLITE_IOCAP_SEQUENTIAL | SQLITE_IOCAP_SAFE_APPEND);
+		// SQLITE_IOCAP_ATOMIC512 through SQLITE_IOCAP_ATOMIC64K are consecutive bits
+		for (int size = 512, bit = SQLITE_IOCAP_ATOMIC512; size <= 65536; size *= 2, bit <<= 1) {
+			if (size <= atomic_max) {
+				characteristics |= bit;
+			}
+		}
+		if (psow) {
+			characteristics |= SQLITE_IOCAP_POWERSAFE_OVERWRITE;
+		}
+		if (sequential) {
+			characteristics |= SQLITE_IOCAP_SEQUENTIAL;
+		}
+		if (safe_append) {
+			characteristics |= SQLITE_IOCAP_SAFE_APPEND;
+		}
+		shim.sector_size = sector_size >= 512 && sector_size <= 65536 ? sector_size : default_sector_size;
+		shim.characteristics = characteristics;
+		return result;
+	}
+
+	static bool has_override(sqlite3_filename uri) {
+		if (uri == nullptr) {
+			return false;
+		}
+		for (const char *name : { "probe_sector_size", "probe_atomic", "probe_psow", "probe_sequential", "probe_safe_append" }) {
+			if (sqlite3_uri_parameter(uri, name) != nullptr) {
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+extern "C" int sqlite3_devprobevfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<DevProbeVfsShim> devprobevfs("devprobevfs");
+	int rc = devprobevfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
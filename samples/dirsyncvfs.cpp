@@ -0,0 +1,220 @@
+// Directory sync VFS shim: coalesces directory `fsync`s from concurrent creates and deletes.
+//
+// `xDelete(zName, syncDir=1)` and the first sync of every new journal or WAL
+// file `fsync` the containing directory. With many databases in the same
+// directory, those serialize on the directory inode. This shim performs them
+// itself: requests for the same directory that arrive while a directory
+// `fsync` is running are all satisfied by the next single `fsync`, and
+// directory descriptors are cached.
+//
+// To take over the directory sync of new journals and WAL files, the shim
+// creates them before asking the base VFS to open them without
+// `SQLITE_OPEN_CREATE`, then syncs the directory on the file's first `xSync`.
+//
+// `PRAGMA dirsync_stats` reports directory sync requests and actual `fsync` calls.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Cached descriptor of a directory, plus the state of its group sync.
+struct SyncedDirectory {
+	mutex mtx;
+	condition_variable cv;
+	int fd = -1;
+	// Number of sync requests so far, each requester gets the next one as ticket
+	uint64_t requested = 0;
+	// Every request up to this ticket is durable
+	uint64_t completed = 0;
+	bool syncing = false;
+	struct FailedSync {
+		// First ticket covered by the sync
+		uint64_t first;
+		int result;
+		// Requesters of the covered tickets that haven't returned the result yet
+		uint64_t unreported;
+	};
+	// Failed syncs by the last ticket they covered
+	map<uint64_t, FailedSync> failures;
+
+	~SyncedDirectory() {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+};
+
+class DirectorySyncer {
+public:
+	atomic<sqlite3_int64> requests { 0 };
+	atomic<sqlite3_int64> fsyncs { 0 };
+
+	// Make the entries of the directory containing `path` durable.
+	int sync_parent(const string& path) {
+		requests++;
+		shared_ptr<SyncedDirectory> directory = find_directory(parent_of(path));
+		if (!directory) {
+			return SQLITE_IOERR_DIR_FSYNC;
+		}
+
+		unique_lock<mutex> lock(directory->mtx);
+		uint64_t ticket = ++directory->requested;
+		while (directory->completed < ticket) {
+			if (directory->syncing) {
+				directory->cv.wait(lock);
+				continue;
+			}
+			// An fsync started now covers every request made so far
+			uint64_t covered = directory->requested;
+			directory->syncing = true;
+			lock.unlock();
+			int result = fsync(directory->fd) == 0 ? SQLITE_OK : SQLITE_IOERR_DIR_FSYNC;
+			fsyncs++;
+			lock.lock();
+			if (result != SQLITE_OK) {
+				uint64_t first = directory->completed + 1;
+				directory->failures[covered] = { first, result, covered - first + 1 };
+			}
+			directory->syncing = false;
+			directory->completed = covered;
+			directory->cv.notify_all();
+		}
+
+		// The result of the sync that covered this ticket, not of the latest one
+		auto failure = directory->failures.lower_bound(ticket);
+		if (failure == directory->failures.end() || failure->second.first > ticket) {
+			return SQLITE_OK;
+		}
+		int result = failure->second.result;
+		if (--failure->second.unreported == 0) {
+			directory->failures.erase(failure);
+		}
+		return result;
+	}
+
+	static string parent_of(const string& path) {
+		size_t slash = path.rfind('/');
+		return slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	}
+
+private:
+	mutex mtx;
+	map<string, shared_ptr<SyncedDirectory>> directories;
+
+	shared_ptr<SyncedDirectory> find_directory(const string& directory_path) {
+		lock_guard<mutex> lock(mtx);
+		shared_ptr<SyncedDirectory>& directory = directories[directory_path];
+		if (!directory) {
+			int fd = open(directory_path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				directories.erase(directory_path);
+				return nullptr;
+			}
+			directory = make_shared<SyncedDirectory>();
+			directory->fd = fd;
+		}
+		return directory;
+	}
+};
+
+struct DirSyncFileShim : public SQLiteFileImpl {
+	DirectorySyncer *syncer = nullptr;
+	// Set for files created by this shim, whose directory entry is not durable yet
+	string pending_directory_sync;
+
+	int xSync(int flags) override {
+		int result = SQLiteFileImpl::xSync(flags);
+		if (result == SQLITE_OK && !pending_directory_sync.empty()) {
+			result = syncer->sync_parent(pending_directory_sync);
+			if (result == SQLITE_OK) {
+				pending_directory_sync.clear();
+			}
+		}
+		return result;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA && syncer) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "dirsync_stats") == 0) {
+				sqlite3_int64 requests = syncer->requests, fsyncs = syncer->fsyncs;
+				argv[0] = sqlite3_mprintf("requests=%lld fsyncs=%lld saved=%lld", requests, fsyncs, requests - fsyncs);
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+};
+
+struct DirSyncVfsShim : public SQLiteVfsImpl<DirSyncFileShim> {
+	DirectorySyncer syncer;
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<DirSyncFileShim> *file, int flags, int *pOutFlags) override {
+		file->implementation.syncer = &syncer;
+		const int journal_types = SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_SUPER_JOURNAL | SQLITE_OPEN_WAL;
+		if (zName == nullptr || (flags & journal_types) == 0 || !(flags & SQLITE_OPEN_CREATE)) {
+			return SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		}
+
+		// Create the file here, so the base VFS doesn't sync the directory by itself
+		int create_flags = O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC;
+		int fd = open(zName, create_flags, database_mode(zName));
+		bool created = fd >= 0;
+		if (fd >= 0) {
+			close(fd);
+		}
+		else if (errno != EEXIST || (flags & SQLITE_OPEN_EXCLUSIVE)) {
+			return SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		}
+
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags & ~(SQLITE_OPEN_CREATE | SQLITE_OPEN_EXCLUSIVE), pOutFlags);
+		if (result == SQLITE_OK && created) {
+			file->implementation.pending_directory_sync = zName;
+		}
+		return result;
+	}
+
+	int xDelete(const char *zName, int syncDir) override {
+		int result = SQLiteVfsImpl::xDelete(zName, 0);
+		if (result == SQLITE_OK && syncDir) {
+			result = syncer.sync_parent(zName);
+		}
+		return result;
+	}
+
+	// Journals and WAL files get the same permissions as their database, like the unix VFS does.
+	static mode_t database_mode(const char *zName) {
+		string database_path = zName;
+		size_t dash = database_path.rfind('-');
+		struct stat st;
+		if (dash != string::npos && dash > database_path.rfind('/') + 1 && stat(database_path.substr(0, dash).c_str(), &st) == 0) {
+			return st.st_mode & 0777;
+		}
+		return 0644;
+	}
+};
+
+extern "C" int sqlite3_dirsyncvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<DirSyncVfsShim> dirsyncvfs("dirsyncvfs");
+	int rc = dirsyncvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
@@ -0,0 +1,327 @@
+// Futex lock VFS shim: implements database file locks in process memory with atomics and futex waits.
+//
+// The unix VFS serializes every `xLock` and `xUnlock` on a global mutex and
+// its inode lock table, and often calls `fcntl`. This shim keeps the SHARED,
+// RESERVED, PENDING and EXCLUSIVE state of each database in one atomic word
+// shared by the connections of the process, changed with compare-and-swap.
+// A writer that got PENDING waits on a futex for the remaining readers to
+// leave, instead of returning `SQLITE_BUSY` and sleeping in the busy handler.
+//
+// Other processes are excluded with one coarse OS lock per database: an open
+// file description write lock on SQLite's lock byte range, which also
+// conflicts with the POSIX locks of processes using the default VFS. It is
+// taken when the first lock of the process is taken, and released when the
+// last lock is released. Other processes can thus only use the database while
+// no connection of this process holds a lock, which in WAL mode means while no
+// connection has it open.
+//
+// URI parameters:
+//   futexlock_wait_us=<us>  how long a writer waits for readers to leave (default 1000)
+//
+// `PRAGMA futexlock_stats` reports lock calls, OS lock calls and busy results.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Lock bytes used by SQLite, see `PENDING_BYTE` and following in sqlite3.c
+static const off_t pending_byte = 0x40000000;
+static const off_t lock_bytes_size = 512;
+
+// Layout of `LockWord::state`
+static const uint32_t exclusive_bit = 1u << 31;
+static const uint32_t pending_bit = 1u << 30;
+static const uint32_t reserved_bit = 1u << 29;
+static const uint32_t os_lock_bit = 1u << 28;
+static const uint32_t shared_mask = os_lock_bit - 1;
+
+// Lock state of a database, shared by the connections of this process.
+struct LockWord {
+	atomic<uint32_t> state { 0 };
+	// Serializes taking and releasing the OS lock, never held by the fast path
+	mutex os_mutex;
+	int fd = -1;
+
+	atomic<sqlite3_int64> lock_calls { 0 };
+	atomic<sqlite3_int64> os_lock_calls { 0 };
+	atomic<sqlite3_int64> busy { 0 };
+
+	~LockWord() {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	// Make sure `os_lock_bit` is set, taking the OS lock if necessary.
+	bool acquire_os_lock() {
+		lock_guard<mutex> lock(os_mutex);
+		if (state.load() & os_lock_bit) {
+			return true;
+		}
+		os_lock_calls++;
+		if (!set_os_lock(F_WRLCK)) {
+			return false;
+		}
+		state.fetch_or(os_lock_bit);
+		return true;
+	}
+
+	// Release the OS lock if no lock of this process is left.
+	void release_os_lock() {
+		lock_guard<mutex> lock(os_mutex);
+		uint32_t expected = os_lock_bit;
+		if (state.compare_exchange_strong(expected, 0)) {
+			os_lock_calls++;
+			set_os_lock(F_UNLCK);
+		}
+	}
+
+	bool set_os_lock(short type) {
+#ifdef F_OFD_SETLK
+		struct flock lock = {};
+		lock.l_type = type;
+		lock.l_whence = SEEK_SET;
+		lock.l_start = pending_byte;
+		lock.l_len = lock_bytes_size;
+		return fcntl(fd, F_OFD_SETLK, &lock) == 0;
+#else
+		return flock(fd, (type == F_UNLCK ? LOCK_UN : LOCK_EX) | LOCK_NB) == 0;
+#endif
+	}
+
+	// Wait until `state` is no longer `value`, or `deadline` passes.
+	void wait(uint32_t value, chrono::steady_clock::time_point deadline) {
+		auto now = chrono::steady_clock::now();
+		if (now >= deadline) {
+			return;
+		}
+#ifdef __linux__
+		auto remaining = chrono::duration_cast<chrono::nanoseconds>(deadline - now).count();
+		struct timespec timeout = { (time_t) (remaining / 1000000000), (long) (remaining % 1000000000) };
+		syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state), FUTEX_WAIT_PRIVATE, value, &timeout, nullptr, 0);
+#else
+		this_thread::yield();
+#endif
+	}
+
+	void wake_all() {
+#ifdef __linux__
+		syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#endif
+	}
+};
+
+struct FutexLockFileShim : public SQLiteFileImpl {
+	shared_ptr<LockWord> word;
+	int lock_level = SQLITE_LOCK_NONE;
+	// RESERVED, PENDING and EXCLUSIVE bits set by this connection
+	uint32_t owned_bits = 0;
+	chrono::microseconds exclusive_wait { 1000 };
+
+	int xLock(int level) override {
+		if (!word) {
+			return SQLiteFileImpl::xLock(level);
+		}
+		word->lock_calls++;
+		if (lock_level >= level) {
+			return SQLITE_OK;
+		}
+		int result = level == SQLITE_LOCK_SHARED ? lock_shared() : level == SQLITE_LOCK_RESERVED ? lock_reserved() : lock_exclusive();
+		if (result == SQLITE_BUSY) {
+			word->busy++;
+		}
+		return result;
+	}
+
+	int xUnlock(int level) override {
+		if (!word) {
+			return SQLiteFileImpl::xUnlock(level);
+		}
+		word->lock_calls++;
+		if (lock_level <= level) {
+			return SQLITE_OK;
+		}
+		uint32_t state = word->state.load();
+		if (owned_bits) {
+			state = word->state.fetch_and(~owned_bits) & ~owned_bits;
+			owned_bits = 0;
+		}
+		if (level == SQLITE_LOCK_NONE) {
+			state = word->state.fetch_sub(1) - 1;
+			if (state == os_lock_bit) {
+				word->release_os_lock();
+			}
+		}
+		// A writer may be waiting for readers to leave
+		if (state & pending_bit) {
+			word->wake_all();
+		}
+		lock_level = level;
+		return SQLITE_OK;
+	}
+
+	int xCheckReservedLock(int *pResOut) override {
+		if (!word) {
+			return SQLiteFileImpl::xCheckReservedLock(pResOut);
+		}
+		word->lock_calls++;
+		*pResOut = (word->state.load() & (reserved_bit | pending_bit | exclusive_bit)) != 0;
+		return SQLITE_OK;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA && word) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "futexlock_stats") == 0) {
+				argv[0] = sqlite3_mprintf("lock_calls=%lld os_lock_calls=%lld busy=%lld",
+					word->lock_calls.load(), word->os_lock_calls.load(), word->busy.load());
+				return SQLITE_OK;
+			}
+		}
+		else if (op == SQLITE_FCNTL_LOCKSTATE && word) {
+			*(int *) pArg = lock_level;
+			return SQLITE_OK;
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	int xClose() override {
+		if (word) {
+			xUnlock(SQLITE_LOCK_NONE);
+		}
+		return SQLiteFileImpl::xClose();
+	}
+
+private:
+	int lock_shared() {
+		uint32_t state = word->state.load();
+		while (true) {
+			if (state & (pending_bit | exclusive_bit)) {
+				return SQLITE_BUSY;
+			}
+			if (!(state & os_lock_bit)) {
+				if (!word->acquire_os_lock()) {
+					return SQLITE_BUSY;
+				}
+				state = word->state.load();
+				continue;
+			}
+			if (word->state.compare_exchange_weak(state, state + 1)) {
+				break;
+			}
+		}
+		lock_level = SQLITE_LOCK_SHARED;
+		return SQLITE_OK;
+	}
+
+	int lock_reserved() {
+		uint32_t state = word->state.load();
+		do {
+			if (state & (reserved_bit | pending_bit | exclusive_bit)) {
+				return SQLITE_BUSY;
+			}
+		} while (!word->state.compare_exchange_weak(state, state | reserved_bit));
+		owned_bits |= reserved_bit;
+		lock_level = SQLITE_LOCK_RESERVED;
+		return SQLITE_OK;
+	}
+
+	int lock_exclusive() {
+		uint32_t state = word->state.load();
+		if (!(owned_bits & pending_bit)) {
+			do {
+				if (state & (pending_bit | exclusive_bit)) {
+					return SQLITE_BUSY;
+				}
+			} while (!word->state.compare_exchange_weak(state, state | pending_bit));
+			owned_bits |= pending_bit;
+			lock_level = SQLITE_LOCK_PENDING;
+		}
+
+		// No new readers come in while PENDING is set, wait for the current ones to leave
+		auto deadline = chrono::steady_clock::now() + exclusive_wait;
+		while (true) {
+			state = word->state.load();
+			if ((state & shared_mask) == 1) {
+				break;
+			}
+			if (chrono::steady_clock::now() >= deadline) {
+				return SQLITE_BUSY;
+			}
+			word->wait(state, deadline);
+		}
+		word->state.fetch_or(exclusive_bit);
+		owned_bits |= exclusive_bit;
+		lock_level = SQLITE_LOCK_EXCLUSIVE;
+		return SQLITE_OK;
+	}
+};
+
+struct FutexLockVfsShim : public SQLiteVfsImpl<FutexLockFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<FutexLockFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result != SQLITE_OK || zName == nullptr || !(flags & SQLITE_OPEN_MAIN_DB)) {
+			return result;
+		}
+		file->implementation.word = lock_word(zName);
+		file->implementation.exclusive_wait = chrono::microseconds(sqlite3_uri_int64(zName, "futexlock_wait_us", 1000));
+		return result;
+	}
+
+private:
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<LockWord>> lock_words;
+
+	shared_ptr<LockWord> lock_word(const char *path) {
+		struct stat st;
+		if (stat(path, &st) != 0) {
+			return nullptr;
+		}
+		lock_guard<mutex> lock(mtx);
+		auto key = make_pair(st.st_dev, st.st_ino);
+		shared_ptr<LockWord> word = lock_words[key].lock();
+		if (!word) {
+			// Read-only opens can't take a write lock, they keep the locking of the base VFS
+			int fd = open(path, O_RDWR | O_CLOEXEC);
+			if (fd < 0) {
+				lock_words.erase(key);
+				return nullptr;
+			}
+			word = make_shared<LockWord>();
+			word->fd = fd;
+			lock_words[key] = word;
+		}
+		return word;
+	}
+};
+
+extern "C" int sqlite3_futexlockvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<FutexLockVfsShim> futexlockvfs("futexlockvfs");
+	int rc = futexlockvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
@@ -0,0 +1,297 @@
+// Group commit VFS shim: batches `xSync` calls from many database files.
+//
+// Processes that keep lots of small databases open pay one full flush per
+// commit per file. This shim hands every `xSync` to a process-wide
+// coordinator that waits a short window for other files to sync as well,
+// then flushes the whole batch concurrently on a small thread pool.
+// On Linux, the batch may instead be flushed with a single `syncfs` per
+// filesystem, which lets the device merge all flushes into one.
+// Each caller is released only when its own file is durable.
+//
+// Settings are process-wide and can be changed from any connection:
+//   PRAGMA group_commit_window = <microseconds>;  -- 0 disables batching
+//   PRAGMA group_commit_syncfs = <0|1>;           -- Linux only
+//   PRAGMA group_commit_stats;                    -- requests/batches/flushes
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+// A single `xSync` waiting to be flushed.
+struct SyncRequest {
+	sqlite3_file *file;
+	int flags;
+	int fd;
+	dev_t device;
+	int result = SQLITE_OK;
+	bool done = false;
+};
+
+// Process-wide coordinator that collects `SyncRequest`s and flushes them in batches.
+class GroupCommitter {
+public:
+	atomic<long long> window_us { 1000 };
+	atomic<bool> use_syncfs { false };
+	size_t max_batch = 256;
+	unsigned thread_count = 4;
+
+	atomic<sqlite3_int64> requests { 0 };
+	atomic<sqlite3_int64> batches { 0 };
+	atomic<sqlite3_int64> flushes { 0 };
+
+	~GroupCommitter() {
+		{
+			lock_guard<mutex> lock(mtx);
+			stop = true;
+		}
+		pending_cv.notify_all();
+		work_cv.notify_all();
+		for (thread& t : threads) {
+			t.join();
+		}
+	}
+
+	// Descriptor of a directory on filesystem `device` for `syncfs`, or -1.
+	// Descriptors of database files can't be used: closing any of them drops
+	// every POSIX lock the process holds on the file. Directories carry no
+	// locks, and one per filesystem is kept for the life of the process.
+	int filesystem_fd(dev_t device, const string& directory) {
+		lock_guard<mutex> lock(mtx);
+		auto it = filesystem_fds.find(device);
+		if (it != filesystem_fds.end()) {
+			return it->second;
+		}
+		int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		struct stat st;
+		if (fd >= 0 && (fstat(fd, &st) != 0 || st.st_dev != device)) {
+			close(fd);
+			return -1;
+		}
+		if (fd >= 0) {
+			filesystem_fds[device] = fd;
+		}
+		return fd;
+	}
+
+	// Blocks until `request` is flushed, returning the flush result.
+	int sync(SyncRequest& request) {
+		requests++;
+		if (window_us <= 0) {
+			flushes++;
+			return request.file->pMethods->xSync(request.file, request.flags);
+		}
+
+		unique_lock<mutex> lock(mtx);
+		if (threads.empty()) {
+			start_threads();
+		}
+		if (pending.empty()) {
+			first_pending = chrono::steady_clock::now();
+		}
+		pending.push_back(&request);
+		if (pending.size() == 1 || pending.size() >= max_batch) {
+			pending_cv.notify_one();
+		}
+		done_cv.wait(lock, [&] { return request.done; });
+		return request.result;
+	}
+
+private:
+	// Either a single `xSync` or a `syncfs` covering every request on the same filesystem
+	struct Job {
+		vector<SyncRequest *> requests;
+		bool syncfs;
+	};
+
+	mutex mtx;
+	condition_variable pending_cv;
+	condition_variable work_cv;
+	condition_variable done_cv;
+	deque<SyncRequest *> pending;
+	chrono::steady_clock::time_point first_pending;
+	deque<Job> jobs;
+	vector<thread> threads;
+	map<dev_t, int> filesystem_fds;
+	bool stop = false;
+
+	void start_threads() {
+		threads.emplace_back(&GroupCommitter::dispatch_loop, this);
+		for (unsigned i = 0; i < thread_count; i++) {
+			threads.emplace_back(&GroupCommitter::worker_loop, this);
+		}
+	}
+
+	// Waits for the batching window to close, then splits the batch into jobs.
+	void dispatch_loop() {
+		unique_lock<mutex> lock(mtx);
+		while (true) {
+			pending_cv.wait(lock, [&] { return stop || !pending.empty(); });
+			if (stop) {
+				break;
+			}
+			auto deadline = first_pending + chrono::microseconds(window_us.load());
+			pending_cv.wait_until(lock, deadline, [&] { return stop || pending.size() >= max_batch; });
+
+			batches++;
+#ifdef __linux__
+			if (use_syncfs) {
+				// One job per filesystem, files without a descriptor get their own job
+				map<dev_t, vector<SyncRequest *>> by_device;
+				for (SyncRequest *request : pending) {
+					if (request->fd >= 0) {
+						by_device[request->device].push_back(request);
+					}
+					else {
+						jobs.push_back(Job { { request }, false });
+					}
+				}
+				for (auto& it : by_device) {
+					jobs.push_back(Job { move(it.second), true });
+				}
+			}
+			else
+#endif
+			{
+				for (SyncRequest *request : pending) {
+					jobs.push_back(Job { { request }, false });
+				}
+			}
+			pending.clear();
+			work_cv.notify_all();
+		}
+	}
+
+	void worker_loop() {
+		unique_lock<mutex> lock(mtx);
+		while (true) {
+			work_cv.wait(lock, [&] { return stop || !jobs.empty(); });
+			if (jobs.empty()) {
+				break;
+			}
+			Job job = move(jobs.front());
+			jobs.pop_front();
+
+			lock.unlock();
+			flushes++;
+#ifdef __linux__
+			if (job.syncfs) {
+				int result = syncfs(job.requests[0]->fd) == 0 ? SQLITE_OK : SQLITE_IOERR_FSYNC;
+				for (SyncRequest *request : job.requests) {
+					request->result = result;
+				}
+			}
+			else
+#endif
+			{
+				SyncRequest *request = job.requests[0];
+				request->result = request->file->pMethods->xSync(request->file, request->flags);
+			}
+			lock.lock();
+
+			for (SyncRequest *request : job.requests) {
+				request->done = true;
+			}
+			done_cv.notify_all();
+		}
+	}
+};
+
+struct GroupCommitFileShim : public SQLiteFileImpl {
+	GroupCommitter *committer = nullptr;
+	// Directory holding the file, empty if it has no name
+	string directory;
+	dev_t device = 0;
+	// Directory descriptor for `syncfs`, looked up on the first sync in syncfs mode
+	int fd = -1;
+
+	int xSync(int flags) override {
+		SyncRequest request;
+		request.file = original_file;
+		request.flags = flags;
+		request.fd = -1;
+#ifdef __linux__
+		if (committer->use_syncfs && !directory.empty()) {
+			if (fd < 0) {
+				fd = committer->filesystem_fd(device, directory);
+			}
+			request.fd = fd;
+		}
+#endif
+		request.device = device;
+		return committer->sync(request);
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "group_commit_window") == 0) {
+				if (argv[2]) {
+					committer->window_us = atoll(argv[2]);
+				}
+				argv[0] = sqlite3_mprintf("%lld", committer->window_us.load());
+				return SQLITE_OK;
+			}
+			else if (sqlite3_stricmp(argv[1], "group_commit_syncfs") == 0) {
+				if (argv[2]) {
+					committer->use_syncfs = atoi(argv[2]) != 0;
+				}
+				argv[0] = sqlite3_mprintf("%d", (int) committer->use_syncfs.load());
+				return SQLITE_OK;
+			}
+			else if (sqlite3_stricmp(argv[1], "group_commit_stats") == 0) {
+				argv[0] = sqlite3_mprintf("requests=%lld batches=%lld flushes=%lld",
+					committer->requests.load(), committer->batches.load(), committer->flushes.load());
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+};
+
+struct GroupCommitVfsShim : public SQLiteVfsImpl<GroupCommitFileShim> {
+	GroupCommitter committer;
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<GroupCommitFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		file->implementation.committer = &committer;
+#ifdef __linux__
+		// Remember which filesystem `syncfs` has to flush
+		struct stat st;
+		if (result == SQLITE_OK && zName && stat(zName, &st) == 0) {
+			const char *slash = strrchr(zName, '/');
+			file->implementation.directory = !slash ? string(".") : slash == zName ? string("/") : string(zName, slash - zName);
+			file->implementation.device = st.st_dev;
+		}
+#endif
+		return result;
+	}
+};
+
+extern "C" int sqlite3_groupcommitvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<GroupCommitVfsShim> groupcommitvfs("groupcommitvfs");
+	int rc = groupcommitvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
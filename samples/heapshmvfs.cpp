@@ -0,0 +1,303 @@
+// Heap shared memory VFS shim: keeps the WAL index of single-process databases in anonymous memory.
+//
+// In WAL mode, the unix VFS maps a `-shm` file for the WAL index and locks
+// it with `fcntl` byte range locks. When only one process uses the database,
+// the connections of that process can share anonymous memory instead. That
+// avoids the lock system calls and works on filesystems without coherent
+// `mmap`. This shim keeps a registry of WAL indexes per database. `xShmLock`
+// uses one atomic word per lock slot, and `xShmBarrier` is a C++11 fence.
+//
+// Other processes are excluded with an open file description write lock on
+// the "DMS" byte of the `-shm` file, the one the unix VFS checks before
+// using a WAL index. Processes using the default VFS can't map the WAL index
+// then, and their transactions fail with `SQLITE_PROTOCOL` after retrying.
+// If another process already uses the WAL index, the base VFS
+// implementation is used instead.
+//
+// URI parameters:
+//   shm_hugepages=<bool>  back the WAL index with huge pages (default 0)
+//
+// `PRAGMA heapshm_stats` reports the mode, mapped regions and busy locks of the database.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Offset of the "DMS" lock byte in a unix VFS `-shm` file, see `UNIX_SHM_DMS` in sqlite3.c
+static const off_t shm_dms_byte = (22 + SQLITE_SHM_NLOCK) * 4 + SQLITE_SHM_NLOCK;
+static const size_t huge_page_size = 2 << 20;
+
+// A WAL index shared by the connections of this process.
+struct HeapShm {
+	mutex mtx;
+	vector<void *> regions;
+	// Anonymous mappings backing `regions`, with their sizes
+	vector<pair<void *, size_t>> chunks;
+	atomic<int> slots[SQLITE_SHM_NLOCK];
+	// Holds the lock on the `-shm` file that excludes other processes
+	int fd = -1;
+	bool hugepages = false;
+
+	atomic<sqlite3_int64> lock_calls { 0 };
+	atomic<sqlite3_int64> busy { 0 };
+
+	HeapShm() {
+		// Positive values count SHARED locks, -1 is an EXCLUSIVE lock
+		for (atomic<int>& slot : slots) {
+			slot = 0;
+		}
+	}
+
+	~HeapShm() {
+		for (auto& chunk : chunks) {
+			munmap(chunk.first, chunk.second);
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	// Make sure regions up to `index` exist. Must be called with `mtx` locked.
+	bool extend(int index, int region_size) {
+		while ((int) regions.size() <= index) {
+			size_t chunk_size = region_size;
+			void *chunk = MAP_FAILED;
+#ifdef MAP_HUGETLB
+			if (hugepages && (size_t) region_size < huge_page_size) {
+				chunk_size = huge_page_size;
+				chunk = mmap(nullptr, chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			}
+#endif
+			if (chunk == MAP_FAILED) {
+				chunk_size = hugepages ? huge_page_size : region_size;
+				chunk = mmap(nullptr, chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (chunk == MAP_FAILED) {
+					return false;
+				}
+#ifdef MADV_HUGEPAGE
+				if (hugepages) {
+					// No huge pages reserved, transparent huge pages may still back the chunk
+					madvise(chunk, chunk_size, MADV_HUGEPAGE);
+				}
+#endif
+			}
+			chunks.emplace_back(chunk, chunk_size);
+			for (size_t offset = 0; offset + region_size <= chunk_size; offset += region_size) {
+				regions.push_back((char *) chunk + offset);
+			}
+		}
+		return true;
+	}
+};
+
+struct HeapShmFileShim : public SQLiteFileImpl {
+	// Called on the first `xShmMap` to find the WAL index of the database, NULL to use the base VFS
+	function<shared_ptr<HeapShm>()> attach;
+	bool attached = false;
+	shared_ptr<HeapShm> shm;
+	// Lock slots held by this connection
+	uint16_t shared_mask = 0;
+	uint16_t exclusive_mask = 0;
+
+	int xShmMap(int iPg, int pgsz, int flags, void volatile **pp) override {
+		if (!attached && attach) {
+			shm = attach();
+			attached = true;
+		}
+		if (!shm) {
+			return SQLiteFileImpl::xShmMap(iPg, pgsz, flags, pp);
+		}
+		lock_guard<mutex> lock(shm->mtx);
+		if ((int) shm->regions.size() <= iPg && flags && !shm->extend(iPg, pgsz)) {
+			return SQLITE_IOERR_SHMMAP;
+		}
+		*pp = (int) shm->regions.size() > iPg ? shm->regions[iPg] : nullptr;
+		return SQLITE_OK;
+	}
+
+	int xShmLock(int offset, int n, int flags) override {
+		if (!shm) {
+			return SQLiteFileImpl::xShmLock(offset, n, flags);
+		}
+		shm->lock_calls++;
+		uint16_t mask = (uint16_t) (((1 << n) - 1) << offset);
+		if (flags & SQLITE_SHM_UNLOCK) {
+			for (int i = offset; i < offset + n; i++) {
+				if (shared_mask & (1 << i)) {
+					shm->slots[i]--;
+				}
+				else if (exclusive_mask & (1 << i)) {
+					shm->slots[i] = 0;
+				}
+			}
+			shared_mask &= ~mask;
+			exclusive_mask &= ~mask;
+			return SQLITE_OK;
+		}
+
+		if (flags & SQLITE_SHM_SHARED) {
+			// Only single slots are locked SHARED
+			if ((shared_mask | exclusive_mask) & mask) {
+				return SQLITE_OK;
+			}
+			atomic<int>& slot = shm->slots[offset];
+			int value = slot.load();
+			do {
+				if (value < 0) {
+					shm->busy++;
+					return SQLITE_BUSY;
+				}
+			} while (!slot.compare_exchange_weak(value, value + 1));
+			shared_mask |= mask;
+			return SQLITE_OK;
+		}
+
+		for (int i = offset; i < offset + n; i++) {
+			int expected = 0;
+			if (!(exclusive_mask & (1 << i)) && !shm->slots[i].compare_exchange_strong(expected, -1)) {
+				// Give back the slots taken so far
+				for (int j = offset; j < i; j++) {
+					if (!(exclusive_mask & (1 << j))) {
+						shm->slots[j] = 0;
+					}
+				}
+				shm->busy++;
+				return SQLITE_BUSY;
+			}
+		}
+		exclusive_mask |= mask;
+		return SQLITE_OK;
+	}
+
+	void xShmBarrier() override {
+		if (!shm) {
+			return SQLiteFileImpl::xShmBarrier();
+		}
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+
+	int xShmUnmap(int deleteFlag) override {
+		if (!shm) {
+			attached = false;
+			return SQLiteFileImpl::xShmUnmap(deleteFlag);
+		}
+		xShmLock(0, SQLITE_SHM_NLOCK, SQLITE_SHM_UNLOCK | SQLITE_SHM_EXCLUSIVE);
+		shm.reset();
+		attached = false;
+		return SQLITE_OK;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "heapshm_stats") == 0) {
+				if (!shm) {
+					argv[0] = sqlite3_mprintf("mode=%s", attached ? "base" : "none");
+					return SQLITE_OK;
+				}
+				lock_guard<mutex> lock(shm->mtx);
+				argv[0] = sqlite3_mprintf("mode=heap regions=%d lock_calls=%lld busy=%lld",
+					(int) shm->regions.size(), shm->lock_calls.load(), shm->busy.load());
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+};
+
+struct HeapShmVfsShim : public SQLiteVfsImpl<HeapShmFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<HeapShmFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result != SQLITE_OK || zName == nullptr || !(flags & SQLITE_OPEN_MAIN_DB)) {
+			return result;
+		}
+		string path = zName;
+		bool hugepages = sqlite3_uri_boolean(zName, "shm_hugepages", 0);
+		file->implementation.attach = [this, path, hugepages] {
+			return heap_shm(path, hugepages);
+		};
+		return result;
+	}
+
+private:
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<HeapShm>> indexes;
+	// `-shm` descriptors of databases used by another process. They are never closed, as that would drop
+	// the POSIX locks the base VFS holds on the same file.
+	map<pair<dev_t, ino_t>, int> busy_fds;
+
+	// The WAL index of the database at `path`, or NULL if another process uses a `-shm` file.
+	shared_ptr<HeapShm> heap_shm(const string& path, bool hugepages) {
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0) {
+			return nullptr;
+		}
+		lock_guard<mutex> lock(mtx);
+		auto key = make_pair(st.st_dev, st.st_ino);
+		shared_ptr<HeapShm> shm = indexes[key].lock();
+		if (shm) {
+			return shm;
+		}
+		indexes.erase(key);
+
+		int fd;
+		auto busy_fd = busy_fds.find(key);
+		if (busy_fd != busy_fds.end()) {
+			fd = busy_fd->second;
+			busy_fds.erase(busy_fd);
+		}
+		else {
+			fd = open((path + "-shm").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, st.st_mode & 0777);
+			if (fd < 0) {
+				return nullptr;
+			}
+		}
+#ifdef F_OFD_SETLK
+		struct flock dms = {};
+		dms.l_type = F_WRLCK;
+		dms.l_whence = SEEK_SET;
+		dms.l_start = shm_dms_byte;
+		dms.l_len = 1;
+		bool excluded = fcntl(fd, F_OFD_SETLK, &dms) == 0;
+#else
+		bool excluded = flock(fd, LOCK_EX | LOCK_NB) == 0;
+#endif
+		if (!excluded) {
+			busy_fds[key] = fd;
+			return nullptr;
+		}
+		shm = make_shared<HeapShm>();
+		shm->fd = fd;
+		shm->hugepages = hugepages;
+		indexes[key] = shm;
+		return shm;
+	}
+};
+
+extern "C" int sqlite3_heapshmvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<HeapShmVfsShim> heapshmvfs("heapshmvfs");
+	int rc = heapshmvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
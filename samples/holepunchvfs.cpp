@@ -0,0 +1,307 @@
+// Hole punching VFS shim: gives disk space of freelist pages back to the filesystem.
+//
+// Large deletes leave lots of pages in the database freelist, which still
+// take disk space and backup bandwidth until a VACUUM. This shim follows the
+// freelist trunk pages as SQLite writes them and punches holes over freelist
+// leaf pages with `FALLOC_FL_PUNCH_HOLE`. Reads of punched pages are answered
+// with zeros without touching the disk.
+//
+// Leaf pages are only punched once the transaction that freed them can't be
+// rolled back: punched leaves were never journaled, a rollback would leave
+// b-tree pages pointing at zeros. In WAL mode that is after the database
+// `xSync` of a checkpoint. In rollback journal modes the database `xSync` of
+// a commit comes before the journal is deleted, truncated or zeroed, which
+// isn't durable by itself in DELETE mode. Leaves are punched at the next sync
+// of the journal instead: the one following the zeroed header in PERSIST and
+// exclusive locking modes, and the first one of the next write transaction
+// otherwise, which syncs the journal directory too and comes before any write
+// to the database. Trunk pages are cached between scans and only read again
+// after being written, so a commit costs one header read plus one read per
+// modified trunk page.
+//
+// @note Nothing is punched with `synchronous=OFF`, which never syncs.
+// @warning Punched pages are tracked per process. Don't use this shim if other
+//          processes write to the same database.
+//
+// `PRAGMA punch_stats` reports punched pages and zero reads served from memory.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+static uint32_t read_be32(const unsigned char *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// Freelist state of a database file, shared by every connection to it in this process.
+struct FreelistState {
+	struct Trunk {
+		uint32_t next;
+		vector<uint32_t> leaves;
+	};
+
+	mutex mtx;
+	int fd = -1;
+	int page_size = 0;
+	// Bit N is set when page N is currently a punched hole
+	vector<bool> punched;
+	map<uint32_t, Trunk> trunks;
+	sqlite3_int64 punched_pages = 0;
+	sqlite3_int64 zero_reads = 0;
+	// A rollback journal commit freed pages, punch them at the next journal sync
+	bool scan_pending = false;
+
+	~FreelistState() {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	bool is_punched(uint32_t pgno) {
+		return pgno < punched.size() && punched[pgno];
+	}
+
+	// Forget punched pages and cached trunks touched by a write to `[offset, offset + amount)`.
+	void written(sqlite3_int64 offset, sqlite3_int64 amount) {
+		if (page_size == 0) {
+			return;
+		}
+		uint32_t first = (uint32_t) (offset / page_size) + 1;
+		uint32_t last = (uint32_t) ((offset + amount - 1) / page_size) + 1;
+		for (uint32_t pgno = first; pgno <= last; pgno++) {
+			if (is_punched(pgno)) {
+				punched[pgno] = false;
+			}
+			trunks.erase(pgno);
+		}
+	}
+
+	void truncated(sqlite3_int64 size) {
+		if (page_size == 0) {
+			return;
+		}
+		uint32_t page_count = (uint32_t) (size / page_size);
+		if (punched.size() > page_count + 1) {
+			punched.resize(page_count + 1);
+		}
+		trunks.erase(trunks.upper_bound(page_count), trunks.end());
+	}
+
+	// Walk the freelist of the database and punch holes for leaf pages that are not punched yet.
+	void scan() {
+		scan_pending = false;
+		unsigned char header[100];
+		if (fd < 0 || pread(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+			return;
+		}
+		int header_page_size = (header[16] << 8) | header[17];
+		header_page_size = header_page_size == 1 ? 65536 : header_page_size;
+		if (header_page_size != page_size) {
+			page_size = header_page_size;
+			punched.clear();
+			trunks.clear();
+		}
+		uint32_t trunk_pgno = read_be32(header + 32);
+		uint32_t free_count = read_be32(header + 36);
+		uint32_t max_leaves = page_size / 4 - 2;
+
+		map<uint32_t, Trunk> seen;
+		vector<uint32_t> leaves;
+		vector<unsigned char> buffer;
+		while (trunk_pgno != 0 && seen.size() < free_count && seen.count(trunk_pgno) == 0) {
+			auto it = trunks.find(trunk_pgno);
+			if (it == trunks.end()) {
+				buffer.resize(page_size);
+				if (pread(fd, buffer.data(), page_size, (off_t) (trunk_pgno - 1) * page_size) != page_size) {
+					return;
+				}
+				Trunk trunk;
+				trunk.next = read_be32(buffer.data());
+				uint32_t leaf_count = read_be32(buffer.data() + 4);
+				if (leaf_count > max_leaves) {
+					// Not a trunk page, the freelist is corrupt or we are out of sync with it
+					return;
+				}
+				for (uint32_t i = 0; i < leaf_count; i++) {
+					trunk.leaves.push_back(read_be32(buffer.data() + 8 + 4 * i));
+				}
+				it = trunks.emplace(trunk_pgno, move(trunk)).first;
+			}
+			leaves.insert(leaves.end(), it->second.leaves.begin(), it->second.leaves.end());
+			seen.emplace(trunk_pgno, it->second);
+			trunk_pgno = it->second.next;
+		}
+		trunks = move(seen);
+
+		sort(leaves.begin(), leaves.end());
+		size_t i = 0;
+		while (i < leaves.size()) {
+			if (leaves[i] <= 1 || is_punched(leaves[i])) {
+				i++;
+				continue;
+			}
+			// Punch runs of adjacent pages with a single call
+			size_t j = i + 1;
+			while (j < leaves.size() && leaves[j] == leaves[j - 1] + 1 && !is_punched(leaves[j])) {
+				j++;
+			}
+			punch(leaves[i], leaves[j - 1]);
+			i = j;
+		}
+	}
+
+	void punch(uint32_t first, uint32_t last) {
+#ifdef __linux__
+		off_t offset = (off_t) (first - 1) * page_size;
+		off_t length = (off_t) (last - first + 1) * page_size;
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) != 0) {
+			return;
+		}
+		if (punched.size() <= last) {
+			punched.resize(last + 1);
+		}
+		for (uint32_t pgno = first; pgno <= last; pgno++) {
+			punched[pgno] = true;
+		}
+		punched_pages += last - first + 1;
+#endif
+	}
+};
+
+struct HolePunchFileShim : public SQLiteFileImpl {
+	shared_ptr<FreelistState> state;
+	// Set on the rollback journal of a database, whose syncs make its last commit durable
+	bool journal = false;
+	bool dirty = false;
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (state && !journal) {
+			lock_guard<mutex> lock(state->mtx);
+			int page_size = state->page_size;
+			if (page_size > 0 && iAmt == page_size && iOfst % page_size == 0 && state->is_punched(iOfst / page_size + 1)) {
+				memset(p, 0, iAmt);
+				state->zero_reads++;
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (state && !journal) {
+			lock_guard<mutex> lock(state->mtx);
+			state->written(iOfst, iAmt);
+			dirty = true;
+		}
+		return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (state && !journal) {
+			lock_guard<mutex> lock(state->mtx);
+			state->truncated(size);
+		}
+		return SQLiteFileImpl::xTruncate(size);
+	}
+
+	int xSync(int flags) override {
+		int result = SQLiteFileImpl::xSync(flags);
+		if (result != SQLITE_OK || !state) {
+			return result;
+		}
+		lock_guard<mutex> lock(state->mtx);
+		if (journal) {
+			if (state->scan_pending) {
+				state->scan();
+			}
+			return result;
+		}
+		if (dirty) {
+			// The file format version bytes are 2 in WAL mode, where database syncs are checkpoints
+			unsigned char versions[2];
+			if (SQLiteFileImpl::xRead(versions, sizeof(versions), 18) == SQLITE_OK && versions[0] == 2 && versions[1] == 2) {
+				state->scan();
+			}
+			else {
+				state->scan_pending = true;
+			}
+			dirty = false;
+		}
+		return result;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA && state && !journal) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "punch_stats") == 0) {
+				lock_guard<mutex> lock(state->mtx);
+				argv[0] = sqlite3_mprintf("punched_pages=%lld zero_reads=%lld", state->punched_pages, state->zero_reads);
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+};
+
+struct HolePunchVfsShim : public SQLiteVfsImpl<HolePunchFileShim> {
+	mutex registry_mutex;
+	map<string, weak_ptr<FreelistState>> registry;
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<HolePunchFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result == SQLITE_OK && zName && (flags & SQLITE_OPEN_MAIN_DB) && !(flags & SQLITE_OPEN_READONLY)) {
+			file->implementation.state = find_state(zName);
+		}
+		else if (result == SQLITE_OK && zName && (flags & SQLITE_OPEN_MAIN_JOURNAL)) {
+			size_t length = strlen(zName);
+			if (length > 8 && strcmp(zName + length - 8, "-journal") == 0) {
+				lock_guard<mutex> lock(registry_mutex);
+				auto it = registry.find(string(zName, length - 8));
+				if (it != registry.end()) {
+					file->implementation.state = it->second.lock();
+					file->implementation.journal = true;
+				}
+			}
+		}
+		return result;
+	}
+
+	shared_ptr<FreelistState> find_state(const char *zName) {
+		lock_guard<mutex> lock(registry_mutex);
+		shared_ptr<FreelistState> state = registry[zName].lock();
+		if (!state) {
+			int fd = open(zName, O_RDWR | O_CLOEXEC);
+			if (fd < 0) {
+				return nullptr;
+			}
+			state = make_shared<FreelistState>();
+			state->fd = fd;
+			registry[zName] = state;
+		}
+		return state;
+	}
+};
+
+extern "C" int sqlite3_holepunchvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<HolePunchVfsShim> holepunchvfs("holepunchvfs");
+	int rc = holepunchvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
@@ -0,0 +1,119 @@
+// Journal directory VFS shim: places rollback journals and WAL files in a separate directory.
+//
+// Sequential, sync heavy journal and WAL writes do better on a dedicated
+// device than on the disk serving random database reads. This shim redirects
+// `xOpen`, `xAccess` and `xDelete` of journal, super-journal and WAL files to
+// the directory named by the `SQLITE_JOURNAL_DIR` environment variable.
+//
+// The redirected name only depends on the original full path, for example
+// `/data/db.sqlite-journal` becomes `$SQLITE_JOURNAL_DIR/%2Fdata%2Fdb.sqlite-journal.j`,
+// so hot journals are still found after a crash and restart, as long as the
+// same directory is configured. Very long names are shortened with a hash.
+//
+// @note The shared memory `-shm` file of WAL databases stays next to the database.
+// @note Redirected files are created with the default file permissions instead of the database ones.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace sqlitevfs;
+using namespace std;
+
+struct JournalDirFileShim : public SQLiteFileImpl {
+	// The base VFS keeps a pointer to the file name, so it must live as long as the file
+	string redirected_path;
+};
+
+struct JournalDirVfsShim : public SQLiteVfsImpl<JournalDirFileShim> {
+	string journal_directory;
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<JournalDirFileShim> *file, int flags, int *pOutFlags) override {
+		const int redirect_types = SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_SUPER_JOURNAL | SQLITE_OPEN_WAL;
+		if (zName == nullptr || (flags & redirect_types) == 0) {
+			return SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		}
+		file->implementation.redirected_path = redirect(zName);
+		return original_vfs->xOpen(original_vfs, file->implementation.redirected_path.c_str(), file->original_file, flags, pOutFlags);
+	}
+
+	int xDelete(const char *zName, int syncDir) override {
+		if (is_journal_name(zName)) {
+			return SQLiteVfsImpl::xDelete(redirect(zName).c_str(), syncDir);
+		}
+		return SQLiteVfsImpl::xDelete(zName, syncDir);
+	}
+
+	int xAccess(const char *zName, int flags, int *pResOut) override {
+		if (is_journal_name(zName)) {
+			return SQLiteVfsImpl::xAccess(redirect(zName).c_str(), flags, pResOut);
+		}
+		return SQLiteVfsImpl::xAccess(zName, flags, pResOut);
+	}
+
+	// Whether `zName` follows SQLite's naming for journals, WAL files and super-journals.
+	static bool is_journal_name(const char *zName) {
+		size_t length = strlen(zName);
+		if ((length > 8 && strcmp(zName + length - 8, "-journal") == 0) || (length > 4 && strcmp(zName + length - 4, "-wal") == 0)) {
+			return true;
+		}
+		// Super-journals are named "<database>-mjXXXXXXXXX", with 9 hex digits
+		if (length > 12 && strncmp(zName + length - 12, "-mj", 3) == 0) {
+			for (const char *c = zName + length - 9; *c; c++) {
+				if (!isxdigit((unsigned char) *c)) {
+					return false;
+				}
+			}
+			return true;
+		}
+		return false;
+	}
+
+	// Map a journal path to its place inside `journal_directory`.
+	string redirect(const char *zName) const {
+		string escaped;
+		for (const char *c = zName; *c; c++) {
+			switch (*c) {
+				case '/': escaped += "%2F"; break;
+				case '%': escaped += "%25"; break;
+				default: escaped += *c; break;
+			}
+		}
+		if (escaped.size() > 200) {
+			// Keep the tail, which has the database and journal names, plus a hash of the whole path
+			uint64_t hash = 14695981039346656037ULL;
+			for (const char *c = zName; *c; c++) {
+				hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+			}
+			char hash_string[17];
+			snprintf(hash_string, sizeof(hash_string), "%016llx", (unsigned long long) hash);
+			escaped = string(hash_string) + "~" + escaped.substr(escaped.size() - 180);
+		}
+		// The ".j" extension stops the unix VFS from looking for a database file next to the journal
+		// to copy permissions from, as that database only exists in the original directory.
+		return journal_directory + "/" + escaped + ".j";
+	}
+};
+
+extern "C" int sqlite3_journaldirvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	const char *journal_directory = getenv("SQLITE_JOURNAL_DIR");
+	if (journal_directory == nullptr || journal_directory[0] == '\0') {
+		*pzErrMsg = sqlite3_mprintf("journaldirvfs: SQLITE_JOURNAL_DIR environment variable is not set");
+		return SQLITE_ERROR;
+	}
+
+	static SQLiteVfs<JournalDirVfsShim> journaldirvfs("journaldirvfs");
+	journaldirvfs.implementation.journal_directory = journal_directory;
+	int rc = journaldirvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
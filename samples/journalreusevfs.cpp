@@ -0,0 +1,268 @@
+// Journal reuse VFS shim: keeps rollback journals around instead of creating and deleting them.
+//
+// In DELETE journal mode every transaction creates the journal, syncs its
+// directory entry, and unlinks it on commit. This shim turns the commit's
+// `xDelete` into zeroing the journal header, which SQLite already treats as
+// "no hot journal", just like in PERSIST mode. The next transaction opens
+// the existing, preallocated journal without `SQLITE_OPEN_CREATE`, so no
+// directory sync happens either. The journal mode of the database doesn't
+// change.
+//
+// As in PERSIST mode, the zeroed header is synced before the commit returns,
+// and the journal of a multi-database transaction, which names its
+// super-journal at its end, is truncated instead.
+// The shim can't tell `synchronous=OFF` apart, so that sync happens there too.
+// The costs of PERSIST mode remain as well: since the journal exists, every
+// read transaction opens it and reads its header to check whether it is hot.
+//
+// Journals that stay unused for a while are unlinked by a background thread,
+// off the commit path. It only does so while holding an EXCLUSIVE lock on the
+// database, so no connection in any process can be using the journal.
+//
+// `PRAGMA journal_reuse_stats` reports reused journals, header invalidations and background unlinks.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Size of a rollback journal header: magic, record count, nonce, initial size, sector size and page size
+static const int journal_header_size = 28;
+// Last bytes of a journal that names a super-journal, see `writeSuperJournal` in sqlite3.c
+static const unsigned char journal_magic[8] = { 0xd9, 0xd5, 0x05, 0xf9, 0x20, 0xa1, 0x63, 0xd7 };
+
+struct JournalReuseStats {
+	atomic<sqlite3_int64> reused_opens { 0 };
+	atomic<sqlite3_int64> invalidations { 0 };
+	atomic<sqlite3_int64> background_unlinks { 0 };
+};
+
+struct JournalReuseFileShim : public SQLiteFileImpl {
+	JournalReuseStats *stats = nullptr;
+	// Called on close for journals, so the VFS knows when they are not in use
+	function<void()> on_close;
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA && stats) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "journal_reuse_stats") == 0) {
+				argv[0] = sqlite3_mprintf("reused_opens=%lld invalidations=%lld background_unlinks=%lld",
+					stats->reused_opens.load(), stats->invalidations.load(), stats->background_unlinks.load());
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	int xClose() override {
+		int result = SQLiteFileImpl::xClose();
+		if (on_close) {
+			on_close();
+		}
+		return result;
+	}
+};
+
+struct JournalReuseVfsShim : public SQLiteVfsImpl<JournalReuseFileShim> {
+	struct Journal {
+		int users = 0;
+		bool invalidated = false;
+		chrono::steady_clock::time_point invalidated_at;
+	};
+
+	chrono::milliseconds keep_unused_for { 10000 };
+	sqlite3_int64 preallocate_size = 1 << 20;
+	JournalReuseStats stats;
+
+	~JournalReuseVfsShim() {
+		{
+			lock_guard<mutex> lock(mtx);
+			stop = true;
+		}
+		cv.notify_all();
+		if (reaper.joinable()) {
+			reaper.join();
+		}
+	}
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<JournalReuseFileShim> *file, int flags, int *pOutFlags) override {
+		file->implementation.stats = &stats;
+		if (zName == nullptr || !(flags & SQLITE_OPEN_MAIN_JOURNAL)) {
+			return SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		}
+
+		string path = zName;
+		{
+			lock_guard<mutex> lock(mtx);
+			journals[path].users++;
+			if (!reaper.joinable()) {
+				reaper = thread(&JournalReuseVfsShim::reap_loop, this);
+			}
+		}
+		file->implementation.on_close = [this, path] {
+			lock_guard<mutex> lock(mtx);
+			journals[path].users--;
+		};
+
+		// Reopening an existing journal without SQLITE_OPEN_CREATE skips the directory sync
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags & ~(SQLITE_OPEN_CREATE | SQLITE_OPEN_EXCLUSIVE), pOutFlags);
+		if (result == SQLITE_OK) {
+			stats.reused_opens++;
+		}
+		else if (flags & SQLITE_OPEN_CREATE) {
+			result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+#ifdef __linux__
+			int fd = result == SQLITE_OK ? open(zName, O_WRONLY | O_CLOEXEC) : -1;
+			if (fd >= 0) {
+				fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, preallocate_size);
+				close(fd);
+			}
+#endif
+		}
+		if (result != SQLITE_OK) {
+			file->implementation.on_close();
+		}
+		return result;
+	}
+
+	int xDelete(const char *zName, int syncDir) override {
+		size_t length = strlen(zName);
+		if (length <= 8 || strcmp(zName + length - 8, "-journal") != 0) {
+			return SQLiteVfsImpl::xDelete(zName, syncDir);
+		}
+
+		// Zero the header instead, SQLite won't consider the journal hot anymore
+		int fd = open(zName, O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			return SQLiteVfsImpl::xDelete(zName, syncDir);
+		}
+		// A super-journal record would still tie the journal to its super-journal, truncate it like `zeroJournalHdr` does
+		struct stat st;
+		unsigned char tail[sizeof(journal_magic)];
+		bool has_super = fstat(fd, &st) == 0 && st.st_size >= journal_header_size + 16
+			&& pread(fd, tail, sizeof(tail), st.st_size - sizeof(tail)) == (ssize_t) sizeof(tail)
+			&& memcmp(tail, journal_magic, sizeof(tail)) == 0;
+		bool ok;
+		if (has_super) {
+			ok = ftruncate(fd, 0) == 0 && fdatasync(fd) == 0;
+#ifdef __linux__
+			if (ok) {
+				fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, preallocate_size);
+			}
+#endif
+		}
+		else {
+			static const char zeros[journal_header_size] = {};
+			// Synced like PERSIST mode does, a header that comes back after a crash would roll back a committed transaction
+			ok = pwrite(fd, zeros, sizeof(zeros), 0) == (ssize_t) sizeof(zeros) && fdatasync(fd) == 0;
+		}
+		close(fd);
+		if (!ok) {
+			return SQLITE_IOERR_DELETE;
+		}
+		stats.invalidations++;
+
+		lock_guard<mutex> lock(mtx);
+		Journal& journal = journals[zName];
+		journal.invalidated = true;
+		journal.invalidated_at = chrono::steady_clock::now();
+		return SQLITE_OK;
+	}
+
+private:
+	mutex mtx;
+	condition_variable cv;
+	map<string, Journal> journals;
+	thread reaper;
+	bool stop = false;
+
+	// Unlink journals that were not used for `keep_unused_for`.
+	void reap_loop() {
+		unique_lock<mutex> lock(mtx);
+		while (!stop) {
+			cv.wait_for(lock, keep_unused_for / 2);
+			if (stop) {
+				break;
+			}
+			auto now = chrono::steady_clock::now();
+			vector<string> candidates;
+			for (auto& it : journals) {
+				if (it.second.users == 0 && it.second.invalidated && now - it.second.invalidated_at >= keep_unused_for) {
+					candidates.push_back(it.first);
+				}
+			}
+			for (const string& path : candidates) {
+				// Keep the journal marked as used while unlinking, so this process doesn't open it meanwhile
+				journals[path].users++;
+				lock.unlock();
+				bool unlinked = unlink_unused(path);
+				lock.lock();
+				Journal& journal = journals[path];
+				journal.users--;
+				if (unlinked && journal.users == 0) {
+					journals.erase(path);
+				}
+			}
+		}
+	}
+
+	// Unlink the journal if it is still empty or its header invalid, while holding an EXCLUSIVE lock on its database.
+	bool unlink_unused(const string& journal_path) {
+		string database_path = journal_path.substr(0, journal_path.size() - 8);
+		sqlite3_file *database = (sqlite3_file *) sqlite3_malloc(original_vfs->szOsFile);
+		if (database == nullptr) {
+			return false;
+		}
+		memset(database, 0, original_vfs->szOsFile);
+		bool unlinked = false;
+		if (original_vfs->xOpen(original_vfs, database_path.c_str(), database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_MAIN_DB, nullptr) == SQLITE_OK) {
+			if (database->pMethods->xLock(database, SQLITE_LOCK_SHARED) == SQLITE_OK) {
+				if (database->pMethods->xLock(database, SQLITE_LOCK_RESERVED) == SQLITE_OK
+					&& database->pMethods->xLock(database, SQLITE_LOCK_EXCLUSIVE) == SQLITE_OK) {
+					char first_byte = 0;
+					int fd = open(journal_path.c_str(), O_RDONLY | O_CLOEXEC);
+					if (fd >= 0 && pread(fd, &first_byte, 1, 0) >= 0 && first_byte == 0) {
+						unlinked = original_vfs->xDelete(original_vfs, journal_path.c_str(), 0) == SQLITE_OK;
+					}
+					if (fd >= 0) {
+						close(fd);
+					}
+				}
+				database->pMethods->xUnlock(database, SQLITE_LOCK_NONE);
+			}
+			database->pMethods->xClose(database);
+		}
+		sqlite3_free(database);
+		if (unlinked) {
+			stats.background_unlinks++;
+		}
+		return unlinked;
+	}
+};
+
+extern "C" int sqlite3_journalreusevfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<JournalReuseVfsShim> journalreusevfs("journalreusevfs");
+	int rc = journalreusevfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
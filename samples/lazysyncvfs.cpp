@@ -0,0 +1,406 @@
+// Lazy sync VFS shim: defers `xSync` to a background flusher with a bounded data loss window.
+//
+// `xSync` only marks the file as dirty and returns. A background thread
+// flushes dirty files once they have been dirty for `lazysync_interval_ms`
+// or after `lazysync_bytes` bytes were written to them, whichever comes
+// first. A crash may lose commits from about that window, but never
+// corrupts the database, because the write ordering SQLite relies on is
+// kept: before a database, journal or WAL file is written, truncated or
+// deleted, every other file of the same database with a deferred sync is
+// flushed first.
+//
+// In WAL mode commits only append to the WAL, so commit latency becomes a
+// memory operation and syncs only happen in the background and around
+// checkpoints. Rollback journal modes still flush when the database file
+// is written, since the journal must be durable before that.
+//
+// URI parameters:
+//   lazysync_interval_ms=<ms>  maximum age of a deferred sync (default 100)
+//   lazysync_bytes=<bytes>     maximum bytes written before a flush (default 8 MiB)
+//
+// `PRAGMA lazysync_stats` reports deferred syncs and flushes of the database.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Descriptor the background flusher syncs a file with, shared by every
+// connection to its inode. Closing a descriptor drops all POSIX locks the
+// process holds on the file, so it is closed with the last connection.
+struct SharedDescriptor {
+	int fd = -1;
+
+	~SharedDescriptor() {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+};
+
+// A database file, journal or WAL whose syncs are deferred.
+struct LazySyncMember {
+	string path;
+	shared_ptr<SharedDescriptor> descriptor;
+	int fd = -1;
+	bool dirty = false;
+	bool directory_synced = false;
+	chrono::steady_clock::time_point dirty_since;
+	sqlite3_int64 bytes_since_flush = 0;
+	// Error of a background flush, reported by the next `xSync`
+	int flush_error = SQLITE_OK;
+};
+
+// A database together with its journal and WAL, the unit of write ordering.
+struct LazySyncGroup {
+	mutex mtx;
+	vector<LazySyncMember *> members;
+	chrono::milliseconds interval { 100 };
+	sqlite3_int64 byte_limit = 8 << 20;
+
+	sqlite3_int64 deferred_syncs = 0;
+	sqlite3_int64 background_flushes = 0;
+	sqlite3_int64 ordering_flushes = 0;
+
+	// Flush every dirty member except `except`. Must be called with `mtx` locked.
+	int flush_others(LazySyncMember *except) {
+		int result = SQLITE_OK;
+		for (LazySyncMember *member : members) {
+			if (member != except && member->dirty) {
+				int flush_result = flush(member);
+				ordering_flushes++;
+				if (flush_result != SQLITE_OK) {
+					result = flush_result;
+				}
+			}
+		}
+		return result;
+	}
+
+	// Must be called with `mtx` locked.
+	int flush(LazySyncMember *member) {
+		int result = SQLITE_OK;
+		if (fdatasync(member->fd) != 0) {
+			result = SQLITE_IOERR_FSYNC;
+		}
+		else if (!member->directory_synced) {
+			// Newly created journals and WAL files also need their directory entry to be durable
+			size_t slash = member->path.rfind('/');
+			string directory = slash == string::npos ? "." : slash == 0 ? "/" : member->path.substr(0, slash);
+			int dir_fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+			if (dir_fd >= 0) {
+				fsync(dir_fd);
+				close(dir_fd);
+			}
+			member->directory_synced = true;
+		}
+		member->dirty = false;
+		member->bytes_since_flush = 0;
+		if (result != SQLITE_OK) {
+			member->flush_error = result;
+		}
+		return result;
+	}
+};
+
+// Process-wide background thread that flushes expired deferred syncs.
+class LazySyncFlusher {
+public:
+	~LazySyncFlusher() {
+		{
+			lock_guard<mutex> lock(mtx);
+			stop = true;
+		}
+		cv.notify_all();
+		if (worker.joinable()) {
+			worker.join();
+		}
+	}
+
+	// Add `member` to the group of `database_path`, creating it if necessary.
+	shared_ptr<LazySyncGroup> join_group(const string& database_path, LazySyncMember *member, chrono::milliseconds interval, sqlite3_int64 byte_limit) {
+		lock_guard<mutex> lock(mtx);
+		if (!worker.joinable()) {
+			worker = thread(&LazySyncFlusher::run, this);
+		}
+		shared_ptr<LazySyncGroup>& group = groups[database_path];
+		if (!group) {
+			group = make_shared<LazySyncGroup>();
+			group->interval = interval;
+			group->byte_limit = byte_limit;
+		}
+		lock_guard<mutex> group_lock(group->mtx);
+		group->members.push_back(member);
+		return group;
+	}
+
+	shared_ptr<LazySyncGroup> existing_group(const string& database_path) {
+		lock_guard<mutex> lock(mtx);
+		auto it = groups.find(database_path);
+		return it != groups.end() ? it->second : nullptr;
+	}
+
+	void wake() {
+		cv.notify_one();
+	}
+
+private:
+	mutex mtx;
+	condition_variable cv;
+	map<string, shared_ptr<LazySyncGroup>> groups;
+	thread worker;
+	bool stop = false;
+
+	void run() {
+		unique_lock<mutex> lock(mtx);
+		vector<shared_ptr<LazySyncGroup>> active_groups;
+		while (!stop) {
+			active_groups.clear();
+			for (auto it = groups.begin(); it != groups.end(); ) {
+				lock_guard<mutex> group_lock(it->second->mtx);
+				if (it->second->members.empty()) {
+					it = groups.erase(it);
+				}
+				else {
+					active_groups.push_back(it->second);
+					++it;
+				}
+			}
+			// Don't block other databases from opening while flushing
+			lock.unlock();
+
+			chrono::milliseconds next_wait(1000);
+			auto now = chrono::steady_clock::now();
+			for (shared_ptr<LazySyncGroup>& group : active_groups) {
+				lock_guard<mutex> group_lock(group->mtx);
+				for (LazySyncMember *member : group->members) {
+					if (!member->dirty) {
+						continue;
+					}
+					auto deadline = member->dirty_since + group->interval;
+					if (deadline <= now || member->bytes_since_flush >= group->byte_limit) {
+						group->flush(member);
+						group->background_flushes++;
+					}
+					else {
+						auto wait = chrono::duration_cast<chrono::milliseconds>(deadline - now) + chrono::milliseconds(1);
+						next_wait = wait < next_wait ? wait : next_wait;
+					}
+				}
+			}
+
+			lock.lock();
+			if (!stop) {
+				cv.wait_for(lock, next_wait);
+			}
+		}
+	}
+};
+
+struct LazySyncFileShim : public SQLiteFileImpl {
+	LazySyncFlusher *flusher = nullptr;
+	shared_ptr<LazySyncGroup> group;
+	LazySyncMember member;
+	// Gives `member.descriptor` back to the VFS
+	function<void()> release_descriptor;
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (group) {
+			bool wake_flusher;
+			{
+				lock_guard<mutex> lock(group->mtx);
+				int result = group->flush_others(&member);
+				if (result != SQLITE_OK) {
+					return result;
+				}
+				member.bytes_since_flush += iAmt;
+				wake_flusher = member.dirty && member.bytes_since_flush >= group->byte_limit;
+			}
+			if (wake_flusher) {
+				flusher->wake();
+			}
+		}
+		return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (group) {
+			lock_guard<mutex> lock(group->mtx);
+			int result = group->flush_others(&member);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		return SQLiteFileImpl::xTruncate(size);
+	}
+
+	int xSync(int flags) override {
+		if (group == nullptr) {
+			return SQLiteFileImpl::xSync(flags);
+		}
+		bool became_dirty = false;
+		int result;
+		{
+			lock_guard<mutex> lock(group->mtx);
+			result = member.flush_error;
+			member.flush_error = SQLITE_OK;
+			if (!member.dirty) {
+				member.dirty = true;
+				member.dirty_since = chrono::steady_clock::now();
+				became_dirty = true;
+			}
+			group->deferred_syncs++;
+		}
+		// Let the flusher know about the new deadline
+		if (became_dirty) {
+			flusher->wake();
+		}
+		return result;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA && group) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "lazysync_stats") == 0) {
+				lock_guard<mutex> lock(group->mtx);
+				argv[0] = sqlite3_mprintf("deferred_syncs=%lld background_flushes=%lld ordering_flushes=%lld",
+					group->deferred_syncs, group->background_flushes, group->ordering_flushes);
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	int xClose() override {
+		if (group) {
+			lock_guard<mutex> lock(group->mtx);
+			if (member.dirty) {
+				group->flush(&member);
+			}
+			auto& members = group->members;
+			for (auto it = members.begin(); it != members.end(); ++it) {
+				if (*it == &member) {
+					members.erase(it);
+					break;
+				}
+			}
+		}
+		int result = SQLiteFileImpl::xClose();
+		if (release_descriptor) {
+			release_descriptor();
+		}
+		return result;
+	}
+};
+
+struct LazySyncVfsShim : public SQLiteVfsImpl<LazySyncFileShim> {
+	LazySyncFlusher flusher;
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<SharedDescriptor>> descriptors;
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<LazySyncFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		const int lazy_types = SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL;
+		if (result != SQLITE_OK || zName == nullptr || (flags & lazy_types) == 0 || (flags & SQLITE_OPEN_READONLY)) {
+			return result;
+		}
+
+		LazySyncFileShim& shim = file->implementation;
+		struct stat st;
+		if (stat(zName, &st) == 0) {
+			pair<dev_t, ino_t> key = make_pair(st.st_dev, st.st_ino);
+			shim.member.descriptor = shared_descriptor(zName, key);
+			shim.release_descriptor = [this, key, &shim] {
+				release_shared_descriptor(key, shim.member.descriptor);
+			};
+			shim.member.fd = shim.member.descriptor->fd;
+		}
+		if (shim.member.fd < 0) {
+			// Without a descriptor to flush from the background, just sync normally
+			return result;
+		}
+		shim.member.path = zName;
+		shim.member.directory_synced = !(flags & SQLITE_OPEN_CREATE);
+
+		sqlite3_filename database = (flags & SQLITE_OPEN_MAIN_DB) ? zName : sqlite3_filename_database(zName);
+		chrono::milliseconds interval(sqlite3_uri_int64(database, "lazysync_interval_ms", 100));
+		sqlite3_int64 byte_limit = sqlite3_uri_int64(database, "lazysync_bytes", 8 << 20);
+		shim.flusher = &flusher;
+		shim.group = flusher.join_group(database, &shim.member, interval, byte_limit);
+		return result;
+	}
+
+	shared_ptr<SharedDescriptor> shared_descriptor(const char *path, pair<dev_t, ino_t> key) {
+		lock_guard<mutex> lock(mtx);
+		weak_ptr<SharedDescriptor>& entry = descriptors[key];
+		shared_ptr<SharedDescriptor> descriptor = entry.lock();
+		if (!descriptor) {
+			descriptor = make_shared<SharedDescriptor>();
+			descriptor->fd = open(path, O_RDWR | O_CLOEXEC);
+			entry = descriptor;
+		}
+		return descriptor;
+	}
+
+	// Drop a reference, and the entry of the file along with the last one.
+	void release_shared_descriptor(pair<dev_t, ino_t> key, shared_ptr<SharedDescriptor>& descriptor) {
+		lock_guard<mutex> lock(mtx);
+		descriptor.reset();
+		auto it = descriptors.find(key);
+		if (it != descriptors.end() && it->second.expired()) {
+			descriptors.erase(it);
+		}
+	}
+
+	int xDelete(const char *zName, int syncDir) override {
+		// Deleting a journal commits the transaction, the database must be durable before that
+		shared_ptr<LazySyncGroup> group = flusher.existing_group(database_path(zName));
+		if (group) {
+			lock_guard<mutex> lock(group->mtx);
+			int result = group->flush_others(nullptr);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		return SQLiteVfsImpl::xDelete(zName, syncDir);
+	}
+
+	static string database_path(const string& path) {
+		for (const char *suffix : { "-journal", "-wal" }) {
+			size_t suffix_length = strlen(suffix);
+			if (path.size() > suffix_length && path.compare(path.size() - suffix_length, suffix_length, suffix) == 0) {
+				return path.substr(0, path.size() - suffix_length);
+			}
+		}
+		return path;
+	}
+};
+
+extern "C" int sqlite3_lazysyncvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<LazySyncVfsShim> lazysyncvfs("lazysyncvfs");
+	int rc = lazysyncvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
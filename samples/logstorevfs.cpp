@@ -0,0 +1,1034 @@
+// Log store VFS shim: appends every page written to the database to a log, instead of overwriting it in place.
+//
+// Layout of a log store database file:
+//   - two 4096 byte superblocks, written alternately: geometry, logical size
+//     and the segments of the last checkpoint
+//   - segments of `log_segment_size` bytes, each starting with two copies of
+//     its summary (sequence number, logical size and the page held by each
+//     slot), followed by page slots
+// Page writes go to the next free slot of the head segment, so the device
+// sees sequential writes whatever pages SQLite writes. An in-memory index
+// maps every page to its slot, and `xRead` follows it, reading runs of pages
+// that are adjacent in the log at once.
+//
+// The index is persisted in two ways. On `xSync`, the summaries of the
+// segments written since the last sync are written, alternating between
+// their two copies, right before syncing the file. Every 64 filled segments,
+// or after a truncation, a checkpoint writes the whole index to checkpoint
+// segments, syncs them, then points the superblock at them. Opening a
+// database loads the checkpoint and replays the summaries of the segments
+// that are newer, in sequence order. After a crash, every page whose slot or
+// summary may be torn was written by the interrupted transaction or WAL
+// checkpoint, and SQLite rewrites it from the rollback journal or WAL.
+//
+// A background thread compacts the log: while the segments holding data
+// exceed `log_space_amp` times the space of the live pages, it copies the
+// live pages of the segment with the fewest of them to the head, one batch
+// at a time. Compacted segments, and those of replaced checkpoints, are only
+// reused once the copies are synced, so the durable index never points to a
+// slot that was overwritten since. Free segments at the end of the file are
+// given back on sync.
+//
+// URI parameters:
+//   log_segment_size=<bytes>  size of the segments of a new database (default 4 MiB)
+//   log_space_amp=<ratio>     space amplification that triggers compaction (default 1.5)
+//   log_compaction=<bool>     run the compaction thread (default 1)
+//
+// `PRAGMA logstore_stats` reports the logical and physical sizes, segments and compaction progress.
+//
+// @note The index is shared by the connections of one process, a log store database
+//       must not be used by several processes at once.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+static const char superblock_magic[8] = { 'S', 'Q', 'L', 'L', 'O', 'G', '0', '1' };
+static const char summary_magic[8] = { 'S', 'Q', 'L', 'L', 'S', 'E', 'G', '1' };
+static const int superblock_size = 4096;
+static const sqlite3_int64 segments_start = 2 * superblock_size;
+// magic, checksum, kind, used slots, sequence, logical pages, sync count and data checksum
+static const int summary_header_size = 56;
+static const int max_checkpoint_segments = (superblock_size - 64) / 4;
+static const int checkpoint_interval = 64;
+// Pages copied by the compaction thread per lock of the store
+static const int compaction_batch = 32;
+
+static const uint32_t pages_kind = 1;
+static const uint32_t checkpoint_kind = 2;
+
+static void put_u32(unsigned char *p, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_u64(unsigned char *p, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t) p[i] << (8 * i);
+	}
+	return value;
+}
+
+// Same checksum as SQLite's WAL frames, `size` must be a multiple of 8.
+static void log_checksum(const unsigned char *data, size_t size, unsigned char out[8]) {
+	uint32_t s1 = 0, s2 = 0;
+	for (size_t i = 0; i + 8 <= size; i += 8) {
+		s1 += get_u32(data + i) + s2;
+		s2 += get_u32(data + i + 4) + s1;
+	}
+	put_u32(out, s1);
+	put_u32(out + 4, s2);
+}
+
+enum SegmentState {
+	segment_free,
+	segment_head,
+	segment_sealed,
+	segment_checkpoint,
+	// Compacted, free once the copies of its pages are synced
+	segment_released,
+};
+
+struct Segment {
+	SegmentState state = segment_free;
+	uint64_t seq = 0;
+	uint32_t used = 0;
+	uint32_t live = 0;
+	uint32_t sync_count = 0;
+	// Whether the summary changed since it was last written
+	bool dirty = false;
+	// Page number + 1 held by each slot, 0 for none
+	vector<uint32_t> pages;
+};
+
+// Index and segments of a log store database, shared by the connections of this process.
+class LogStore {
+public:
+	mutex mtx;
+	// 0 until the first write sets up the file
+	int page_size = 0;
+	sqlite3_int64 page_count = 0;
+	double space_amp = 1.5;
+
+	sqlite3_int64 appended_pages = 0;
+	sqlite3_int64 compacted_pages = 0;
+	sqlite3_int64 compacted_segments = 0;
+	sqlite3_int64 checkpoints = 0;
+	sqlite3_int64 replayed_segments = 0;
+
+	~LogStore() {
+		{
+			lock_guard<mutex> lock(mtx);
+			stopping = true;
+		}
+		cv.notify_all();
+		if (compactor.joinable()) {
+			compactor.join();
+		}
+	}
+
+	// Files the compaction thread may use for I/O, as long as it holds `mtx`.
+	void attach(sqlite3_file *file) {
+		lock_guard<mutex> lock(mtx);
+		files.insert(file);
+	}
+
+	void detach(sqlite3_file *file) {
+		lock_guard<mutex> lock(mtx);
+		files.erase(file);
+	}
+
+	void start_compaction() {
+		compactor = thread([this] {
+			compact();
+		});
+	}
+
+	// Load the superblock, checkpoint and newer summaries, or leave the store empty for empty files.
+	int load(sqlite3_file *file, sqlite3_int64 new_segment_size) {
+		segment_size = new_segment_size;
+		sqlite3_int64 physical_size;
+		int result = file->pMethods->xFileSize(file, &physical_size);
+		if (result != SQLITE_OK || physical_size == 0) {
+			return result;
+		}
+
+		unsigned char superblocks[2 * superblock_size];
+		result = file->pMethods->xRead(file, superblocks, sizeof(superblocks), 0);
+		if (result != SQLITE_OK) {
+			return result == SQLITE_IOERR_SHORT_READ ? SQLITE_NOTADB : result;
+		}
+		const unsigned char *superblock = nullptr;
+		for (int copy = 0; copy < 2; copy++) {
+			const unsigned char *candidate = superblocks + copy * superblock_size;
+			unsigned char checksum[8];
+			log_checksum(candidate + 16, superblock_size - 16, checksum);
+			if (memcmp(candidate, superblock_magic, 8) == 0 && memcmp(candidate + 8, checksum, 8) == 0
+				&& (!superblock || get_u64(candidate + 16) > get_u64(superblock + 16))) {
+				superblock = candidate;
+			}
+		}
+		if (!superblock) {
+			return SQLITE_NOTADB;
+		}
+		uint32_t stored_page_size = get_u32(superblock + 24), stored_segment_size = get_u32(superblock + 28);
+		if (stored_page_size < 512 || stored_page_size > 65536 || (stored_page_size & (stored_page_size - 1)) != 0
+			|| stored_segment_size < (1 << 20) || get_u32(superblock + 48) > (uint32_t) max_checkpoint_segments) {
+			return SQLITE_CORRUPT;
+		}
+		superblock_generation = get_u64(superblock + 16);
+		set_geometry((int) stored_page_size, stored_segment_size);
+		checkpoint_seq = get_u64(superblock + 32);
+		page_count = (sqlite3_int64) get_u64(superblock + 40);
+		next_seq = checkpoint_seq + 1;
+		segments.resize((physical_size - segments_start + segment_size - 1) / segment_size);
+		index.assign(page_count, 0);
+
+		// The checkpoint holds the slot + 1 of every page, 0 for pages never written
+		uint32_t checkpoint_count = get_u32(superblock + 48);
+		vector<unsigned char> data;
+		sqlite3_int64 entries_per_segment = (segment_size - 2 * summary_bytes) / 4;
+		for (uint32_t i = 0; i < checkpoint_count; i++) {
+			uint32_t number = get_u32(superblock + 64 + i * 4);
+			if (number >= segments.size()) {
+				return SQLITE_CORRUPT;
+			}
+			data.resize(summary_bytes);
+			result = file->pMethods->xRead(file, data.data(), summary_bytes, segment_offset(number));
+			unsigned char checksum[8];
+			log_checksum(data.data() + 16, summary_bytes - 16, checksum);
+			if (result != SQLITE_OK || memcmp(data.data(), summary_magic, 8) != 0 || memcmp(data.data() + 8, checksum, 8) != 0
+				|| get_u32(data.data() + 16) != checkpoint_kind || get_u32(data.data() + 20) > entries_per_segment) {
+				return SQLITE_CORRUPT;
+			}
+			// Checkpoint segments are only as long as their entries
+			uint32_t used = get_u32(data.data() + 20);
+			sqlite3_int64 data_size = (used * 4 + 7) / 8 * 8;
+			data.resize(2 * summary_bytes + data_size);
+			const unsigned char *entries = data.data() + 2 * summary_bytes;
+			result = file->pMethods->xRead(file, data.data() + 2 * summary_bytes, (int) data_size, segment_offset(number) + 2 * summary_bytes);
+			log_checksum(entries, data_size, checksum);
+			if (result != SQLITE_OK || memcmp(data.data() + 48, checksum, 8) != 0) {
+				return SQLITE_CORRUPT;
+			}
+			for (uint32_t j = 0; j < used && i * entries_per_segment + j < page_count; j++) {
+				index[i * entries_per_segment + j] = get_u32(entries + j * 4);
+			}
+			segments[number].state = segment_checkpoint;
+			checkpoint_segments.push_back(number);
+			// Checkpoint segments took sequence numbers after `checkpoint_seq`, segments reused later must not repeat them
+			next_seq = max(next_seq, get_u64(data.data() + 24) + 1);
+		}
+
+		// Replay the summaries newer than the checkpoint, the latest write of a page wins
+		struct Replayed {
+			uint64_t seq;
+			uint32_t number;
+			sqlite3_int64 page_count;
+		};
+		vector<Replayed> replayed;
+		vector<unsigned char> summaries(2 * summary_bytes);
+		for (uint32_t number = 0; number < segments.size(); number++) {
+			if (file->pMethods->xRead(file, summaries.data(), (int) summaries.size(), segment_offset(number)) != SQLITE_OK) {
+				continue;
+			}
+			// The newest incarnation of the segment, then its latest sync. Reused segments keep counting
+			// syncs, so their first summary goes to the copy of an older one.
+			Segment& segment = segments[number];
+			const unsigned char *summary = nullptr;
+			for (int copy = 0; copy < 2; copy++) {
+				const unsigned char *candidate = summaries.data() + copy * summary_bytes;
+				unsigned char checksum[8];
+				log_checksum(candidate + 16, summary_bytes - 16, checksum);
+				if (memcmp(candidate, summary_magic, 8) != 0 || memcmp(candidate + 8, checksum, 8) != 0) {
+					continue;
+				}
+				segment.sync_count = max(segment.sync_count, get_u32(candidate + 40));
+				if (!summary || get_u64(candidate + 24) > get_u64(summary + 24)
+					|| (get_u64(candidate + 24) == get_u64(summary + 24) && get_u32(candidate + 40) > get_u32(summary + 40))) {
+					summary = candidate;
+				}
+			}
+			if (!summary || segment.state == segment_checkpoint) {
+				continue;
+			}
+			uint64_t seq = get_u64(summary + 24);
+			next_seq = max(next_seq, seq + 1);
+			if (get_u32(summary + 16) != pages_kind || seq <= checkpoint_seq) {
+				continue;
+			}
+			segment.seq = seq;
+			segment.used = min<uint32_t>(get_u32(summary + 20), slots);
+			segment.pages.assign(slots, 0);
+			for (uint32_t slot = 0; slot < segment.used; slot++) {
+				segment.pages[slot] = get_u32(summary + summary_header_size + slot * 4);
+			}
+			replayed.push_back({ seq, number, (sqlite3_int64) get_u64(summary + 32) });
+		}
+		sort(replayed.begin(), replayed.end(), [](const Replayed& a, const Replayed& b) {
+			return a.seq < b.seq;
+		});
+		for (const Replayed& entry : replayed) {
+			const Segment& segment = segments[entry.number];
+			for (uint32_t slot = 0; slot < segment.used; slot++) {
+				uint32_t page = segment.pages[slot];
+				if (page) {
+					if (page > index.size()) {
+						index.resize(page);
+					}
+					index[page - 1] = slot_id(entry.number, slot);
+				}
+			}
+			page_count = entry.page_count;
+		}
+		index.resize(page_count);
+		filled_since_checkpoint = (int) replayed.size();
+		replayed_segments = (sqlite3_int64) replayed.size();
+
+		// Count live pages, older segments only have their slots rebuilt from the index
+		for (uint32_t page = 0; page < index.size(); page++) {
+			if (index[page]) {
+				if (segment_of(index[page]) >= segments.size()) {
+					return SQLITE_CORRUPT;
+				}
+				Segment& segment = segments[segment_of(index[page])];
+				if (segment.pages.empty()) {
+					segment.pages.assign(slots, 0);
+					segment.used = slots;
+				}
+				segment.pages[slot_of(index[page])] = page + 1;
+				segment.live++;
+				live_pages++;
+			}
+		}
+		for (Segment& segment : segments) {
+			if (segment.state != segment_checkpoint) {
+				segment.state = segment.live ? segment_sealed : segment_free;
+			}
+			if (segment.state == segment_free) {
+				segment.pages.clear();
+			}
+		}
+		return SQLITE_OK;
+	}
+
+	// Read `length` bytes of pages at `offset` of the logical file.
+	int read(sqlite3_file *file, unsigned char *out, int length, sqlite3_int64 offset) {
+		sqlite3_int64 position = offset;
+		vector<unsigned char> partial;
+		while (position < offset + length) {
+			sqlite3_int64 page = position / page_size;
+			int in_page = (int) (position % page_size);
+			// Extend the run while the following pages are in the following slots
+			int run = 1;
+			uint32_t id;
+			{
+				lock_guard<mutex> lock(mtx);
+				if (page >= page_count) {
+					memset(out + (position - offset), 0, offset + length - position);
+					return SQLITE_IOERR_SHORT_READ;
+				}
+				id = index[page];
+				while (id && in_page == 0 && position + (sqlite3_int64) (run + 1) * page_size <= offset + length
+					&& page + run < page_count && index[page + run] == id + run && segment_of(id + run) == segment_of(id)) {
+					run++;
+				}
+			}
+			int chunk = (int) min<sqlite3_int64>((sqlite3_int64) run * page_size - in_page, offset + length - position);
+			unsigned char *destination = out + (position - offset);
+			if (!id) {
+				// Never written, like a hole in a sparse file
+				memset(destination, 0, chunk);
+			}
+			else {
+				int result = file->pMethods->xRead(file, destination, chunk, slot_offset(id) + in_page);
+				if (result != SQLITE_OK) {
+					return result == SQLITE_IOERR_SHORT_READ ? SQLITE_CORRUPT : result;
+				}
+			}
+			position += chunk;
+		}
+		return SQLITE_OK;
+	}
+
+	// Append whole pages written at `offset` of the logical file.
+	int write(sqlite3_file *file, const unsigned char *data, int length, sqlite3_int64 offset) {
+		for (int done = 0; done < length; done += page_size) {
+			uint32_t page = (uint32_t) ((offset + done) / page_size);
+			uint32_t id;
+			{
+				lock_guard<mutex> lock(mtx);
+				id = allocate_slot(page);
+				// The slot counts as live until it is mapped, so its segment isn't released meanwhile
+				segments[segment_of(id)].live++;
+				writes_in_flight.insert(page);
+				appended_pages++;
+			}
+			int result = file->pMethods->xWrite(file, data + done, page_size, slot_offset(id));
+			lock_guard<mutex> lock(mtx);
+			segments[segment_of(id)].live--;
+			writes_in_flight.erase(page);
+			if (result != SQLITE_OK) {
+				segments[segment_of(id)].pages[slot_of(id)] = 0;
+				return result;
+			}
+			map_page(page, id);
+		}
+		cv.notify_one();
+		return SQLITE_OK;
+	}
+
+	// Set up the geometry from the first write, and write the first superblock.
+	int create(sqlite3_file *file, int new_page_size) {
+		set_geometry(new_page_size, (uint32_t) segment_size);
+		return write_superblock(file);
+	}
+
+	void truncate(sqlite3_int64 size) {
+		sqlite3_int64 pages = (size + page_size - 1) / page_size;
+		for (sqlite3_int64 page = pages; page < (sqlite3_int64) index.size(); page++) {
+			unmap_page(page);
+		}
+		page_count = min(page_count, pages);
+		index.resize(page_count);
+		// Replayed summaries could bring back truncated pages, a checkpoint makes them older than it
+		checkpoint_needed = true;
+	}
+
+	// Make the index durable up to now, with summaries or a checkpoint, and sync with `sync_flags`.
+	int sync(sqlite3_file *file, int sync_flags) {
+		unique_lock<mutex> lock(mtx);
+		if (unsynced_copies) {
+			// Summaries must not point to copies that aren't durable, no journal has them
+			unsynced_copies = false;
+			lock.unlock();
+			int result = file->pMethods->xSync(file, sync_flags);
+			lock.lock();
+			if (result != SQLITE_OK) {
+				unsynced_copies = true;
+				return result;
+			}
+		}
+		int result = write_summaries(file);
+		vector<uint32_t> new_checkpoint;
+		uint64_t new_checkpoint_seq = 0;
+		sqlite3_int64 checkpoint_pages = page_count;
+		if (result == SQLITE_OK && page_size && (checkpoint_needed || filled_since_checkpoint >= checkpoint_interval)) {
+			result = write_checkpoint(file, new_checkpoint, new_checkpoint_seq);
+		}
+		// Segments without live pages need no compaction, the summaries written above replace them
+		for (uint32_t number = 0; number < segments.size(); number++) {
+			if (segments[number].state == segment_sealed && segments[number].live == 0) {
+				segments[number].state = segment_released;
+				released.push_back(number);
+			}
+		}
+		vector<uint32_t> synced_releases;
+		synced_releases.swap(released);
+		lock.unlock();
+
+		if (result == SQLITE_OK) {
+			result = file->pMethods->xSync(file, sync_flags);
+		}
+		bool adopted = false;
+		if (result == SQLITE_OK && new_checkpoint_seq) {
+			lock.lock();
+			result = write_superblock(file, &new_checkpoint, new_checkpoint_seq, checkpoint_pages);
+			if (result == SQLITE_OK) {
+				// The superblock may be durable from now on, the old checkpoint is freed once it surely is
+				for (uint32_t number : checkpoint_segments) {
+					segments[number].state = segment_released;
+					released.push_back(number);
+				}
+				checkpoint_segments = new_checkpoint;
+				checkpoint_seq = new_checkpoint_seq;
+				checkpoints++;
+				adopted = true;
+			}
+			lock.unlock();
+			if (result == SQLITE_OK) {
+				result = file->pMethods->xSync(file, sync_flags);
+			}
+		}
+
+		lock.lock();
+		if (result != SQLITE_OK) {
+			released.insert(released.end(), synced_releases.begin(), synced_releases.end());
+			if (new_checkpoint_seq && !adopted) {
+				for (uint32_t number : new_checkpoint) {
+					free_segment(number);
+				}
+				checkpoint_needed = true;
+			}
+			return result;
+		}
+		for (uint32_t number : synced_releases) {
+			free_segment(number);
+		}
+		// Give back free segments at the end of the file
+		size_t end = segments.size();
+		while (end > 0 && segments[end - 1].state == segment_free) {
+			end--;
+		}
+		if (end < segments.size()) {
+			sqlite3_int64 physical_size;
+			if (file->pMethods->xFileSize(file, &physical_size) == SQLITE_OK && physical_size > segment_offset((uint32_t) end)) {
+				file->pMethods->xTruncate(file, segment_offset((uint32_t) end));
+			}
+			segments.resize(end);
+		}
+		cv.notify_one();
+		return SQLITE_OK;
+	}
+
+	// Write the summaries of segments written since the last sync, without syncing.
+	int flush(sqlite3_file *file) {
+		lock_guard<mutex> lock(mtx);
+		return write_summaries(file);
+	}
+
+	// Whether writes, copies or a truncation since the last sync would be lost on reopen.
+	bool needs_sync() {
+		lock_guard<mutex> lock(mtx);
+		for (const Segment& segment : segments) {
+			if (segment.dirty) {
+				return true;
+			}
+		}
+		return unsynced_copies || checkpoint_needed;
+	}
+
+	// Must be called with `mtx` locked.
+	char *stats() {
+		int counts[5] = {};
+		for (const Segment& segment : segments) {
+			counts[segment.state]++;
+		}
+		sqlite3_int64 data_segments = counts[segment_head] + counts[segment_sealed] + counts[segment_released];
+		return sqlite3_mprintf("logical_size=%lld physical_size=%lld live_pages=%lld segments=%d free=%d checkpoint=%d released=%d "
+			"space_amp=%.2f appended_pages=%lld compacted_pages=%lld compacted_segments=%lld checkpoints=%lld replayed_segments=%lld",
+			page_count * page_size, segment_offset((uint32_t) segments.size()), live_pages, (int) segments.size(),
+			counts[segment_free], counts[segment_checkpoint], counts[segment_released],
+			live_pages ? (double) data_segments * slots / live_pages : 0.0,
+			appended_pages, compacted_pages, compacted_segments, checkpoints, replayed_segments);
+	}
+
+private:
+	sqlite3_int64 segment_size = 0;
+	// Bytes of each of the two summary copies, and page slots per segment
+	int summary_bytes = 0;
+	uint32_t slots = 0;
+	// Slot + 1 of every page, 0 for pages never written
+	vector<uint32_t> index;
+	sqlite3_int64 live_pages = 0;
+	vector<Segment> segments;
+	int head = -1;
+	uint64_t next_seq = 1;
+	uint64_t superblock_generation = 0;
+	// Segments with a greater sequence number are replayed on open
+	uint64_t checkpoint_seq = 0;
+	vector<uint32_t> checkpoint_segments;
+	int filled_since_checkpoint = 0;
+	bool checkpoint_needed = false;
+	// Compacted segments that the durable index may still point to
+	vector<uint32_t> released;
+	bool unsynced_copies = false;
+	// Pages whose new slot is being written, which the compaction must not copy over
+	set<uint32_t> writes_in_flight;
+
+	set<sqlite3_file *> files;
+	thread compactor;
+	condition_variable cv;
+	bool stopping = false;
+
+	void set_geometry(int new_page_size, uint32_t new_segment_size) {
+		page_size = new_page_size;
+		segment_size = new_segment_size;
+		sqlite3_int64 max_slots = segment_size / page_size;
+		summary_bytes = (int) ((summary_header_size + 4 * max_slots + 4095) / 4096 * 4096);
+		slots = (uint32_t) ((segment_size - 2 * summary_bytes) / page_size);
+	}
+
+	sqlite3_int64 segment_offset(uint32_t number) const {
+		return segments_start + number * segment_size;
+	}
+
+	uint32_t slot_id(uint32_t number, uint32_t slot) const {
+		return number * slots + slot + 1;
+	}
+
+	uint32_t segment_of(uint32_t id) const {
+		return (id - 1) / slots;
+	}
+
+	uint32_t slot_of(uint32_t id) const {
+		return (id - 1) % slots;
+	}
+
+	sqlite3_int64 slot_offset(uint32_t id) const {
+		return segment_offset(segment_of(id)) + 2 * summary_bytes + (sqlite3_int64) slot_of(id) * page_size;
+	}
+
+	// The lowest free segment, or a new one at the end of the file. Must be called with `mtx` locked.
+	uint32_t take_segment(SegmentState state) {
+		uint32_t number = 0;
+		while (number < segments.size() && segments[number].state != segment_free) {
+			number++;
+		}
+		if (number == segments.size()) {
+			segments.emplace_back();
+		}
+		Segment& segment = segments[number];
+		segment.state = state;
+		segment.seq = next_seq++;
+		segment.used = 0;
+		segment.live = 0;
+		segment.dirty = true;
+		return number;
+	}
+
+	// Must be called with `mtx` locked.
+	void free_segment(uint32_t number) {
+		Segment& segment = segments[number];
+		segment.state = segment_free;
+		segment.pages.clear();
+		segment.pages.shrink_to_fit();
+		segment.dirty = false;
+	}
+
+	// The next slot of the head segment, recorded as holding `page`. Must be called with `mtx` locked.
+	uint32_t allocate_slot(uint32_t page) {
+		if (head < 0 || segments[head].used == slots) {
+			if (head >= 0) {
+				segments[head].state = segment_sealed;
+				filled_since_checkpoint++;
+			}
+			head = (int) take_segment(segment_head);
+			segments[head].pages.assign(slots, 0);
+		}
+		Segment& segment = segments[head];
+		uint32_t slot = segment.used++;
+		segment.pages[slot] = page + 1;
+		segment.dirty = true;
+		return slot_id((uint32_t) head, slot);
+	}
+
+	// Must be called with `mtx` locked.
+	void map_page(uint32_t page, uint32_t id) {
+		if (page >= index.size()) {
+			index.resize(page + 1);
+		}
+		unmap_page(page);
+		index[page] = id;
+		segments[segment_of(id)].live++;
+		live_pages++;
+		page_count = max<sqlite3_int64>(page_count, page + 1);
+	}
+
+	// Must be called with `mtx` locked.
+	void unmap_page(sqlite3_int64 page) {
+		if (index[page]) {
+			// Summaries written from now on don't name the old copy
+			Segment& segment = segments[segment_of(index[page])];
+			segment.pages[slot_of(index[page])] = 0;
+			segment.live--;
+			live_pages--;
+			index[page] = 0;
+		}
+	}
+
+	// Must be called with `mtx` locked.
+	int write_summaries(sqlite3_file *file) {
+		vector<unsigned char> summary;
+		for (uint32_t number = 0; number < segments.size(); number++) {
+			Segment& segment = segments[number];
+			if (!segment.dirty || (segment.state != segment_head && segment.state != segment_sealed)) {
+				continue;
+			}
+			summary.assign(summary_bytes, 0);
+			put_u32(summary.data() + 16, pages_kind);
+			put_u32(summary.data() + 20, segment.used);
+			put_u64(summary.data() + 24, segment.seq);
+			put_u64(summary.data() + 32, (uint64_t) page_count);
+			put_u32(summary.data() + 40, segment.sync_count + 1);
+			for (uint32_t slot = 0; slot < segment.used; slot++) {
+				put_u32(summary.data() + summary_header_size + slot * 4, segment.pages[slot]);
+			}
+			memcpy(summary.data(), summary_magic, 8);
+			log_checksum(summary.data() + 16, summary_bytes - 16, summary.data() + 8);
+			// Alternate copies, so a torn write leaves the previous summary
+			int copy = (segment.sync_count + 1) % 2;
+			int result = file->pMethods->xWrite(file, summary.data(), summary_bytes, segment_offset(number) + copy * summary_bytes);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			segment.sync_count++;
+			segment.dirty = false;
+		}
+		return SQLITE_OK;
+	}
+
+	// Write the index to new checkpoint segments. Must be called with `mtx` locked.
+	int write_checkpoint(sqlite3_file *file, vector<uint32_t>& numbers, uint64_t& seq) {
+		sqlite3_int64 entries_per_segment = (segment_size - 2 * summary_bytes) / 4;
+		sqlite3_int64 count = max<sqlite3_int64>(1, (page_count + entries_per_segment - 1) / entries_per_segment);
+		if (count > max_checkpoint_segments) {
+			return SQLITE_FULL;
+		}
+		// Later writes go to a newer segment, replayed after the checkpoint
+		if (head >= 0) {
+			segments[head].state = segment_sealed;
+			head = -1;
+		}
+		seq = next_seq - 1;
+		vector<unsigned char> data;
+		for (sqlite3_int64 i = 0; i < count; i++) {
+			uint32_t number = take_segment(segment_checkpoint);
+			segments[number].dirty = false;
+			numbers.push_back(number);
+			sqlite3_int64 first = i * entries_per_segment;
+			uint32_t used = (uint32_t) max<sqlite3_int64>(0, min(entries_per_segment, page_count - first));
+			sqlite3_int64 data_size = (used * 4 + 7) / 8 * 8;
+			data.assign(2 * summary_bytes + data_size, 0);
+			unsigned char *entries = data.data() + 2 * summary_bytes;
+			for (uint32_t j = 0; j < used; j++) {
+				put_u32(entries + j * 4, index[first + j]);
+			}
+			put_u32(data.data() + 16, checkpoint_kind);
+			put_u32(data.data() + 20, used);
+			put_u64(data.data() + 24, segments[number].seq);
+			put_u64(data.data() + 32, (uint64_t) page_count);
+			log_checksum(entries, data_size, data.data() + 48);
+			memcpy(data.data(), summary_magic, 8);
+			log_checksum(data.data() + 16, summary_bytes - 16, data.data() + 8);
+			int result = file->pMethods->xWrite(file, data.data(), (int) data.size(), segment_offset(number));
+			if (result != SQLITE_OK) {
+				for (uint32_t taken : numbers) {
+					free_segment(taken);
+				}
+				numbers.clear();
+				return result;
+			}
+		}
+		filled_since_checkpoint = 0;
+		checkpoint_needed = false;
+		return SQLITE_OK;
+	}
+
+	// Write the next superblock copy, pointing to `checkpoint` if given. Must be called with `mtx` locked.
+	int write_superblock(sqlite3_file *file, const vector<uint32_t> *checkpoint = nullptr, uint64_t seq = 0, sqlite3_int64 pages = 0) {
+		unsigned char superblock[superblock_size] = {};
+		memcpy(superblock, superblock_magic, 8);
+		put_u64(superblock + 16, superblock_generation + 1);
+		put_u32(superblock + 24, (uint32_t) page_size);
+		put_u32(superblock + 28, (uint32_t) segment_size);
+		put_u64(superblock + 32, checkpoint ? seq : checkpoint_seq);
+		put_u64(superblock + 40, (uint64_t) (checkpoint ? pages : 0));
+		const vector<uint32_t>& numbers = checkpoint ? *checkpoint : checkpoint_segments;
+		put_u32(superblock + 48, (uint32_t) numbers.size());
+		for (size_t i = 0; i < numbers.size(); i++) {
+			put_u32(superblock + 64 + i * 4, numbers[i]);
+		}
+		log_checksum(superblock + 16, superblock_size - 16, superblock + 8);
+		int copy = (int) ((superblock_generation + 1) % 2);
+		int result = file->pMethods->xWrite(file, superblock, superblock_size, copy * superblock_size);
+		if (result == SQLITE_OK) {
+			superblock_generation++;
+		}
+		return result;
+	}
+
+	// Must be called with `mtx` locked.
+	bool over_budget() const {
+		sqlite3_int64 data_segments = 0;
+		for (const Segment& segment : segments) {
+			if (segment.state == segment_head || segment.state == segment_sealed) {
+				data_segments++;
+			}
+		}
+		sqlite3_int64 needed = (live_pages + slots - 1) / slots;
+		return data_segments > 2 && data_segments > needed * space_amp + 1;
+	}
+
+	// The sealed segment with the fewest live pages, or -1. Must be called with `mtx` locked.
+	int pick_victim() const {
+		int victim = -1;
+		for (uint32_t number = 0; number < segments.size(); number++) {
+			const Segment& segment = segments[number];
+			if (segment.state == segment_sealed && segment.live < slots && (victim < 0 || segment.live < segments[victim].live)) {
+				victim = (int) number;
+			}
+		}
+		return victim;
+	}
+
+	// Compaction thread: copy the live pages of mostly dead segments to the head while over budget.
+	void compact() {
+		unique_lock<mutex> lock(mtx);
+		vector<unsigned char> page(0);
+		while (!stopping) {
+			int victim = page_size && !files.empty() && over_budget() ? pick_victim() : -1;
+			if (victim < 0) {
+				cv.wait_for(lock, chrono::seconds(1));
+				continue;
+			}
+			page.resize(page_size);
+			// I/O goes through an open file, which can't be closed while `mtx` is held
+			sqlite3_file *file = *files.begin();
+			uint32_t slot = 0;
+			int result = SQLITE_OK;
+			while (result == SQLITE_OK && slot < segments[victim].used) {
+				for (int copied = 0; copied < compaction_batch && slot < segments[victim].used; slot++) {
+					uint32_t id = slot_id((uint32_t) victim, slot);
+					uint32_t number = segments[victim].pages[slot];
+					if (!number || number > index.size() || index[number - 1] != id || writes_in_flight.count(number - 1)) {
+						continue;
+					}
+					result = file->pMethods->xRead(file, page.data(), page_size, slot_offset(id));
+					uint32_t copy = 0;
+					if (result == SQLITE_OK) {
+						copy = allocate_slot(number - 1);
+						result = file->pMethods->xWrite(file, page.data(), page_size, slot_offset(copy));
+					}
+					if (result != SQLITE_OK) {
+						break;
+					}
+					map_page(number - 1, copy);
+					unsynced_copies = true;
+					compacted_pages++;
+					copied++;
+				}
+				// Let connections in between batches
+				lock.unlock();
+				this_thread::yield();
+				lock.lock();
+				if (stopping || files.empty() || segments[victim].state != segment_sealed) {
+					break;
+				}
+				file = *files.begin();
+			}
+			if (result == SQLITE_OK && segments[victim].state == segment_sealed && segments[victim].live == 0) {
+				segments[victim].state = segment_released;
+				released.push_back((uint32_t) victim);
+				compacted_segments++;
+			}
+			else if (result != SQLITE_OK) {
+				// Try again later, the pages copied so far are fine
+				cv.wait_for(lock, chrono::seconds(1));
+			}
+		}
+	}
+};
+
+struct LogStoreFileShim : public SQLiteFileImpl {
+	shared_ptr<LogStore> store;
+	// Reused for partial page writes
+	vector<unsigned char> page_buffer;
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!store) {
+			return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		}
+		{
+			lock_guard<mutex> lock(store->mtx);
+			if (store->page_size == 0) {
+				memset(p, 0, iAmt);
+				return SQLITE_IOERR_SHORT_READ;
+			}
+		}
+		return store->read(original_file, (unsigned char *) p, iAmt, iOfst);
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!store) {
+			return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		}
+		int page_size;
+		{
+			lock_guard<mutex> lock(store->mtx);
+			if (store->page_size == 0) {
+				bool page_sized = iOfst == 0 && iAmt >= 512 && iAmt <= 65536 && (iAmt & (iAmt - 1)) == 0;
+				int result = store->create(original_file, page_sized ? iAmt : 4096);
+				if (result != SQLITE_OK) {
+					store->page_size = 0;
+					return result;
+				}
+			}
+			page_size = store->page_size;
+		}
+		if (iOfst % page_size == 0 && iAmt % page_size == 0) {
+			return store->write(original_file, (const unsigned char *) p, iAmt, iOfst);
+		}
+		sqlite3_int64 start = iOfst / page_size * page_size;
+		sqlite3_int64 end = (iOfst + iAmt + page_size - 1) / page_size * page_size;
+		page_buffer.resize(end - start);
+		int result = store->read(original_file, page_buffer.data(), (int) (end - start), start);
+		if (result != SQLITE_OK && result != SQLITE_IOERR_SHORT_READ) {
+			return result;
+		}
+		memcpy(page_buffer.data() + (iOfst - start), p, iAmt);
+		return store->write(original_file, page_buffer.data(), (int) (end - start), start);
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (!store) {
+			return SQLiteFileImpl::xTruncate(size);
+		}
+		lock_guard<mutex> lock(store->mtx);
+		if (store->page_size) {
+			store->truncate(size);
+		}
+		return SQLITE_OK;
+	}
+
+	int xSync(int flags) override {
+		if (!store) {
+			return SQLiteFileImpl::xSync(flags);
+		}
+		return store->sync(original_file, flags);
+	}
+
+	int xFileSize(sqlite3_int64 *pSize) override {
+		if (!store) {
+			return SQLiteFileImpl::xFileSize(pSize);
+		}
+		lock_guard<mutex> lock(store->mtx);
+		*pSize = store->page_count * store->page_size;
+		return SQLITE_OK;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (store) {
+			switch (op) {
+				case SQLITE_FCNTL_PRAGMA: {
+					char **argv = (char **) pArg;
+					if (sqlite3_stricmp(argv[1], "logstore_stats") == 0) {
+						lock_guard<mutex> lock(store->mtx);
+						argv[0] = store->stats();
+						return SQLITE_OK;
+					}
+					break;
+				}
+				// Sent in place of `xSync` with `PRAGMA synchronous=OFF`, summaries must still reach the file
+				case SQLITE_FCNTL_SYNC:
+				case SQLITE_FCNTL_CKPT_DONE:
+					store->flush(original_file);
+					break;
+				// The physical file doesn't grow along with the logical size
+				case SQLITE_FCNTL_SIZE_HINT:
+				case SQLITE_FCNTL_CHUNK_SIZE:
+					return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	// Pages aren't where SQLite expects them in the file
+	int xFetch(sqlite3_int64 iOfst, int iAmt, void **pp) override {
+		if (!store) {
+			return SQLiteFileImpl::xFetch(iOfst, iAmt, pp);
+		}
+		*pp = nullptr;
+		return SQLITE_OK;
+	}
+
+	int xUnfetch(sqlite3_int64 iOfst, void *p) override {
+		if (!store) {
+			return SQLiteFileImpl::xUnfetch(iOfst, p);
+		}
+		return SQLITE_OK;
+	}
+
+	int xClose() override {
+		if (store) {
+			// SQLite truncates after its last sync, and summaries left by `PRAGMA synchronous=OFF`
+			// or a rollback must be synced before they can be trusted
+			if (store->needs_sync()) {
+				store->sync(original_file, SQLITE_SYNC_NORMAL);
+			}
+			store->detach(original_file);
+			store.reset();
+		}
+		return SQLiteFileImpl::xClose();
+	}
+};
+
+struct LogStoreVfsShim : public SQLiteVfsImpl<LogStoreFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<LogStoreFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		struct stat st;
+		if (result != SQLITE_OK || zName == nullptr || !(flags & SQLITE_OPEN_MAIN_DB) || stat(zName, &st) != 0) {
+			return result;
+		}
+		LogStoreFileShim& shim = file->implementation;
+
+		lock_guard<mutex> lock(mtx);
+		weak_ptr<LogStore>& entry = stores[make_pair(st.st_dev, st.st_ino)];
+		shim.store = entry.lock();
+		if (!shim.store) {
+			shim.store = make_shared<LogStore>();
+			// At least 8 slots of the largest pages, in whole 64 KiB units
+			sqlite3_int64 segment_size = sqlite3_uri_int64(zName, "log_segment_size", 4 << 20);
+			segment_size = max<sqlite3_int64>(1 << 20, min<sqlite3_int64>(segment_size, 256 << 20)) / 65536 * 65536;
+			result = shim.store->load(file->original_file, segment_size);
+			if (result != SQLITE_OK) {
+				shim.store.reset();
+				file->original_file->pMethods->xClose(file->original_file);
+				return result;
+			}
+			const char *space_amp = sqlite3_uri_parameter(zName, "log_space_amp");
+			if (space_amp) {
+				shim.store->space_amp = max(1.1, atof(space_amp));
+			}
+			if (sqlite3_uri_boolean(zName, "log_compaction", 1)) {
+				shim.store->start_compaction();
+			}
+			entry = shim.store;
+		}
+		shim.store->attach(file->original_file);
+		return result;
+	}
+
+private:
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<LogStore>> stores;
+};
+
+extern "C" int sqlite3_logstorevfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<LogStoreVfsShim> logstorevfs("logstorevfs");
+	int rc = logstorevfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
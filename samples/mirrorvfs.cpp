@@ -0,0 +1,559 @@
+// Mirror VFS shim: keeps a second copy of a database on another volume and reads from the faster one.
+//
+// Every write, truncate and delete of the database, its rollback journal and
+// its WAL file is applied to both copies, and `xSync` flushes them in
+// parallel. Locks and the WAL index are those of the primary copy. Journal
+// and WAL reads, including recovery, go to the primary, and its rollbacks are
+// written to both copies, so they agree again after a crash.
+//
+// Database reads are balanced between the copies by the latency of the device
+// reads observed on their volumes, weighted by the reads in flight, with one
+// read in 32 sent to the other copy to keep its figures current. On Linux a
+// read first tries the page cache with `RWF_NOWAIT`. A read that has to reach
+// the device is handed to a thread pool. If it doesn't complete within the
+// given percentile of recent device read latencies of its volume, the same
+// read is sent to the other copy, and the first answer wins. A stalled volume
+// then costs about that percentile instead of the whole stall.
+//
+// URI parameters:
+//   mirror=<path>             path of the copy; its journal and WAL file are
+//                             named like the primary ones
+//   mirror_hedge=<percentile> latency percentile after which reads are sent to
+//                             the other copy (default 95, 0 disables it)
+//
+// `PRAGMA mirror_stats` reports the reads, latencies and hedged reads of each copy.
+//
+// @note The copy of an existing database must be made beforehand, for example with
+//       `VACUUM INTO`. A primary with data and an empty copy fails with SQLITE_CANTOPEN.
+// @note An error on either copy fails the operation, there is no degraded mode.
+// @note Super-journals of multi-database transactions are not mirrored.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Recent device reads kept per volume to compute latency percentiles
+static const int latency_samples = 256;
+// Percentiles are only trusted once this many reads were seen
+static const int min_latency_samples = 32;
+static const int probe_interval = 32;
+static const int deadline_refresh_interval = 64;
+
+static sqlite3_int64 now_ns() {
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Latency of the device reads on one volume, shared by every copy stored there.
+struct ReplicaStats {
+	atomic<sqlite3_int64> average_ns { 0 };
+	atomic<int> in_flight { 0 };
+	atomic<sqlite3_int64> device_reads { 0 };
+
+	void record(sqlite3_int64 ns) {
+		// Exponential moving average, racing updates only lose a sample
+		sqlite3_int64 average = average_ns;
+		average_ns = average == 0 ? ns : average + (ns - average) / 8;
+		device_reads++;
+		lock_guard<mutex> lock(mtx);
+		samples[next_sample++ % latency_samples] = ns;
+	}
+
+	// The `percentile` of the recent latencies, or 0 if too few reads were seen.
+	sqlite3_int64 latency_percentile(int percentile) {
+		vector<sqlite3_int64> recent;
+		{
+			lock_guard<mutex> lock(mtx);
+			if (next_sample < min_latency_samples) {
+				return 0;
+			}
+			recent.assign(samples, samples + min<sqlite3_int64>(next_sample, latency_samples));
+		}
+		auto nth = recent.begin() + (recent.size() - 1) * percentile / 100;
+		nth_element(recent.begin(), nth, recent.end());
+		return *nth;
+	}
+
+private:
+	mutex mtx;
+	sqlite3_int64 samples[latency_samples];
+	sqlite3_int64 next_sample = 0;
+};
+
+// Process-wide pool running device reads and mirror syncs, growing while every thread is busy.
+class MirrorIoPool {
+public:
+	size_t max_threads = 64;
+
+	~MirrorIoPool() {
+		{
+			lock_guard<mutex> lock(mtx);
+			stop = true;
+		}
+		work_cv.notify_all();
+		for (thread& t : threads) {
+			t.join();
+		}
+	}
+
+	void submit(function<void()> job) {
+		lock_guard<mutex> lock(mtx);
+		jobs.push_back(move(job));
+		// Threads stuck on a stalled volume must not hold back reads of the other one
+		if (jobs.size() > idle && threads.size() < max_threads) {
+			threads.emplace_back(&MirrorIoPool::worker_loop, this);
+		}
+		else {
+			work_cv.notify_one();
+		}
+	}
+
+private:
+	mutex mtx;
+	condition_variable work_cv;
+	deque<function<void()>> jobs;
+	vector<thread> threads;
+	size_t idle = 0;
+	bool stop = false;
+
+	void worker_loop() {
+		unique_lock<mutex> lock(mtx);
+		while (true) {
+			idle++;
+			work_cv.wait(lock, [&] { return stop || !jobs.empty(); });
+			idle--;
+			if (jobs.empty()) {
+				break;
+			}
+			function<void()> job = move(jobs.front());
+			jobs.pop_front();
+			lock.unlock();
+			job();
+			lock.lock();
+		}
+	}
+};
+
+// Read-only descriptor of one copy of the database, shared by its connections and never closed:
+// closing a descriptor of the primary would release the locks of all its connections.
+struct ReplicaReader {
+	int fd = -1;
+	shared_ptr<ReplicaStats> stats;
+
+	// Read from the device, zero filling past the end of the file, and record the latency.
+	int read(void *p, int iAmt, sqlite3_int64 iOfst) {
+		stats->in_flight++;
+		sqlite3_int64 start = now_ns();
+		int done = 0;
+		int error = 0;
+		while (done < iAmt) {
+			ssize_t got = pread(fd, (char *) p + done, iAmt - done, iOfst + done);
+			if (got < 0 && errno == EINTR) {
+				continue;
+			}
+			if (got < 0) {
+				error = errno;
+			}
+			if (got <= 0) {
+				break;
+			}
+			done += (int) got;
+		}
+		stats->record(now_ns() - start);
+		stats->in_flight--;
+		if (done < iAmt) {
+			memset((char *) p + done, 0, iAmt - done);
+			return error ? SQLITE_IOERR_READ : SQLITE_IOERR_SHORT_READ;
+		}
+		return SQLITE_OK;
+	}
+};
+
+// A device read handed to the pool, which its caller may stop waiting for.
+struct PendingRead {
+	mutex mtx;
+	condition_variable cv;
+	vector<char> buffer;
+	bool done = false;
+	bool abandoned = false;
+	int result = SQLITE_OK;
+};
+
+struct MirrorVfsShim;
+
+struct MirrorFileShim : public SQLiteFileImpl {
+	MirrorVfsShim *vfs = nullptr;
+	MirrorIoPool *pool = nullptr;
+	// NULL for files that aren't mirrored
+	sqlite3_file *mirror = nullptr;
+	// Registered database name, only set on main databases
+	string database_name;
+
+	// Database reads, from the primary (0) and the mirror (1)
+	shared_ptr<ReplicaReader> readers[2];
+	int hedge_percentile = 95;
+	sqlite3_int64 deadline_ns[2] = { 0, 0 };
+	bool try_nowait = true;
+
+	sqlite3_int64 reads = 0;
+	sqlite3_int64 cached_reads = 0;
+	sqlite3_int64 replica_reads[2] = { 0, 0 };
+	sqlite3_int64 hedged_reads = 0;
+	sqlite3_int64 hedges_won = 0;
+
+	int xClose() override;
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!readers[0] || !readers[1]) {
+			return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		}
+		reads++;
+		int chosen = choose();
+		replica_reads[chosen]++;
+#ifdef RWF_NOWAIT
+		if (try_nowait) {
+			struct iovec iov = { p, (size_t) iAmt };
+			ssize_t got = preadv2(readers[chosen]->fd, &iov, 1, iOfst, RWF_NOWAIT);
+			if (got == iAmt) {
+				cached_reads++;
+				return SQLITE_OK;
+			}
+			if (got < 0 && errno == EOPNOTSUPP) {
+				try_nowait = false;
+			}
+		}
+#endif
+		if (reads % deadline_refresh_interval == 1) {
+			for (int i = 0; i < 2; i++) {
+				deadline_ns[i] = hedge_percentile > 0 ? readers[i]->stats->latency_percentile(hedge_percentile) : 0;
+			}
+		}
+		if (deadline_ns[chosen] == 0) {
+			return readers[chosen]->read(p, iAmt, iOfst);
+		}
+		return hedged_read(chosen, p, iAmt, iOfst);
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		int result = SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		if (result == SQLITE_OK && mirror) {
+			result = mirror->pMethods->xWrite(mirror, p, iAmt, iOfst);
+		}
+		return result;
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		int result = SQLiteFileImpl::xTruncate(size);
+		if (result == SQLITE_OK && mirror) {
+			result = mirror->pMethods->xTruncate(mirror, size);
+		}
+		return result;
+	}
+
+	int xSync(int flags) override {
+		if (!mirror) {
+			return SQLiteFileImpl::xSync(flags);
+		}
+		shared_ptr<PendingRead> mirror_sync = make_shared<PendingRead>();
+		sqlite3_file *mirror_file = mirror;
+		pool->submit([mirror_sync, mirror_file, flags] {
+			int result = mirror_file->pMethods->xSync(mirror_file, flags);
+			lock_guard<mutex> lock(mirror_sync->mtx);
+			mirror_sync->result = result;
+			mirror_sync->done = true;
+			mirror_sync->cv.notify_all();
+		});
+		int result = SQLiteFileImpl::xSync(flags);
+		unique_lock<mutex> lock(mirror_sync->mtx);
+		mirror_sync->cv.wait(lock, [&] { return mirror_sync->done; });
+		return result == SQLITE_OK ? mirror_sync->result : result;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA && readers[0] && readers[1]) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "mirror_stats") == 0) {
+				argv[0] = sqlite3_mprintf("reads=%lld cached_reads=%lld primary_reads=%lld mirror_reads=%lld "
+					"primary_avg_us=%lld mirror_avg_us=%lld primary_deadline_us=%lld mirror_deadline_us=%lld "
+					"hedged_reads=%lld hedges_won=%lld",
+					reads, cached_reads, replica_reads[0], replica_reads[1],
+					readers[0]->stats->average_ns.load() / 1000, readers[1]->stats->average_ns.load() / 1000,
+					deadline_ns[0] / 1000, deadline_ns[1] / 1000, hedged_reads, hedges_won);
+				return SQLITE_OK;
+			}
+		}
+		else if (op == SQLITE_FCNTL_SIZE_HINT && mirror) {
+			mirror->pMethods->xFileControl(mirror, op, pArg);
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	~MirrorFileShim() {
+		if (mirror) {
+			if (mirror->pMethods) {
+				mirror->pMethods->xClose(mirror);
+			}
+			sqlite3_free(mirror);
+		}
+	}
+
+private:
+	// The copy with the lowest expected latency, or now and then the other one.
+	int choose() {
+		sqlite3_int64 scores[2];
+		for (int i = 0; i < 2; i++) {
+			scores[i] = readers[i]->stats->average_ns * (readers[i]->stats->in_flight + 1);
+		}
+		int best = scores[1] < scores[0] ? 1 : 0;
+		return reads % probe_interval == 0 ? 1 - best : best;
+	}
+
+	// Read from `chosen` on the pool, and from the other copy too if that takes longer than its deadline.
+	int hedged_read(int chosen, void *p, int iAmt, sqlite3_int64 iOfst) {
+		shared_ptr<PendingRead> pending = make_shared<PendingRead>();
+		pending->buffer.resize(iAmt);
+		shared_ptr<ReplicaReader> reader = readers[chosen];
+		pool->submit([pending, reader, iAmt, iOfst] {
+			{
+				lock_guard<mutex> lock(pending->mtx);
+				if (pending->abandoned) {
+					return;
+				}
+			}
+			int result = reader->read(pending->buffer.data(), iAmt, iOfst);
+			lock_guard<mutex> lock(pending->mtx);
+			pending->result = result;
+			pending->done = true;
+			pending->cv.notify_all();
+		});
+
+		unique_lock<mutex> lock(pending->mtx);
+		if (!pending->cv.wait_for(lock, chrono::nanoseconds(deadline_ns[chosen]), [&] { return pending->done; })) {
+			lock.unlock();
+			hedged_reads++;
+			int other = 1 - chosen;
+			replica_reads[other]++;
+			int result = readers[other]->read(p, iAmt, iOfst);
+			lock.lock();
+			if (result == SQLITE_OK || result == SQLITE_IOERR_SHORT_READ) {
+				// The first read may still be queued, it won't be needed anymore
+				pending->abandoned = true;
+				if (!pending->done) {
+					hedges_won++;
+				}
+				return result;
+			}
+			// The other copy failed, fall back to the first read
+			pending->cv.wait(lock, [&] { return pending->done; });
+		}
+		memcpy(p, pending->buffer.data(), iAmt);
+		return pending->result;
+	}
+};
+
+struct MirrorVfsShim : public SQLiteVfsImpl<MirrorFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<MirrorFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result != SQLITE_OK || zName == nullptr || !(flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_WAL))) {
+			return result;
+		}
+		MirrorFileShim& shim = file->implementation;
+		shim.vfs = this;
+		shim.pool = &pool;
+
+		string mirror_path;
+		if (flags & SQLITE_OPEN_MAIN_DB) {
+			const char *mirror_parameter = sqlite3_uri_parameter(zName, "mirror");
+			if (mirror_parameter == nullptr) {
+				return result;
+			}
+			vector<char> full_path(original_vfs->mxPathname + 1);
+			result = original_vfs->xFullPathname(original_vfs, mirror_parameter, original_vfs->mxPathname + 1, full_path.data());
+			if (result == SQLITE_OK && strcmp(full_path.data(), zName) == 0) {
+				sqlite3_log(SQLITE_CANTOPEN, "\"%s\" can't be its own mirror", zName);
+				result = SQLITE_CANTOPEN;
+			}
+			mirror_path = full_path.data();
+		}
+		else {
+			// Journals and WAL files are mirrored next to the mirror of their database
+			mirror_path = mirror_of(zName);
+			if (mirror_path.empty()) {
+				return result;
+			}
+		}
+
+		if (result == SQLITE_OK) {
+			shim.mirror = (sqlite3_file *) sqlite3_malloc(original_vfs->szOsFile);
+			if (shim.mirror == nullptr) {
+				result = SQLITE_NOMEM;
+			}
+			else {
+				memset(shim.mirror, 0, original_vfs->szOsFile);
+				result = original_vfs->xOpen(original_vfs, mirror_path.c_str(), shim.mirror, flags, nullptr);
+				if (result != SQLITE_OK) {
+					sqlite3_log(result, "cannot open mirror \"%s\"", mirror_path.c_str());
+				}
+			}
+		}
+		if (result == SQLITE_OK && (flags & SQLITE_OPEN_MAIN_DB)) {
+			result = open_readers(zName, mirror_path, file, shim);
+		}
+		if (result != SQLITE_OK) {
+			file->original_file->pMethods->xClose(file->original_file);
+			return result;
+		}
+		if (flags & SQLITE_OPEN_MAIN_DB) {
+			lock_guard<mutex> lock(mtx);
+			pair<string, int>& entry = mirrors[zName];
+			if (entry.second++ == 0) {
+				entry.first = mirror_path;
+			}
+			shim.database_name = zName;
+		}
+		return result;
+	}
+
+	// The mirror goes first: if the primary journal survives a crash, its rollback rewrites both copies.
+	int xDelete(const char *zName, int syncDir) override {
+		string mirror_path = mirror_of(zName);
+		if (!mirror_path.empty()) {
+			int result = SQLiteVfsImpl::xDelete(mirror_path.c_str(), syncDir);
+			if (result != SQLITE_OK && result != SQLITE_IOERR_DELETE_NOENT) {
+				return result;
+			}
+		}
+		return SQLiteVfsImpl::xDelete(zName, syncDir);
+	}
+
+	void release(const string& database_name) {
+		lock_guard<mutex> lock(mtx);
+		auto it = mirrors.find(database_name);
+		if (it != mirrors.end() && --it->second.second == 0) {
+			mirrors.erase(it);
+		}
+	}
+
+private:
+	mutex mtx;
+	// Mirror paths of the open databases, with their open counts
+	map<string, pair<string, int>> mirrors;
+	// Keyed by device, as copies on the same volume share its latency
+	map<dev_t, shared_ptr<ReplicaStats>> volumes;
+	// Kept for the life of the process, a deleted copy keeps its inode number until its
+	// descriptor is closed.
+	map<pair<dev_t, ino_t>, shared_ptr<ReplicaReader>> readers;
+	MirrorIoPool pool;
+
+	// Mirror path of the journal or WAL file `zName` of an open database, or an empty string.
+	string mirror_of(const char *zName) {
+		static const char *suffixes[] = { "-journal", "-wal" };
+		size_t length = strlen(zName);
+		lock_guard<mutex> lock(mtx);
+		for (const char *suffix : suffixes) {
+			size_t suffix_length = strlen(suffix);
+			if (length > suffix_length && strcmp(zName + length - suffix_length, suffix) == 0) {
+				auto it = mirrors.find(string(zName, length - suffix_length));
+				if (it != mirrors.end()) {
+					return it->second.first + suffix;
+				}
+			}
+		}
+		return string();
+	}
+
+	// Check the copies can be used together and open the descriptors database reads go through.
+	int open_readers(const char *zName, const string& mirror_path, SQLiteFile<MirrorFileShim> *file, MirrorFileShim& shim) {
+		sqlite3_int64 primary_size = 0;
+		sqlite3_int64 mirror_size = 0;
+		int result = file->original_file->pMethods->xFileSize(file->original_file, &primary_size);
+		if (result == SQLITE_OK) {
+			result = shim.mirror->pMethods->xFileSize(shim.mirror, &mirror_size);
+		}
+		if (result == SQLITE_OK && primary_size > 0 && mirror_size == 0) {
+			sqlite3_log(SQLITE_CANTOPEN, "mirror \"%s\" of \"%s\" is empty", mirror_path.c_str(), zName);
+			result = SQLITE_CANTOPEN;
+		}
+		if (result != SQLITE_OK) {
+			return result;
+		}
+
+		shim.hedge_percentile = (int) max<sqlite3_int64>(0, min<sqlite3_int64>(99, sqlite3_uri_int64(zName, "mirror_hedge", shim.hedge_percentile)));
+		const char *paths[2] = { zName, mirror_path.c_str() };
+		for (int i = 0; i < 2; i++) {
+			shim.readers[i] = reader(paths[i]);
+			if (!shim.readers[i]) {
+				// Reads then stay on the primary, through the base VFS
+				shim.readers[0].reset();
+				shim.readers[1].reset();
+				return SQLITE_OK;
+			}
+		}
+		return SQLITE_OK;
+	}
+
+	// The reader of the copy at `path`, opened the first time this process reads it, or NULL.
+	shared_ptr<ReplicaReader> reader(const char *path) {
+		struct stat st;
+		if (stat(path, &st) != 0) {
+			return nullptr;
+		}
+		lock_guard<mutex> lock(mtx);
+		shared_ptr<ReplicaReader>& entry = readers[make_pair(st.st_dev, st.st_ino)];
+		if (!entry) {
+			int fd = open(path, O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				readers.erase(make_pair(st.st_dev, st.st_ino));
+				return nullptr;
+			}
+			shared_ptr<ReplicaStats>& stats = volumes[st.st_dev];
+			if (!stats) {
+				stats = make_shared<ReplicaStats>();
+			}
+			entry = make_shared<ReplicaReader>();
+			entry->fd = fd;
+			entry->stats = stats;
+		}
+		return entry;
+	}
+};
+
+int MirrorFileShim::xClose() {
+	if (!database_name.empty()) {
+		vfs->release(database_name);
+	}
+	return SQLiteFileImpl::xClose();
+}
+
+extern "C" int sqlite3_mirrorvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<MirrorVfsShim> mirrorvfs("mirrorvfs");
+	int rc = mirrorvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
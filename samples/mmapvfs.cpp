@@ -0,0 +1,348 @@
+// Memory mapped VFS shim: serves `xFetch` and `xRead` from its own growable mapping.
+//
+// The mapping is created with optional `MAP_POPULATE` prefaulting and
+// transparent huge page hints, grows geometrically as the file grows, and
+// gets `madvise` hints per region depending on whether fetches look
+// sequential or random.
+// Growing or truncating the file replaces the mapping, but mappings that
+// still have pages fetched by SQLite are only unmapped after the last
+// `xUnfetch`, so outstanding pointers stay valid.
+//
+// Enable memory mapping with `PRAGMA mmap_size` as usual.
+//
+// URI parameters:
+//   mmap_populate=<0|1>   prefault mapped pages with `MAP_POPULATE` (default 0)
+//   mmap_hugepages=<0|1>  ask for transparent huge pages with `MADV_HUGEPAGE` (default 0)
+//
+// `PRAGMA mmap_stats` reports fetches, remaps and `madvise` calls.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Read-only descriptor of a database, shared by every connection to its inode.
+// Closing a descriptor drops all POSIX locks the process holds on the file, so
+// it stays open until the last connection to the database is closed.
+// Mappings don't need it to stay open.
+struct SharedDescriptor {
+	int fd = -1;
+
+	~SharedDescriptor() {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+};
+
+struct MmapFileShim : public SQLiteFileImpl {
+	struct Mapping {
+		char *base;
+		sqlite3_int64 size;
+		int refs;
+		// Per region advice, indexed by offset / region_size
+		vector<char> advice;
+	};
+
+	static const sqlite3_int64 min_mapping_size = 1 << 20;
+	static const sqlite3_int64 region_size = 2 << 20;
+	enum Advice { ADVICE_NONE, ADVICE_RANDOM, ADVICE_WILLNEED };
+
+	shared_ptr<SharedDescriptor> descriptor;
+	// Gives `descriptor` back to the VFS
+	function<void()> release_descriptor;
+	int fd = -1;
+	bool populate = false;
+	bool hugepages = false;
+	sqlite3_int64 mmap_limit = 0;
+	// Logical file size, mappings may extend past it
+	sqlite3_int64 file_size = 0;
+	// Mapping used for new fetches, may be NULL
+	Mapping *current = nullptr;
+	// Replaced mappings waiting for their last `xUnfetch`
+	vector<Mapping *> retired;
+	sqlite3_int64 last_fetch_end = -1;
+
+	sqlite3_int64 fetches = 0;
+	sqlite3_int64 remaps = 0;
+	sqlite3_int64 madvise_calls = 0;
+
+	int xFetch(sqlite3_int64 iOfst, int iAmt, void **pp) override {
+		*pp = nullptr;
+		if (fd < 0 || iOfst + iAmt > mmap_limit) {
+			return SQLITE_OK;
+		}
+		if (iOfst + iAmt > file_size) {
+			int result = xFileSize(&file_size);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			// Only hand out pages that exist in the file
+			if (iOfst + iAmt > file_size) {
+				return SQLITE_OK;
+			}
+		}
+		if ((current == nullptr || iOfst + iAmt > current->size) && !remap()) {
+			return SQLITE_OK;
+		}
+		advise(iOfst, iAmt);
+		current->refs++;
+		fetches++;
+		*pp = current->base + iOfst;
+		return SQLITE_OK;
+	}
+
+	int xUnfetch(sqlite3_int64, void *p) override {
+		if (p == nullptr) {
+			// SQLite asks for the whole file to be unmapped
+			retire();
+			return SQLITE_OK;
+		}
+		if (current && (char *) p >= current->base && (char *) p < current->base + current->size) {
+			current->refs--;
+			return SQLITE_OK;
+		}
+		for (size_t i = 0; i < retired.size(); i++) {
+			Mapping *mapping = retired[i];
+			if ((char *) p >= mapping->base && (char *) p < mapping->base + mapping->size) {
+				if (--mapping->refs == 0) {
+					destroy(mapping);
+					retired.erase(retired.begin() + i);
+				}
+				break;
+			}
+		}
+		return SQLITE_OK;
+	}
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (current && iOfst + iAmt <= current->size && iOfst + iAmt <= file_size) {
+			memcpy(p, current->base + iOfst, iAmt);
+			return SQLITE_OK;
+		}
+		return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		int result = SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		if (result == SQLITE_OK && iOfst + iAmt > file_size) {
+			file_size = iOfst + iAmt;
+		}
+		return result;
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (current && size < current->size) {
+			retire();
+		}
+		int result = SQLiteFileImpl::xTruncate(size);
+		xFileSize(&file_size);
+		return result;
+	}
+
+	// SQLite checks the file size at the start of every transaction, which keeps `file_size` fresh
+	int xFileSize(sqlite3_int64 *pSize) override {
+		int result = SQLiteFileImpl::xFileSize(pSize);
+		if (result == SQLITE_OK) {
+			file_size = *pSize;
+		}
+		return result;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		switch (op) {
+			case SQLITE_FCNTL_MMAP_SIZE: {
+				if (fd < 0) {
+					break;
+				}
+				sqlite3_int64 new_limit = *(sqlite3_int64 *) pArg;
+				*(sqlite3_int64 *) pArg = mmap_limit;
+				if (new_limit >= 0 && new_limit != mmap_limit) {
+					mmap_limit = new_limit;
+					retire();
+				}
+				return SQLITE_OK;
+			}
+
+			case SQLITE_FCNTL_PRAGMA: {
+				char **argv = (char **) pArg;
+				if (sqlite3_stricmp(argv[1], "mmap_stats") == 0) {
+					argv[0] = sqlite3_mprintf("fetches=%lld remaps=%lld madvise_calls=%lld mapped=%lld retired=%d",
+						fetches, remaps, madvise_calls, current ? current->size : 0, (int) retired.size());
+					return SQLITE_OK;
+				}
+				break;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	int xClose() override {
+		retire();
+		// SQLite unfetches everything before closing, but don't leak anything if it didn't
+		for (Mapping *mapping : retired) {
+			destroy(mapping);
+		}
+		retired.clear();
+		int result = SQLiteFileImpl::xClose();
+		if (release_descriptor) {
+			release_descriptor();
+		}
+		return result;
+	}
+
+	// Replace the current mapping by one covering at least `file_size` bytes.
+	bool remap() {
+		sqlite3_int64 size = current ? current->size * 2 : min_mapping_size;
+		while (size < file_size) {
+			size *= 2;
+		}
+		if (size > mmap_limit) {
+			size = mmap_limit;
+		}
+
+		int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+		if (populate) {
+			flags |= MAP_POPULATE;
+		}
+#endif
+		void *base = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+		if (base == MAP_FAILED) {
+			return false;
+		}
+#ifdef MADV_HUGEPAGE
+		if (hugepages) {
+			madvise(base, size, MADV_HUGEPAGE);
+			madvise_calls++;
+		}
+#endif
+		retire();
+		current = new Mapping { (char *) base, size, 0, vector<char>((size + region_size - 1) / region_size, ADVICE_NONE) };
+		remaps++;
+		return true;
+	}
+
+	// Stop handing out pages from the current mapping, unmapping it as soon as it is not referenced.
+	void retire() {
+		if (current == nullptr) {
+			return;
+		}
+		if (current->refs == 0) {
+			destroy(current);
+		}
+		else {
+			retired.push_back(current);
+		}
+		current = nullptr;
+	}
+
+	void destroy(Mapping *mapping) {
+		munmap(mapping->base, mapping->size);
+		delete mapping;
+	}
+
+	// Give the kernel read-ahead advice for the region containing `iOfst`, based on the last fetch.
+	void advise(sqlite3_int64 iOfst, int iAmt) {
+		bool sequential = iOfst == last_fetch_end;
+		last_fetch_end = iOfst + iAmt;
+
+		size_t region = iOfst / region_size;
+		if (sequential) {
+			// Ask for the next region before the scan gets there
+			region++;
+			if (region >= current->advice.size() || current->advice[region] == ADVICE_WILLNEED) {
+				return;
+			}
+			sqlite3_int64 length = region_size;
+			if ((sqlite3_int64) region * region_size + length > current->size) {
+				length = current->size - (sqlite3_int64) region * region_size;
+			}
+			madvise(current->base + region * region_size, length, MADV_WILLNEED);
+			current->advice[region] = ADVICE_WILLNEED;
+		}
+		else {
+			if (current->advice[region] != ADVICE_NONE) {
+				return;
+			}
+			sqlite3_int64 length = region_size;
+			if ((sqlite3_int64) region * region_size + length > current->size) {
+				length = current->size - (sqlite3_int64) region * region_size;
+			}
+			madvise(current->base + region * region_size, length, MADV_RANDOM);
+			current->advice[region] = ADVICE_RANDOM;
+		}
+		madvise_calls++;
+	}
+};
+
+struct MmapVfsShim : public SQLiteVfsImpl<MmapFileShim> {
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<SharedDescriptor>> descriptors;
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<MmapFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result == SQLITE_OK && zName && (flags & SQLITE_OPEN_MAIN_DB)) {
+			MmapFileShim& shim = file->implementation;
+			shim.populate = sqlite3_uri_boolean(zName, "mmap_populate", 0);
+			shim.hugepages = sqlite3_uri_boolean(zName, "mmap_hugepages", 0);
+			struct stat st;
+			if (stat(zName, &st) == 0) {
+				pair<dev_t, ino_t> key = make_pair(st.st_dev, st.st_ino);
+				shim.descriptor = shared_descriptor(zName, key);
+				shim.release_descriptor = [this, key, &shim] {
+					release_shared_descriptor(key, shim.descriptor);
+				};
+				shim.fd = shim.descriptor->fd;
+			}
+		}
+		return result;
+	}
+
+	shared_ptr<SharedDescriptor> shared_descriptor(const char *path, pair<dev_t, ino_t> key) {
+		lock_guard<mutex> lock(mtx);
+		weak_ptr<SharedDescriptor>& entry = descriptors[key];
+		shared_ptr<SharedDescriptor> descriptor = entry.lock();
+		if (!descriptor) {
+			descriptor = make_shared<SharedDescriptor>();
+			descriptor->fd = open(path, O_RDONLY | O_CLOEXEC);
+			entry = descriptor;
+		}
+		return descriptor;
+	}
+
+	// Drop a reference, and the entry of the file along with the last one.
+	void release_shared_descriptor(pair<dev_t, ino_t> key, shared_ptr<SharedDescriptor>& descriptor) {
+		lock_guard<mutex> lock(mtx);
+		descriptor.reset();
+		auto it = descriptors.find(key);
+		if (it != descriptors.end() && it->second.expired()) {
+			descriptors.erase(it);
+		}
+	}
+};
+
+extern "C" int sqlite3_mmapvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<MmapVfsShim> mmapvfs("mmapvfs");
+	int rc = mmapvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
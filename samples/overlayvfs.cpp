@@ -0,0 +1,559 @@
+// Overlay VFS shim: opens a database as a copy-on-write overlay of a read-only base database.
+//
+// An overlay is made of three files:
+//   - the base, a database shared by any number of overlays, and never written
+//   - the delta, the file SQLite opens, holding the written pages at their
+//     usual offsets, as a sparse file
+//   - `<delta>-overlay`, a 4096 byte header (magic, page size, base path and
+//     identity, logical size) followed by a bitmap of the pages in the delta
+// `xRead` serves every page from the delta if its bit is set, or from the
+// base otherwise, reading runs of pages from the same file at once. `xWrite`
+// goes to the delta and sets the bits; writes that don't cover a whole page
+// copy it from the base first. A new overlay is ready at once, whatever the
+// size of the base, and unchanged pages are shared in the OS page cache.
+//
+// Bits are only set once the pages are in the delta, and the changed bitmap
+// blocks are written on `xSync`, right before syncing the delta. After a
+// crash, a bit set for a page that isn't durable in the delta belongs to the
+// interrupted transaction or checkpoint, which SQLite rewrites from the
+// rollback journal or WAL. Locks, journals and WAL files are those of the delta.
+//
+// URI parameters:
+//   overlay_base=<path>  base database of a new overlay, the delta must be empty
+//                        (later opens use the path recorded in the header)
+//
+// `PRAGMA overlay_stats` reports the sizes and the pages read from each file.
+//
+// @note The base must not change while overlays use it, opening an overlay whose base
+//       size or modification time changed fails with SQLITE_CANTOPEN.
+// @note The bitmap is shared by the connections of one process, an overlay must not be
+//       used by several processes at once.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+static const char overlay_magic[8] = { 'S', 'Q', 'L', 'O', 'V', 'L', '0', '1' };
+static const int header_size = 4096;
+static const int path_offset = 64;
+// Bitmap blocks are written whole, each covers 32768 pages
+static const int bitmap_block_size = 4096;
+static const int words_per_block = bitmap_block_size / 8;
+
+static void put_u64(unsigned char *p, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t) p[i] << (8 * i);
+	}
+	return value;
+}
+
+static uint64_t mtime_ns(const struct stat& st) {
+	return (uint64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// Bitmap and base of an overlay, shared by the connections of this process.
+struct OverlayStore {
+	mutex mtx;
+	sqlite3_vfs *vfs = nullptr;
+	sqlite3_file *base = nullptr;
+	sqlite3_file *map_file = nullptr;
+	string base_path;
+	uint64_t base_size = 0;
+	uint64_t base_mtime = 0;
+	int page_size = 4096;
+	sqlite3_int64 size = 0;
+	// Pages that may still come from the base, truncations lower it
+	sqlite3_int64 base_pages = 0;
+	// One bit per page, set for pages in the delta
+	vector<uint64_t> bitmap;
+	// Bitmap blocks changed since the last `xSync`
+	set<sqlite3_int64> dirty_blocks;
+	bool header_dirty = false;
+
+	sqlite3_int64 base_reads = 0;
+	sqlite3_int64 delta_reads = 0;
+
+	~OverlayStore() {
+		for (sqlite3_file *file : { base, map_file }) {
+			if (file) {
+				if (file->pMethods) {
+					file->pMethods->xClose(file);
+				}
+				sqlite3_free(file);
+			}
+		}
+	}
+
+	// Must be called with `mtx` locked.
+	bool in_delta(sqlite3_int64 page) const {
+		return page / 64 < (sqlite3_int64) bitmap.size() && (bitmap[page / 64] >> (page % 64)) & 1;
+	}
+
+	// Must be called with `mtx` locked.
+	void set_in_delta(sqlite3_int64 page, bool value) {
+		if (page / 64 >= (sqlite3_int64) bitmap.size()) {
+			if (!value) {
+				return;
+			}
+			bitmap.resize(page / 64 + 1);
+		}
+		uint64_t bit = (uint64_t) 1 << (page % 64);
+		if (((bitmap[page / 64] & bit) != 0) != value) {
+			bitmap[page / 64] ^= bit;
+			dirty_blocks.insert(page / 64 / words_per_block);
+		}
+	}
+
+	sqlite3_int64 delta_pages() const {
+		sqlite3_int64 count = 0;
+		for (uint64_t word : bitmap) {
+			count += __builtin_popcountll(word);
+		}
+		return count;
+	}
+
+	// Write the header and the changed bitmap blocks. Must be called with `mtx` locked.
+	int flush_map() {
+		if (header_dirty) {
+			unsigned char header[header_size] = {};
+			memcpy(header, overlay_magic, sizeof(overlay_magic));
+			put_u64(header + 8, (uint64_t) page_size);
+			put_u64(header + 16, base_size);
+			put_u64(header + 24, base_mtime);
+			put_u64(header + 32, (uint64_t) size);
+			put_u64(header + 40, (uint64_t) base_pages);
+			memcpy(header + path_offset, base_path.data(), base_path.size());
+			int result = map_file->pMethods->xWrite(map_file, header, header_size, 0);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			header_dirty = false;
+		}
+		unsigned char block[bitmap_block_size];
+		for (auto it = dirty_blocks.begin(); it != dirty_blocks.end(); it = dirty_blocks.erase(it)) {
+			sqlite3_int64 first = *it * words_per_block;
+			for (int i = 0; i < words_per_block; i++) {
+				put_u64(block + i * 8, first + i < (sqlite3_int64) bitmap.size() ? bitmap[first + i] : 0);
+			}
+			int result = map_file->pMethods->xWrite(map_file, block, bitmap_block_size, header_size + *it * bitmap_block_size);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		return SQLITE_OK;
+	}
+
+	// Open the base recorded in the header, after checking it is unchanged.
+	int open_base() {
+		struct stat st;
+		if (stat(base_path.c_str(), &st) != 0) {
+			sqlite3_log(SQLITE_CANTOPEN, "overlay base \"%s\" not found", base_path.c_str());
+			return SQLITE_CANTOPEN;
+		}
+		if (base_mtime == 0) {
+			base_size = (uint64_t) st.st_size;
+			base_mtime = mtime_ns(st);
+		}
+		else if (base_size != (uint64_t) st.st_size || base_mtime != mtime_ns(st)) {
+			sqlite3_log(SQLITE_CANTOPEN, "overlay base \"%s\" changed since the overlay was created", base_path.c_str());
+			return SQLITE_CANTOPEN;
+		}
+		base = (sqlite3_file *) sqlite3_malloc(vfs->szOsFile);
+		if (base == nullptr) {
+			return SQLITE_NOMEM;
+		}
+		memset(base, 0, vfs->szOsFile);
+		return vfs->xOpen(vfs, base_path.c_str(), base, SQLITE_OPEN_READONLY | SQLITE_OPEN_MAIN_DB, nullptr);
+	}
+
+	// Create the header of a new overlay of `path`, the size and page size of the base become those of the delta.
+	int create(const char *path) {
+		base_path = path;
+		if (base_path.size() >= (size_t) (header_size - path_offset)) {
+			return SQLITE_CANTOPEN;
+		}
+		int result = open_base();
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		unsigned char database_header[100];
+		if (base_size >= sizeof(database_header)
+			&& base->pMethods->xRead(base, database_header, sizeof(database_header), 0) == SQLITE_OK
+			&& memcmp(database_header, "SQLite format 3", 16) == 0) {
+			int stored = (database_header[16] << 8) | database_header[17];
+			page_size = stored == 1 ? 65536 : stored;
+		}
+		size = (sqlite3_int64) base_size;
+		base_pages = (size + page_size - 1) / page_size;
+		header_dirty = true;
+		result = flush_map();
+		if (result == SQLITE_OK) {
+			result = map_file->pMethods->xSync(map_file, SQLITE_SYNC_NORMAL);
+		}
+		return result;
+	}
+
+	// Load the header and bitmap, then open the base.
+	int load() {
+		unsigned char header[header_size];
+		int result = map_file->pMethods->xRead(map_file, header, header_size, 0);
+		if (result != SQLITE_OK || memcmp(header, overlay_magic, sizeof(overlay_magic)) != 0) {
+			return result == SQLITE_OK || result == SQLITE_IOERR_SHORT_READ ? SQLITE_NOTADB : result;
+		}
+		page_size = (int) get_u64(header + 8);
+		base_size = get_u64(header + 16);
+		base_mtime = get_u64(header + 24);
+		size = (sqlite3_int64) get_u64(header + 32);
+		base_pages = (sqlite3_int64) get_u64(header + 40);
+		base_path.assign((const char *) header + path_offset, strnlen((const char *) header + path_offset, header_size - path_offset));
+		if (page_size < 512 || page_size > 65536 || (page_size & (page_size - 1)) != 0) {
+			return SQLITE_NOTADB;
+		}
+
+		sqlite3_int64 map_size;
+		result = map_file->pMethods->xFileSize(map_file, &map_size);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		// Only the words of pages below the logical size matter
+		sqlite3_int64 words = min((map_size - header_size) / 8, (size + page_size - 1) / page_size / 64 + 1);
+		vector<unsigned char> data(max<sqlite3_int64>(words, 0) * 8);
+		if (!data.empty()) {
+			result = map_file->pMethods->xRead(map_file, data.data(), (int) data.size(), header_size);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		bitmap.resize(data.size() / 8);
+		for (size_t i = 0; i < bitmap.size(); i++) {
+			bitmap[i] = get_u64(data.data() + i * 8);
+		}
+		return open_base();
+	}
+};
+
+struct OverlayFileShim : public SQLiteFileImpl {
+	shared_ptr<OverlayStore> store;
+	// Reused for writes of partial pages
+	vector<unsigned char> page_buffer;
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!store) {
+			return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		}
+		unsigned char *out = (unsigned char *) p;
+		sqlite3_int64 end = iOfst + iAmt;
+		sqlite3_int64 position = iOfst;
+		int result = SQLITE_OK;
+		while (position < end && result == SQLITE_OK) {
+			// Read the run of pages coming from the same file at once
+			sqlite3_int64 run_end;
+			int source;
+			{
+				lock_guard<mutex> lock(store->mtx);
+				if (position >= store->size) {
+					memset(out + (position - iOfst), 0, end - position);
+					return SQLITE_IOERR_SHORT_READ;
+				}
+				sqlite3_int64 page = position / store->page_size;
+				source = page_source(page);
+				run_end = min(end, store->size);
+				for (sqlite3_int64 next = page + 1; next * store->page_size < run_end; next++) {
+					if (page_source(next) != source) {
+						run_end = next * store->page_size;
+						break;
+					}
+				}
+				sqlite3_int64 pages = (run_end - 1) / store->page_size - page + 1;
+				if (source == 1) {
+					store->delta_reads += pages;
+				}
+				else if (source == 2) {
+					store->base_reads += pages;
+				}
+			}
+			result = read_run(source, out + (position - iOfst), (int) (run_end - position), position);
+			position = run_end;
+		}
+		if (result == SQLITE_OK && position < end) {
+			memset(out + (position - iOfst), 0, end - position);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return result;
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!store) {
+			return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		}
+		int page_size = store->page_size;
+		sqlite3_int64 first = iOfst / page_size;
+		sqlite3_int64 last = (iOfst + iAmt - 1) / page_size;
+		const unsigned char *data = (const unsigned char *) p;
+		sqlite3_int64 offset = iOfst;
+		int length = iAmt;
+		bool copy_first, copy_last;
+		{
+			lock_guard<mutex> lock(store->mtx);
+			copy_first = iOfst % page_size != 0 && !store->in_delta(first);
+			copy_last = (iOfst + iAmt) % page_size != 0 && !store->in_delta(last);
+		}
+		if (copy_first || copy_last) {
+			// The rest of the partial pages comes from the base, the delta must get all of them
+			offset = first * page_size;
+			length = (int) ((last + 1) * page_size - offset);
+			page_buffer.resize(length);
+			int result = xRead(page_buffer.data(), length, offset);
+			if (result != SQLITE_OK && result != SQLITE_IOERR_SHORT_READ) {
+				return result;
+			}
+			memcpy(page_buffer.data() + (iOfst - offset), p, iAmt);
+			data = page_buffer.data();
+		}
+		int result = SQLiteFileImpl::xWrite(data, length, offset);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		lock_guard<mutex> lock(store->mtx);
+		for (sqlite3_int64 page = first; page <= last; page++) {
+			store->set_in_delta(page, true);
+		}
+		if (iOfst + iAmt > store->size) {
+			store->size = iOfst + iAmt;
+			store->header_dirty = true;
+		}
+		return SQLITE_OK;
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (!store) {
+			return SQLiteFileImpl::xTruncate(size);
+		}
+		lock_guard<mutex> lock(store->mtx);
+		sqlite3_int64 pages = (size + store->page_size - 1) / store->page_size;
+		for (sqlite3_int64 page = pages; page < (sqlite3_int64) store->bitmap.size() * 64; page++) {
+			store->set_in_delta(page, false);
+		}
+		// Pages the file grows back to must not come from the base again
+		store->base_pages = min(store->base_pages, pages);
+		store->size = size;
+		store->header_dirty = true;
+		sqlite3_int64 delta_size;
+		int result = SQLiteFileImpl::xFileSize(&delta_size);
+		if (result == SQLITE_OK && delta_size > size) {
+			result = SQLiteFileImpl::xTruncate(size);
+		}
+		return result;
+	}
+
+	int xSync(int flags) override {
+		if (!store) {
+			return SQLiteFileImpl::xSync(flags);
+		}
+		sqlite3_file *map_file;
+		{
+			lock_guard<mutex> lock(store->mtx);
+			int result = store->flush_map();
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			map_file = store->map_file;
+		}
+		int result = map_file->pMethods->xSync(map_file, flags);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		return SQLiteFileImpl::xSync(flags);
+	}
+
+	int xFileSize(sqlite3_int64 *pSize) override {
+		if (!store) {
+			return SQLiteFileImpl::xFileSize(pSize);
+		}
+		lock_guard<mutex> lock(store->mtx);
+		*pSize = store->size;
+		return SQLITE_OK;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (store) {
+			switch (op) {
+				case SQLITE_FCNTL_PRAGMA: {
+					char **argv = (char **) pArg;
+					if (sqlite3_stricmp(argv[1], "overlay_stats") == 0) {
+						sqlite3_int64 delta_size = 0;
+						SQLiteFileImpl::xFileSize(&delta_size);
+						lock_guard<mutex> lock(store->mtx);
+						argv[0] = sqlite3_mprintf("logical_size=%lld base_size=%lld delta_size=%lld delta_pages=%lld page_size=%d "
+							"base_reads=%lld delta_reads=%lld base=%s", store->size, (sqlite3_int64) store->base_size, delta_size,
+							store->delta_pages(), store->page_size, store->base_reads, store->delta_reads, store->base_path.c_str());
+						return SQLITE_OK;
+					}
+					break;
+				}
+				// Sent in place of `xSync` with `PRAGMA synchronous=OFF`, the bitmap must still reach the file
+				case SQLITE_FCNTL_SYNC: {
+					lock_guard<mutex> lock(store->mtx);
+					store->flush_map();
+					break;
+				}
+				// Growing the delta ahead of time would allocate the pages served by the base
+				case SQLITE_FCNTL_SIZE_HINT:
+				case SQLITE_FCNTL_CHUNK_SIZE:
+					return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	// Pages missing from the delta are holes, it can't be mapped
+	int xFetch(sqlite3_int64 iOfst, int iAmt, void **pp) override {
+		if (!store) {
+			return SQLiteFileImpl::xFetch(iOfst, iAmt, pp);
+		}
+		*pp = nullptr;
+		return SQLITE_OK;
+	}
+
+	int xUnfetch(sqlite3_int64 iOfst, void *p) override {
+		if (!store) {
+			return SQLiteFileImpl::xUnfetch(iOfst, p);
+		}
+		return SQLITE_OK;
+	}
+
+	int xClose() override {
+		if (store) {
+			lock_guard<mutex> lock(store->mtx);
+			store->flush_map();
+		}
+		store.reset();
+		return SQLiteFileImpl::xClose();
+	}
+
+private:
+	// 1 for the delta, 2 for the base, 0 for pages of neither. Must be called with `store->mtx` locked.
+	int page_source(sqlite3_int64 page) const {
+		return store->in_delta(page) ? 1 : (page < store->base_pages ? 2 : 0);
+	}
+
+	int read_run(int source, unsigned char *out, int length, sqlite3_int64 offset) {
+		int result;
+		if (source == 1) {
+			result = SQLiteFileImpl::xRead(out, length, offset);
+		}
+		else if (source == 2) {
+			result = store->base->pMethods->xRead(store->base, out, length, offset);
+		}
+		else {
+			// Grown past the base without being written, like a hole in a sparse file
+			memset(out, 0, length);
+			result = SQLITE_OK;
+		}
+		// The last page of the base or delta may be partial, the reading file zero fills the rest
+		return result == SQLITE_IOERR_SHORT_READ ? SQLITE_OK : result;
+	}
+};
+
+struct OverlayVfsShim : public SQLiteVfsImpl<OverlayFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<OverlayFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		struct stat st;
+		if (result != SQLITE_OK || zName == nullptr || !(flags & SQLITE_OPEN_MAIN_DB) || stat(zName, &st) != 0) {
+			return result;
+		}
+		OverlayFileShim& shim = file->implementation;
+		string map_path = string(zName) + "-overlay";
+		const char *base_path = sqlite3_uri_parameter(zName, "overlay_base");
+		int exists = 0;
+		original_vfs->xAccess(original_vfs, map_path.c_str(), SQLITE_ACCESS_EXISTS, &exists);
+		if (!exists && !base_path) {
+			return result;
+		}
+
+		lock_guard<mutex> lock(mtx);
+		weak_ptr<OverlayStore>& entry = stores[make_pair(st.st_dev, st.st_ino)];
+		shim.store = entry.lock();
+		if (!shim.store) {
+			shared_ptr<OverlayStore> store = make_shared<OverlayStore>();
+			store->vfs = original_vfs;
+			store->map_file = (sqlite3_file *) sqlite3_malloc(original_vfs->szOsFile);
+			if (store->map_file == nullptr) {
+				result = SQLITE_NOMEM;
+			}
+			else {
+				memset(store->map_file, 0, original_vfs->szOsFile);
+				int map_flags = (flags & SQLITE_OPEN_READONLY ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE)
+					| SQLITE_OPEN_MAIN_JOURNAL;
+				result = original_vfs->xOpen(original_vfs, map_path.c_str(), store->map_file, map_flags, nullptr);
+			}
+			if (result == SQLITE_OK && exists) {
+				result = store->load();
+				// Pages written past the durable size by an interrupted transaction are never read
+				if (result == SQLITE_OK && st.st_size > store->size && !(flags & SQLITE_OPEN_READONLY)) {
+					file->original_file->pMethods->xTruncate(file->original_file, store->size);
+				}
+			}
+			else if (result == SQLITE_OK) {
+				// The delta of a new overlay must not hold pages the bitmap doesn't know about
+				result = st.st_size == 0 ? store->create(base_path) : SQLITE_CANTOPEN;
+			}
+			if (result != SQLITE_OK) {
+				file->original_file->pMethods->xClose(file->original_file);
+				return result;
+			}
+			entry = store;
+			shim.store = store;
+		}
+		return result;
+	}
+
+	// Deleting a delta deletes its bitmap with it.
+	int xDelete(const char *zName, int syncDir) override {
+		int result = SQLiteVfsImpl::xDelete(zName, syncDir);
+		if (result == SQLITE_OK) {
+			string map_path = string(zName) + "-overlay";
+			int exists = 0;
+			if (original_vfs->xAccess(original_vfs, map_path.c_str(), SQLITE_ACCESS_EXISTS, &exists) == SQLITE_OK && exists) {
+				result = SQLiteVfsImpl::xDelete(map_path.c_str(), syncDir);
+			}
+		}
+		return result;
+	}
+
+private:
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<OverlayStore>> stores;
+};
+
+extern "C" int sqlite3_overlayvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<OverlayVfsShim> overlayvfs("overlayvfs");
+	int rc = overlayvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
@@ -0,0 +1,285 @@
+// Owner VFS shim: answers locks in memory and caches the database header when one process owns the database.
+//
+// Starting a read transaction costs an `xLock(SHARED)` and an `xUnlock` (both
+// `fcntl` calls), often an `xCheckReservedLock`, and a read of the header to
+// check the file change counter. With the `single_process=1` URI parameter,
+// the first connection of the process to open the database tries to become
+// its owner by taking a write lock on SQLite's whole lock byte range. On Linux this is an
+// open file description lock, which also conflicts with the POSIX locks
+// of other processes using the default VFS, so they get `SQLITE_BUSY`. Other
+// systems use `flock`, which only excludes processes using this shim. The
+// ownership lasts until the last connection of the process to the database is closed.
+//
+// While it owns the database, the process answers all lock calls from an
+// in-memory lock table shared by its connections. It serves reads within the
+// 100 byte database header from a copy kept current by its own writes.
+// When ownership can't be taken, the database uses the normal locking of the base VFS.
+//
+// `PRAGMA owner_stats` reports the mode, elided lock calls and cached header reads.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Lock bytes used by SQLite, see `PENDING_BYTE` and following in sqlite3.c
+static const off_t pending_byte = 0x40000000;
+static const off_t lock_bytes_size = 512;
+static const int header_size = 100;
+
+class OwnerFileShim;
+
+// A database opened with `single_process=1`, shared by the connections of this process.
+struct OwnedDatabase {
+	mutex mtx;
+	// Kept open as long as the database is used, closing it would drop the POSIX locks of the process
+	int fd = -1;
+	// Whether this process owns the database, or uses the locking of the base VFS
+	bool owned = false;
+
+	// In-memory lock table, with the same semantics as the unix VFS one
+	int shared_count = 0;
+	OwnerFileShim *reserved_owner = nullptr;
+	OwnerFileShim *pending_owner = nullptr;
+	OwnerFileShim *exclusive_owner = nullptr;
+
+	unsigned char header[header_size];
+	bool header_valid = false;
+
+	sqlite3_int64 elided_lock_calls = 0;
+	sqlite3_int64 header_hits = 0;
+
+	~OwnedDatabase() {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+
+	// Take the process-wide ownership lock on `fd`.
+	bool acquire() {
+#ifdef F_OFD_SETLK
+		struct flock lock = {};
+		lock.l_type = F_WRLCK;
+		lock.l_whence = SEEK_SET;
+		lock.l_start = pending_byte;
+		lock.l_len = lock_bytes_size;
+		return fcntl(fd, F_OFD_SETLK, &lock) == 0;
+#else
+		return flock(fd, LOCK_EX | LOCK_NB) == 0;
+#endif
+	}
+};
+
+class OwnerFileShim : public SQLiteFileImpl {
+public:
+	shared_ptr<OwnedDatabase> database;
+	int lock_level = SQLITE_LOCK_NONE;
+
+	bool owned() const {
+		return database && database->owned;
+	}
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!owned() || iOfst >= header_size) {
+			return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		}
+		lock_guard<mutex> lock(database->mtx);
+		if (database->header_valid && iOfst + iAmt <= header_size) {
+			memcpy(p, database->header + iOfst, iAmt);
+			database->header_hits++;
+			return SQLITE_OK;
+		}
+		int result = SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		if (result == SQLITE_OK && iOfst == 0 && iAmt >= header_size) {
+			memcpy(database->header, p, header_size);
+			database->header_valid = true;
+		}
+		return result;
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!owned() || iOfst >= header_size) {
+			return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		}
+		lock_guard<mutex> lock(database->mtx);
+		int result = SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		if (result != SQLITE_OK) {
+			database->header_valid = false;
+		}
+		else if (iOfst == 0 && iAmt >= header_size) {
+			memcpy(database->header, p, header_size);
+			database->header_valid = true;
+		}
+		else if (database->header_valid) {
+			int length = iOfst + iAmt <= header_size ? iAmt : header_size - (int) iOfst;
+			memcpy(database->header + iOfst, p, length);
+		}
+		return result;
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (owned() && size < header_size) {
+			lock_guard<mutex> lock(database->mtx);
+			database->header_valid = false;
+		}
+		return SQLiteFileImpl::xTruncate(size);
+	}
+
+	int xLock(int level) override {
+		if (!owned()) {
+			return SQLiteFileImpl::xLock(level);
+		}
+		lock_guard<mutex> lock(database->mtx);
+		database->elided_lock_calls++;
+		if (lock_level >= level) {
+			return SQLITE_OK;
+		}
+		OwnedDatabase& db = *database;
+		bool others_writing = (db.pending_owner && db.pending_owner != this) || (db.exclusive_owner && db.exclusive_owner != this);
+		if (level == SQLITE_LOCK_SHARED) {
+			if (others_writing) {
+				return SQLITE_BUSY;
+			}
+			db.shared_count++;
+		}
+		else if (level == SQLITE_LOCK_RESERVED) {
+			if (db.reserved_owner || others_writing) {
+				return SQLITE_BUSY;
+			}
+			db.reserved_owner = this;
+		}
+		else {
+			if (others_writing) {
+				return SQLITE_BUSY;
+			}
+			// Stay PENDING until the other readers are gone, so no new ones come in
+			db.pending_owner = this;
+			lock_level = SQLITE_LOCK_PENDING;
+			if (db.shared_count > 1) {
+				return SQLITE_BUSY;
+			}
+			db.exclusive_owner = this;
+		}
+		lock_level = level;
+		return SQLITE_OK;
+	}
+
+	int xUnlock(int level) override {
+		if (!owned()) {
+			return SQLiteFileImpl::xUnlock(level);
+		}
+		lock_guard<mutex> lock(database->mtx);
+		database->elided_lock_calls++;
+		if (lock_level <= level) {
+			return SQLITE_OK;
+		}
+		OwnedDatabase& db = *database;
+		if (lock_level > SQLITE_LOCK_SHARED) {
+			for (OwnerFileShim **owner : { &db.reserved_owner, &db.pending_owner, &db.exclusive_owner }) {
+				if (*owner == this) {
+					*owner = nullptr;
+				}
+			}
+		}
+		if (level == SQLITE_LOCK_NONE) {
+			db.shared_count--;
+		}
+		lock_level = level;
+		return SQLITE_OK;
+	}
+
+	int xCheckReservedLock(int *pResOut) override {
+		if (!owned()) {
+			return SQLiteFileImpl::xCheckReservedLock(pResOut);
+		}
+		lock_guard<mutex> lock(database->mtx);
+		database->elided_lock_calls++;
+		*pResOut = database->reserved_owner || database->pending_owner || database->exclusive_owner;
+		return SQLITE_OK;
+	}
+
+	int xClose() override {
+		if (owned()) {
+			xUnlock(SQLITE_LOCK_NONE);
+		}
+		return SQLiteFileImpl::xClose();
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "owner_stats") == 0) {
+				if (!owned()) {
+					argv[0] = sqlite3_mprintf("mode=shared");
+					return SQLITE_OK;
+				}
+				lock_guard<mutex> lock(database->mtx);
+				argv[0] = sqlite3_mprintf("mode=owned elided_lock_calls=%lld header_hits=%lld", database->elided_lock_calls, database->header_hits);
+				return SQLITE_OK;
+			}
+		}
+		else if (op == SQLITE_FCNTL_LOCKSTATE && owned()) {
+			*(int *) pArg = lock_level;
+			return SQLITE_OK;
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+};
+
+struct OwnerVfsShim : public SQLiteVfsImpl<OwnerFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<OwnerFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result != SQLITE_OK || zName == nullptr || !(flags & SQLITE_OPEN_MAIN_DB) || !(flags & SQLITE_OPEN_READWRITE)
+			|| !sqlite3_uri_boolean(zName, "single_process", 0)) {
+			return result;
+		}
+		file->implementation.database = own(zName);
+		return result;
+	}
+
+private:
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<OwnedDatabase>> databases;
+
+	// The shared state of `path`. The first connection of the process decides whether it is owned.
+	shared_ptr<OwnedDatabase> own(const char *path) {
+		struct stat st;
+		if (stat(path, &st) != 0) {
+			return nullptr;
+		}
+
+		lock_guard<mutex> lock(mtx);
+		auto key = make_pair(st.st_dev, st.st_ino);
+		shared_ptr<OwnedDatabase> database = databases[key].lock();
+		if (!database) {
+			database = make_shared<OwnedDatabase>();
+			database->fd = open(path, O_RDWR | O_CLOEXEC);
+			database->owned = database->fd >= 0 && database->acquire();
+			databases[key] = database;
+		}
+		return database;
+	}
+};
+
+extern "C" int sqlite3_ownervfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<OwnerVfsShim> ownervfs("ownervfs");
+	int rc = ownervfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
@@ -0,0 +1,214 @@
+// Preallocation VFS shim: grows database and WAL files in large chunks with `fallocate`.
+//
+// Appending one page at a time fragments extents and causes filesystem
+// metadata traffic on every write. This shim reserves disk space ahead of
+// writes in geometrically growing chunks, using `FALLOC_FL_KEEP_SIZE` so the
+// logical size reported by `xFileSize` never includes the reserved space.
+// `SQLITE_FCNTL_CHUNK_SIZE` sets the minimum chunk, `SQLITE_FCNTL_SIZE_HINT`
+// reserves space up front, and `xTruncate`/`xClose` give unused space back.
+//
+// URI parameters:
+//   prealloc_chunk=<bytes>     minimum growth step (default 1 MiB)
+//   prealloc_max_step=<bytes>  maximum growth step (default 64 MiB)
+//
+// `PRAGMA prealloc_stats` reports the physical allocation and number of `fallocate` calls.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Descriptor of a file shared by every connection to its inode. Closing any
+// descriptor of a file drops all POSIX locks the process holds on it, so it
+// is only closed once the last connection using the file is gone.
+struct SharedDescriptor {
+	int fd = -1;
+
+	~SharedDescriptor() {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+};
+
+struct PreallocFileShim : public SQLiteFileImpl {
+	shared_ptr<SharedDescriptor> descriptor;
+	// Gives `descriptor` back to the VFS
+	function<void()> release_descriptor;
+	// Descriptor used for `fallocate`, -1 if preallocation is off
+	int fd = -1;
+	sqlite3_int64 chunk_size = 1 << 20;
+	sqlite3_int64 max_step = 64 << 20;
+	// Bytes reserved on disk, including the logical file contents
+	sqlite3_int64 allocated = 0;
+	sqlite3_int64 fallocate_calls = 0;
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		sqlite3_int64 end = iOfst + iAmt;
+		if (end > allocated) {
+			sqlite3_int64 step = allocated < chunk_size ? chunk_size : allocated > max_step ? max_step : allocated;
+			sqlite3_int64 target = allocated + step;
+			while (target < end) {
+				target += step;
+			}
+			reserve(target);
+		}
+		return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		int result = SQLiteFileImpl::xTruncate(size);
+		if (result == SQLITE_OK) {
+			release_tail();
+		}
+		return result;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		switch (op) {
+			case SQLITE_FCNTL_CHUNK_SIZE:
+				if (*(int *) pArg > 0) {
+					chunk_size = *(int *) pArg;
+				}
+				// Don't forward it, the default VFS would extend the logical size instead
+				return fd >= 0 ? SQLITE_OK : SQLiteFileImpl::xFileControl(op, pArg);
+
+			case SQLITE_FCNTL_SIZE_HINT:
+				if (fd < 0) {
+					break;
+				}
+				if (*(sqlite3_int64 *) pArg > allocated) {
+					sqlite3_int64 hint = *(sqlite3_int64 *) pArg;
+					reserve((hint + chunk_size - 1) / chunk_size * chunk_size);
+				}
+				return SQLITE_OK;
+
+			case SQLITE_FCNTL_PRAGMA: {
+				char **argv = (char **) pArg;
+				if (sqlite3_stricmp(argv[1], "prealloc_stats") == 0) {
+					argv[0] = sqlite3_mprintf("allocated=%lld fallocate_calls=%lld chunk_size=%lld",
+						allocated, fallocate_calls, chunk_size);
+					return SQLITE_OK;
+				}
+				break;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	int xClose() override {
+		release_tail();
+		int result = SQLiteFileImpl::xClose();
+		if (release_descriptor) {
+			release_descriptor();
+		}
+		return result;
+	}
+
+	// Reserve disk space up to `target` bytes without changing the logical file size.
+	void reserve(sqlite3_int64 target) {
+		if (fd < 0 || target <= allocated) {
+			return;
+		}
+#ifdef __linux__
+		fallocate_calls++;
+		if (fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated, target - allocated) == 0) {
+			allocated = target;
+			return;
+		}
+#endif
+		// Preallocation is only an optimization, stop trying if the filesystem doesn't support it.
+		// The descriptor stays open until the file is closed, as other connections may hold locks.
+		fd = -1;
+	}
+
+	// Free reserved space past the logical end of file.
+	void release_tail() {
+		sqlite3_int64 size;
+		if (fd < 0 || SQLiteFileImpl::xFileSize(&size) != SQLITE_OK) {
+			return;
+		}
+#ifdef __linux__
+		if (allocated > size) {
+			fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, size, allocated - size);
+		}
+#endif
+		allocated = size;
+	}
+};
+
+struct PreallocVfsShim : public SQLiteVfsImpl<PreallocFileShim> {
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<SharedDescriptor>> descriptors;
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<PreallocFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		const int prealloc_types = SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_WAL | SQLITE_OPEN_MAIN_JOURNAL;
+		if (result != SQLITE_OK || zName == nullptr || (flags & prealloc_types) == 0 || (flags & SQLITE_OPEN_READONLY)) {
+			return result;
+		}
+
+		PreallocFileShim& shim = file->implementation;
+		shim.chunk_size = sqlite3_uri_int64(zName, "prealloc_chunk", shim.chunk_size);
+		shim.max_step = sqlite3_uri_int64(zName, "prealloc_max_step", shim.max_step);
+		if (shim.max_step < shim.chunk_size) {
+			shim.max_step = shim.chunk_size;
+		}
+		struct stat st;
+		if (stat(zName, &st) == 0) {
+			pair<dev_t, ino_t> key = make_pair(st.st_dev, st.st_ino);
+			shim.descriptor = shared_descriptor(zName, key);
+			shim.release_descriptor = [this, key, &shim] {
+				release_shared_descriptor(key, shim.descriptor);
+			};
+			shim.fd = shim.descriptor->fd;
+			shim.allocated = st.st_size;
+		}
+		return result;
+	}
+
+	shared_ptr<SharedDescriptor> shared_descriptor(const char *path, pair<dev_t, ino_t> key) {
+		lock_guard<mutex> lock(mtx);
+		weak_ptr<SharedDescriptor>& entry = descriptors[key];
+		shared_ptr<SharedDescriptor> descriptor = entry.lock();
+		if (!descriptor) {
+			descriptor = make_shared<SharedDescriptor>();
+			descriptor->fd = open(path, O_RDWR | O_CLOEXEC);
+			entry = descriptor;
+		}
+		return descriptor;
+	}
+
+	// Drop a reference, and the entry of the file along with the last one. Under `mtx`,
+	// so no connection opening the file meanwhile gets a descriptor that is being closed.
+	void release_shared_descriptor(pair<dev_t, ino_t> key, shared_ptr<SharedDescriptor>& descriptor) {
+		lock_guard<mutex> lock(mtx);
+		descriptor.reset();
+		auto it = descriptors.find(key);
+		if (it != descriptors.end() && it->second.expired()) {
+			descriptors.erase(it);
+		}
+	}
+};
+
+extern "C" int sqlite3_preallocvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<PreallocVfsShim> preallocvfs("preallocvfs");
+	int rc = preallocvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
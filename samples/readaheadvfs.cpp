@@ -0,0 +1,252 @@
+// Read-ahead VFS shim: prefetches pages of sequential scans with a single `preadv`.
+//
+// When the main database is read sequentially, the next pages are fetched
+// in one batch through `SQLiteFileImpl::xReadV`. This shim also overrides
+// `xReadV` itself, coalescing adjacent buffers into a single `preadv` call
+// on its own descriptor, instead of looping over `xRead`.
+//
+// Prefetched pages are dropped on any write and whenever locks change,
+// so they never outlive the read transaction that fetched them.
+//
+// URI parameters:
+//   readahead_pages=<count>  number of pages fetched at once (default 16)
+//
+// `PRAGMA readahead_stats` reports prefetches, `preadv` calls and cache hits.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+using namespace sqlitevfs;
+using namespace std;
+
+// Read-only descriptor of a database, shared by every connection to its inode.
+// Closing it drops all POSIX locks the process holds on the database, so that
+// only happens once the last connection is gone.
+struct SharedDescriptor {
+	int fd = -1;
+
+	~SharedDescriptor() {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+};
+
+struct ReadAheadFileShim : public SQLiteFileImpl {
+	shared_ptr<SharedDescriptor> descriptor;
+	// Gives `descriptor` back to the VFS
+	function<void()> release_descriptor;
+	int fd = -1;
+	int readahead_pages = 16;
+
+	vector<char> cache;
+	sqlite3_int64 cache_offset = 0;
+	sqlite3_int64 cache_size = 0;
+	sqlite3_int64 last_read_end = -1;
+	int sequential_reads = 0;
+
+	sqlite3_int64 prefetches = 0;
+	sqlite3_int64 preadv_calls = 0;
+	sqlite3_int64 cache_hits = 0;
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		sequential_reads = iOfst == last_read_end ? sequential_reads + 1 : 0;
+		last_read_end = iOfst + iAmt;
+		if (iOfst >= cache_offset && iOfst + iAmt <= cache_offset + cache_size) {
+			memcpy(p, cache.data() + (iOfst - cache_offset), iAmt);
+			cache_hits++;
+			return SQLITE_OK;
+		}
+
+		if (sequential_reads >= 2 && fd >= 0 && iAmt >= 512 && (iAmt & (iAmt - 1)) == 0) {
+			if (prefetch(iAmt, iOfst)) {
+				memcpy(p, cache.data(), iAmt);
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+	}
+
+	int xReadV(const IoVec *iov, int iovcnt) override {
+		if (fd < 0) {
+			return SQLiteFileImpl::xReadV(iov, iovcnt);
+		}
+
+		int result = SQLITE_OK;
+		vector<struct iovec> batch;
+		int i = 0;
+		while (i < iovcnt) {
+			// Gather a run of adjacent buffers
+			sqlite3_int64 offset = iov[i].iOfst;
+			sqlite3_int64 total = 0;
+			int first = i;
+			batch.clear();
+			do {
+				batch.push_back({ iov[i].p, (size_t) iov[i].iAmt });
+				total += iov[i].iAmt;
+				i++;
+			} while (i < iovcnt && batch.size() < IOV_MAX && iov[i].iOfst == offset + total);
+
+			preadv_calls++;
+			ssize_t got = preadv(fd, batch.data(), (int) batch.size(), offset);
+			if (got == total) {
+				continue;
+			}
+			// Errors and short reads are rare, let `xRead` deal with them buffer by buffer
+			for (int j = first; j < i; j++) {
+				int read_result = SQLiteFileImpl::xRead(iov[j].p, iov[j].iAmt, iov[j].iOfst);
+				if (read_result == SQLITE_IOERR_SHORT_READ) {
+					result = read_result;
+				}
+				else if (read_result != SQLITE_OK) {
+					return read_result;
+				}
+			}
+		}
+		return result;
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		invalidate();
+		return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		invalidate();
+		return SQLiteFileImpl::xTruncate(size);
+	}
+
+	int xLock(int flags) override {
+		invalidate();
+		return SQLiteFileImpl::xLock(flags);
+	}
+
+	int xUnlock(int flags) override {
+		invalidate();
+		return SQLiteFileImpl::xUnlock(flags);
+	}
+
+	int xShmLock(int offset, int n, int flags) override {
+		invalidate();
+		return SQLiteFileImpl::xShmLock(offset, n, flags);
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (op == SQLITE_FCNTL_PRAGMA) {
+			char **argv = (char **) pArg;
+			if (sqlite3_stricmp(argv[1], "readahead_stats") == 0) {
+				argv[0] = sqlite3_mprintf("prefetches=%lld preadv_calls=%lld cache_hits=%lld", prefetches, preadv_calls, cache_hits);
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	// Fill the cache with up to `readahead_pages` pages starting at `iOfst`, stopping at the end of the file.
+	bool prefetch(int page_size, sqlite3_int64 iOfst) {
+		sqlite3_int64 file_size;
+		if (SQLiteFileImpl::xFileSize(&file_size) != SQLITE_OK) {
+			return false;
+		}
+		int pages = (int) min<sqlite3_int64>(readahead_pages, (file_size - iOfst) / page_size);
+		if (pages < 2) {
+			return false;
+		}
+		cache.resize((size_t) page_size * pages);
+		vector<IoVec> iov(pages);
+		for (int i = 0; i < pages; i++) {
+			iov[i] = { cache.data() + (size_t) i * page_size, page_size, iOfst + (sqlite3_int64) i * page_size };
+		}
+		prefetches++;
+		if (xReadV(iov.data(), pages) != SQLITE_OK) {
+			invalidate();
+			return false;
+		}
+		cache_offset = iOfst;
+		cache_size = (sqlite3_int64) page_size * pages;
+		return true;
+	}
+
+	void invalidate() {
+		cache_size = 0;
+	}
+
+	int xClose() override {
+		int result = SQLiteFileImpl::xClose();
+		if (release_descriptor) {
+			release_descriptor();
+		}
+		return result;
+	}
+};
+
+struct ReadAheadVfsShim : public SQLiteVfsImpl<ReadAheadFileShim> {
+	mutex mtx;
+	map<pair<dev_t, ino_t>, weak_ptr<SharedDescriptor>> descriptors;
+
+	int xOpen(sqlite3_filename zName, SQLiteFile<ReadAheadFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result == SQLITE_OK && zName && (flags & SQLITE_OPEN_MAIN_DB)) {
+			ReadAheadFileShim& shim = file->implementation;
+			shim.readahead_pages = (int) sqlite3_uri_int64(zName, "readahead_pages", shim.readahead_pages);
+			struct stat st;
+			if (shim.readahead_pages > 1 && stat(zName, &st) == 0) {
+				pair<dev_t, ino_t> key = make_pair(st.st_dev, st.st_ino);
+				shim.descriptor = shared_descriptor(zName, key);
+				shim.release_descriptor = [this, key, &shim] {
+					release_shared_descriptor(key, shim.descriptor);
+				};
+				shim.fd = shim.descriptor->fd;
+			}
+		}
+		return result;
+	}
+
+	shared_ptr<SharedDescriptor> shared_descriptor(const char *path, pair<dev_t, ino_t> key) {
+		lock_guard<mutex> lock(mtx);
+		weak_ptr<SharedDescriptor>& entry = descriptors[key];
+		shared_ptr<SharedDescriptor> descriptor = entry.lock();
+		if (!descriptor) {
+			descriptor = make_shared<SharedDescriptor>();
+			descriptor->fd = open(path, O_RDONLY | O_CLOEXEC);
+			entry = descriptor;
+		}
+		return descriptor;
+	}
+
+	// Drop a reference, and the entry of the file along with the last one.
+	void release_shared_descriptor(pair<dev_t, ino_t> key, shared_ptr<SharedDescriptor>& descriptor) {
+		lock_guard<mutex> lock(mtx);
+		descriptor.reset();
+		auto it = descriptors.find(key);
+		if (it != descriptors.end() && it->second.expired()) {
+			descriptors.erase(it);
+		}
+	}
+};
+
+extern "C" int sqlite3_readaheadvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<ReadAheadVfsShim> readaheadvfs("readaheadvfs");
+	int rc = readaheadvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
@@ -0,0 +1,537 @@
+// Segment VFS shim: stores a database as a series of fixed-size segment files.
+//
+// The file SQLite opens becomes a 4096 byte descriptor (magic, segment size
+// and a truncation epoch), and the pages live in `<database>.0000`,
+// `<database>.0001`, ... next to it, each holding `segment_size` bytes of the
+// logical file. Locks, the WAL index, journals and WAL files are those of the
+// descriptor.
+//
+// Segments are opened on first use and their handles cached, up to
+// `max_open_segments` per connection; the least recently used segments
+// without unsynced writes are closed beyond that. `xSync` flushes every
+// segment written since the last sync concurrently, on up to
+// `max_sync_threads` threads. Segments are created in order and removed from
+// the last one, so the logical size is `segment_size` for every segment before
+// the last one, plus the size of the last one. `xTruncate` unlinks whole tail
+// segments instead of shrinking a huge file, and backups can copy and verify
+// segments independently.
+//
+// Connections of other processes may still have handles of unlinked segments
+// open, so `xTruncate` bumps the epoch in the descriptor and syncs it first.
+// Connections check it whenever they take a file or WAL index lock, and drop
+// their handles when it changed.
+//
+// URI parameters:
+//   segment_size=<bytes>       multiple of 65536 (default 1 GiB), so that pages
+//                              never straddle segments; only used on creation
+//   max_open_segments=<count>  segment handles kept open per connection (default 64)
+//
+// A database that isn't empty and whose file isn't a descriptor is used as is.
+//
+// `PRAGMA segment_stats` reports the segments, open handles and syncs.
+//
+// @note The descriptor is not a database, other VFSes can't open it. Deleting it
+//       leaves the segment files behind.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace sqlitevfs;
+using namespace std;
+
+static const char segment_magic[8] = { 'S', 'Q', 'L', 'S', 'E', 'G', '0', '1' };
+static const int descriptor_size = 4096;
+static const int epoch_offset = 16;
+static const sqlite3_int64 segment_alignment = 65536;
+static const sqlite3_int64 default_segment_size = (sqlite3_int64) 1 << 30;
+static const int default_max_open_segments = 64;
+static const size_t max_sync_threads = 8;
+
+static void put_u64(unsigned char *p, uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= (uint64_t) p[i] << (8 * i);
+	}
+	return value;
+}
+
+// Cached handle of one segment file.
+struct Segment {
+	// NULL while the segment is closed
+	sqlite3_file *file = nullptr;
+	// Written since the last `xSync`, such segments are never closed by the cache
+	bool dirty = false;
+	sqlite3_int64 last_used = 0;
+};
+
+struct SegmentFileShim : public SQLiteFileImpl {
+	sqlite3_vfs *vfs = nullptr;
+	// 0 for files that aren't segmented
+	sqlite3_int64 segment_size = 0;
+	string base_name;
+	bool readonly = false;
+	int max_open_segments = default_max_open_segments;
+	uint64_t epoch = 0;
+
+	vector<Segment> segments;
+	// Number of segment files, as last seen
+	sqlite3_int64 segment_count = 1;
+	int open_segments = 0;
+	sqlite3_int64 use_clock = 0;
+
+	sqlite3_int64 segment_opens = 0;
+	sqlite3_int64 syncs = 0;
+	sqlite3_int64 segment_syncs = 0;
+	sqlite3_int64 unlinked_segments = 0;
+
+	int iVersion() const override {
+		// No memory mapping, the descriptor holds no pages
+		return segment_size ? 2 : SQLiteFileImpl::iVersion();
+	}
+
+	int xClose() override {
+		close_segments(0);
+		return SQLiteFileImpl::xClose();
+	}
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!segment_size) {
+			return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		}
+		int result = SQLITE_OK;
+		char *buffer = (char *) p;
+		while (iAmt > 0) {
+			sqlite3_int64 index = iOfst / segment_size;
+			sqlite3_int64 within = iOfst % segment_size;
+			int length = (int) min<sqlite3_int64>(iAmt, segment_size - within);
+			sqlite3_file *segment = nullptr;
+			int read_result = open_segment(index, false, &segment);
+			if (read_result == SQLITE_OK && segment) {
+				read_result = segment->pMethods->xRead(segment, buffer, length, within);
+			}
+			else if (read_result == SQLITE_OK) {
+				// Past the last segment
+				memset(buffer, 0, length);
+				read_result = SQLITE_IOERR_SHORT_READ;
+			}
+			if (read_result == SQLITE_IOERR_SHORT_READ) {
+				result = read_result;
+			}
+			else if (read_result != SQLITE_OK) {
+				return read_result;
+			}
+			buffer += length;
+			iAmt -= length;
+			iOfst += length;
+		}
+		return result;
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (!segment_size) {
+			return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		}
+		const char *buffer = (const char *) p;
+		while (iAmt > 0) {
+			sqlite3_int64 index = iOfst / segment_size;
+			sqlite3_int64 within = iOfst % segment_size;
+			int length = (int) min<sqlite3_int64>(iAmt, segment_size - within);
+			sqlite3_file *segment;
+			int result = extend(index, &segment);
+			if (result == SQLITE_OK) {
+				result = segment->pMethods->xWrite(segment, buffer, length, within);
+			}
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			buffer += length;
+			iAmt -= length;
+			iOfst += length;
+		}
+		return SQLITE_OK;
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (!segment_size) {
+			return SQLiteFileImpl::xTruncate(size);
+		}
+		int result = refresh_segment_count();
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		sqlite3_int64 keep = max<sqlite3_int64>(1, (size + segment_size - 1) / segment_size);
+		if (keep < segment_count) {
+			// Tell the other connections their handles of these segments are stale
+			unsigned char epoch_bytes[8];
+			put_u64(epoch_bytes, ++epoch);
+			result = original_file->pMethods->xWrite(original_file, epoch_bytes, sizeof(epoch_bytes), epoch_offset);
+			// Durable before any segment is gone, so the epoch never goes back after a crash
+			if (result == SQLITE_OK) {
+				result = original_file->pMethods->xSync(original_file, SQLITE_SYNC_NORMAL);
+			}
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			close_segments(keep);
+			// From the last one, so that the remaining segments stay contiguous after a crash
+			for (sqlite3_int64 i = segment_count - 1; i >= keep; i--) {
+				result = vfs->xDelete(vfs, segment_path(i).c_str(), i == keep);
+				if (result != SQLITE_OK && result != SQLITE_IOERR_DELETE_NOENT) {
+					return result;
+				}
+				segment_count = i;
+				unlinked_segments++;
+			}
+		}
+		sqlite3_file *last;
+		result = extend(keep - 1, &last);
+		if (result == SQLITE_OK) {
+			result = last->pMethods->xTruncate(last, size - (keep - 1) * segment_size);
+		}
+		return result;
+	}
+
+	int xSync(int flags) override {
+		if (!segment_size) {
+			return SQLiteFileImpl::xSync(flags);
+		}
+		vector<sqlite3_int64> dirty;
+		for (size_t i = 0; i < segments.size(); i++) {
+			if (segments[i].dirty) {
+				dirty.push_back((sqlite3_int64) i);
+			}
+		}
+		syncs++;
+		segment_syncs += dirty.size();
+		vector<int> results(dirty.size(), SQLITE_OK);
+		atomic<size_t> next(0);
+		auto sync_segments = [&] {
+			for (size_t i = next++; i < dirty.size(); i = next++) {
+				sqlite3_file *segment = segments[dirty[i]].file;
+				results[i] = segment->pMethods->xSync(segment, flags);
+			}
+		};
+		vector<thread> threads;
+		for (size_t i = 1; i < min(dirty.size(), max_sync_threads); i++) {
+			threads.emplace_back(sync_segments);
+		}
+		sync_segments();
+		for (thread& t : threads) {
+			t.join();
+		}
+		int result = SQLITE_OK;
+		for (size_t i = 0; i < dirty.size(); i++) {
+			// Segments that failed stay dirty, so the next sync retries them
+			if (results[i] == SQLITE_OK) {
+				segments[dirty[i]].dirty = false;
+			}
+			else if (result == SQLITE_OK) {
+				result = results[i];
+			}
+		}
+		return result;
+	}
+
+	int xFileSize(sqlite3_int64 *pSize) override {
+		if (!segment_size) {
+			return SQLiteFileImpl::xFileSize(pSize);
+		}
+		int result = refresh_segment_count();
+		sqlite3_file *last = nullptr;
+		if (result == SQLITE_OK) {
+			result = open_segment(segment_count - 1, false, &last);
+		}
+		sqlite3_int64 last_size = 0;
+		if (result == SQLITE_OK && last) {
+			result = last->pMethods->xFileSize(last, &last_size);
+		}
+		if (result == SQLITE_OK) {
+			*pSize = (segment_count - 1) * segment_size + last_size;
+		}
+		return result;
+	}
+
+	int xLock(int flags) override {
+		int result = SQLiteFileImpl::xLock(flags);
+		return result == SQLITE_OK && segment_size ? check_epoch() : result;
+	}
+
+	int xShmLock(int offset, int n, int flags) override {
+		int result = SQLiteFileImpl::xShmLock(offset, n, flags);
+		if (result == SQLITE_OK && segment_size && (flags & SQLITE_SHM_LOCK)) {
+			result = check_epoch();
+			if (result != SQLITE_OK) {
+				SQLiteFileImpl::xShmLock(offset, n, (flags & ~SQLITE_SHM_LOCK) | SQLITE_SHM_UNLOCK);
+			}
+		}
+		return result;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (segment_size) {
+			if (op == SQLITE_FCNTL_PRAGMA) {
+				char **argv = (char **) pArg;
+				if (sqlite3_stricmp(argv[1], "segment_stats") == 0) {
+					refresh_segment_count();
+					argv[0] = sqlite3_mprintf("segment_size=%lld segments=%lld open_segments=%d segment_opens=%lld "
+						"syncs=%lld segment_syncs=%lld unlinked_segments=%lld epoch=%llu",
+						segment_size, segment_count, open_segments, segment_opens, syncs, segment_syncs, unlinked_segments,
+						(unsigned long long) epoch);
+					return SQLITE_OK;
+				}
+			}
+			else if (op == SQLITE_FCNTL_SIZE_HINT) {
+				// It would preallocate the descriptor
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	int xDeviceCharacteristics() override {
+		int characteristics = SQLiteFileImpl::xDeviceCharacteristics();
+		if (segment_size) {
+			// Writes are not atomic across segment files
+			characteristics &= SQLITE_IOCAP_POWERSAFE_OVERWRITE | SQLITE_IOCAP_SAFE_APPEND
+				| SQLITE_IOCAP_UNDELETABLE_WHEN_OPEN | SQLITE_IOCAP_IMMUTABLE;
+		}
+		return characteristics;
+	}
+
+	// Write the descriptor of a new database to `file`.
+	int create(sqlite3_file *file, sqlite3_int64 size) {
+		if (size < segment_alignment || size % segment_alignment != 0) {
+			sqlite3_log(SQLITE_CANTOPEN, "segment size %lld is not a multiple of %lld", size, segment_alignment);
+			return SQLITE_CANTOPEN;
+		}
+		unsigned char descriptor[descriptor_size] = {};
+		memcpy(descriptor, segment_magic, sizeof(segment_magic));
+		put_u64(descriptor + 8, (uint64_t) size);
+		put_u64(descriptor + epoch_offset, 0);
+		int result = file->pMethods->xWrite(file, descriptor, descriptor_size, 0);
+		if (result == SQLITE_OK) {
+			result = file->pMethods->xSync(file, SQLITE_SYNC_NORMAL);
+		}
+		if (result == SQLITE_OK) {
+			segment_size = size;
+		}
+		return result;
+	}
+
+	// Read the segment size and epoch of a descriptor.
+	int load(const unsigned char *descriptor) {
+		sqlite3_int64 size = (sqlite3_int64) get_u64(descriptor + 8);
+		if (size < segment_alignment || size % segment_alignment != 0) {
+			return SQLITE_NOTADB;
+		}
+		segment_size = size;
+		epoch = get_u64(descriptor + epoch_offset);
+		return SQLITE_OK;
+	}
+
+	// Close the handles of segments from `first` on.
+	void close_segments(sqlite3_int64 first) {
+		for (sqlite3_int64 i = first; i < (sqlite3_int64) segments.size(); i++) {
+			Segment& segment = segments[i];
+			if (segment.file) {
+				if (segment.file->pMethods) {
+					segment.file->pMethods->xClose(segment.file);
+				}
+				sqlite3_free(segment.file);
+				open_segments--;
+			}
+		}
+		segments.resize(min<sqlite3_int64>(first, segments.size()));
+	}
+
+private:
+	string segment_path(sqlite3_int64 index) const {
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%04lld", index);
+		return base_name + suffix;
+	}
+
+	// Get the handle of segment `index`, opening it if needed.
+	// Missing segments are created when `create` is set, or give a NULL handle otherwise.
+	int open_segment(sqlite3_int64 index, bool create, sqlite3_file **out) {
+		if (index >= (sqlite3_int64) segments.size()) {
+			segments.resize(index + 1);
+		}
+		Segment& segment = segments[index];
+		segment.last_used = ++use_clock;
+		if (!segment.file) {
+			if (!create) {
+				int exists = 0;
+				int result = vfs->xAccess(vfs, segment_path(index).c_str(), SQLITE_ACCESS_EXISTS, &exists);
+				if (result != SQLITE_OK || !exists) {
+					*out = nullptr;
+					return result;
+				}
+			}
+			if (open_segments >= max_open_segments) {
+				evict();
+			}
+			sqlite3_file *file = (sqlite3_file *) sqlite3_malloc(vfs->szOsFile);
+			if (file == nullptr) {
+				return SQLITE_NOMEM;
+			}
+			memset(file, 0, vfs->szOsFile);
+			// Created segments sync their directory on their first sync
+			int flags = readonly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | (create ? SQLITE_OPEN_CREATE : 0);
+			int result = vfs->xOpen(vfs, segment_path(index).c_str(), file, flags | SQLITE_OPEN_MAIN_JOURNAL, nullptr);
+			if (result != SQLITE_OK) {
+				sqlite3_free(file);
+				return result;
+			}
+			segment.file = file;
+			// Makes sure a new directory entry is flushed by the next sync
+			segment.dirty = create;
+			open_segments++;
+			segment_opens++;
+		}
+		if (create) {
+			segment.dirty = true;
+			segment_count = max(segment_count, index + 1);
+		}
+		*out = segment.file;
+		return SQLITE_OK;
+	}
+
+	// Get the handle of segment `index`, creating it and any missing segment before it.
+	int extend(sqlite3_int64 index, sqlite3_file **out) {
+		// Segments are created in order, a missing segment is always past the end of the file
+		for (sqlite3_int64 i = segment_count; i < index; i++) {
+			int result = open_segment(i, true, out);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+		}
+		return open_segment(index, true, out);
+	}
+
+	// Close the least recently used segment without unsynced writes.
+	void evict() {
+		Segment *victim = nullptr;
+		for (Segment& segment : segments) {
+			if (segment.file && !segment.dirty && (!victim || segment.last_used < victim->last_used)) {
+				victim = &segment;
+			}
+		}
+		if (victim) {
+			victim->file->pMethods->xClose(victim->file);
+			sqlite3_free(victim->file);
+			victim->file = nullptr;
+			open_segments--;
+		}
+	}
+
+	// Find the last segment, segments may have been created or unlinked by other connections.
+	int refresh_segment_count() {
+		while (true) {
+			int exists = 0;
+			int result = vfs->xAccess(vfs, segment_path(segment_count).c_str(), SQLITE_ACCESS_EXISTS, &exists);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			if (!exists) {
+				break;
+			}
+			segment_count++;
+		}
+		while (segment_count > 1) {
+			int exists = 0;
+			int result = vfs->xAccess(vfs, segment_path(segment_count - 1).c_str(), SQLITE_ACCESS_EXISTS, &exists);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			if (exists) {
+				break;
+			}
+			segment_count--;
+		}
+		return SQLITE_OK;
+	}
+
+	// Drop every segment handle if another connection unlinked segments since the last check.
+	int check_epoch() {
+		unsigned char epoch_bytes[8];
+		int result = original_file->pMethods->xRead(original_file, epoch_bytes, sizeof(epoch_bytes), epoch_offset);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		uint64_t current = get_u64(epoch_bytes);
+		if (current != epoch) {
+			epoch = current;
+			close_segments(0);
+			segment_count = 1;
+		}
+		return SQLITE_OK;
+	}
+};
+
+struct SegmentVfsShim : public SQLiteVfsImpl<SegmentFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<SegmentFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result != SQLITE_OK || zName == nullptr || !(flags & SQLITE_OPEN_MAIN_DB)) {
+			return result;
+		}
+		SegmentFileShim& shim = file->implementation;
+		shim.vfs = original_vfs;
+		shim.base_name = zName;
+		shim.readonly = (flags & SQLITE_OPEN_READONLY) != 0;
+		shim.max_open_segments = (int) max<sqlite3_int64>(1, sqlite3_uri_int64(zName, "max_open_segments", default_max_open_segments));
+
+		// Serializes the creation of descriptors by connections of this process
+		lock_guard<mutex> lock(mtx);
+		sqlite3_int64 size = 0;
+		unsigned char descriptor[descriptor_size] = {};
+		result = file->original_file->pMethods->xFileSize(file->original_file, &size);
+		if (result == SQLITE_OK && size > 0) {
+			result = file->original_file->pMethods->xRead(file->original_file, descriptor, descriptor_size, 0);
+		}
+		if (result == SQLITE_IOERR_SHORT_READ) {
+			result = SQLITE_OK;
+		}
+		if (result == SQLITE_OK) {
+			if (memcmp(descriptor, segment_magic, sizeof(segment_magic)) == 0) {
+				result = shim.load(descriptor);
+			}
+			else if (size == 0 && !shim.readonly) {
+				result = shim.create(file->original_file, sqlite3_uri_int64(zName, "segment_size", default_segment_size));
+			}
+		}
+		if (result != SQLITE_OK) {
+			file->original_file->pMethods->xClose(file->original_file);
+		}
+		return result;
+	}
+
+private:
+	mutex mtx;
+};
+
+extern "C" int sqlite3_segmentvfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<SegmentVfsShim> segmentvfs("segmentvfs");
+	int rc = segmentvfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}
@@ -0,0 +1,579 @@
+// Striping VFS shim: spreads a database across several files, RAID-0 style.
+//
+// The file SQLite opens becomes a 4096 byte descriptor (magic, stripe unit,
+// stripe count and the full paths of the stripe files), and the data lives in
+// the stripe files, which are meant to sit on different devices. The logical
+// file is cut in stripe units dealt round-robin to the stripes: unit `k` is
+// unit `k / count` of stripe `k % count`. Locks, the WAL index, journals and
+// WAL files are those of the descriptor, only the database pages are striped.
+//
+// Requests covering several stripes are split, and the pieces of different
+// stripes are transferred concurrently on a process-wide thread pool, the
+// calling thread taking its share. This also applies to `xReadV`. `xSync`
+// flushes every stripe written since the last sync concurrently and only
+// returns once all of them are durable, so SQLite's ordering of journal and
+// database flushes holds across devices. `xTruncate` cuts every stripe to its
+// share of the new size, and `xFileSize` is derived from the stripe sizes.
+// Stripes missing data below the logical size read as zeros.
+//
+// Single page reads with a stripe unit of at least the page size touch one
+// stripe, the gain then comes from concurrent connections spreading their
+// reads across devices. Smaller stripe units make every page fan out.
+//
+// URI parameters (only used when creating the database):
+//   stripe_dirs=<dir>:<dir>...  directories of the stripe files, which are
+//                               named `<database name>.stripe<index>`
+//   stripe_unit=<bytes>         power of two from 512 to 16 MiB (default 65536)
+//
+// A database opened without `stripe_dirs` whose file isn't a descriptor is
+// used as is.
+//
+// `PRAGMA stripe_stats` reports the layout and the reads and writes per stripe.
+//
+// @note The descriptor is not a database, other VFSes can't open it. Deleting it
+//       leaves the stripe files behind.
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+#include <SQLiteVfs.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace sqlitevfs;
+using namespace std;
+
+static const char stripe_magic[8] = { 'S', 'Q', 'L', 'S', 'T', 'R', 'P', '1' };
+static const int descriptor_size = 4096;
+static const int paths_offset = 64;
+static const int max_stripes = 64;
+static const int min_stripe_unit = 512;
+static const int max_stripe_unit = 1 << 24;
+static const int default_stripe_unit = 65536;
+
+static void put_u32(unsigned char *p, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++) {
+		value |= (uint32_t) p[i] << (8 * i);
+	}
+	return value;
+}
+
+// Process-wide pool running the per-stripe parts of a request concurrently.
+class StripeIoPool {
+public:
+	unsigned thread_count = 8;
+
+	~StripeIoPool() {
+		{
+			lock_guard<mutex> lock(mtx);
+			stop = true;
+		}
+		work_cv.notify_all();
+		for (thread& t : threads) {
+			t.join();
+		}
+	}
+
+	// Runs `task(0)` to `task(count - 1)` concurrently and returns once all of them finished.
+	void run(size_t count, const function<void(size_t)>& task) {
+		if (count == 1) {
+			task(0);
+			return;
+		}
+		Batch batch;
+		batch.task = &task;
+		batch.count = count;
+		unique_lock<mutex> lock(mtx);
+		if (threads.empty()) {
+			for (unsigned i = 0; i < thread_count; i++) {
+				threads.emplace_back(&StripeIoPool::worker_loop, this);
+			}
+		}
+		batches.push_back(&batch);
+		work_cv.notify_all();
+		// Busy workers don't hold the caller back, it runs whatever is left itself
+		while (batch.next < batch.count) {
+			run_one(lock, batch);
+		}
+		done_cv.wait(lock, [&] { return batch.done == batch.count; });
+	}
+
+private:
+	struct Batch {
+		const function<void(size_t)> *task;
+		size_t count;
+		size_t next = 0;
+		size_t done = 0;
+	};
+
+	mutex mtx;
+	condition_variable work_cv;
+	condition_variable done_cv;
+	// Batches with tasks left to start
+	deque<Batch *> batches;
+	vector<thread> threads;
+	bool stop = false;
+
+	// Starts the next task of `batch`, which must have one left.
+	void run_one(unique_lock<mutex>& lock, Batch& batch) {
+		size_t index = batch.next++;
+		if (batch.next == batch.count) {
+			batches.erase(find(batches.begin(), batches.end(), &batch));
+		}
+		lock.unlock();
+		(*batch.task)(index);
+		lock.lock();
+		if (++batch.done == batch.count) {
+			done_cv.notify_all();
+		}
+	}
+
+	void worker_loop() {
+		unique_lock<mutex> lock(mtx);
+		while (true) {
+			work_cv.wait(lock, [&] { return stop || !batches.empty(); });
+			if (batches.empty()) {
+				break;
+			}
+			run_one(lock, *batches.front());
+		}
+	}
+};
+
+// Part of a request falling in a single stripe unit, at its offset in the stripe file.
+struct StripePiece {
+	char *buffer;
+	int amount;
+	sqlite3_int64 offset;
+};
+
+struct StripeFileShim : public SQLiteFileImpl {
+	StripeIoPool *pool = nullptr;
+	// Empty for files that aren't striped
+	vector<sqlite3_file *> stripes;
+	vector<string> stripe_paths;
+	sqlite3_int64 stripe_unit = default_stripe_unit;
+	// Stripes written since the last `xSync`
+	vector<char> dirty;
+
+	// Reused for every request, to avoid allocations
+	vector<vector<StripePiece>> pieces;
+	vector<int> touched;
+	vector<int> results;
+
+	vector<sqlite3_int64> reads;
+	vector<sqlite3_int64> writes;
+	sqlite3_int64 parallel_requests = 0;
+
+	int iVersion() const override {
+		// No memory mapping, the descriptor holds no pages
+		return stripes.empty() ? SQLiteFileImpl::iVersion() : 2;
+	}
+
+	int xClose() override {
+		close_stripes();
+		return SQLiteFileImpl::xClose();
+	}
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (stripes.empty()) {
+			return SQLiteFileImpl::xRead(p, iAmt, iOfst);
+		}
+		split((char *) p, iAmt, iOfst, reads);
+		return transfer(false);
+	}
+
+	int xReadV(const IoVec *iov, int iovcnt) override {
+		if (stripes.empty()) {
+			return SQLiteFileImpl::xReadV(iov, iovcnt);
+		}
+		for (int i = 0; i < iovcnt; i++) {
+			split((char *) iov[i].p, iov[i].iAmt, iov[i].iOfst, reads);
+		}
+		return transfer(false);
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		if (stripes.empty()) {
+			return SQLiteFileImpl::xWrite(p, iAmt, iOfst);
+		}
+		split((char *) p, iAmt, iOfst, writes);
+		for (int stripe : touched) {
+			dirty[stripe] = 1;
+		}
+		return transfer(true);
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		if (stripes.empty()) {
+			return SQLiteFileImpl::xTruncate(size);
+		}
+		results.assign(stripes.size(), SQLITE_OK);
+		pool->run(stripes.size(), [&](size_t i) {
+			results[i] = stripes[i]->pMethods->xTruncate(stripes[i], stripe_length((int) i, size));
+		});
+		fill(dirty.begin(), dirty.end(), 1);
+		return first_error();
+	}
+
+	int xSync(int flags) override {
+		if (stripes.empty()) {
+			return SQLiteFileImpl::xSync(flags);
+		}
+		touched.clear();
+		for (size_t i = 0; i < stripes.size(); i++) {
+			if (dirty[i]) {
+				touched.push_back((int) i);
+			}
+		}
+		results.assign(touched.size(), SQLITE_OK);
+		if (!touched.empty()) {
+			pool->run(touched.size(), [&](size_t i) {
+				sqlite3_file *stripe = stripes[touched[i]];
+				results[i] = stripe->pMethods->xSync(stripe, flags);
+			});
+		}
+		// Stripes that failed stay dirty, so the next sync retries them
+		for (size_t i = 0; i < touched.size(); i++) {
+			if (results[i] == SQLITE_OK) {
+				dirty[touched[i]] = 0;
+			}
+		}
+		touched.clear();
+		return first_error();
+	}
+
+	int xFileSize(sqlite3_int64 *pSize) override {
+		if (stripes.empty()) {
+			return SQLiteFileImpl::xFileSize(pSize);
+		}
+		// The logical size ends with the last byte of whichever stripe reaches furthest
+		sqlite3_int64 size = 0;
+		for (size_t i = 0; i < stripes.size(); i++) {
+			sqlite3_int64 stripe_size;
+			int result = stripes[i]->pMethods->xFileSize(stripes[i], &stripe_size);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			if (stripe_size > 0) {
+				sqlite3_int64 last = stripe_size - 1;
+				sqlite3_int64 unit = last / stripe_unit * (sqlite3_int64) stripes.size() + (sqlite3_int64) i;
+				size = max(size, unit * stripe_unit + last % stripe_unit + 1);
+			}
+		}
+		*pSize = size;
+		return SQLITE_OK;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		if (!stripes.empty()) {
+			if (op == SQLITE_FCNTL_PRAGMA) {
+				char **argv = (char **) pArg;
+				if (sqlite3_stricmp(argv[1], "stripe_stats") == 0) {
+					argv[0] = stats();
+					return SQLITE_OK;
+				}
+			}
+			else if (op == SQLITE_FCNTL_SIZE_HINT) {
+				// It would preallocate the descriptor
+				return SQLITE_OK;
+			}
+		}
+		return SQLiteFileImpl::xFileControl(op, pArg);
+	}
+
+	int xSectorSize() override {
+		if (stripes.empty()) {
+			return SQLiteFileImpl::xSectorSize();
+		}
+		int sector_size = 0;
+		for (sqlite3_file *stripe : stripes) {
+			sector_size = max(sector_size, stripe->pMethods->xSectorSize(stripe));
+		}
+		return sector_size;
+	}
+
+	int xDeviceCharacteristics() override {
+		if (stripes.empty()) {
+			return SQLiteFileImpl::xDeviceCharacteristics();
+		}
+		// Writes are neither atomic nor ordered across devices, keep what every stripe guarantees on its own
+		int characteristics = SQLITE_IOCAP_POWERSAFE_OVERWRITE | SQLITE_IOCAP_SAFE_APPEND
+			| SQLITE_IOCAP_UNDELETABLE_WHEN_OPEN | SQLITE_IOCAP_IMMUTABLE;
+		for (sqlite3_file *stripe : stripes) {
+			characteristics &= stripe->pMethods->xDeviceCharacteristics(stripe);
+		}
+		return characteristics;
+	}
+
+	// Open the stripes listed in a descriptor.
+	int load(const unsigned char *descriptor, sqlite3_vfs *vfs, int flags) {
+		uint32_t unit = get_u32(descriptor + 8);
+		uint32_t count = get_u32(descriptor + 12);
+		if (unit < (uint32_t) min_stripe_unit || unit > (uint32_t) max_stripe_unit || (unit & (unit - 1)) != 0
+			|| count < 1 || count > (uint32_t) max_stripes) {
+			return SQLITE_NOTADB;
+		}
+		stripe_unit = unit;
+		const char *path = (const char *) descriptor + paths_offset;
+		const char *end = (const char *) descriptor + descriptor_size;
+		for (uint32_t i = 0; i < count; i++) {
+			size_t length = strnlen(path, end - path);
+			if (length == 0 || path + length == end) {
+				return SQLITE_NOTADB;
+			}
+			stripe_paths.emplace_back(path, length);
+			path += length + 1;
+		}
+		int stripe_flags = (flags & SQLITE_OPEN_READONLY ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE) | SQLITE_OPEN_MAIN_JOURNAL;
+		return open_stripes(vfs, stripe_flags);
+	}
+
+	// Create empty stripes in `dirs` and write the descriptor of a new database to `file`.
+	int create(sqlite3_file *file, const char *name, const char *dirs, sqlite3_int64 unit, sqlite3_vfs *vfs) {
+		if (unit < min_stripe_unit || unit > max_stripe_unit || (unit & (unit - 1)) != 0) {
+			sqlite3_log(SQLITE_CANTOPEN, "stripe unit %lld is not a power of two from %d to %d", unit, min_stripe_unit, max_stripe_unit);
+			return SQLITE_CANTOPEN;
+		}
+		stripe_unit = unit;
+		const char *slash = strrchr(name, '/');
+		string base_name = slash ? slash + 1 : name;
+		string list = dirs;
+		size_t used = paths_offset;
+		for (size_t start = 0; start <= list.size(); ) {
+			size_t colon = min(list.find(':', start), list.size());
+			if (colon > start) {
+				string path = list.substr(start, colon - start) + "/" + base_name + ".stripe" + to_string(stripe_paths.size());
+				vector<char> full_path(vfs->mxPathname + 1);
+				int result = vfs->xFullPathname(vfs, path.c_str(), vfs->mxPathname + 1, full_path.data());
+				if (result != SQLITE_OK) {
+					return result;
+				}
+				stripe_paths.emplace_back(full_path.data());
+				used += stripe_paths.back().size() + 1;
+			}
+			start = colon + 1;
+		}
+		if (stripe_paths.empty() || stripe_paths.size() > (size_t) max_stripes || used > (size_t) descriptor_size) {
+			sqlite3_log(SQLITE_CANTOPEN, "stripe_dirs must name 1 to %d directories fitting in the descriptor", max_stripes);
+			return SQLITE_CANTOPEN;
+		}
+
+		int result = open_stripes(vfs, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_MAIN_JOURNAL);
+		for (size_t i = 0; i < stripes.size() && result == SQLITE_OK; i++) {
+			// Leftovers of another database would show through the new one
+			sqlite3_int64 size;
+			result = stripes[i]->pMethods->xFileSize(stripes[i], &size);
+			if (result == SQLITE_OK && size != 0) {
+				sqlite3_log(SQLITE_CANTOPEN, "stripe \"%s\" is not empty", stripe_paths[i].c_str());
+				result = SQLITE_CANTOPEN;
+			}
+			// Makes the new directory entry durable before the descriptor points to it
+			if (result == SQLITE_OK) {
+				result = stripes[i]->pMethods->xSync(stripes[i], SQLITE_SYNC_NORMAL);
+			}
+		}
+		if (result != SQLITE_OK) {
+			return result;
+		}
+
+		unsigned char descriptor[descriptor_size] = {};
+		memcpy(descriptor, stripe_magic, sizeof(stripe_magic));
+		put_u32(descriptor + 8, (uint32_t) stripe_unit);
+		put_u32(descriptor + 12, (uint32_t) stripes.size());
+		char *path = (char *) descriptor + paths_offset;
+		for (const string& stripe_path : stripe_paths) {
+			memcpy(path, stripe_path.c_str(), stripe_path.size() + 1);
+			path += stripe_path.size() + 1;
+		}
+		result = file->pMethods->xWrite(file, descriptor, descriptor_size, 0);
+		if (result == SQLITE_OK) {
+			result = file->pMethods->xSync(file, SQLITE_SYNC_NORMAL);
+		}
+		return result;
+	}
+
+	void close_stripes() {
+		for (sqlite3_file *stripe : stripes) {
+			if (stripe->pMethods) {
+				stripe->pMethods->xClose(stripe);
+			}
+			sqlite3_free(stripe);
+		}
+		stripes.clear();
+	}
+
+private:
+	int open_stripes(sqlite3_vfs *vfs, int flags) {
+		for (const string& path : stripe_paths) {
+			sqlite3_file *stripe = (sqlite3_file *) sqlite3_malloc(vfs->szOsFile);
+			if (stripe == nullptr) {
+				return SQLITE_NOMEM;
+			}
+			memset(stripe, 0, vfs->szOsFile);
+			stripes.push_back(stripe);
+			int result = vfs->xOpen(vfs, path.c_str(), stripe, flags, nullptr);
+			if (result != SQLITE_OK) {
+				sqlite3_log(result, "cannot open stripe \"%s\"", path.c_str());
+				return result;
+			}
+		}
+		dirty.assign(stripes.size(), 0);
+		pieces.resize(stripes.size());
+		reads.assign(stripes.size(), 0);
+		writes.assign(stripes.size(), 0);
+		return SQLITE_OK;
+	}
+
+	// Split a request into `pieces`, listing the stripes involved in `touched`.
+	void split(char *buffer, int amount, sqlite3_int64 offset, vector<sqlite3_int64>& counters) {
+		sqlite3_int64 count = (sqlite3_int64) stripes.size();
+		while (amount > 0) {
+			sqlite3_int64 unit = offset / stripe_unit;
+			int stripe = (int) (unit % count);
+			sqlite3_int64 within = offset % stripe_unit;
+			int length = (int) min<sqlite3_int64>(amount, stripe_unit - within);
+			if (pieces[stripe].empty()) {
+				touched.push_back(stripe);
+			}
+			pieces[stripe].push_back(StripePiece { buffer, length, unit / count * stripe_unit + within });
+			counters[stripe]++;
+			buffer += length;
+			amount -= length;
+			offset += length;
+		}
+	}
+
+	// Transfer the split pieces, one stripe per task, then clear them.
+	int transfer(bool write) {
+		results.assign(touched.size(), SQLITE_OK);
+		if (touched.size() > 1) {
+			parallel_requests++;
+		}
+		pool->run(touched.size(), [&](size_t i) {
+			sqlite3_file *stripe = stripes[touched[i]];
+			for (const StripePiece& piece : pieces[touched[i]]) {
+				int result = write
+					? stripe->pMethods->xWrite(stripe, piece.buffer, piece.amount, piece.offset)
+					: stripe->pMethods->xRead(stripe, piece.buffer, piece.amount, piece.offset);
+				// A short read zero fills the piece, like a hole in a sparse file
+				if (result == SQLITE_IOERR_SHORT_READ) {
+					results[i] = result;
+				}
+				else if (result != SQLITE_OK) {
+					results[i] = result;
+					break;
+				}
+			}
+		});
+		for (int stripe : touched) {
+			pieces[stripe].clear();
+		}
+		touched.clear();
+		return first_error();
+	}
+
+	// The first error in `results`, short reads only counting when nothing else failed.
+	int first_error() const {
+		int result = SQLITE_OK;
+		for (int stripe_result : results) {
+			if (stripe_result != SQLITE_OK && stripe_result != SQLITE_IOERR_SHORT_READ) {
+				return stripe_result;
+			}
+			if (stripe_result != SQLITE_OK) {
+				result = stripe_result;
+			}
+		}
+		return result;
+	}
+
+	// Length of `stripe` holding the bytes of a logical file of `size` bytes.
+	sqlite3_int64 stripe_length(int stripe, sqlite3_int64 size) const {
+		sqlite3_int64 row_size = stripe_unit * (sqlite3_int64) stripes.size();
+		sqlite3_int64 rest = size % row_size - stripe * stripe_unit;
+		return size / row_size * stripe_unit + max<sqlite3_int64>(0, min(rest, stripe_unit));
+	}
+
+	char *stats() {
+		string sizes, read_counts, write_counts;
+		for (size_t i = 0; i < stripes.size(); i++) {
+			sqlite3_int64 size = -1;
+			stripes[i]->pMethods->xFileSize(stripes[i], &size);
+			const char *separator = i ? "," : "";
+			sizes += separator + to_string(size);
+			read_counts += separator + to_string(reads[i]);
+			write_counts += separator + to_string(writes[i]);
+		}
+		return sqlite3_mprintf("stripes=%d unit=%lld stripe_sizes=%s reads=%s writes=%s parallel_requests=%lld",
+			(int) stripes.size(), stripe_unit, sizes.c_str(), read_counts.c_str(), write_counts.c_str(), parallel_requests);
+	}
+};
+
+struct StripeVfsShim : public SQLiteVfsImpl<StripeFileShim> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<StripeFileShim> *file, int flags, int *pOutFlags) override {
+		int result = SQLiteVfsImpl::xOpen(zName, file, flags, pOutFlags);
+		if (result != SQLITE_OK || zName == nullptr || !(flags & SQLITE_OPEN_MAIN_DB)) {
+			return result;
+		}
+		StripeFileShim& shim = file->implementation;
+		shim.pool = &pool;
+		const char *dirs = sqlite3_uri_parameter(zName, "stripe_dirs");
+
+		// Serializes the creation of descriptors by connections of this process
+		lock_guard<mutex> lock(mtx);
+		sqlite3_int64 size = 0;
+		unsigned char descriptor[descriptor_size] = {};
+		result = file->original_file->pMethods->xFileSize(file->original_file, &size);
+		if (result == SQLITE_OK && size > 0) {
+			result = file->original_file->pMethods->xRead(file->original_file, descriptor, descriptor_size, 0);
+		}
+		if (result == SQLITE_IOERR_SHORT_READ) {
+			result = SQLITE_OK;
+		}
+		if (result == SQLITE_OK) {
+			if (memcmp(descriptor, stripe_magic, sizeof(stripe_magic)) == 0) {
+				result = shim.load(descriptor, original_vfs, flags);
+			}
+			else if (size == 0 && dirs && !(flags & SQLITE_OPEN_READONLY)) {
+				result = shim.create(file->original_file, zName, dirs, sqlite3_uri_int64(zName, "stripe_unit", default_stripe_unit), original_vfs);
+			}
+			else if (dirs && size > 0) {
+				sqlite3_log(SQLITE_CANTOPEN, "\"%s\" is not a striped database", zName);
+				result = SQLITE_CANTOPEN;
+			}
+		}
+		if (result != SQLITE_OK) {
+			shim.close_stripes();
+			file->original_file->pMethods->xClose(file->original_file);
+		}
+		return result;
+	}
+
+private:
+	mutex mtx;
+	StripeIoPool pool;
+};
+
+extern "C" int sqlite3_stripevfs_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines *pApi) {
+	SQLITE_EXTENSION_INIT2(pApi);
+
+	static SQLiteVfs<StripeVfsShim> stripevfs("stripevfs");
+	int rc = stripevfs.register_vfs(false);
+	if (rc == SQLITE_OK) {
+		rc = SQLITE_OK_LOAD_PERMANENTLY;
+	}
+	return rc;
+}